@@ -15,7 +15,6 @@
 
 #include "audio.h"
 #include "endian.h"
-#include <assert.h>
 
 static const int16_t MULAWTable[256] = { 
      -32124,-31100,-30076,-29052,-28028,-27004,-25980,-24956, 
@@ -146,279 +145,216 @@ int rsnd_format_to_bytes(enum rsd_format fmt)
    return -1;
 }
 
-inline static void swap_bytes16(uint16_t *data, size_t bytes)
-{
-   for (int i = 0; i < (int)bytes/2; i++)
-   {
-      swap_endian_16(&data[i]);
+#define SWAP16(x) ((uint16_t)(((x) >> 8) | ((x) << 8)))
+#define SWAP32(x) ((uint32_t)(((x) >> 24) | (((x) >> 8) & 0xff00) | (((x) << 8) & 0xff0000) | ((x) << 24)))
+#define S16_TO_FLOAT(x) ((float)(int16_t)(x) / 0x8000)
+#define S32_TO_FLOAT(x) ((float)(int32_t)(x) / 0x80000000UL)
+
+/* Every kernel does all the work for a sample in one go: load, fix byte order, flip sign,
+ * change sample size and write it out. x is the raw input sample. */
+#define AUDIO_KERNEL(name, in_type, out_type, expr) \
+   static void name(void *out_, const void *in_, size_t samples) \
+   { \
+      const in_type *in = in_; \
+      out_type *out = out_; \
+      for (size_t i = 0; i < samples; i++) \
+      { \
+         in_type x = in[i]; \
+         out[i] = (expr); \
+      } \
    }
-}
 
-inline static void swap_bytes32(uint32_t *data, size_t bytes)
+AUDIO_KERNEL(flip8, uint8_t, uint8_t, x ^ 0x80)
+AUDIO_KERNEL(s8_to_s16, uint8_t, uint16_t, x << 8)
+AUDIO_KERNEL(u8_to_s16, uint8_t, uint16_t, (x ^ 0x80) << 8)
+AUDIO_KERNEL(s8_to_float, uint8_t, float, S16_TO_FLOAT(x << 8))
+AUDIO_KERNEL(u8_to_float, uint8_t, float, S16_TO_FLOAT((x ^ 0x80) << 8))
+AUDIO_KERNEL(alaw_to_s16, uint8_t, int16_t, ALAWTable[x])
+AUDIO_KERNEL(mulaw_to_s16, uint8_t, int16_t, MULAWTable[x])
+AUDIO_KERNEL(alaw_to_float, uint8_t, float, S16_TO_FLOAT(ALAWTable[x]))
+AUDIO_KERNEL(mulaw_to_float, uint8_t, float, S16_TO_FLOAT(MULAWTable[x]))
+
+AUDIO_KERNEL(swap16, uint16_t, uint16_t, SWAP16(x))
+AUDIO_KERNEL(flip16, uint16_t, uint16_t, x ^ 0x8000)
+AUDIO_KERNEL(swap_flip16, uint16_t, uint16_t, SWAP16(x) ^ 0x8000)
+AUDIO_KERNEL(flip_swap16, uint16_t, uint16_t, SWAP16(x ^ 0x8000))
+AUDIO_KERNEL(flip16_foreign, uint16_t, uint16_t, x ^ SWAP16(0x8000))
+AUDIO_KERNEL(s16_to_float, uint16_t, float, S16_TO_FLOAT(x))
+AUDIO_KERNEL(swap_s16_to_float, uint16_t, float, S16_TO_FLOAT(SWAP16(x)))
+AUDIO_KERNEL(u16_to_float, uint16_t, float, S16_TO_FLOAT(x ^ 0x8000))
+AUDIO_KERNEL(swap_u16_to_float, uint16_t, float, S16_TO_FLOAT(SWAP16(x) ^ 0x8000))
+
+AUDIO_KERNEL(swap32, uint32_t, uint32_t, SWAP32(x))
+AUDIO_KERNEL(flip32, uint32_t, uint32_t, x ^ 0x80000000UL)
+AUDIO_KERNEL(swap_flip32, uint32_t, uint32_t, SWAP32(x) ^ 0x80000000UL)
+AUDIO_KERNEL(flip_swap32, uint32_t, uint32_t, SWAP32(x ^ 0x80000000UL))
+AUDIO_KERNEL(flip32_foreign, uint32_t, uint32_t, x ^ SWAP32(0x80000000UL))
+AUDIO_KERNEL(s32_to_s16, uint32_t, uint16_t, x >> 16)
+AUDIO_KERNEL(swap_s32_to_s16, uint32_t, uint16_t, SWAP32(x) >> 16)
+AUDIO_KERNEL(u32_to_s16, uint32_t, uint16_t, (x ^ 0x80000000UL) >> 16)
+AUDIO_KERNEL(swap_u32_to_s16, uint32_t, uint16_t, (SWAP32(x) ^ 0x80000000UL) >> 16)
+AUDIO_KERNEL(s32_to_float, uint32_t, float, S32_TO_FLOAT(x))
+AUDIO_KERNEL(swap_s32_to_float, uint32_t, float, S32_TO_FLOAT(SWAP32(x)))
+AUDIO_KERNEL(u32_to_float, uint32_t, float, S32_TO_FLOAT(x ^ 0x80000000UL))
+AUDIO_KERNEL(swap_u32_to_float, uint32_t, float, S32_TO_FLOAT(SWAP32(x) ^ 0x80000000UL))
+
+// Signed to unsigned and back is the same thing, flipping the sign bit, so RSD_U_TO_S covers both here.
+#define RSD_FLIP RSD_U_TO_S
+
+static const struct audio_kernel_entry
 {
-   for (int i = 0; i < (int)bytes/4; i++)
-   {
-      swap_endian_32(&data[i]);
-   }
-}
-
-inline static void s32_to_float(void *data, size_t bytes)
+   int bytes;     // Sample size of the input.
+   int in_swap;   // Input is in foreign byte order.
+   int operation; // Without RSD_SWAP_ENDIAN.
+   int out_swap;  // Output is in foreign byte order.
+   audio_kernel_t kernel;
+   int out_bytes;
+   enum simd_op simd; // Vector version of kernel, if any.
+} audio_kernels[] = {
+   { 1, 0, RSD_FLIP, 0, flip8, 1, SIMD_NONE },
+   { 1, 0, RSD_S8_TO_S16, 0, s8_to_s16, 2, SIMD_NONE },
+   { 1, 0, RSD_FLIP | RSD_S8_TO_S16, 0, u8_to_s16, 2, SIMD_NONE },
+   { 1, 0, RSD_S8_TO_S16 | RSD_S16_TO_FLOAT, 0, s8_to_float, 4, SIMD_NONE },
+   { 1, 0, RSD_FLIP | RSD_S8_TO_S16 | RSD_S16_TO_FLOAT, 0, u8_to_float, 4, SIMD_NONE },
+   { 1, 0, RSD_ALAW_TO_S16, 0, alaw_to_s16, 2, SIMD_NONE },
+   { 1, 0, RSD_MULAW_TO_S16, 0, mulaw_to_s16, 2, SIMD_NONE },
+   { 1, 0, RSD_ALAW_TO_S16 | RSD_S16_TO_FLOAT, 0, alaw_to_float, 4, SIMD_NONE },
+   { 1, 0, RSD_MULAW_TO_S16 | RSD_S16_TO_FLOAT, 0, mulaw_to_float, 4, SIMD_NONE },
+
+   { 2, 0, RSD_NULL, 1, swap16, 2, SIMD_SWAP16 },
+   { 2, 1, RSD_NULL, 0, swap16, 2, SIMD_SWAP16 },
+   { 2, 0, RSD_FLIP, 0, flip16, 2, SIMD_FLIP16 },
+   { 2, 1, RSD_FLIP, 0, swap_flip16, 2, SIMD_SWAP_FLIP16 },
+   { 2, 0, RSD_FLIP, 1, flip_swap16, 2, SIMD_NONE },
+   { 2, 1, RSD_FLIP, 1, flip16_foreign, 2, SIMD_NONE },
+   { 2, 0, RSD_S16_TO_FLOAT, 0, s16_to_float, 4, SIMD_S16_TO_FLOAT },
+   { 2, 1, RSD_S16_TO_FLOAT, 0, swap_s16_to_float, 4, SIMD_SWAP_S16_TO_FLOAT },
+   { 2, 0, RSD_FLIP | RSD_S16_TO_FLOAT, 0, u16_to_float, 4, SIMD_NONE },
+   { 2, 1, RSD_FLIP | RSD_S16_TO_FLOAT, 0, swap_u16_to_float, 4, SIMD_NONE },
+
+   { 4, 0, RSD_NULL, 1, swap32, 4, SIMD_SWAP32 },
+   { 4, 1, RSD_NULL, 0, swap32, 4, SIMD_SWAP32 },
+   { 4, 0, RSD_FLIP, 0, flip32, 4, SIMD_FLIP32 },
+   { 4, 1, RSD_FLIP, 0, swap_flip32, 4, SIMD_SWAP_FLIP32 },
+   { 4, 0, RSD_FLIP, 1, flip_swap32, 4, SIMD_NONE },
+   { 4, 1, RSD_FLIP, 1, flip32_foreign, 4, SIMD_NONE },
+   { 4, 0, RSD_S32_TO_S16, 0, s32_to_s16, 2, SIMD_S32_TO_S16 },
+   { 4, 1, RSD_S32_TO_S16, 0, swap_s32_to_s16, 2, SIMD_SWAP_S32_TO_S16 },
+   { 4, 0, RSD_FLIP | RSD_S32_TO_S16, 0, u32_to_s16, 2, SIMD_NONE },
+   { 4, 1, RSD_FLIP | RSD_S32_TO_S16, 0, swap_u32_to_s16, 2, SIMD_NONE },
+   { 4, 0, RSD_S32_TO_FLOAT, 0, s32_to_float, 4, SIMD_S32_TO_FLOAT },
+   { 4, 1, RSD_S32_TO_FLOAT, 0, swap_s32_to_float, 4, SIMD_SWAP_S32_TO_FLOAT },
+   { 4, 0, RSD_FLIP | RSD_S32_TO_FLOAT, 0, u32_to_float, 4, SIMD_NONE },
+   { 4, 1, RSD_FLIP | RSD_S32_TO_FLOAT, 0, swap_u32_to_float, 4, SIMD_NONE },
+};
+
+int audio_converter_init(audio_converter_t *conv, enum rsd_format fmt, int operation)
 {
-   assert(sizeof(float) == 4);
-   size_t samples = bytes / sizeof(int32_t);
-   union
-   {
-      float *f;
-      int32_t *i;
-   } u;
-   u.i = data;
-   for (int i = samples - 1; i >= 0; i--)
-      u.f[i] = (float)u.i[i] / 0x80000000UL;
-}
-
-inline static void s16_to_float(void *data, size_t bytes)
-{
-   assert(sizeof(float) == 4);
-   size_t samples = bytes / sizeof(int16_t);
-   union 
-   {
-      float *f;
-      int16_t *i;
-   } u;
-   u.i = data;
+   int bytes = rsnd_format_to_bytes(fmt);
+   if ( bytes < 0 || operation < 0 )
+      return -1;
+
+   conv->kernel = NULL;
+   conv->simd = NULL;
+   conv->in_bytes = bytes;
+   conv->out_bytes = bytes;
+   if ( operation == RSD_NULL )
+      return 0;
 
-   for (int i = samples - 1; i >= 0; i--)
-      u.f[i] = (float)u.i[i] / 0x8000;
-}
+   if ( operation & (RSD_S_TO_U | RSD_U_TO_S) )
+      operation = (operation & ~(RSD_S_TO_U | RSD_U_TO_S)) | RSD_FLIP;
 
-inline static void alaw_to_s16(void *data, size_t bytes)
-{
-   union
+   // Samples are worked on in native byte order. Unless RSD_SWAP_ENDIAN asks for swapping them,
+   // they go out in the byte order they came in with.
+   int in_swap = 0;
+   int out_swap = 0;
+   if ( bytes > 1 )
    {
-      uint8_t *u8;
-      int16_t *i16;
-   } u;
-
-   u.u8 = data;
-
-   for ( int i = (int)bytes - 1; i >= 0; i-- )
-      u.i16[i] = ALAWTable[u.u8[i]];
-}
+      int big_endian = (fmt & (RSD_S16_BE | RSD_U16_BE | RSD_S32_BE | RSD_U32_BE)) ? 1 : 0;
+      in_swap = is_little_endian() ? big_endian : !big_endian;
+      out_swap = in_swap ^ ((operation & RSD_SWAP_ENDIAN) ? 1 : 0);
+   }
+   operation &= ~RSD_SWAP_ENDIAN;
 
-inline static void mulaw_to_s16(void *data, size_t bytes)
-{
-   union
+   for ( size_t i = 0; i < sizeof(audio_kernels) / sizeof(audio_kernels[0]); i++ )
    {
-      uint8_t *u8;
-      int16_t *i16;
-   } u;
+      const struct audio_kernel_entry *entry = &audio_kernels[i];
+      if ( entry->bytes == bytes && entry->in_swap == in_swap &&
+            entry->operation == operation && entry->out_swap == out_swap )
+      {
+         conv->kernel = entry->kernel;
+         conv->simd = simd_kernel(entry->simd);
+         conv->out_bytes = entry->out_bytes;
+         return 0;
+      }
+   }
 
-   u.u8 = data;
+   // Asked to swap single bytes.
+   if ( operation == RSD_NULL && in_swap == out_swap )
+      return 0;
 
-   for ( int i = (int)bytes - 1; i >= 0; i-- )
-      u.i16[i] = MULAWTable[u.u8[i]];
+   return -1;
 }
 
-inline static void s8_to_s16(void *data, size_t samples)
+// Vector kernels do what they can, and leave the rest to the scalar one.
+static void audio_run_kernel(const audio_converter_t *conv, void *out, const void *in, size_t samples)
 {
-   union
-   {
-      int8_t *i8;
-      int16_t *i16;
-   } u;
+   size_t done = 0;
+   if ( conv->simd != NULL )
+      done = conv->simd(out, in, samples);
 
-   u.i8 = data;
-
-   for ( int i = (int)samples - 1; i >= 0; i-- )
-      u.i16[i] = ((int16_t)u.i8[i]) << 8;
+   conv->kernel((uint8_t*)out + done * conv->out_bytes, (const uint8_t*)in + done * conv->in_bytes, samples - done);
 }
 
-inline static void s32_to_s16(void *data, size_t samples)
-{
-   union
-   {
-      int16_t *i16;
-      int32_t *i32;
-   } u;
-   u.i16 = data;
-
-   for (int i = 0; i < (int)samples; i++)
-      u.i16[i] = (int16_t)(u.i32[i] >> 16);
-}
+#define AUDIO_CONVERT_BLOCK 256
 
-void audio_converter(void* data, enum rsd_format fmt, int operation, size_t bytes)
+size_t audio_convert(const audio_converter_t *conv, void *out, const void *in, size_t bytes)
 {
-   if ( operation == RSD_NULL )
-      return;
-   
-   // Temporarily hold the data that is to be sign-flipped.
-   int swapped = 0;
-   int bits = rsnd_format_to_bytes(fmt) * 8;
-
-   uint8_t buffer[bytes*2];
-   
-   // Fancy union to make the conversions more clean looking ;)
-   union
-   {
-      uint8_t *u8;
-      int8_t *s8;
-      uint16_t *u16;
-      int16_t *s16;
-      uint32_t *u32;
-      int32_t *s32;
-      void *ptr;
-   } u;
-
-   memcpy(buffer, data, bytes);
-   u.ptr = buffer;
-
-   if ( operation & RSD_ALAW_TO_S16 )
-   {
-      alaw_to_s16(buffer, bytes);
-      bytes *= 2;
-      fmt = (is_little_endian()) ? RSD_S16_LE : RSD_S16_BE;
-   }
+   size_t samples = bytes / conv->in_bytes;
+   size_t out_size = samples * conv->out_bytes;
 
-   if ( operation & RSD_MULAW_TO_S16 )
+   if ( conv->kernel == NULL )
    {
-      mulaw_to_s16(buffer, bytes);
-      bytes *= 2;
-      fmt = (is_little_endian()) ? RSD_S16_LE : RSD_S16_BE;
+      if ( out != in )
+         memcpy(out, in, out_size);
+      return out_size;
    }
 
-   int i = 0;
-   if ( is_little_endian() )
-      i++;
-   if ( fmt & (RSD_S16_BE | RSD_U16_BE | RSD_S32_BE | RSD_U32_BE) )
-      i++;
-
-   // If we're gonna operate on the data, we better make sure that we are in native byte order
-   if ( (i % 2) == 0 )
+   if ( out != in || conv->in_bytes == conv->out_bytes )
    {
-      if (bits == 16)
-      {
-         swap_bytes16(u.u16, bytes);
-         swapped = 1;
-      }
-      else if (bits == 32)
-      {
-         swap_bytes32(u.u32, bytes);
-         swapped = 1;
-      }
+      audio_run_kernel(conv, out, in, samples);
+      return out_size;
    }
 
-   if ( operation & RSD_S_TO_U )
-   {
-      if ( bits == 8 )
-      {
-         for ( int i = 0; i < (int)bytes; i++ )
-         {
-            int32_t temp32 = (u.s8)[i];
-            temp32 += (1 << 7);
-            (u.u8)[i] = (uint8_t)temp32;
-         }
-      }
-
-      else if ( bits == 16 )
-      {
-         for ( int i = 0; i < (int)bytes/2; i++ )
-         {
-            int32_t temp32 = (u.s16)[i];
-            temp32 += (1 << 15);
-            (u.u16)[i] = (uint16_t)temp32;
-         }
-      }
-
-      else if ( bits == 32 )
-      {
-         for ( int i = 0; i < (int)bytes/4; i++ )
-         {
-            int64_t temp64 = (u.s32)[i];
-            temp64 += (1 << 31);
-            (u.u32)[i] = (uint32_t)temp64;
-         }
-      }
-   }
+   // In place, but the sample size changes. Convert through a small block, so we never write over
+   // samples we haven't read yet. Widening has to start at the end for that, narrowing at the start.
+   uint8_t block[AUDIO_CONVERT_BLOCK * sizeof(float)];
+   const uint8_t *src = in;
+   uint8_t *dst = out;
 
-   else if ( operation & RSD_U_TO_S )
+   if ( conv->out_bytes > conv->in_bytes )
    {
-      if ( bits == 8 )
-      {
-         for ( int i = 0; i < (int)bytes; i++ )
-         {
-            int32_t temp32 = (u.u8)[i];
-            temp32 -= (1 << 7);
-            (u.s8)[i] = (int8_t)temp32;
-         }
-      }
-
-      else if ( bits == 16 )
-      {
-         for ( int i = 0; i < (int)bytes/2; i++ )
-         {
-            int32_t temp32 = (u.u16)[i];
-            temp32 -= (1 << 15);
-            (u.s16)[i] = (int16_t)temp32;
-         }
-      }
-
-      else if ( bits == 32 )
+      size_t left = samples;
+      while ( left > 0 )
       {
-         for ( int i = 0; i < (int)bytes/4; i++ )
-         {
-            int64_t temp64 = (u.u32)[i];
-            temp64 -= (1 << 31);
-            (u.s32)[i] = (int32_t)temp64;
-         }
+         size_t count = left > AUDIO_CONVERT_BLOCK ? AUDIO_CONVERT_BLOCK : left;
+         left -= count;
+         audio_run_kernel(conv, block, src + left * conv->in_bytes, count);
+         memcpy(dst + left * conv->out_bytes, block, count * conv->out_bytes);
       }
    }
-
-   if ( operation & RSD_S8_TO_S16 )
-   {
-      s8_to_s16(u.ptr, bytes);
-      bytes *= 2;
-      fmt = (is_little_endian()) ? RSD_S16_LE : RSD_S16_BE;
-   }
-   else if ( operation & RSD_S32_TO_S16 )
-   {
-      s32_to_s16(u.ptr, bytes);
-      bytes /= 2;
-      fmt = (is_little_endian()) ? RSD_S16_LE : RSD_S16_BE;
-   }
-
-
-   if ( operation & RSD_SWAP_ENDIAN )
+   else
    {
-      if ( !swapped && bits == 16 )
-      {
-         swap_bytes16(u.u16, bytes);
-      }
-      else if ( !swapped && bits == 32 )
+      for ( size_t done = 0; done < samples; )
       {
-         swap_bytes32(u.u32, bytes);
+         size_t count = samples - done > AUDIO_CONVERT_BLOCK ? AUDIO_CONVERT_BLOCK : samples - done;
+         audio_run_kernel(conv, block, src + done * conv->in_bytes, count);
+         memcpy(dst + done * conv->out_bytes, block, count * conv->out_bytes);
+         done += count;
       }
    }
 
-   else if ( swapped ) // We need to flip back. Kinda expensive, but hey. An endian-flipping-less algorithm will be more complex. :)
-   {
-      if ( bits == 16 )
-         swap_bytes16(u.u16, bytes);
-      else if ( bits == 32 )
-         swap_bytes32(u.u32, bytes);
-   }
-
-   if ( operation & RSD_S16_TO_FLOAT )
-   {
-      s16_to_float(u.ptr, bytes);
-      bytes *= sizeof(float) / sizeof(int16_t);
-   }
-   else if ( operation & RSD_S32_TO_FLOAT )
-   {
-      s32_to_float(u.ptr, bytes);
-      bytes *= sizeof(float) / sizeof(int32_t);
-   }
-
-   memcpy(data, buffer, bytes);
+   return out_size;
 }
 
 int converter_fmt_to_s16ne(enum rsd_format format)
@@ -502,6 +438,41 @@ int converter_fmt_to_s32ne(enum rsd_format format)
 }
 
 
+int resample_cb_init(resample_cb_state_t *state, enum rsd_format fmt, int channels, size_t frames,
+      void *data, connection_t *conn)
+{
+   memset(state, 0, sizeof(*state));
+
+   int conversion = (rsnd_format_to_bytes(fmt) == 4) ?
+      converter_fmt_to_s32ne(fmt) | RSD_S32_TO_FLOAT : converter_fmt_to_s16ne(fmt) | RSD_S16_TO_FLOAT;
+   if ( audio_converter_init(&state->conv, fmt, conversion) < 0 )
+      return -1;
+
+   state->data = data;
+   state->conn = conn;
+   state->frames = frames;
+   state->framesize = channels * rsnd_format_to_bytes(fmt);
+   state->raw = malloc(frames * state->framesize);
+   state->buffer = malloc(frames * channels * sizeof(float));
+   if ( state->raw == NULL || state->buffer == NULL )
+   {
+      resample_cb_free(state);
+      return -1;
+   }
+
+   return 0;
+}
+
+void resample_cb_free(resample_cb_state_t *state)
+{
+   free(state->raw);
+   free(state->buffer);
+   state->raw = NULL;
+   state->buffer = NULL;
+}
+
+/* Reads what the resampler needs for about one chunk of output in one go, and converts it
+ * to float in a single pass. The buffer stays valid until we're called again. */
 #ifdef HAVE_SAMPLERATE
 long resample_callback(void *cb_data, float **data)
 #else
@@ -510,52 +481,14 @@ size_t resample_callback(void *cb_data, float **data)
 {
    resample_cb_state_t *state = cb_data;
 
-   int conversion = RSD_NULL;
-
-   if (rsnd_format_to_bytes(state->format) == 4)
-      conversion = converter_fmt_to_s32ne(state->format);
-   else
-      conversion = converter_fmt_to_s16ne(state->format);
-   if (conversion == -1)
-   {
-      *data = NULL;
-      return 0;
-   }
-   
-   assert(sizeof(float) == 4);
-   size_t bufsize = sizeof(state->buffer)/sizeof(state->buffer[0]);
-   uint32_t buf[bufsize];
-   union
-   {
-      int16_t *i16;
-      int32_t *i32;
-      void *ptr;
-   } inbuffer;
-   inbuffer.ptr = buf;
-
-   int channels = state->framesize / rsnd_format_to_bytes(state->format);
-   size_t read_size = (bufsize / channels) * state->framesize;
-
-   int rc = receive_data(state->data, state->conn, inbuffer.ptr, read_size);
+   int rc = receive_data(state->data, state->conn, state->raw, state->frames * state->framesize);
    if ( rc <= 0 )
    {
       *data = NULL;
       return 0;
    }
 
-   audio_converter(inbuffer.ptr, state->format, conversion, read_size);
-#ifdef HAVE_SAMPLERATE
-   if (rsnd_format_to_bytes(state->format) == 4)
-      src_int_to_float_array(inbuffer.i32, state->buffer, bufsize);
-   else
-      src_short_to_float_array(inbuffer.i16, state->buffer, bufsize);
-#else
-   if (rsnd_format_to_bytes(state->format) == 4)
-      resampler_s32_to_float(state->buffer, inbuffer.i32, bufsize);
-   else
-      resampler_s16_to_float(state->buffer, inbuffer.i16, bufsize);
-#endif
-
+   audio_convert(&state->conv, state->buffer, state->raw, rc);
    *data = state->buffer;
    return rc / state->framesize;
 }
@@ -44,6 +44,8 @@
 #include "resampler.h"
 #endif
 
+#include "simd.h"
+
 // Defines audio formats supported by rsound. Might be extended in the future :)
 enum rsd_format
 {
@@ -69,6 +71,31 @@ enum
    RSD_CONN_UNIX = 0x0001
 };
 
+// Framing of the data socket. Newer clients put this magic in the RIFF chunk size of the WAV header
+// to ask for having control messages on the data socket as well. See DOCUMENTATION.
+#define RSD_FRAME_MAGIC 0x52534432 // "RSD2"
+// Same, but with a control socket. Either magic means that the protocol flags are valid.
+#define RSD_PROTO_MAGIC 0x52534431 // "RSD1"
+#define RSD_FRAME_HEADER_SIZE 8
+
+// Binary control messages, asked for in the protocol flags of the WAV header. See proto.h.
+#define RSD_PROTO_FLAG_BINARY 0x0001
+// The client may start over with a new stream on the same connection by sending RESET. Needs framing and binary messages.
+#define RSD_PROTO_FLAG_RESET 0x0002
+#define RSD_CTL_MSG_SIZE 32
+#define RSD_CTL_MSG_MAXSIZE (RSD_CTL_MSG_SIZE + 256)
+
+// A control frame holds exactly one control message, text or binary.
+#define RSD_FRAME_CTL_MAXSIZE RSD_CTL_MSG_MAXSIZE
+// Replies the event loop holds on to for a client which doesn't read them.
+#define RSD_CTL_QUEUE_SIZE (4 * (RSD_FRAME_HEADER_SIZE + RSD_FRAME_CTL_MAXSIZE))
+
+enum
+{
+   RSD_FRAME_AUDIO = 0x0000,
+   RSD_FRAME_CTL = 0x0001
+};
+
 // The header that is sent from client to server
 typedef struct wav_header 
 {
@@ -76,6 +103,8 @@ typedef struct wav_header
    uint32_t sampleRate;
    uint16_t bitsPerSample;
    uint16_t rsd_format;
+   int framed; // Client asked for framing.
+   uint16_t proto_flags;
    char *stream_name;
 } wav_header_t;
 
@@ -108,6 +137,34 @@ typedef struct
    int64_t serv_ptr;
    float rate_ratio;
    char identity[256];
+
+   // Control messages are binary.
+   int binary_ctl;
+   // Partial binary messages from the ctl socket.
+   char ctl_buf[2 * RSD_CTL_MSG_MAXSIZE];
+   size_t ctl_ptr;
+   // REPORT messages we push to the client. Interval in ms, 0 if it doesn't want any.
+   int report_interval;
+   int64_t next_report;
+
+   // The client can end the stream with RESET, and start a new one the same way.
+   // The WAV header of the next stream waits here until the old stream is torn down.
+   int reset;
+   int reset_pending;
+   int reset_next;
+   char reset_header[HEADER_SIZE];
+
+   // State of the deframer when control and audio share the data socket.
+   int framed;
+   uint16_t frame_type;
+   uint32_t frame_left;
+   size_t frame_ptr;
+   char frame_buf[RSD_FRAME_CTL_MAXSIZE + 1];
+
+   // The event loop can't wait for the client to read its replies, so what doesn't go out right away waits here.
+   int queue_ctl;
+   char ctl_queue[RSD_CTL_QUEUE_SIZE];
+   size_t ctl_queue_len;
 } connection_t;
 
 
@@ -130,7 +187,25 @@ enum rsd_format_conv
    RSD_S32_TO_S16 = 0x0100
 };
 
-void audio_converter(void* data, enum rsd_format fmt, int operation, size_t bytes); 
+// Converts samples from in to out in a single pass.
+typedef void (*audio_kernel_t)(void *out, const void *in, size_t samples);
+
+// A conversion, picked once when a stream is opened.
+typedef struct audio_converter
+{
+   audio_kernel_t kernel; // NULL if the data is passed through as is.
+   simd_kernel_t simd;    // Does the bulk of the work instead of kernel if the CPU can.
+   int in_bytes;  // Sample size going in ...
+   int out_bytes; // ... and coming out.
+} audio_converter_t;
+
+// Picks the kernel for doing operation on data in fmt. Returns -1 if the combination isn't supported.
+int audio_converter_init(audio_converter_t *conv, enum rsd_format fmt, int operation);
+
+// Converts bytes of data from in, and returns the number of bytes written to out.
+// out may be the same buffer as in, but must otherwise not overlap with it.
+// In either case, it has to be large enough for the converted data.
+size_t audio_convert(const audio_converter_t *conv, void *out, const void *in, size_t bytes);
 
 #ifdef HAVE_SAMPLERATE
 long resample_callback(void *cb_data, float **data);
@@ -140,13 +215,20 @@ size_t resample_callback(void *cb_data, float **data);
 
 typedef struct
 {
-   enum rsd_format format;
+   audio_converter_t conv; // Straight from what the client sends to float.
    void *data;
    connection_t *conn;
-   float buffer[DEFAULT_CHUNK_SIZE];
+   uint8_t *raw; // What comes off the socket ...
+   float *buffer; // ... and what we hand to the resampler.
+   size_t frames; // Read at a time.
    int framesize;
 } resample_cb_state_t;
 
+// Sets up reading frames at a time of fmt from conn. Returns -1 if fmt can't be resampled.
+int resample_cb_init(resample_cb_state_t *state, enum rsd_format fmt, int channels, size_t frames,
+      void *data, connection_t *conn);
+void resample_cb_free(resample_cb_state_t *state);
+
 int receive_data(void *backend_data, connection_t *conn, void *buffer, size_t size);
 int converter_fmt_to_s16ne(enum rsd_format format);
 int converter_fmt_to_s32ne(enum rsd_format format);
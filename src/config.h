@@ -0,0 +1,9 @@
+
+#ifndef __CONFIG_H
+#define __CONFIG_H
+#define RSD_VERSION "1.2"
+#define HAVE_SYS_SOUNDCARD_H 1
+#define _OSS 1
+#define HAVE_SYSLOG 1
+#define HAVE_EPOLL 1
+#endif
@@ -0,0 +1,9 @@
+
+RSD_VERSION = 1.2
+CC = cc
+CFLAGS =  -std=gnu99 -Wall -Wextra
+HAVE_OSS = 1
+HAVE_SYSLOG = 1
+HAVE_EPOLL = 1
+NEED_RT = 1
+PREFIX = /usr/local
@@ -57,9 +57,7 @@ static int ross_latency(ross_t *ro)
       return 0;
 
    int ret = rsd_delay(ro->rd);
-   rsd_callback_lock(ro->rd);
    ret += rsnd_fifo_read_avail(ro->buffer);
-   rsd_callback_unlock(ro->rd);
    return ret;
 }
 
@@ -133,9 +131,7 @@ static unsigned ross_write_avail(ross_t *ro)
    if (!ro->started)
       return ro->bufsize;
 
-   rsd_callback_lock(ro->rd);
    unsigned ret = rsnd_fifo_write_avail(ro->buffer);
-   rsd_callback_unlock(ro->rd);
    return ret;
 }
 
@@ -144,9 +140,7 @@ static int ross_read_avail(ross_t *ro)
    if (!ro->started)
       return 0;
 
-   rsd_callback_lock(ro->rd);
    unsigned ret = rsnd_fifo_read_avail(ro->buffer);
-   rsd_callback_unlock(ro->rd);
    return ret;
 }
 
@@ -14,6 +14,8 @@
  */
 
 #include "rsound.h"
+#include "proto.h"
+#include "endian.h"
 
 #include <poll.h>
 
@@ -30,6 +32,7 @@
 #include <arpa/inet.h>
 #include <signal.h>
 #include <time.h>
+#include <fcntl.h>
 #endif
 
 #ifdef HAVE_SYSLOG
@@ -52,6 +55,8 @@ int no_threading = 0;
 
 #ifdef HAVE_SAMPLERATE
 int src_converter = SRC_SINC_FASTEST;
+#else
+int resampler_quality = RESAMPLER_QUALITY_DEFAULT;
 #endif
 
 int verbose = 0;
@@ -60,30 +65,21 @@ int use_syslog = 0;
 int listen_socket = 0;
 int rsd_conn_type = RSD_CONN_TCP;
 int resample_freq = 0;
+int adaptive_latency = 0;
 int daemonize = 0;
+int use_mixer = 0;
+int event_loop_workers = 0;
+int pool_workers = 0;
+int pool_stack_size = 0;
 
 static void* get_addr(struct sockaddr*);
-static int valid_ips(struct sockaddr_storage *their_addr);
+static int get_port(struct sockaddr*);
 static void log_message(const char* ip);
-
-// Union for casting without aliasing violations.
-static union
-{
-   struct sockaddr* addr;
-   struct sockaddr_storage* storage;
-   struct sockaddr_in* v4;
-   struct sockaddr_in6* v6;
-} u[2];
+static void accept_loop(int s);
 
 int main(int argc, char ** argv)
 {
-   int s = -1, s_new = -1, s_ctl = -1;
-   connection_t conn;
-   struct sockaddr_storage their_addr[2];
-   u[0].storage = &their_addr[0];
-   u[1].storage = &their_addr[1];
-   socklen_t addr_size;
-   struct pollfd fd;
+   int s = -1;
 
    /* Parses input and sets the global variables */
    parse_input(argc, argv);
@@ -124,11 +120,8 @@ int main(int argc, char ** argv)
    if ( debug )
       log_printf("Listening for connection ...\n");
 
-   fd.fd = s;
-   fd.events = POLLIN;
-
    /* Set up listening socket */
-   if ( listen(s, 10) == -1 )
+   if ( listen(s, SOMAXCONN) == -1 )
    {
       log_printf("Couldn't listen for connections \"%s\"...\n", strerror(errno));
       exit(1);
@@ -156,76 +149,7 @@ int main(int argc, char ** argv)
 #endif
 
 
-   /* We're accepting two connects after each other, as we have one stream socket for audio data
-      and one for controlling the server. Currently, the control socket is only useful for
-      determining quickly when the client has hung up the connection. In case a control socket
-      isn't supplied in a short time window (nmap, port scanners, etc),
-      we shut down the connection. The connection, if accepted, will be handled in a new thread. */
-
-   for(;;)
-   {
-      addr_size = sizeof (their_addr[0]);
-      s_new = accept(s, u[0].addr, &addr_size);
-
-      if ( s_new == -1 )
-      {
-         log_printf("Accepting failed... Errno: %d\n", errno);
-         log_printf("%s\n", strerror( errno ) ); 
-         continue;
-      }
-
-      /* Accepts a ctl socket. They have to come from same source. 
-       * Times out very quickly (in case the server is being queried from an unknown source. */
-
-      if (poll(&fd, 1, 200) < 0)
-      {
-         perror("poll");
-         close(s_new);
-         close(s_ctl);
-         close(s);
-         exit(1);
-      }
-
-      /* Accepts the connection if there's one pending */
-      if (fd.revents & POLLIN)
-      {
-         addr_size = sizeof (their_addr[0]);
-         s_ctl = accept(s, u[1].addr, &addr_size);
-      }
-      /* We didn't get a control socket, so we don't care about it :) 
-         If s_ctl is 0, the backend will not perform any operations on it. */
-      else 
-      {
-         if ( debug )
-            log_printf("CTL-socket timed out. Ignoring CTL-socket. \n");
-
-         s_ctl = 0;
-      }
-
-      if ( s_ctl == -1 )
-      {
-         close(s_new); s_new = -1;
-         log_printf("%s\n", strerror( errno ) ); 
-         continue;
-      }
-
-      /* Checks if they are from same source, if not, close the connection. */
-      /* Check will be ignored if there is no ctl-socket active. */
-      /* TODO: Security here is *retarded* :D */
-      if ( (s_ctl > 0) && valid_ips(their_addr) < 0 )
-      {
-         close(s_new); s_new = -1;
-         close(s_ctl); s_ctl = -1;
-         continue;
-      }
-
-      conn.socket = s_new;
-      conn.ctl_socket = s_ctl;
-      new_sound_thread(conn);
-      s_new = -1; // Makes sure that we cannot clutter the backend connection in any way.
-      s_ctl = -1;
-   }
-
+   accept_loop(s);
    return 0;
 }
 
@@ -252,6 +176,24 @@ static void* get_addr(struct sockaddr *sa)
    return NULL;
 }
 
+static int get_port(struct sockaddr *sa)
+{
+   union
+   {
+      struct sockaddr *sa;
+      struct sockaddr_in *v4;
+      struct sockaddr_in6 *v6;
+   } u;
+
+   u.sa = sa;
+
+   if ( sa->sa_family == AF_INET ) 
+      return ntohs(u.v4->sin_port);
+   else if ( sa->sa_family == AF_INET6 )
+      return ntohs(u.v6->sin6_port);
+   return 0;
+}
+
 // Hooray!
 #ifdef _WIN32
 static const char *inet_ntop(int af, const void *src, char *dst, socklen_t cnt)
@@ -291,40 +233,353 @@ static const char *inet_ntop(int af, const void *src, char *dst, socklen_t cnt)
 }
 #endif
 
-static int valid_ips( struct sockaddr_storage *their_addr )
+static void log_message( const char * ip )
 {
-   char remoteIP[2][INET6_ADDRSTRLEN] = { "", "" };
+   char timestring[64] = {0};
+
+   if ( verbose )
+   {
+      time_t cur_time;
+      time(&cur_time);
+      strftime(timestring, 63, "%Y-%m-%d - %H:%M:%S", localtime(&cur_time)); 
+      log_printf("Connection :: [ %s ] [ %s ] ::\n", timestring, ip);
+   }
+}
 
-   inet_ntop(their_addr[0].ss_family, 
-         get_addr(u[0].addr),
-         remoteIP[0], INET6_ADDRSTRLEN);
-   inet_ntop(their_addr[1].ss_family, 
-         get_addr(u[0].addr),
-         remoteIP[1], INET6_ADDRSTRLEN);
 
+/* We have one stream socket for audio data and one for controlling the server for every client.
+   Clients connect the data socket first, then the ctl socket, and then send the WAV header on the data socket.
+   Nothing is sent on the ctl socket before the client has heard back from us.
+   
+   All pending connections are accepted right away. A connection which starts out with "RIFF" is a data socket,
+   and it is paired with the first silent connection from the same address accepted after it.
+   In case a control socket isn't supplied in a short time window (old clients), the data socket is handled without one.
+   Silent connections which never get paired (nmap, port scanners, etc) are eventually shut down.
+   Clients which ask for framing in the WAV header have no ctl socket, and are handled right away.
+   Pending connections are kept in the order they were accepted, which is also the order they time out in. */
+
+#define PENDING_MAX 128
+/* A silent connection must have been around for this long before we believe it's a ctl socket of an older client,
+   and not a data socket which is slow to send its header. */
+#define PENDING_SETTLE_MS 50
+#define PENDING_CTL_TIMEOUT_MS 200
+#define PENDING_TIMEOUT_MS 2000
+/* What we peek at stays on the socket, so a connection which has sent too little to tell what it is
+   would wake us up right away forever. Those are looked at again on a timer instead. */
+#define PENDING_PEEK_MS (PENDING_SETTLE_MS / 2)
+
+typedef struct
+{
+   int fd;
+   int is_data;
+   int is_ctl;
+   int is_framed; // Has everything on the data socket, so there's no ctl socket to wait for.
+   int port;
+   int pair_port; // Port of the data socket, as told by the client on the ctl socket.
+   int64_t time;
+   int64_t data_time; // When the WAV header showed up.
+   int peeked; // Bytes we've seen so far, if that wasn't enough.
+   int64_t peek_time;
+   char ip[INET6_ADDRSTRLEN];
+} pending_conn_t;
+
+static pending_conn_t pending[PENDING_MAX];
+static int num_pending;
+
+static int64_t get_time_ms(void)
+{
+#ifdef _WIN32
+   return GetTickCount();
+#else
+   struct timespec tv;
+   clock_gettime(CLOCK_MONOTONIC, &tv);
+   return (int64_t)tv.tv_sec * 1000 + tv.tv_nsec / 1000000;
+#endif
+}
 
-   if ( strcmp( remoteIP[0], remoteIP[1] ) != 0  )
+static int set_non_blocking(int s)
+{
+#ifdef _WIN32
+   u_long iMode = 1;
+   return ioctlsocket(s, FIONBIO, &iMode) == 0 ? 0 : -1;
+#else
+   return fcntl(s, F_SETFL, O_NONBLOCK);
+#endif
+}
+
+static void remove_pending(int index, int close_fd)
+{
+   if ( close_fd )
+      close(pending[index].fd);
+
+   memmove(&pending[index], &pending[index + 1], (num_pending - index - 1) * sizeof(pending[0]));
+   num_pending--;
+}
+
+static void accept_pending(int s)
+{
+   struct sockaddr_storage their_addr;
+   union
+   {
+      struct sockaddr* addr;
+      struct sockaddr_storage* storage;
+   } u;
+   u.storage = &their_addr;
+
+   while ( num_pending < PENDING_MAX )
    {
-      log_printf("*** Warning: Got two connections from different sources. ***\n");
-      log_printf("*** %s :: %s ***\n", remoteIP[0], remoteIP[1]);
+      socklen_t addr_size = sizeof(their_addr);
+      int s_new = accept(s, u.addr, &addr_size);
+
+      if ( s_new == -1 )
+      {
+         if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+         {
+            log_printf("Accepting failed... Errno: %d\n", errno);
+            log_printf("%s\n", strerror( errno ) ); 
+         }
+         return;
+      }
+
+      pending_conn_t *conn = &pending[num_pending++];
+      memset(conn, 0, sizeof(*conn));
+      conn->fd = s_new;
+      conn->time = get_time_ms();
+
+      // Unix sockets have no address, so they all look the same to us.
+      void *addr = get_addr(u.addr);
+      if ( addr )
+         inet_ntop(their_addr.ss_family, addr, conn->ip, INET6_ADDRSTRLEN);
+      conn->port = get_port(u.addr);
+   }
+}
+
+/* Peeks at silent connections to see what they are. Data sockets start out with the WAV header,
+   while newer clients tell us which data socket they belong to on the ctl socket. */
+static int classify_conn(pending_conn_t *conn)
+{
+   char buf[RSD_PROTO_CHUNKSIZE + RSD_PROTO_MAXSIZE + 1];
+
+   int rc = recv(conn->fd, buf, sizeof(buf) - 1, MSG_PEEK);
+   if ( rc <= 0 )
       return -1;
+
+   if ( rc >= 8 && memcmp(buf, "RIFF", 4) == 0 )
+   {
+      uint32_t riff_size = *((uint32_t*)(buf + 4));
+      if ( !is_little_endian() )
+         swap_endian_32(&riff_size);
+
+      conn->is_data = 1;
+      conn->is_framed = riff_size == RSD_FRAME_MAGIC;
+      conn->data_time = get_time_ms();
+      return 0;
    }
+   else if ( memcmp(buf, "RIFF", rc < 4 ? rc : 4) == 0 )
+      goto incomplete;
+
+   if ( memcmp(buf, "RSD", rc < 3 ? rc : 3) != 0 )
+      return -1;
+   if ( rc < RSD_PROTO_CHUNKSIZE )
+      goto incomplete;
 
-   log_message(remoteIP[1]);
+   buf[RSD_PROTO_CHUNKSIZE] = '\0';
+   long len = strtol(buf + 3, NULL, 10);
+   if ( len <= 0 || len > RSD_PROTO_MAXSIZE )
+      return -1;
+   if ( rc < RSD_PROTO_CHUNKSIZE + len )
+      goto incomplete;
 
+   rc = recv(conn->fd, buf, RSD_PROTO_CHUNKSIZE + len, 0);
+   if ( rc != RSD_PROTO_CHUNKSIZE + len )
+      return -1;
+
+   buf[rc] = '\0';
+   if ( sscanf(buf + RSD_PROTO_CHUNKSIZE, " PAIR %d", &conn->pair_port) != 1 )
+      return -1;
+
+   conn->is_ctl = 1;
+   return 0;
+
+incomplete:
+   conn->peeked = rc;
+   conn->peek_time = get_time_ms();
    return 0;
 }
 
-static void log_message( const char * ip )
+static int is_peek_due(const pending_conn_t *conn, int64_t now)
 {
-   char timestring[64] = {0};
+   return conn->peeked > 0 && now - conn->peek_time >= PENDING_PEEK_MS;
+}
 
-   if ( verbose )
+static void classify_pending(const struct pollfd *fds, int num_fds, int64_t now)
+{
+   for ( int i = 0, k = 0; k < num_fds; k++ )
    {
-      time_t cur_time;
-      time(&cur_time);
-      strftime(timestring, 63, "%Y-%m-%d - %H:%M:%S", localtime(&cur_time)); 
-      log_printf("Connection :: [ %s ] [ %s ] ::\n", timestring, ip);
+      int ready = (fds[k].revents & (POLLIN | POLLHUP | POLLERR)) || is_peek_due(&pending[i], now);
+      if ( pending[i].is_data || pending[i].is_ctl || !ready )
+      {
+         i++;
+         continue;
+      }
+
+      if ( classify_conn(&pending[i]) < 0 )
+      {
+         if ( debug )
+            log_printf("Got garbage on unpaired connection. Dropping it.\n");
+         remove_pending(i, 1);
+      }
+      else
+         i++;
+   }
+}
+
+// Is the data socket this ctl socket claims to belong to still around?
+static int is_pending_port(const char *ip, int port)
+{
+   for ( int i = 0; i < num_pending; i++ )
+   {
+      if ( !pending[i].is_ctl && pending[i].port == port && strcmp(pending[i].ip, ip) == 0 )
+         return 1;
+   }
+   return 0;
+}
+
+static int find_ctl(int data, int64_t now)
+{
+   const pending_conn_t *conn = &pending[data];
+
+   // The client told us which one it is.
+   for ( int j = 0; j < num_pending; j++ )
+   {
+      if ( pending[j].is_ctl && pending[j].pair_port == conn->port && strcmp(pending[j].ip, conn->ip) == 0 )
+         return j;
+   }
+
+   // Ports don't have to match if there's NAT going on. Go with the first ctl socket which doesn't match anyone else.
+   for ( int j = data + 1; j < num_pending; j++ )
+   {
+      if ( pending[j].is_ctl && strcmp(pending[j].ip, conn->ip) == 0 && !is_pending_port(conn->ip, pending[j].pair_port) )
+         return j;
+   }
+
+   /* Older clients don't say anything on the ctl socket. The ctl socket is the first silent one after the data socket.
+      Newer clients have sent the pairing message before the WAV header, so give that some time to show up first. */
+   if ( now - conn->data_time < PENDING_SETTLE_MS )
+      return -1;
+
+   for ( int j = data + 1; j < num_pending; j++ )
+   {
+      if ( !pending[j].is_data && !pending[j].is_ctl && strcmp(pending[j].ip, conn->ip) == 0 )
+         return now - pending[j].time >= PENDING_SETTLE_MS ? j : -1;
+   }
+
+   return -1;
+}
+
+static void dispatch_pending(int64_t now)
+{
+   for ( int i = 0; i < num_pending; )
+   {
+      if ( !pending[i].is_data )
+      {
+         if ( now - pending[i].time >= PENDING_TIMEOUT_MS )
+         {
+            if ( debug )
+               log_printf("Connection was never paired up. Dropping it.\n");
+            remove_pending(i, 1);
+         }
+         else
+            i++;
+         continue;
+      }
+
+      int ctl = pending[i].is_framed ? -1 : find_ctl(i, now);
+
+      connection_t conn;
+      memset(&conn, 0, sizeof(conn));
+      conn.socket = pending[i].fd;
+
+      if ( ctl >= 0 )
+         conn.ctl_socket = pending[ctl].fd;
+      else if ( pending[i].is_framed )
+      {
+         if ( debug )
+            log_printf("Client uses framing. No CTL-socket needed.\n");
+      }
+      else if ( now - pending[i].time >= PENDING_CTL_TIMEOUT_MS )
+      {
+         /* We didn't get a control socket, so we don't care about it :) 
+            If ctl_socket is 0, the backend will not perform any operations on it. */
+         if ( debug )
+            log_printf("CTL-socket timed out. Ignoring CTL-socket. \n");
+      }
+      else
+      {
+         i++;
+         continue;
+      }
+
+      log_message(pending[i].ip);
+      new_sound_thread(conn);
+
+      if ( ctl > i )
+      {
+         remove_pending(ctl, 0);
+         remove_pending(i, 0);
+      }
+      else if ( ctl >= 0 )
+      {
+         remove_pending(i, 0);
+         remove_pending(ctl, 0);
+         i--; // Everything after ctl has moved one step back.
+      }
+      else
+         remove_pending(i, 0);
    }
 }
 
+static void accept_loop(int s)
+{
+   struct pollfd fds[PENDING_MAX + 1];
+
+   if ( set_non_blocking(s) < 0 )
+   {
+      log_printf("Setting non-blocking socket failed.\n");
+      exit(1);
+   }
+
+   for(;;)
+   {
+      for ( int i = 0; i < num_pending; i++ )
+      {
+         fds[i].fd = pending[i].fd;
+         fds[i].events = pending[i].is_data || pending[i].is_ctl || pending[i].peeked ? 0 : POLLIN;
+         fds[i].revents = 0;
+      }
+
+      // If we're full, the rest will have to wait in the backlog.
+      fds[num_pending].fd = s;
+      fds[num_pending].events = num_pending < PENDING_MAX ? POLLIN : 0;
+      fds[num_pending].revents = 0;
+
+      int num_fds = num_pending;
+      int timeout = num_pending > 0 ? PENDING_PEEK_MS : -1;
+      if ( poll(fds, num_fds + 1, timeout) < 0 )
+      {
+         if ( errno == EINTR )
+            continue;
+
+         perror("poll");
+         close(s);
+         exit(1);
+      }
+
+      classify_pending(fds, num_fds, get_time_ms());
+
+      if ( fds[num_fds].revents & POLLIN )
+         accept_pending(s);
+
+      dispatch_pending(get_time_ms());
+   }
+}
@@ -0,0 +1,55 @@
+/*  RSound - A PCM audio client/server
+ *  Copyright (C) 2010-2011 - Hans-Kristian Arntzen
+ *
+ *  RSound is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RSound is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RSound.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A PI controller on the buffer fill. The fill moves by the difference between the clocks,
+ * less the correction, every second. With these gains it settles in some 30 seconds without
+ * overshooting much, and the smoothing keeps network jitter from modulating the pitch. */
+
+#include "drift.h"
+#include <string.h>
+
+// Time constant of the smoothing of the measurements, in seconds.
+#define DRIFT_SMOOTHING 1.0
+#define DRIFT_KP 0.14
+#define DRIFT_KI 0.01
+
+void drift_init(drift_t *drift, double target)
+{
+   memset(drift, 0, sizeof(*drift));
+   drift->target = target;
+}
+
+double drift_update(drift_t *drift, double buffered, double period)
+{
+   if ( drift->elapsed == 0.0 )
+      drift->fill = buffered;
+   else
+      drift->fill += (buffered - drift->fill) * period / (DRIFT_SMOOTHING + period);
+   drift->elapsed += period;
+
+   // Too much buffered means we have to eat input faster, i.e. make less output of it.
+   double error = drift->fill - drift->target;
+   double integral = drift->integral + error * period;
+   double correction = 1.0 - DRIFT_KP * error - DRIFT_KI * integral;
+
+   // The integral only runs while we're not clamped, so it doesn't wind up.
+   if ( correction > 1.0 + DRIFT_MAX_CORRECTION )
+      return 1.0 + DRIFT_MAX_CORRECTION;
+   if ( correction < 1.0 - DRIFT_MAX_CORRECTION )
+      return 1.0 - DRIFT_MAX_CORRECTION;
+
+   drift->integral = integral;
+   return correction;
+}
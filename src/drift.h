@@ -0,0 +1,40 @@
+/*  RSound - A PCM audio client/server
+ *  Copyright (C) 2010-2011 - Hans-Kristian Arntzen
+ *
+ *  RSound is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RSound is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RSound.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DRIFT_H
+#define __DRIFT_H
+
+/* Follows how much audio is buffered for a stream, and works out how much faster or slower
+ * than nominal the resampler has to run to keep that constant, even though the client's clock
+ * and the device's clock don't quite agree. */
+
+// Most the ratio is ever changed by. 0.5% can't be heard, and clocks are a lot closer than that.
+#define DRIFT_MAX_CORRECTION 0.005
+
+typedef struct drift
+{
+   double target; // Seconds buffered we steer towards.
+   double fill; // Seconds buffered, smoothed.
+   double integral;
+   double elapsed; // Seconds of output so far.
+} drift_t;
+
+void drift_init(drift_t *drift, double target);
+
+// Adds a measurement of how many seconds are buffered, after writing period seconds of output.
+// Returns what the nominal ratio (output rate / input rate) should be multiplied by.
+double drift_update(drift_t *drift, double buffered, double period);
+
+#endif
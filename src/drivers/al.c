@@ -83,9 +83,8 @@ static int al_open(void* data, wav_header_t *w)
 
 
    al->fmt = w->rsd_format;
-   al->conv = RSD_NULL;
-
-   al->conv = converter_fmt_to_s16ne(w->rsd_format);
+   if (audio_converter_init(&al->conv, w->rsd_format, converter_fmt_to_s16ne(w->rsd_format)) < 0)
+      return -1;
 
    // Don't support multichannels yet.
    if (w->numChannels > 2)
@@ -166,16 +165,9 @@ static size_t al_write(void *data, const void* inbuf, size_t size)
    uint8_t convbuf[2*size];
    void *buffer_ptr = (void*)inbuf;
 
-   if (al->conv != RSD_NULL)
+   if (al->conv.kernel != NULL)
    {
-      if (rsnd_format_to_bytes(al->fmt) == 1)
-         osize = 2 * size;
-      else if (rsnd_format_to_bytes(al->fmt) == 4)
-         osize = size / 2;
-
-      memcpy(convbuf, inbuf, size);
-
-      audio_converter(convbuf, al->fmt, al->conv, size);
+      osize = audio_convert(&al->conv, convbuf, inbuf, size);
       buffer_ptr = convbuf;
    }
 
@@ -40,7 +40,7 @@ typedef struct
    int latency;
 
    enum rsd_format fmt;
-   int conv;
+   audio_converter_t conv;
 
 } al_t;
 
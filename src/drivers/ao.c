@@ -51,20 +51,21 @@ static int ao_rsd_open(void* data, wav_header_t *w)
    int bits = 0;
    int endian = AO_FMT_NATIVE;
 
-   interface->converter = RSD_NULL;
-   interface->fmt = w->rsd_format;
-
+   int conversion;
    if (rsnd_format_to_bytes(w->rsd_format) == 4) 
    {
-      interface->converter = converter_fmt_to_s32ne(w->rsd_format);
+      conversion = converter_fmt_to_s32ne(w->rsd_format);
       bits = 32;
    }
    else
    {
-      interface->converter = converter_fmt_to_s16ne(w->rsd_format);
+      conversion = converter_fmt_to_s16ne(w->rsd_format);
       bits = 16;
    }
 
+   if (audio_converter_init(&interface->converter, w->rsd_format, conversion) < 0)
+      return -1;
+
    ao_sample_format format = {
       .bits = bits,
       .channels = w->numChannels,
@@ -94,13 +95,9 @@ static size_t ao_rsd_write(void *data, const void* inbuf, size_t size)
    uint8_t convbuf[2 * size];
    void *buffer = (void*)inbuf;
 
-   if (sound->converter != RSD_NULL)
+   if (sound->converter.kernel != NULL)
    {
-      osize = (rsnd_format_to_bytes(sound->fmt) == 1) ? 2*size : size;
-
-      memcpy(convbuf, inbuf, size);
-
-      audio_converter(convbuf, sound->fmt, sound->converter, size);
+      osize = audio_convert(&sound->converter, convbuf, inbuf, size);
       buffer = convbuf;
    }
 
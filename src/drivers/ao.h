@@ -23,8 +23,7 @@
 typedef struct
 {
    ao_device *device;
-   enum rsd_format fmt;
-   int converter;
+   audio_converter_t converter;
 } ao_t;
 
 #endif
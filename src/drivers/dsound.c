@@ -66,7 +66,8 @@ static int ds_rsd_open(void* data, wav_header_t *w)
 
    int bits = 16;
    ds->fmt = w->rsd_format;
-   ds->conv = converter_fmt_to_s16ne(w->rsd_format);
+   if (audio_converter_init(&ds->conv, w->rsd_format, converter_fmt_to_s16ne(w->rsd_format)) < 0)
+      return -1;
 
    ds->rings = 16;
    ds->latency = DEFAULT_CHUNK_SIZE * 2;
@@ -106,16 +107,9 @@ static size_t ds_rsd_write(void *data, const void* inbuf, size_t size)
    uint8_t convbuf[2 * size];
    const uint8_t *buffer_ptr = inbuf;
 
-   if (ds->conv != RSD_NULL)
+   if (ds->conv.kernel != NULL)
    {
-      if (rsnd_format_to_bytes(ds->fmt) == 1)
-         osize = 2 * size;
-      else if (rsnd_format_to_bytes(ds->fmt) == 4)
-         osize = size / 2;
-
-      memcpy(convbuf, inbuf, size);
-
-      audio_converter(convbuf, ds->fmt, ds->conv, size);
+      osize = audio_convert(&ds->conv, convbuf, inbuf, size);
       buffer_ptr = convbuf;
    }
 
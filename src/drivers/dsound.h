@@ -25,7 +25,7 @@ typedef struct
    LPDIRECTSOUND ds;
    LPDIRECTSOUNDBUFFER dsb;
 
-   int conv;
+   audio_converter_t conv;
    int fmt;
    int rings;
    int latency;
@@ -0,0 +1,265 @@
+/*  RSound - A PCM audio client/server
+ *  Copyright (C) 2010-2011 - Hans-Kristian Arntzen
+ * 
+ *  RSound is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RSound is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RSound.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "file.h"
+#include "../rsound.h"
+
+static pthread_mutex_t file_count_lock = PTHREAD_MUTEX_INITIALIZER;
+static int file_count = 0;
+
+static void file_set_le16(uint8_t *buf, uint16_t val)
+{
+   buf[0] = val & 0xff;
+   buf[1] = val >> 8;
+}
+
+static void file_set_le32(uint8_t *buf, uint32_t val)
+{
+   for ( int i = 0; i < 4; i++ )
+      buf[i] = (val >> (8 * i)) & 0xff;
+}
+
+/* Everything is converted to S16_LE, so the header is always plain PCM. The sizes are filled in when we're done. */
+static int file_write_header(file_t *sound, wav_header_t *w)
+{
+   uint8_t header[HEADER_SIZE] = {0};
+
+   memcpy(header, "RIFF", 4);
+   memcpy(header + 8, "WAVE", 4);
+   memcpy(header + 12, "fmt ", 4);
+   file_set_le32(header + 16, 16);
+   file_set_le16(header + 20, 1);
+   file_set_le16(header + 22, w->numChannels);
+   file_set_le32(header + 24, w->sampleRate);
+   file_set_le32(header + 28, w->sampleRate * w->numChannels * 2);
+   file_set_le16(header + 32, w->numChannels * 2);
+   file_set_le16(header + 34, 16);
+   memcpy(header + 36, "data", 4);
+
+   if ( fwrite(header, 1, sizeof(header), sound->file) != sizeof(header) )
+      return -1;
+
+   return 0;
+}
+
+static void file_finish_header(file_t *sound)
+{
+   uint8_t buf[4];
+
+   file_set_le32(buf, sound->data_size + HEADER_SIZE - 8);
+   fseek(sound->file, 4, SEEK_SET);
+   fwrite(buf, 1, sizeof(buf), sound->file);
+
+   file_set_le32(buf, sound->data_size);
+   fseek(sound->file, 40, SEEK_SET);
+   fwrite(buf, 1, sizeof(buf), sound->file);
+}
+
+/* Writes out the ring buffer to disk, so a slow disk doesn't stall the stream. */
+static void* file_thread(void *data)
+{
+   file_t *sound = data;
+
+   pthread_mutex_lock(&sound->lock);
+   for (;;)
+   {
+      while ( sound->avail == 0 && !sound->done )
+         pthread_cond_wait(&sound->cond, &sound->lock);
+
+      if ( sound->avail == 0 )
+         break;
+
+      size_t size = sound->avail;
+      if ( size > FILE_BUFFER_SIZE - sound->read_ptr )
+         size = FILE_BUFFER_SIZE - sound->read_ptr;
+      const char *buf = sound->buffer + sound->read_ptr;
+      pthread_mutex_unlock(&sound->lock);
+
+      size_t rc = fwrite(buf, 1, size, sound->file);
+
+      pthread_mutex_lock(&sound->lock);
+      if ( rc != size )
+      {
+         log_printf("Failed to write to file.\n");
+         sound->done = 1;
+         sound->avail = 0;
+         pthread_cond_signal(&sound->cond);
+         break;
+      }
+
+      sound->data_size += size;
+      sound->read_ptr = (sound->read_ptr + size) % FILE_BUFFER_SIZE;
+      sound->avail -= size;
+      pthread_cond_signal(&sound->cond);
+   }
+   pthread_mutex_unlock(&sound->lock);
+
+   return NULL;
+}
+
+static void file_close(void *data)
+{
+   file_t *sound = data;
+
+   if ( sound->thread_active )
+   {
+      pthread_mutex_lock(&sound->lock);
+      sound->done = 1;
+      pthread_cond_signal(&sound->cond);
+      pthread_mutex_unlock(&sound->lock);
+      pthread_join(sound->thread, NULL);
+   }
+
+   if ( sound->file != NULL )
+   {
+      file_finish_header(sound);
+      fclose(sound->file);
+   }
+
+   pthread_mutex_destroy(&sound->lock);
+   pthread_cond_destroy(&sound->cond);
+   free(sound);
+}
+
+static int file_init(void **data)
+{
+   file_t *sound = calloc(1, sizeof(file_t));
+   if ( sound == NULL )
+      return -1;
+
+   pthread_mutex_init(&sound->lock, NULL);
+   pthread_cond_init(&sound->cond, NULL);
+   *data = sound;
+   return 0;
+}
+
+static int file_open(void *data, wav_header_t *w)
+{
+   file_t *sound = data;
+   char path[128] = {0};
+
+   if ( strcmp(device, "default") != 0 )
+      strncpy(path, device, sizeof(path) - 1);
+   else
+   {
+      pthread_mutex_lock(&file_count_lock);
+      snprintf(path, sizeof(path), FILE_DEFAULT_NAME, file_count++);
+      pthread_mutex_unlock(&file_count_lock);
+   }
+
+   if ( audio_converter_init(&sound->conv, w->rsd_format, converter_fmt_to_s16ne(w->rsd_format)) < 0 )
+   {
+      log_printf("File backend doesn't support %s sampling format.\n", rsnd_format_to_string(w->rsd_format));
+      return -1;
+   }
+   // Native S16 to what goes in the file.
+   audio_converter_init(&sound->to_le, RSD_S16_LE, is_little_endian() ? RSD_NULL : RSD_SWAP_ENDIAN);
+   sound->latency_denom = rsnd_format_to_bytes(w->rsd_format);
+   sound->latency_enum = rsnd_format_to_bytes(RSD_S16_LE);
+
+   sound->file = fopen(path, "wb");
+   if ( sound->file == NULL )
+   {
+      log_printf("Couldn't open file %s.\n", path);
+      return -1;
+   }
+
+   if ( file_write_header(sound, w) < 0 )
+   {
+      log_printf("Couldn't write WAV header to %s.\n", path);
+      return -1;
+   }
+
+   if ( pthread_create(&sound->thread, NULL, file_thread, sound) != 0 )
+   {
+      log_printf("Couldn't start writer thread.\n");
+      return -1;
+   }
+   sound->thread_active = 1;
+
+   if ( debug )
+      log_printf("Writing stream to %s.\n", path);
+
+   return 0;
+}
+
+static void file_get_backend(void *data, backend_info_t *backend_info)
+{
+   (void)data;
+   backend_info->latency = 0;
+   backend_info->chunk_size = DEFAULT_CHUNK_SIZE;
+}
+
+// What hasn't hit the disk yet, in bytes of the original stream.
+static int file_latency(void *data)
+{
+   file_t *sound = data;
+   pthread_mutex_lock(&sound->lock);
+   int latency = (sound->avail * sound->latency_denom) / sound->latency_enum;
+   pthread_mutex_unlock(&sound->lock);
+   return latency;
+}
+
+static size_t file_write(void *data, const void *buf, size_t size)
+{
+   file_t *sound = data;
+
+   uint8_t tmpbuf[2 * size];
+   size_t osize = audio_convert(&sound->conv, tmpbuf, buf, size);
+   audio_convert(&sound->to_le, tmpbuf, tmpbuf, osize);
+
+   const uint8_t *ptr = tmpbuf;
+   size_t left = osize;
+
+   pthread_mutex_lock(&sound->lock);
+   while ( left > 0 )
+   {
+      while ( sound->avail == FILE_BUFFER_SIZE && !sound->done )
+         pthread_cond_wait(&sound->cond, &sound->lock);
+
+      // Writer thread gave up.
+      if ( sound->done )
+      {
+         pthread_mutex_unlock(&sound->lock);
+         return 0;
+      }
+
+      size_t write_ptr = (sound->read_ptr + sound->avail) % FILE_BUFFER_SIZE;
+      size_t chunk = FILE_BUFFER_SIZE - sound->avail;
+      if ( chunk > FILE_BUFFER_SIZE - write_ptr )
+         chunk = FILE_BUFFER_SIZE - write_ptr;
+      if ( chunk > left )
+         chunk = left;
+
+      memcpy(sound->buffer + write_ptr, ptr, chunk);
+      sound->avail += chunk;
+      ptr += chunk;
+      left -= chunk;
+      pthread_cond_signal(&sound->cond);
+   }
+   pthread_mutex_unlock(&sound->lock);
+
+   return size;
+}
+
+const rsd_backend_callback_t rsd_file = {
+   .init = file_init,
+   .open = file_open,
+   .write = file_write,
+   .latency = file_latency,
+   .get_backend_info = file_get_backend,
+   .close = file_close,
+   .backend = "file"
+};
@@ -0,0 +1,50 @@
+/*  RSound - A PCM audio client/server
+ *  Copyright (C) 2010-2011 - Hans-Kristian Arntzen
+ * 
+ *  RSound is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RSound is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RSound.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FILE_H
+#define FILE_H
+
+#include "../audio.h"
+#include "../endian.h"
+#include <stdio.h>
+#include <pthread.h>
+
+// Used when no device is given. %d is replaced with a running number, so each stream gets its own file.
+#define FILE_DEFAULT_NAME "rsd-%d.wav"
+// Audio waiting to be written to disk by the writer thread.
+#define FILE_BUFFER_SIZE (1 << 16)
+
+typedef struct
+{
+   FILE *file;
+   uint32_t data_size;
+
+   audio_converter_t conv;
+   audio_converter_t to_le;
+   int latency_enum;
+   int latency_denom;
+
+   // Ring buffer between file_write() and the writer thread.
+   pthread_t thread;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   char buffer[FILE_BUFFER_SIZE];
+   size_t read_ptr;
+   size_t avail;
+   int thread_active;
+   int done;
+} file_t;
+
+#endif
@@ -82,15 +82,15 @@ static void shutdown_cb(void *data)
    jd->shutdown = 1;
 }
 
-static inline int audio_conv_op(enum rsd_format format)
+static inline int jack_init_converter(jack_t *jd)
 {
    int op = RSD_NULL;
-   if (rsnd_format_to_bytes(format) == 4)
-      op = converter_fmt_to_s32ne(format) | RSD_S32_TO_FLOAT;
+   if (rsnd_format_to_bytes(jd->format) == 4)
+      op = converter_fmt_to_s32ne(jd->format) | RSD_S32_TO_FLOAT;
    else
-      op = converter_fmt_to_s16ne(format) | RSD_S16_TO_FLOAT;
+      op = converter_fmt_to_s16ne(jd->format) | RSD_S16_TO_FLOAT;
 
-   return op;
+   return audio_converter_init(&jd->conv, jd->format, op);
 }
 
 static int parse_ports(char **dest_ports, int max_ports, const char *port_list)
@@ -125,8 +125,9 @@ static int jack_open(void *data, wav_header_t *w)
    jack_t *jd = data;
    jd->channels = w->numChannels;
    jd->format = w->rsd_format;
-   jd->conv_op = audio_conv_op(jd->format);
    jd->rate = w->sampleRate;
+   if (jack_init_converter(jd) < 0)
+      return -1;
 
    if (jd->channels > MAX_PORTS)
    {
@@ -249,7 +250,7 @@ static void jack_get_backend(void *data, backend_info_t *backend_info)
          jd->format = is_little_endian() ? RSD_S32_LE : RSD_S32_BE;
       else
          jd->format = is_little_endian() ? RSD_S16_LE : RSD_S16_BE;
-      jd->conv_op = audio_conv_op(jd->format);
+      jack_init_converter(jd);
    }
    else
       backend_info->resample = 0;
@@ -270,8 +271,7 @@ static size_t write_buffer(jack_t *jd, const void* buf, size_t size)
    // Convert our data to float, deinterleave and write.
    float out_buffer[BYTES_TO_SAMPLES(size, jd->format)];
    float out_deinterleaved_buffer[jd->channels][BYTES_TO_SAMPLES(size, jd->format)/jd->channels];
-   memcpy(out_buffer, buf, size);
-   audio_converter(out_buffer, jd->format, jd->conv_op, size);
+   audio_convert(&jd->conv, out_buffer, buf, size);
 
    for (int i = 0; i < jd->channels; i++)
       for (size_t j = 0; j < BYTES_TO_SAMPLES(size, jd->format)/jd->channels; j++)
@@ -34,7 +34,7 @@ typedef struct
    int channels;
    volatile int shutdown;
    int format;
-   int conv_op;
+   audio_converter_t conv;
    unsigned rate;
 } jack_t;
 
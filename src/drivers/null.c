@@ -0,0 +1,146 @@
+/*  RSound - A PCM audio client/server
+ *  Copyright (C) 2010-2011 - Hans-Kristian Arntzen
+ * 
+ *  RSound is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RSound is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RSound.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "null.h"
+#include "../rsound.h"
+
+static uint64_t null_elapsed_ns(const struct timespec *start)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64_t)(now.tv_sec - start->tv_sec) * 1000000000ULL + (now.tv_nsec - start->tv_nsec);
+}
+
+/* Bytes the "device" has played since it started. Like a real card, it only finishes whole periods. */
+static uint64_t null_consumed(null_t *sound)
+{
+   uint64_t bytes = null_elapsed_ns(&sound->start) * sound->bps / 1000000000ULL;
+   return bytes - bytes % sound->period_size;
+}
+
+/* How much data sits in the buffer right now. If it ran dry, we had an underrun. */
+static size_t null_fill(null_t *sound)
+{
+   if ( !sound->running )
+      return 0;
+
+   uint64_t consumed = null_consumed(sound);
+   if ( consumed >= sound->written )
+      return 0;
+
+   return sound->written - consumed;
+}
+
+static void null_close(void *data)
+{
+   null_t *sound = data;
+   if ( debug && sound->underruns > 0 )
+      log_printf("null: %u underruns.\n", sound->underruns);
+   free(sound);
+}
+
+static int null_init(void **data)
+{
+   null_t *sound = calloc(1, sizeof(null_t));
+   if ( sound == NULL )
+      return -1;
+   *data = sound;
+   return 0;
+}
+
+static int null_open(void *data, wav_header_t *w)
+{
+   null_t *sound = data;
+   size_t framesize = w->numChannels * rsnd_format_to_bytes(w->rsd_format);
+
+   sound->bps = w->sampleRate * framesize;
+   sound->period_size = NULL_PERIOD_FRAMES * framesize;
+   sound->buffer_size = NULL_PERIODS * sound->period_size;
+   sound->running = 0;
+   sound->written = 0;
+
+   if ( sound->bps == 0 )
+   {
+      log_printf("Invalid stream parameters for null backend.\n");
+      return -1;
+   }
+
+   return 0;
+}
+
+static void null_get_backend(void *data, backend_info_t *backend_info)
+{
+   null_t *sound = data;
+   backend_info->latency = sound->period_size;
+   backend_info->chunk_size = sound->period_size;
+}
+
+static int null_latency(void *data)
+{
+   return null_fill(data);
+}
+
+/* Blocks until the data fits in the buffer, so the stream is paced like it would be with real hardware. */
+static size_t null_write(void *data, const void *buf, size_t size)
+{
+   null_t *sound = data;
+   (void)buf;
+
+   if ( size > sound->buffer_size )
+      size = sound->buffer_size;
+
+   size_t fill;
+   while ( (fill = null_fill(sound)) + size > sound->buffer_size )
+   {
+      // Sleep until the next period boundary where there is room for us.
+      uint64_t needed = fill + size - sound->buffer_size;
+      needed = ((needed + sound->period_size - 1) / sound->period_size) * sound->period_size;
+      uint64_t target_ns = (null_consumed(sound) + needed) * 1000000000ULL / sound->bps;
+      uint64_t elapsed_ns = null_elapsed_ns(&sound->start);
+
+      if ( target_ns > elapsed_ns )
+      {
+         uint64_t sleep_ns = target_ns - elapsed_ns;
+         struct timespec tv = {
+            .tv_sec = sleep_ns / 1000000000ULL,
+            .tv_nsec = sleep_ns % 1000000000ULL
+         };
+         nanosleep(&tv, NULL);
+      }
+   }
+
+   // The "device" starts over as soon as it gets data after being idle, like a card would after an underrun.
+   if ( !sound->running || null_consumed(sound) >= sound->written )
+   {
+      if ( sound->running )
+         sound->underruns++;
+      clock_gettime(CLOCK_MONOTONIC, &sound->start);
+      sound->written = 0;
+      sound->running = 1;
+   }
+
+   sound->written += size;
+   return size;
+}
+
+const rsd_backend_callback_t rsd_null = {
+   .init = null_init,
+   .open = null_open,
+   .write = null_write,
+   .latency = null_latency,
+   .get_backend_info = null_get_backend,
+   .close = null_close,
+   .backend = "null"
+};
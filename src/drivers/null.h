@@ -0,0 +1,39 @@
+/*  RSound - A PCM audio client/server
+ *  Copyright (C) 2010-2011 - Hans-Kristian Arntzen
+ * 
+ *  RSound is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RSound is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RSound.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NULL_H
+#define NULL_H
+
+#include "../audio.h"
+#include <time.h>
+
+/* Pretends to be a sound card with a buffer of NULL_PERIODS periods of NULL_PERIOD_FRAMES frames each.
+   Data is consumed a period at a time, at exactly the rate of the stream. */
+#define NULL_PERIOD_FRAMES 256
+#define NULL_PERIODS 8
+
+typedef struct
+{
+   size_t bps;            // Bytes per second.
+   size_t period_size;    // In bytes.
+   size_t buffer_size;    // In bytes.
+
+   int running;
+   struct timespec start; // When the "device" started consuming data.
+   uint64_t written;      // Bytes written since start.
+   unsigned underruns;
+} null_t;
+
+#endif
@@ -44,10 +44,9 @@ static int oss_open(void *data, wav_header_t *w)
       strncpy(oss_device, OSS_DEVICE, 127);
 
    sound->audio_fd = open(oss_device, O_WRONLY, 0);
-   sound->conv = RSD_NULL;
+   int conversion = RSD_NULL;
    sound->latency_enum = 1;
    sound->latency_denom = 1;
-   sound->fmt = w->rsd_format;
 
    if ( sound->audio_fd == -1 )
    {
@@ -109,13 +108,16 @@ static int oss_open(void *data, wav_header_t *w)
 
       default:
          format = AFMT_S16_NE;
-         sound->conv = converter_fmt_to_s16ne(w->rsd_format);
+         conversion = converter_fmt_to_s16ne(w->rsd_format);
          sound->latency_denom = rsnd_format_to_bytes(w->rsd_format);
          sound->latency_enum = rsnd_format_to_bytes(RSD_S16_LE);
          break;
    }
    int oldfmt = format;
 
+   if ( audio_converter_init(&sound->conv, w->rsd_format, conversion) < 0 )
+      return -1;
+
    int channels = w->numChannels, oldchannels = w->numChannels; 
    int sampleRate = w->sampleRate;
 
@@ -193,12 +195,10 @@ static size_t oss_write(void *data, const void* buf, size_t size)
    size_t osize = size;
    uint8_t tmpbuf[2 * size];
 
-   if (sound->conv != RSD_NULL)
+   if (sound->conv.kernel != NULL)
    {
       real_buf = tmpbuf;
-      osize = (size * sound->latency_enum) / sound->latency_denom;
-      memcpy(tmpbuf, buf, size);
-      audio_converter(tmpbuf, sound->fmt, sound->conv, size);
+      osize = audio_convert(&sound->conv, tmpbuf, buf, size);
    }
 
    ssize_t rd = write(sound->audio_fd, real_buf, osize);
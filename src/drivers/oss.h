@@ -34,8 +34,7 @@
 typedef struct
 {
    int audio_fd;
-   int conv;
-   enum rsd_format fmt;
+   audio_converter_t conv;
    int latency_enum;
    int latency_denom;
 } oss_t;
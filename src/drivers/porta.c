@@ -60,20 +60,21 @@ static int porta_open(void *data, wav_header_t *w)
       return -1;
    params.channelCount = w->numChannels;
 
-   sound->converter = RSD_NULL;
-   sound->fmt = w->rsd_format;
-
+   int conversion;
    if (rsnd_format_to_bytes(w->rsd_format) == 4)
    {
-      sound->converter = converter_fmt_to_s32ne(w->rsd_format);
+      conversion = converter_fmt_to_s32ne(w->rsd_format);
       params.sampleFormat = paInt32;
    }
    else
    {
-      sound->converter = converter_fmt_to_s16ne(w->rsd_format);
+      conversion = converter_fmt_to_s16ne(w->rsd_format);
       params.sampleFormat = paInt16;
    }
 
+   if (audio_converter_init(&sound->converter, w->rsd_format, conversion) < 0)
+      return -1;
+
    params.suggestedLatency = Pa_GetDeviceInfo(params.device)->defaultLowOutputLatency;
    params.hostApiSpecificStreamInfo = NULL;
 
@@ -133,13 +134,9 @@ static size_t porta_write(void *data, const void *inbuf, size_t size)
    uint8_t convbuf[2 * size];
    void *buffer = (void*)inbuf;
 
-   if (sound->converter != RSD_NULL)
+   if (sound->converter.kernel != NULL)
    {
-      osize = (sound->fmt & (RSD_ALAW | RSD_MULAW)) ? 2*size : size;
-
-      memcpy(convbuf, inbuf, size);
-
-      audio_converter(convbuf, sound->fmt, sound->converter, size);
+      osize = audio_convert(&sound->converter, convbuf, inbuf, size);
       buffer = convbuf;
    }
 
@@ -27,8 +27,7 @@ typedef struct
    size_t size;
    size_t frames;
    uint32_t bps;
-   enum rsd_format fmt;
-   int converter;
+   audio_converter_t converter;
 } porta_t;
 
 #endif
@@ -46,8 +46,7 @@ static int pulse_open(void* data, wav_header_t *w)
    ss.channels = w->numChannels;
    ss.rate = w->sampleRate;
 
-   interface->fmt = w->rsd_format;
-   interface->conv = RSD_NULL;
+   int conversion = RSD_NULL;
 
    switch ( w->rsd_format )
    {
@@ -63,13 +62,13 @@ static int pulse_open(void* data, wav_header_t *w)
 
       case RSD_U32_LE:
          ss.format = PA_SAMPLE_S32LE;
-         interface->conv |= RSD_U_TO_S;
+         conversion |= RSD_U_TO_S;
          interface->framesize = 4;
          break;
 
       case RSD_U32_BE:
          ss.format = PA_SAMPLE_S32BE;
-         interface->conv |= RSD_U_TO_S;
+         conversion |= RSD_U_TO_S;
          interface->framesize = 4;
          break;
 
@@ -80,13 +79,13 @@ static int pulse_open(void* data, wav_header_t *w)
 
       case RSD_U16_LE:
          ss.format = PA_SAMPLE_S16LE;
-         interface->conv |= RSD_U_TO_S;
+         conversion |= RSD_U_TO_S;
          interface->framesize = 2;
          break;
 
       case RSD_U16_BE:
          ss.format = PA_SAMPLE_S16BE;
-         interface->conv |= RSD_U_TO_S;
+         conversion |= RSD_U_TO_S;
          interface->framesize = 2;
          break;
 
@@ -102,7 +101,7 @@ static int pulse_open(void* data, wav_header_t *w)
 
       case RSD_S8:
          ss.format = PA_SAMPLE_U8;
-         interface->conv |= RSD_S_TO_U;
+         conversion |= RSD_S_TO_U;
          interface->framesize = 1;
          break;
 
@@ -120,6 +119,9 @@ static int pulse_open(void* data, wav_header_t *w)
          return -1;
    }
 
+   if ( audio_converter_init(&interface->conv, w->rsd_format, conversion) < 0 )
+      return -1;
+
    interface->framesize *= w->numChannels;
    interface->rate = w->sampleRate;
 
@@ -137,7 +139,7 @@ static size_t pulse_write(void *data, const void* buf, size_t size)
 {
    pulse_t *sound = data;
 
-   audio_converter((void*)buf, sound->fmt, sound->conv, size);
+   audio_convert(&sound->conv, (void*)buf, buf, size);
 
    if ( pa_simple_write(sound->s, buf, size, NULL) < 0 )
       return -1;
@@ -24,8 +24,7 @@ typedef struct
    pa_simple *s;
    int framesize;
    int rate;
-   enum rsd_format fmt;
-   int conv;
+   audio_converter_t conv;
 } pulse_t;
 
 #endif
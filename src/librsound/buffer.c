@@ -15,27 +15,123 @@
 
 #include "buffer.h"
 
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(SYS_memfd_create)
+#define HAVE_FIFO_MIRROR
+#endif
+#endif
+
+/* Single producer, single consumer ring. One thread writes and another reads without
+ * taking a lock. The read and write counters run freely and are masked into a
+ * power-of-two sized buffer. Each is only stored by its own side, with release
+ * semantics, so once the other side has loaded it with acquire semantics, the data
+ * copied before it is visible as well.
+ *
+ * Where we can, the buffer is a memfd mapped twice back to back. Whatever span is
+ * readable or writable is then contiguous in memory, so it can be handed straight to
+ * send() or written into by the caller. Otherwise we fall back to a plain buffer, and
+ * the spans stop at the wrap point. */
+
+#if defined(__ATOMIC_ACQUIRE)
+#define FIFO_LOAD_ACQUIRE(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define FIFO_STORE_RELEASE(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+#else
+static inline size_t fifo_load_acquire(volatile size_t *ptr)
+{
+   size_t val = *ptr;
+   __sync_synchronize();
+   return val;
+}
+#define FIFO_LOAD_ACQUIRE(ptr) fifo_load_acquire(ptr)
+#define FIFO_STORE_RELEASE(ptr, val) do { __sync_synchronize(); *(ptr) = (val); } while(0)
+#endif
+
+// Keeps the two counters from sharing a cache line, so the threads don't fight over it.
+#define FIFO_CACHE_LINE 64
+
 struct rsound_fifo_buffer
 {
    char *buffer;
-   size_t bufsize;
-   size_t first;
-   size_t end;
+   size_t size; // What we can hold, as asked for.
+   size_t mask; // Buffer is a power of two, larger or equal to size.
+   int mirrored; // Buffer is mapped a second time right after itself.
+
+   char pad0[FIFO_CACHE_LINE];
+   volatile size_t write_ptr; // Only stored by the writer.
+   char pad1[FIFO_CACHE_LINE - sizeof(size_t)];
+   volatile size_t read_ptr; // Only stored by the reader.
+   char pad2[FIFO_CACHE_LINE - sizeof(size_t)];
 };
 
+#ifdef HAVE_FIFO_MIRROR
+static char* fifo_map_mirror(size_t bufsize)
+{
+   int fd = syscall(SYS_memfd_create, "rsound-fifo", 1 /* MFD_CLOEXEC */);
+   if (fd < 0)
+      return NULL;
+
+   char *base = MAP_FAILED;
+   if (ftruncate(fd, bufsize) < 0)
+      goto error;
+
+   // Reserve room for both views first, then put the memfd on top of it twice.
+   base = mmap(NULL, 2 * bufsize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (base == MAP_FAILED)
+      goto error;
+
+   if (mmap(base, bufsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+      goto error;
+   if (mmap(base + bufsize, bufsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+      goto error;
+
+   close(fd);
+   return base;
+
+error:
+   if (base != MAP_FAILED)
+      munmap(base, 2 * bufsize);
+   close(fd);
+   return NULL;
+}
+#endif
+
 rsound_fifo_buffer_t* rsnd_fifo_new(size_t size)
 {
    rsound_fifo_buffer_t *buf = calloc(1, sizeof(*buf));
    if (buf == NULL)
       return NULL;
 
-   buf->buffer = calloc(1, size + 1);
+   size_t bufsize = 1;
+   while (bufsize < size)
+      bufsize <<= 1;
+
+#ifdef HAVE_FIFO_MIRROR
+   // The mirror has to start on a page boundary. Pages are a power of two as well.
+   long page = sysconf(_SC_PAGESIZE);
+   size_t mirror_size = bufsize;
+   while (page > 0 && mirror_size < (size_t)page)
+      mirror_size <<= 1;
+
+   buf->buffer = fifo_map_mirror(mirror_size);
+   if (buf->buffer != NULL)
+   {
+      buf->mirrored = 1;
+      bufsize = mirror_size;
+   }
+   else
+#endif
+   buf->buffer = calloc(1, bufsize);
+
    if (buf->buffer == NULL)
    {
       free(buf);
       return NULL;
    }
-   buf->bufsize = size + 1;
+   buf->size = size;
+   buf->mask = bufsize - 1;
 
    return buf;
 }
@@ -45,6 +141,11 @@ void rsnd_fifo_free(rsound_fifo_buffer_t* buffer)
    assert(buffer);
    assert(buffer->buffer);
 
+#ifdef HAVE_FIFO_MIRROR
+   if (buffer->mirrored)
+      munmap(buffer->buffer, 2 * (buffer->mask + 1));
+   else
+#endif
    free(buffer->buffer);
    free(buffer);
 }
@@ -54,11 +155,9 @@ size_t rsnd_fifo_read_avail(rsound_fifo_buffer_t* buffer)
    assert(buffer);
    assert(buffer->buffer);
 
-   size_t first = buffer->first;
-   size_t end = buffer->end;
-   if (end < first)
-      end += buffer->bufsize;
-   return end - first;
+   size_t read_ptr = FIFO_LOAD_ACQUIRE(&buffer->read_ptr);
+   size_t write_ptr = FIFO_LOAD_ACQUIRE(&buffer->write_ptr);
+   return write_ptr - read_ptr;
 }
 
 size_t rsnd_fifo_write_avail(rsound_fifo_buffer_t* buffer)
@@ -66,12 +165,9 @@ size_t rsnd_fifo_write_avail(rsound_fifo_buffer_t* buffer)
    assert(buffer);
    assert(buffer->buffer);
 
-   size_t first = buffer->first;
-   size_t end = buffer->end;
-   if (end < first)
-      end += buffer->bufsize;
-
-   return (buffer->bufsize - 1) - (end - first);
+   size_t write_ptr = FIFO_LOAD_ACQUIRE(&buffer->write_ptr);
+   size_t read_ptr = FIFO_LOAD_ACQUIRE(&buffer->read_ptr);
+   return buffer->size - (write_ptr - read_ptr);
 }
 
 void rsnd_fifo_write(rsound_fifo_buffer_t* buffer, const void* in_buf, size_t size)
@@ -81,19 +177,21 @@ void rsnd_fifo_write(rsound_fifo_buffer_t* buffer, const void* in_buf, size_t si
    assert(in_buf);
    assert(rsnd_fifo_write_avail(buffer) >= size);
 
+   size_t write_ptr = buffer->write_ptr;
+   size_t offset = write_ptr & buffer->mask;
    size_t first_write = size;
    size_t rest_write = 0;
-   if (buffer->end + size > buffer->bufsize)
+   if (!buffer->mirrored && offset + size > buffer->mask + 1)
    {
-      first_write = buffer->bufsize - buffer->end;
+      first_write = buffer->mask + 1 - offset;
       rest_write = size - first_write;
    }
 
-   memcpy(buffer->buffer + buffer->end, in_buf, first_write);
+   memcpy(buffer->buffer + offset, in_buf, first_write);
    if (rest_write > 0)
       memcpy(buffer->buffer, (const char*)in_buf + first_write, rest_write);
 
-   buffer->end = (buffer->end + size) % buffer->bufsize;
+   FIFO_STORE_RELEASE(&buffer->write_ptr, write_ptr + size);
 }
 
 
@@ -104,18 +202,71 @@ void rsnd_fifo_read(rsound_fifo_buffer_t* buffer, void* in_buf, size_t size)
    assert(in_buf);
    assert(rsnd_fifo_read_avail(buffer) >= size);
 
+   size_t read_ptr = buffer->read_ptr;
+   size_t offset = read_ptr & buffer->mask;
    size_t first_read = size;
    size_t rest_read = 0;
-   if (buffer->first + size > buffer->bufsize)
+   if (!buffer->mirrored && offset + size > buffer->mask + 1)
    {
-      first_read = buffer->bufsize - buffer->first;
+      first_read = buffer->mask + 1 - offset;
       rest_read = size - first_read;
    }
 
-   memcpy(in_buf, (const char*)buffer->buffer + buffer->first, first_read);
+   memcpy(in_buf, (const char*)buffer->buffer + offset, first_read);
    if (rest_read > 0)
       memcpy((char*)in_buf + first_read, buffer->buffer, rest_read);
 
-   buffer->first = (buffer->first + size) % buffer->bufsize;
+   FIFO_STORE_RELEASE(&buffer->read_ptr, read_ptr + size);
+}
+
+void* rsnd_fifo_write_ptr(rsound_fifo_buffer_t* buffer, size_t *size)
+{
+   assert(buffer);
+   assert(buffer->buffer);
+   assert(size);
+
+   size_t offset = buffer->write_ptr & buffer->mask;
+   *size = rsnd_fifo_write_avail(buffer);
+   if (!buffer->mirrored && offset + *size > buffer->mask + 1)
+      *size = buffer->mask + 1 - offset;
+
+   return buffer->buffer + offset;
+}
+
+void rsnd_fifo_write_commit(rsound_fifo_buffer_t* buffer, size_t size)
+{
+   assert(buffer);
+   assert(rsnd_fifo_write_avail(buffer) >= size);
+
+   FIFO_STORE_RELEASE(&buffer->write_ptr, buffer->write_ptr + size);
+}
+
+const void* rsnd_fifo_read_ptr(rsound_fifo_buffer_t* buffer, size_t *size)
+{
+   return rsnd_fifo_peek(buffer, 0, size);
+}
+
+const void* rsnd_fifo_peek(rsound_fifo_buffer_t* buffer, size_t skip, size_t *size)
+{
+   assert(buffer);
+   assert(buffer->buffer);
+   assert(size);
+
+   size_t avail = rsnd_fifo_read_avail(buffer);
+   assert(avail >= skip);
+
+   size_t offset = (buffer->read_ptr + skip) & buffer->mask;
+   *size = avail - skip;
+   if (!buffer->mirrored && offset + *size > buffer->mask + 1)
+      *size = buffer->mask + 1 - offset;
+
+   return buffer->buffer + offset;
 }
 
+void rsnd_fifo_read_commit(rsound_fifo_buffer_t* buffer, size_t size)
+{
+   assert(buffer);
+   assert(rsnd_fifo_read_avail(buffer) >= size);
+
+   FIFO_STORE_RELEASE(&buffer->read_ptr, buffer->read_ptr + size);
+}
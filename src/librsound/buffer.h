@@ -26,6 +26,8 @@
 typedef struct rsound_fifo_buffer rsound_fifo_buffer_t;
 #endif
 
+/* Lock-free as long as one thread writes and one thread reads. The avail functions
+ * are exact when called from either of those two. */
 rsound_fifo_buffer_t* rsnd_fifo_new(size_t size);
 void rsnd_fifo_write(rsound_fifo_buffer_t* buffer, const void* in_buf, size_t size);
 void rsnd_fifo_read(rsound_fifo_buffer_t* buffer, void* in_buf, size_t size);
@@ -33,4 +35,14 @@ void rsnd_fifo_free(rsound_fifo_buffer_t* buffer);
 size_t rsnd_fifo_read_avail(rsound_fifo_buffer_t* buffer);
 size_t rsnd_fifo_write_avail(rsound_fifo_buffer_t* buffer);
 
+/* Zero-copy access. Returns the largest contiguous span that can be written or read
+ * right now, and its size. Nothing is handed over before the matching commit. With a
+ * mirrored buffer, the span covers everything that is available. */
+void* rsnd_fifo_write_ptr(rsound_fifo_buffer_t* buffer, size_t *size);
+void rsnd_fifo_write_commit(rsound_fifo_buffer_t* buffer, size_t size);
+const void* rsnd_fifo_read_ptr(rsound_fifo_buffer_t* buffer, size_t *size);
+// Like rsnd_fifo_read_ptr(), but skip bytes further in. Gets at the part after the wrap point.
+const void* rsnd_fifo_peek(rsound_fifo_buffer_t* buffer, size_t skip, size_t *size);
+void rsnd_fifo_read_commit(rsound_fifo_buffer_t* buffer, size_t size);
+
 #endif
@@ -32,12 +32,21 @@
 #undef close
 #define close(x) closesocket(x)
 #define CONST_CAST (const char*)
+#define RSND_WOULD_BLOCK() (WSAGetLastError() == WSAEWOULDBLOCK)
+
+struct iovec
+{
+   void *iov_base;
+   size_t iov_len;
+};
 
 #else
 
 #define CONST_CAST
+#define RSND_WOULD_BLOCK() (errno == EAGAIN || errno == EWOULDBLOCK)
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <netdb.h>
 #include <netinet/in.h>
@@ -87,9 +96,56 @@ enum rsd_conn_type
    RSD_CONN_UNIX = 0x0001,
    RSD_CONN_DECNET = 0x0002,
 
-   RSD_CONN_PROTO = 0x100
+   RSD_CONN_PROTO = 0x100,
+   // Control messages go in frames on the data socket.
+   RSD_CONN_FRAMED = 0x200,
+   // Server didn't go along with framing, so we need a ctl socket.
+   RSD_CONN_NO_FRAMING = 0x400,
+   // Control messages are binary rather than text.
+   RSD_CONN_BINARY = 0x800,
+   // Server pushes REPORT messages, so we don't need to ask with INFO.
+   RSD_CONN_REPORTS = 0x1000,
+   // Server can start a new stream on this connection with RESET.
+   RSD_CONN_RESET = 0x2000,
+   // rsd_stop() kept the connection around for the next stream.
+   RSD_CONN_PARKED = 0x4000
+};
+
+// Framing of the data socket. See DOCUMENTATION.
+#define RSD_FRAME_MAGIC 0x52534432
+#define RSD_PROTO_MAGIC 0x52534431
+#define RSD_FRAME_HEADER_SIZE 8
+#define RSD_FRAME_AUDIO 0x0000
+#define RSD_FRAME_CTL 0x0001
+
+// Binary control messages. See DOCUMENTATION.
+#define RSD_PROTO_FLAG_BINARY 0x0001
+#define RSD_PROTO_FLAG_RESET 0x0002
+#define RSD_CTL_MSG_SIZE 32
+#define RSD_CTL_MSG_MAXSIZE (RSD_CTL_MSG_SIZE + 256)
+#define RSD_CTL_RESET_REPLY_SIZE (RSD_CTL_MSG_SIZE + 8)
+
+enum rsd_ctl_type
+{
+   RSD_CTL_NULL = 0x0000,
+   RSD_CTL_STOP = 0x0001,
+   RSD_CTL_INFO = 0x0002,
+   RSD_CTL_IDENTITY = 0x0003,
+   RSD_CTL_CLOSECTL = 0x0004,
+   RSD_CTL_REPORT = 0x0006,
+   RSD_CTL_RESET = 0x0007
 };
 
+typedef struct rsnd_ctl_msg
+{
+   uint16_t type;
+   uint16_t size;
+   uint32_t flags;
+   int64_t client_ptr;
+   int64_t serv_ptr;
+   int64_t timestamp;
+} rsnd_ctl_msg_t;
+
 // Some logging macros.
 static void rsnd_log(enum rsd_logtype type, const char *fmt, ...); 
 #ifdef DEBUG
@@ -106,12 +162,18 @@ static inline void rsnd_swap_endian_16(uint16_t * x);
 static inline void rsnd_swap_endian_32(uint32_t * x);
 static inline int rsnd_format_to_samplesize(enum rsd_format fmt);
 static int rsnd_connect_server(rsound_t *rd);
+static void rsnd_make_header(rsound_t *rd, char *header);
 static int rsnd_send_header_info(rsound_t *rd);
+static int rsnd_set_backend_info(rsound_t *rd, uint32_t latency, uint32_t chunk_size);
 static int rsnd_get_backend_info(rsound_t *rd);
+static int rsnd_reset_connection(rsound_t *rd);
 static int rsnd_create_connection(rsound_t *rd);
 static int rsnd_connect_socket(int fd, const struct sockaddr *addr, socklen_t addr_len);
+static ssize_t rsnd_send_iov(int socket, struct iovec *iov, int iovcnt, int blocking);
 static ssize_t rsnd_send_chunk(int socket, const void *buf, size_t size, int blocking);
 static ssize_t rsnd_recv_chunk(int socket, void *buf, size_t size, int blocking);
+static ssize_t rsnd_send_frame(rsound_t *rd, uint16_t type, const void *buf, size_t size);
+static ssize_t rsnd_send_audio(rsound_t *rd, struct iovec *iov, int iovcnt);
 static int rsnd_start_thread(rsound_t *rd);
 static int rsnd_stop_thread(rsound_t *rd);
 static size_t rsnd_get_delay(rsound_t *rd);
@@ -120,6 +182,11 @@ static int rsnd_reset(rsound_t *rd);
 
 // Protocol functions
 static int rsnd_send_identity_info(rsound_t *rd);
+static int rsnd_send_pair_info(rsound_t *rd);
+static ssize_t rsnd_send_ctl(rsound_t *rd, const char *buf, size_t size, int blocking);
+static int rsnd_send_ctl_msg(rsound_t *rd, rsnd_ctl_msg_t *msg, const char *payload, size_t len, int blocking);
+static ssize_t rsnd_recv_ctl(rsound_t *rd, char *buf, size_t size);
+static void rsnd_unpack_ctl_msg(const char *buf, rsnd_ctl_msg_t *msg);
 static int rsnd_close_ctl(rsound_t *rd);
 static int rsnd_send_info_query(rsound_t *rd);
 static int rsnd_update_server_info(rsound_t *rd);
@@ -283,6 +350,7 @@ static int rsnd_connect_server( rsound_t *rd )
 {
    RSD_DEBUG("rsnd_connect_server");
    struct addrinfo hints, *res = NULL;
+   int no_framing = rd->conn_type & RSD_CONN_NO_FRAMING;
 #ifndef _WIN32
    struct sockaddr_un un;
 #ifdef HAVE_DECNET
@@ -298,7 +366,7 @@ static int rsnd_connect_server( rsound_t *rd )
 #ifndef _WIN32
    if (rd->host[0] == '/')
    {
-      rd->conn_type = RSD_CONN_UNIX;
+      rd->conn_type = RSD_CONN_UNIX | no_framing;
       res = &hints;
       res->ai_family = AF_UNIX;
       res->ai_protocol = 0;
@@ -311,7 +379,7 @@ static int rsnd_connect_server( rsound_t *rd )
 #ifdef HAVE_DECNET
    else if ((delm = strstr(rd->host, "::")) != NULL)
    {
-      rd->conn_type = RSD_CONN_DECNET;
+      rd->conn_type = RSD_CONN_DECNET | no_framing;
       object = delm;
 
       if ( object[2] == 0 ) /* We have no object info, use default object name */
@@ -336,14 +404,13 @@ static int rsnd_connect_server( rsound_t *rd )
    else
 #endif
    {
-      rd->conn_type = RSD_CONN_TCP;
+      rd->conn_type = RSD_CONN_TCP | no_framing;
       if (getaddrinfo(rd->host, rd->port, &hints, &res) != 0)
          goto error;
    }
 
    rd->conn.socket = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-   rd->conn.ctl_socket = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-   if (rd->conn.socket < 0 || rd->conn.ctl_socket < 0)
+   if (rd->conn.socket < 0)
    {
       RSD_ERR("Getting sockets failed.");
       goto error;
@@ -351,8 +418,24 @@ static int rsnd_connect_server( rsound_t *rd )
 
    if (rsnd_connect_socket(rd->conn.socket, res->ai_addr, res->ai_addrlen) < 0)
       goto error;
-   if (rsnd_connect_socket(rd->conn.ctl_socket, res->ai_addr, res->ai_addrlen) < 0)
-      goto error;
+
+   /* We first try to get away with just the data socket. Only older servers need the ctl socket. */
+   if (no_framing)
+   {
+      rd->conn.ctl_socket = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+      if (rd->conn.ctl_socket < 0)
+      {
+         RSD_ERR("Getting sockets failed.");
+         goto error;
+      }
+
+      if (rsnd_connect_socket(rd->conn.ctl_socket, res->ai_addr, res->ai_addrlen) < 0)
+         goto error;
+
+      /* Tells the server which data socket the ctl socket belongs to, so it doesn't have to guess when several clients connect at once. */
+      if ((rd->conn_type & ~RSD_CONN_NO_FRAMING) == RSD_CONN_TCP)
+         rsnd_send_pair_info(rd);
+   }
 
    if (res != NULL && (res->ai_family != AF_UNIX))
       freeaddrinfo(res);
@@ -369,17 +452,13 @@ error:
    return -1;
 }
 
-/* Conjures a WAV-header and sends this to server. Returns -1 when failed, and 0 when success. */
-static int rsnd_send_header_info(rsound_t *rd)
-{
-   /* Defines the size of a wave header */
+/* Defines the size of a wave header */
 #define HEADER_SIZE 44
-   char *header = calloc(1, HEADER_SIZE);
-   if (header == NULL)
-   {
-      RSD_ERR("Could not allocate memory.");
-      return -1;
-   }
+
+/* Conjures a WAV-header for the stream in header, which is HEADER_SIZE bytes. */
+static void rsnd_make_header(rsound_t *rd, char *header)
+{
+   memset(header, 0, HEADER_SIZE);
    uint16_t temp16;
    uint32_t temp32;
 
@@ -392,6 +471,7 @@ static int rsnd_send_header_info(rsound_t *rd)
 #define CHANNEL 22
 #define FRAMESIZE 34
 #define FORMAT 42
+#define PROTO_FLAGS 40
 
 
    uint32_t temp_rate = rd->rate;
@@ -448,7 +528,11 @@ static int rsnd_send_header_info(rsound_t *rd)
    // Here we embed in the rest of the WAV header for it to be somewhat valid
 
    strcpy(header, "RIFF");
-   SET32(header, 4, 0);
+   // The RIFF chunk size is meaningless for a stream. Without a ctl socket, we use it to ask for framing.
+   // Either way, it tells the server that our protocol flags below are valid.
+   temp32 = rd->conn.ctl_socket < 0 ? RSD_FRAME_MAGIC : RSD_PROTO_MAGIC;
+   LSB32(temp32);
+   SET32(header, 4, temp32);
    strcpy(header+8, "WAVE");
    strcpy(header+12, "fmt ");
 
@@ -504,44 +588,31 @@ static int rsnd_send_header_info(rsound_t *rd)
    LSB16(temp_format);
    SET16(header, FORMAT, temp_format);
 
+   // Also in the data chunk size, we tell the server which protocol extensions we can use.
+   temp16 = RSD_PROTO_FLAG_BINARY | RSD_PROTO_FLAG_RESET;
+   LSB16(temp16);
+   SET16(header, PROTO_FLAGS, temp16);
+
    // End static header
+}
+
+/* Sends the WAV-header to server. Returns -1 when failed, and 0 when success. */
+static int rsnd_send_header_info(rsound_t *rd)
+{
+   char header[HEADER_SIZE];
+   rsnd_make_header(rd, header);
 
    if (rsnd_send_chunk(rd->conn.socket, header, HEADER_SIZE, 1) != HEADER_SIZE)
-   {
-      free(header);
       return -1;
-   }
 
-   free(header);
    return 0;
 }
 
-/* Recieves backend info from server that is of interest to the client. (This mini-protocol might be extended later on.) */
-static int rsnd_get_backend_info ( rsound_t *rd )
+/* Sets up the buffers of the stream after what the server told us. */
+static int rsnd_set_backend_info(rsound_t *rd, uint32_t latency, uint32_t chunk_size)
 {
-#define RSND_HEADER_SIZE 8
-#define LATENCY 0
-#define CHUNKSIZE 1
-
-   // Header is 2 uint32_t's. = 8 bytes.
-   uint32_t rsnd_header[2] = {0};
-
-   if (rsnd_recv_chunk(rd->conn.socket, rsnd_header, RSND_HEADER_SIZE, 1) != RSND_HEADER_SIZE)
-   {
-      RSD_ERR("Couldn't receive chunk.");
-      return -1;
-   }
-
-   /* Again, we can't be 100% certain that sizeof(backend_info_t) is equal on every system */
-
-   if (rsnd_is_little_endian())
-   {
-      rsnd_swap_endian_32(&rsnd_header[LATENCY]);
-      rsnd_swap_endian_32(&rsnd_header[CHUNKSIZE]);
-   }
-
-   rd->backend_info.latency = rsnd_header[LATENCY];
-   rd->backend_info.chunk_size = rsnd_header[CHUNKSIZE];
+   rd->backend_info.latency = latency;
+   rd->backend_info.chunk_size = chunk_size;
 
 #define MAX_CHUNK_SIZE 1024 // We do not want larger chunk sizes than this.
    if (rd->backend_info.chunk_size > MAX_CHUNK_SIZE || rd->backend_info.chunk_size <= 0)
@@ -553,6 +624,7 @@ static int rsnd_get_backend_info ( rsound_t *rd )
 
    if (rd->fifo_buffer != NULL)
       rsnd_fifo_free(rd->fifo_buffer);
+   rd->write_granted = 0;
    rd->fifo_buffer = rsnd_fifo_new (rd->buffer_size);
    if (rd->fifo_buffer == NULL)
    {
@@ -561,7 +633,7 @@ static int rsnd_get_backend_info ( rsound_t *rd )
    }
 
    // Only bother with setting network buffer size if we're doing TCP.
-   if (rd->conn_type & RSD_CONN_TCP)
+   if ((rd->conn_type & (RSD_CONN_UNIX | RSD_CONN_DECNET)) == RSD_CONN_TCP)
    {
 #define MAX_TCP_BUFSIZE (1 << 14)
       int bufsiz = rd->buffer_size;
@@ -580,16 +652,66 @@ static int rsnd_get_backend_info ( rsound_t *rd )
       setsockopt(rd->conn.ctl_socket, IPPROTO_TCP, TCP_NODELAY, CONST_CAST &flag, sizeof(int));
    }
 
+   return 0;
+}
+
+/* Recieves backend info from server that is of interest to the client. (This mini-protocol might be extended later on.) */
+static int rsnd_get_backend_info ( rsound_t *rd )
+{
+#define RSND_HEADER_SIZE 8
+#define LATENCY 0
+#define CHUNKSIZE 1
+
+   // Header is 2 uint32_t's. = 8 bytes.
+   uint32_t rsnd_header[2] = {0};
+
+   if (rsnd_recv_chunk(rd->conn.socket, rsnd_header, RSND_HEADER_SIZE, 1) != RSND_HEADER_SIZE)
+   {
+      RSD_ERR("Couldn't receive chunk.");
+      return -1;
+   }
+
+   /* Again, we can't be 100% certain that sizeof(backend_info_t) is equal on every system */
+
+   if (rsnd_is_little_endian())
+   {
+      rsnd_swap_endian_32(&rsnd_header[LATENCY]);
+      rsnd_swap_endian_32(&rsnd_header[CHUNKSIZE]);
+   }
+
+   if (rsnd_set_backend_info(rd, rsnd_header[LATENCY], rsnd_header[CHUNKSIZE]) < 0)
+      return -1;
+
    // Can we read the last 8 bytes so we can use the protocol interface?
    // This is non-blocking.
    if (rsnd_recv_chunk(rd->conn.socket, rsnd_header, RSND_HEADER_SIZE, 0) == RSND_HEADER_SIZE)
+   {
       rd->conn_type |= RSD_CONN_PROTO; 
+
+      // The server acks framing by sending the magic back.
+      if (rsnd_is_little_endian())
+         rsnd_swap_endian_32(&rsnd_header[0]);
+      if (rd->conn.ctl_socket < 0 && rsnd_header[0] == RSD_FRAME_MAGIC)
+         rd->conn_type |= RSD_CONN_FRAMED;
+
+      // ... and tells us which of our protocol extensions it agreed to.
+      if (rsnd_is_little_endian())
+         rsnd_swap_endian_32(&rsnd_header[1]);
+      if (rsnd_header[1] & RSD_PROTO_FLAG_BINARY)
+         rd->conn_type |= RSD_CONN_BINARY;
+      // RESET goes on the data socket, as a binary message.
+      if ((rsnd_header[1] & RSD_PROTO_FLAG_RESET) && (rd->conn_type & RSD_CONN_FRAMED) && (rd->conn_type & RSD_CONN_BINARY))
+         rd->conn_type |= RSD_CONN_RESET;
+   }
    else
    {  
       RSD_DEBUG("Failed to get new proto"); 
    }
 
-   // We no longer want to read from this socket.
+   // We no longer want to read from this socket, unless the server will send control messages on it.
+   if (rd->conn_type & RSD_CONN_FRAMED)
+      return 0;
+
 #ifdef _WIN32
    shutdown(rd->conn.socket, SD_RECEIVE);
 #else
@@ -636,6 +758,27 @@ static int rsnd_create_connection(rsound_t *rd)
          return -1;
       }
    }
+   /* rsd_stop() kept the connection, so we only need to tell the server about the new stream. */
+   if (!rd->ready_for_data && (rd->conn_type & RSD_CONN_PARKED))
+   {
+      if (rsnd_reset_connection(rd) < 0)
+      {
+         RSD_DEBUG("Server didn't take RESET. Reconnecting.");
+         rsnd_reset(rd);
+         return rsnd_create_connection(rd);
+      }
+
+      rc = rsnd_start_thread(rd);
+      if (rc < 0)
+      {
+         RSD_ERR("Starting thread failed!");
+         rsd_stop(rd);
+         return -1;
+      }
+
+      rd->ready_for_data = 1;
+   }
+
    /* Is the server ready for data? The first thing it expects is the wave header */
    if (!rd->ready_for_data)
    {
@@ -660,32 +803,51 @@ static int rsnd_create_connection(rsound_t *rd)
          return -1;
       }
 
-      rc = rsnd_start_thread(rd);
-      if (rc < 0)
+      /* Older servers don't know about framing, and want a ctl socket as well. Start over the old way. */
+      if (rd->conn.ctl_socket < 0 && !(rd->conn_type & RSD_CONN_FRAMED))
       {
-         RSD_ERR("Starting thread failed!");
-         rsd_stop(rd);
-         return -1;
+         RSD_DEBUG("Server doesn't do framing. Reconnecting with ctl socket.");
+         rsnd_reset(rd);
+         rd->conn_type |= RSD_CONN_NO_FRAMING;
+         return rsnd_create_connection(rd);
       }
 
+      /* Sent before the thread is up, as the thread might be using the same socket. */
       if ((rd->conn_type & RSD_CONN_PROTO) && strlen(rd->identity) > 0)
       {
          rsnd_send_identity_info(rd);
       }
 
+      if ((rd->conn_type & RSD_CONN_BINARY) && rd->report_interval > 0)
+      {
+         rsnd_ctl_msg_t msg = {
+            .type = RSD_CTL_REPORT,
+            .flags = rd->report_interval
+         };
+         rsnd_send_ctl_msg(rd, &msg, NULL, 0, 1);
+      }
+
+      rc = rsnd_start_thread(rd);
+      if (rc < 0)
+      {
+         RSD_ERR("Starting thread failed!");
+         rsd_stop(rd);
+         return -1;
+      }
+
       rd->ready_for_data = 1;
    }
 
    return 0;
 }
 
-/* Sends a chunk over the network. Makes sure that everything is sent if blocking. Returns -1 if connection is lost, non-negative if success.
- * If blocking, and not enough data is recieved, it will return -1. */
-static ssize_t rsnd_send_chunk(int socket, const void* buf, size_t size, int blocking)
+/* Sends the segments in iov over the network, in as few calls as the socket allows. We only poll when the socket
+ * would block. The segments are advanced past what has been sent. Makes sure that everything is sent if blocking. 
+ * Returns -1 if connection is lost, non-negative if success. If blocking, and not everything could be sent, it will return -1. */
+static ssize_t rsnd_send_iov(int socket, struct iovec *iov, int iovcnt, int blocking)
 {
-   ssize_t rc = 0;
+   size_t size = 0;
    size_t wrote = 0;
-   ssize_t send_size = 0;
    struct pollfd fd = {
       .fd = socket,
       .events = POLLOUT
@@ -693,43 +855,87 @@ static ssize_t rsnd_send_chunk(int socket, const void* buf, size_t size, int blo
 
    int sleep_time = (blocking) ? 10000 : 0;
 
-#define MAX_PACKET_SIZE 1024
+   for (int i = 0; i < iovcnt; i++)
+      size += iov[i].iov_len;
 
    while (wrote < size)
    {
-      if (rsnd_poll(&fd, 1, sleep_time) < 0)
-         return -1;
+      while (iov->iov_len == 0)
+      {
+         iov++;
+         iovcnt--;
+      }
+
+#ifdef _WIN32
+      ssize_t rc = send(socket, iov->iov_base, iov->iov_len, 0);
+#else
+      struct msghdr msg = {
+         .msg_iov = iov,
+         .msg_iovlen = iovcnt
+      };
+      ssize_t rc = sendmsg(socket, &msg, 0);
+#endif
 
-      if (fd.revents & POLLOUT)
+      if (rc < 0)
       {
-         /* We try to limit ourselves to 1KiB packet sizes. */
-         send_size = (size - wrote) > MAX_PACKET_SIZE ? MAX_PACKET_SIZE : size - wrote;
-         rc = send(socket, (const char*)buf + wrote, send_size, 0);
-         if (rc < 0)
+         if (errno == EINTR)
+            continue;
+
+         if (!RSND_WOULD_BLOCK())
          {
             RSD_ERR("Error sending chunk, %s\n", strerror(errno));
             return rc;
          }
-         wrote += rc;
-      }
-      else if (fd.revents & POLLHUP)
-      {
-         RSD_WARN("*** Remote side hung up! ***");
-         return -1;
-      }
-      else
-      {
-         /* If server hasn't stopped blocking after 10 secs, then we should probably shut down the stream. */
-         if (blocking)
+
+         if (rsnd_poll(&fd, 1, sleep_time) < 0)
             return -1;
-         else
-            return wrote;
+
+         if (fd.revents & POLLHUP)
+         {
+            RSD_WARN("*** Remote side hung up! ***");
+            return -1;
+         }
+         /* If server hasn't stopped blocking after 10 secs, then we should probably shut down the stream. */
+         else if (!(fd.revents & POLLOUT))
+         {
+            if (blocking)
+               return -1;
+            else
+               return wrote;
+         }
+
+         continue;
       }
 
+      wrote += rc;
+      while (rc > 0)
+      {
+         size_t advance = (size_t)rc < iov->iov_len ? (size_t)rc : iov->iov_len;
+         iov->iov_base = (char*)iov->iov_base + advance;
+         iov->iov_len -= advance;
+         rc -= advance;
+         if (iov->iov_len == 0 && rc > 0)
+         {
+            iov++;
+            iovcnt--;
+         }
+      }
    }
    return (ssize_t)wrote;
 }
 
+/* Sends a chunk over the network. */
+static ssize_t rsnd_send_chunk(int socket, const void* buf, size_t size, int blocking)
+{
+   struct iovec iov = {
+      .iov_base = (void*)buf,
+      .iov_len = size
+   };
+   return rsnd_send_iov(socket, &iov, 1, blocking);
+}
+
+#define MAX_PACKET_SIZE 1024
+
 /* Recieved chunk. Makes sure that everything is recieved if blocking. Returns -1 if connection is lost, non-negative if success.
  * If blocking, and not enough data is recieved, it will return -1. */
 static ssize_t rsnd_recv_chunk(int socket, void *buf, size_t size, int blocking)
@@ -783,6 +989,93 @@ static ssize_t rsnd_recv_chunk(int socket, void *buf, size_t size, int blocking)
    return (ssize_t)has_read;
 }
 
+/* Sends data in frames on the data socket. Frames are always sent in full, as a partial frame would throw the server off. 
+ * Each frame goes out with its header in one call, without copying the data. */
+static ssize_t rsnd_send_frame_iov(rsound_t *rd, uint16_t type, const struct iovec *data, int datacnt)
+{
+   size_t size = 0;
+   for (int i = 0; i < datacnt; i++)
+      size += data[i].iov_len;
+
+   size_t max_frame = rd->packet_size > 0 ? (size_t)rd->packet_size : size;
+   size_t wrote = 0;
+   int seg = 0;
+   size_t seg_offset = 0;
+
+   while (wrote < size)
+   {
+      size_t frame_size = (size - wrote) > max_frame ? max_frame : size - wrote;
+
+      // Network byte order, as everything else.
+      uint8_t header[RSD_FRAME_HEADER_SIZE] = {
+         type >> 8, type & 0xff, 0, 0,
+         frame_size >> 24, (frame_size >> 16) & 0xff, (frame_size >> 8) & 0xff, frame_size & 0xff
+      };
+
+      // A frame may span the end of one segment and the start of the next.
+      struct iovec iov[3] = {{ .iov_base = header, .iov_len = sizeof(header) }};
+      int iovcnt = 1;
+      size_t left = frame_size;
+      while (left > 0)
+      {
+         size_t len = data[seg].iov_len - seg_offset;
+         if (len > left)
+            len = left;
+
+         iov[iovcnt].iov_base = (char*)data[seg].iov_base + seg_offset;
+         iov[iovcnt].iov_len = len;
+         iovcnt++;
+         left -= len;
+         seg_offset += len;
+         if (seg_offset == data[seg].iov_len)
+         {
+            seg++;
+            seg_offset = 0;
+         }
+      }
+
+      if (rsnd_send_iov(rd->conn.socket, iov, iovcnt, 1) != (ssize_t)(RSD_FRAME_HEADER_SIZE + frame_size))
+         return -1;
+
+      wrote += frame_size;
+   }
+
+   return (ssize_t)wrote;
+}
+
+static ssize_t rsnd_send_frame(rsound_t *rd, uint16_t type, const void *buf, size_t size)
+{
+   struct iovec data = {
+      .iov_base = (void*)buf,
+      .iov_len = size
+   };
+   return rsnd_send_frame_iov(rd, type, &data, 1);
+}
+
+/* Audio can come in two pieces, when it wraps around in the fifo. */
+static ssize_t rsnd_send_audio(rsound_t *rd, struct iovec *iov, int iovcnt)
+{
+   if (rd->conn_type & RSD_CONN_FRAMED)
+      return rsnd_send_frame_iov(rd, RSD_FRAME_AUDIO, iov, iovcnt);
+
+   if (rd->packet_size <= 0)
+      return rsnd_send_iov(rd->conn.socket, iov, iovcnt, 1);
+
+   ssize_t wrote = 0;
+   for (int i = 0; i < iovcnt; i++)
+   {
+      const char *buf = iov[i].iov_base;
+      for (size_t offset = 0; offset < iov[i].iov_len; offset += rd->packet_size)
+      {
+         size_t size = iov[i].iov_len - offset > (size_t)rd->packet_size ? (size_t)rd->packet_size : iov[i].iov_len - offset;
+         if (rsnd_send_chunk(rd->conn.socket, buf + offset, size, 1) != (ssize_t)size)
+            return -1;
+         wrote += size;
+      }
+   }
+   return wrote;
+}
+
 static int rsnd_poll(struct pollfd *fd, int numfd, int timeout)
 {
    for(;;)
@@ -802,6 +1095,24 @@ static int rsnd_poll(struct pollfd *fd, int numfd, int timeout)
    return 0;
 }
 
+/* Checks if the other side has closed the socket, without taking anything off it. */
+static int rsnd_hung_up(int socket)
+{
+   char c;
+   struct pollfd fd = {
+      .fd = socket,
+      .events = POLLIN
+   };
+
+   if (rsnd_poll(&fd, 1, 0) < 0)
+      return 1;
+   if (fd.revents & (POLLHUP | POLLERR | POLLNVAL))
+      return 1;
+   if (fd.revents & POLLIN)
+      return recv(socket, &c, 1, MSG_PEEK) <= 0;
+   return 0;
+}
+
 static void rsnd_sleep(int msecs)
 {
 #ifdef _WIN32
@@ -816,95 +1127,230 @@ static void rsnd_sleep(int msecs)
 }
 
 
-/* Calculates how many bytes there are in total in the virtual buffer. This is calculated client side.
-   It should be accurate enough unless we have big problems with buffer underruns.
-   This function is called by rsd_delay() to determine the latency. 
-   This function might be changed in the future to correctly determine latency from server. */
-static void rsnd_drain(rsound_t *rd)
+/* Monotonic time in nanoseconds. Only used to timestamp control messages. */
+static int64_t rsnd_get_time_ns(void)
 {
-   /* If the audio playback has started on the server we need to use timers. */
-   if (rd->has_written)
-   {
-      int64_t temp, temp2;
+#if defined(_POSIX_MONOTONIC_CLOCK) && !defined(__APPLE__)
+   struct timespec now_tv;
+   clock_gettime(CLOCK_MONOTONIC, &now_tv);
+   return (int64_t)now_tv.tv_sec * 1000000000 + now_tv.tv_nsec;
+#else
+   struct timeval now_tv;
+   gettimeofday(&now_tv, NULL);
+   return (int64_t)now_tv.tv_sec * 1000000000 + (int64_t)now_tv.tv_usec * 1000;
+#endif
+}
 
-      /* Falls back to gettimeofday() when CLOCK_MONOTONIC is not supported */
+/* Fields which one thread writes while another one reads them are only accessed through these. */
+#if defined(__ATOMIC_SEQ_CST)
+#define RSND_BARRIER() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define RSND_ACQUIRE() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define RSND_RELEASE() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define RSND_LOAD(ptr) __atomic_load_n(ptr, __ATOMIC_RELAXED)
+#define RSND_STORE(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_RELAXED)
+#define RSND_LOAD_DOUBLE(ptr, out) __atomic_load(ptr, out, __ATOMIC_RELAXED)
+#define RSND_STORE_DOUBLE(ptr, in) __atomic_store(ptr, in, __ATOMIC_RELAXED)
+#else
+#define RSND_BARRIER() __sync_synchronize()
+#define RSND_ACQUIRE() __sync_synchronize()
+#define RSND_RELEASE() __sync_synchronize()
+#define RSND_LOAD(ptr) (*(ptr))
+#define RSND_STORE(ptr, val) (*(ptr) = (val))
+#define RSND_LOAD_DOUBLE(ptr, out) (*(out) = *(ptr))
+#define RSND_STORE_DOUBLE(ptr, in) (*(ptr) = *(in))
+#endif
 
-      /* Calculates the amount of bytes that the server has consumed. */
-#if defined(_POSIX_MONOTONIC_CLOCK) && !defined(__APPLE__)
-      struct timespec now_tv;
-      clock_gettime(CLOCK_MONOTONIC, &now_tv);
+/* What the sender has published about the stream, as of one point in time. */
+typedef struct rsnd_stream_state
+{
+   int64_t total_written;
+   int64_t start_ns;
+   int has_written;
+   int delay_offset;
+   uint32_t latency;
+
+   int clock_valid;
+   int64_t clock_base_ts;
+   double clock_base_played;
+   double clock_slope;
+   int64_t clock_min_offset;
+} rsnd_stream_state_t;
+
+/* rsd_delay() is called a lot, so it must not have to wait for the sender. What it needs is published with a seqlock:
+   the sender makes seq odd, updates the fields, and makes it even again. A reader copies the fields, and starts over 
+   if seq was odd or has changed in the meantime. thread.mutex is only there to keep writers apart, 
+   as rsnd_reset() can be called from either side. */
+static void rsnd_publish_begin(rsound_t *rd)
+{
+   pthread_mutex_lock(&rd->thread.mutex);
+   RSND_STORE(&rd->seq, rd->seq + 1);
+   RSND_RELEASE();
+}
 
-      temp = (int64_t)now_tv.tv_sec - (int64_t)rd->start_tv_nsec.tv_sec;
+static void rsnd_publish_end(rsound_t *rd)
+{
+   RSND_RELEASE();
+   RSND_STORE(&rd->seq, rd->seq + 1);
+   pthread_mutex_unlock(&rd->thread.mutex);
+}
 
-      temp *= rd->rate * rd->channels * rd->samplesize;
+static void rsnd_read_state(rsound_t *rd, rsnd_stream_state_t *state)
+{
+   unsigned int seq;
+   do
+   {
+      seq = RSND_LOAD(&rd->seq);
+      RSND_ACQUIRE();
+
+      state->total_written = RSND_LOAD(&rd->total_written);
+      state->start_ns = RSND_LOAD(&rd->start_ns);
+      state->has_written = RSND_LOAD(&rd->has_written);
+      state->delay_offset = RSND_LOAD(&rd->delay_offset);
+      state->latency = RSND_LOAD(&rd->backend_info.latency);
+      state->clock_valid = RSND_LOAD(&rd->clock.valid);
+      state->clock_base_ts = RSND_LOAD(&rd->clock.base_ts);
+      RSND_LOAD_DOUBLE(&rd->clock.base_played, &state->clock_base_played);
+      RSND_LOAD_DOUBLE(&rd->clock.slope, &state->clock_slope);
+      state->clock_min_offset = RSND_LOAD(&rd->clock.min_offset);
+
+      RSND_ACQUIRE();
+   } while ((seq & 1) || RSND_LOAD(&rd->seq) != seq);
+}
 
-      temp2 = (int64_t)now_tv.tv_nsec - (int64_t)rd->start_tv_nsec.tv_nsec;
-      temp2 *= rd->rate * rd->channels * rd->samplesize;
-      temp2 /= 1000000000;
-      temp += temp2;
-#else
-      struct timeval now_tv;
-      gettimeofday(&now_tv, NULL);
+/* Calculates how many bytes there are in total in the virtual buffer. This is calculated client side.
+   It should be accurate enough unless we have big problems with buffer underruns.
+   This function is called by rsd_delay() to determine the latency, when the server doesn't send timestamps. */
+static int rsnd_drain(rsound_t *rd, const rsnd_stream_state_t *state)
+{
+   int bytes_in_buffer;
 
-      temp = (int64_t)now_tv.tv_sec - (int64_t)rd->start_tv_usec.tv_sec;
-      temp *= rd->rate * rd->channels * rd->samplesize;
+   /* If the audio playback has started on the server we need to use timers. */
+   if (state->has_written)
+   {
+      /* Calculates the amount of bytes that the server has consumed. Split up so it doesn't overflow in long streams. */
+      int64_t bps = rd->rate * rd->channels * rd->samplesize;
+      int64_t elapsed = rsnd_get_time_ns() - state->start_ns;
+      int64_t consumed = (elapsed / 1000000000) * bps + (elapsed % 1000000000) * bps / 1000000000;
 
-      temp2 = (int64_t)now_tv.tv_usec - (int64_t)rd->start_tv_usec.tv_usec;
-      temp2 *= rd->rate * rd->channels * rd->samplesize;
-      temp2 /= 1000000;
-      temp += temp2;
-#endif
       /* Calculates the amount of data we have in our virtual buffer. Only used to calculate delay. */
-      pthread_mutex_lock(&rd->thread.mutex);
-      rd->bytes_in_buffer = (int)((int64_t)rd->total_written + (int64_t)rsnd_fifo_read_avail(rd->fifo_buffer) - temp);
-      pthread_mutex_unlock(&rd->thread.mutex);
+      bytes_in_buffer = (int)(state->total_written + (int64_t)rsnd_fifo_read_avail(rd->fifo_buffer) - consumed);
    }
    else
+      bytes_in_buffer = rsnd_fifo_read_avail(rd->fifo_buffer);
+
+   RSND_STORE(&rd->bytes_in_buffer, bytes_in_buffer);
+   return bytes_in_buffer;
+}
+
+/* The writer and the sender thread only wake each other up when the other one is asleep, and what it waits for is there:
+   the writer when there is room for what it wants to write, the sender when a whole chunk is ready, or either of them on stop.
+   A waiter announces itself before it checks the fifo the last time, and the other side publishes its fifo update before 
+   it looks for waiters. With a full barrier in between on both sides, one of them always sees the other. */
+static void rsnd_wake_sender(rsound_t *rd)
+{
+   RSND_BARRIER();
+   if (RSND_LOAD(&rd->thread.sender_waiting) && rsnd_fifo_read_avail(rd->fifo_buffer) >= rd->backend_info.chunk_size)
    {
-      pthread_mutex_lock(&rd->thread.mutex);
-      rd->bytes_in_buffer = rsnd_fifo_read_avail(rd->fifo_buffer);
-      pthread_mutex_unlock(&rd->thread.mutex);
+      pthread_mutex_lock(&rd->thread.cond_mutex);
+      pthread_cond_signal(&rd->thread.cond);
+      pthread_mutex_unlock(&rd->thread.cond_mutex);
    }
 }
 
-/* Tries to fill the buffer. Uses signals to determine when the buffer is ready to be filled. Should the thread not be active
-   it will treat this as an error. Crude implementation of a blocking FIFO. */ 
-static size_t rsnd_fill_buffer(rsound_t *rd, const char *buf, size_t size)
+static void rsnd_wake_writer(rsound_t *rd)
 {
-
-   /* Wait until we have a ready buffer */
-   for (;;)
+   RSND_BARRIER();
+   size_t wants = RSND_LOAD(&rd->thread.writer_wants);
+   if (wants > 0 && rsnd_fifo_write_avail(rd->fifo_buffer) >= wants)
    {
-      /* Should the thread be shut down while we're running, return with error */
-      if (!rd->thread_active)
-         return 0;
+      pthread_mutex_lock(&rd->thread.cond_mutex);
+      pthread_cond_signal(&rd->thread.space_cond);
+      pthread_mutex_unlock(&rd->thread.cond_mutex);
+   }
+}
+
+/* Wakes up everyone, after thread_active has been cleared. */
+static void rsnd_wake_all(rsound_t *rd)
+{
+   pthread_mutex_lock(&rd->thread.cond_mutex);
+   pthread_cond_broadcast(&rd->thread.cond);
+   pthread_cond_broadcast(&rd->thread.space_cond);
+   pthread_mutex_unlock(&rd->thread.cond_mutex);
+}
+
+/* Without a thread, the writer sends audio itself until there is room. As with the thread, 
+   the server gets 10 secs to take more data before we give up on it. */
+static int rsnd_process_wait(rsound_t *rd, size_t size)
+{
+   while (rsnd_fifo_write_avail(rd->fifo_buffer) < size)
+   {
+      struct pollfd fds[2];
+      int numfd = rsd_get_pollfds(rd, fds, 2);
+      if (numfd < 0)
+         return -1;
+
+      if (rsnd_poll(fds, numfd, 10000) < 0)
+         return -1;
 
-      pthread_mutex_lock(&rd->thread.mutex);
-      if (rsnd_fifo_write_avail(rd->fifo_buffer) >= size)
+      if (!(fds[0].revents | (numfd > 1 ? fds[1].revents : 0)))
       {
-         pthread_mutex_unlock(&rd->thread.mutex);
-         break;
+         RSD_ERR("Server didn't take any data for 10 secs.");
+         rsnd_reset(rd);
+         return -1;
       }
-      pthread_mutex_unlock(&rd->thread.mutex);
 
-      /* Sleeps until we can write to the FIFO. */
-      pthread_mutex_lock(&rd->thread.cond_mutex);
-      pthread_cond_signal(&rd->thread.cond);
-
-      RSD_DEBUG("rsnd_fill_buffer: Going to sleep.");
-      pthread_cond_wait(&rd->thread.cond, &rd->thread.cond_mutex);
-      RSD_DEBUG("rsnd_fill_buffer: Woke up.");
-      pthread_mutex_unlock(&rd->thread.cond_mutex);
+      if (rsd_process(rd) < 0)
+         return -1;
    }
 
-   pthread_mutex_lock(&rd->thread.mutex);
+   return 0;
+}
+
+/* Waits until size bytes can be written to the buffer. Should the thread not be active it will treat this as an error. */
+static int rsnd_wait_buffer(rsound_t *rd, size_t size)
+{
+   /* Should the thread be shut down while we're running, return with error */
+   if (!RSND_LOAD(&rd->thread_active))
+      return -1;
+
+   if (rsnd_fifo_write_avail(rd->fifo_buffer) >= size)
+      return 0;
+
+   /* Nobody else is going to make room. */
+   if (rd->threadless)
+      return rsnd_process_wait(rd, size);
+
+   /* The sender frees a chunk at a time, so there is no point in waking up for less. */
+   size_t wants = size < rd->backend_info.chunk_size ? rd->backend_info.chunk_size : size;
+
+   pthread_mutex_lock(&rd->thread.cond_mutex);
+   RSND_STORE(&rd->thread.writer_wants, wants);
+   RSND_BARRIER();
+
+   RSD_DEBUG("rsnd_wait_buffer: Going to sleep.");
+   while (RSND_LOAD(&rd->thread_active) && rsnd_fifo_write_avail(rd->fifo_buffer) < wants)
+      pthread_cond_wait(&rd->thread.space_cond, &rd->thread.cond_mutex);
+   RSD_DEBUG("rsnd_wait_buffer: Woke up.");
+
+   RSND_STORE(&rd->thread.writer_wants, 0);
+   pthread_mutex_unlock(&rd->thread.cond_mutex);
+
+   return RSND_LOAD(&rd->thread_active) ? 0 : -1;
+}
+
+/* Tries to fill the buffer. */
+static size_t rsnd_fill_buffer(rsound_t *rd, const char *buf, size_t size)
+{
+   /* Wait until we have a ready buffer */
+   if (rsnd_wait_buffer(rd, size) < 0)
+      return 0;
+
+   /* We're the only writer, and the thread the only reader, so this needs no lock. */
    rsnd_fifo_write(rd->fifo_buffer, buf, size);
-   pthread_mutex_unlock(&rd->thread.mutex);
    //RSD_DEBUG("fill_buffer: Wrote to buffer.");
 
-   /* Send signal to thread that buffer has been updated */
-   //RSD_DEBUG("fill_buffer: Waking up thread.");
-   pthread_cond_signal(&rd->thread.cond);
+   /* Let the thread know if it has been waiting for this */
+   rsnd_wake_sender(rd);
 
    return size;
 }
@@ -912,13 +1358,25 @@ static size_t rsnd_fill_buffer(rsound_t *rd, const char *buf, size_t size)
 static int rsnd_start_thread(rsound_t *rd)
 {
    int rc;
-   if (!rd->thread_active)
+   if (!RSND_LOAD(&rd->thread_active))
    {
-      rd->thread_active = 1;
+      /* The application sends the audio itself. */
+      if (rd->threadless)
+      {
+         if (rd->audio_callback)
+         {
+            RSD_ERR("The callback interface needs the thread.");
+            return -1;
+         }
+         RSND_STORE(&rd->thread_active, 1);
+         return 0;
+      }
+
+      RSND_STORE(&rd->thread_active, 1);
       rc = pthread_create(&rd->thread.threadId, NULL, rd->audio_callback ? rsnd_cb_thread : rsnd_thread, rd);
       if (rc < 0)
       {
-         rd->thread_active = 0;
+         RSND_STORE(&rd->thread_active, 0);
          RSD_ERR("Failed to create thread.");
          return -1;
       }
@@ -931,15 +1389,16 @@ static int rsnd_start_thread(rsound_t *rd)
 /* Makes sure that the playback thread has been correctly shut down */
 static int rsnd_stop_thread(rsound_t *rd)
 {
-   if (rd->thread_active)
+   if (RSND_LOAD(&rd->thread_active))
    {
 
       RSD_DEBUG("Shutting down thread.");
 
-      pthread_mutex_lock(&rd->thread.cond_mutex);
-      rd->thread_active = 0;
-      pthread_cond_signal(&rd->thread.cond);
-      pthread_mutex_unlock(&rd->thread.cond_mutex);
+      RSND_STORE(&rd->thread_active, 0);
+      rsnd_wake_all(rd);
+
+      if (rd->threadless)
+         return 0;
 
       if (pthread_join(rd->thread.threadId, NULL) < 0)
          RSD_WARN("*** Warning, did not terminate thread. ***");
@@ -955,21 +1414,116 @@ static int rsnd_stop_thread(rsound_t *rd)
    }
 }
 
+/* Adds a sample of where the server is in the stream, and fits a line through the recent ones, 
+   so that played = base_played + slope * (server time - base_ts). Our clock is mapped onto the server's with 
+   the smallest difference seen between when a sample was taken and when we got it, 
+   as that sample spent the least time on its way to us. */
+static void rsnd_clock_add(rsound_t *rd, int64_t played, int64_t server_ts)
+{
+   int64_t offset = rsnd_get_time_ns() - server_ts;
+   int last = (rd->clock.index + RSD_CLOCK_SAMPLES - 1) % RSD_CLOCK_SAMPLES;
+
+   if (rd->clock.count > 0)
+   {
+      // Old INFO replies may come in after newer reports.
+      if (server_ts <= rd->clock.server_ts[last])
+         return;
+
+      // The server has run dry, or stalled, so the line so far says nothing about what comes next.
+      // Any real drift between the clocks is far less than this between two samples.
+      double expected = rd->clock.base_played + rd->clock.slope * (double)(server_ts - rd->clock.base_ts);
+      double error = expected - (double)played;
+      if (played == rd->clock.played[last] || error > 2.0 * rd->backend_info.chunk_size || error < -2.0 * rd->backend_info.chunk_size)
+         rd->clock.count = 0;
+   }
+
+   rd->clock.played[rd->clock.index] = played;
+   rd->clock.server_ts[rd->clock.index] = server_ts;
+   rd->clock.offset[rd->clock.index] = offset;
+   last = rd->clock.index;
+   rd->clock.index = (rd->clock.index + 1) % RSD_CLOCK_SAMPLES;
+   if (rd->clock.count < RSD_CLOCK_SAMPLES)
+      rd->clock.count++;
+
+   double nominal = (double)rd->rate * rd->channels * rd->samplesize / 1000000000.0;
+   double slope = nominal;
+   double base_played = played;
+   int64_t min_offset = offset;
+
+   // Everything is relative to the newest sample, so the doubles keep their precision.
+   double mean_x = 0.0, mean_y = 0.0;
+   for (int i = 0; i < rd->clock.count; i++)
+   {
+      int j = (last + RSD_CLOCK_SAMPLES - i) % RSD_CLOCK_SAMPLES;
+      mean_x += (double)(rd->clock.server_ts[j] - server_ts);
+      mean_y += (double)(rd->clock.played[j] - played);
+      if (rd->clock.offset[j] < min_offset)
+         min_offset = rd->clock.offset[j];
+   }
+   mean_x /= rd->clock.count;
+   mean_y /= rd->clock.count;
+
+   double sxx = 0.0, sxy = 0.0;
+   for (int i = 0; i < rd->clock.count; i++)
+   {
+      int j = (last + RSD_CLOCK_SAMPLES - i) % RSD_CLOCK_SAMPLES;
+      double x = (double)(rd->clock.server_ts[j] - server_ts) - mean_x;
+      double y = (double)(rd->clock.played[j] - played) - mean_y;
+      sxx += x * x;
+      sxy += x * y;
+   }
+
+   if (sxx > 0.0)
+   {
+      slope = sxy / sxx;
+
+      // The clocks never drift this much apart, so this is a bad fit over a few samples close together.
+      if (slope < nominal * 0.95)
+         slope = nominal * 0.95;
+      else if (slope > nominal * 1.05)
+         slope = nominal * 1.05;
+
+      base_played += mean_y - slope * mean_x;
+   }
+
+   rsnd_publish_begin(rd);
+   RSND_STORE(&rd->clock.base_ts, server_ts);
+   RSND_STORE_DOUBLE(&rd->clock.base_played, &base_played);
+   RSND_STORE_DOUBLE(&rd->clock.slope, &slope);
+   RSND_STORE(&rd->clock.min_offset, min_offset);
+   RSND_STORE(&rd->clock.valid, 1);
+   rsnd_publish_end(rd);
+}
+
 /* Calculates audio delay in bytes */
 static size_t rsnd_get_delay(rsound_t *rd)
 {
    int ptr;
-   rsnd_drain(rd);
-   ptr = rd->bytes_in_buffer;
+   rsnd_stream_state_t state;
+
+   RSND_STORE(&rd->use_latency, 1);
+   rsnd_read_state(rd, &state);
+
+   /* When the server tells us when it was where in the stream, we don't have to guess from when we started. 
+      It can't have played what we haven't sent, which also covers it running dry. */
+   if (state.clock_valid)
+   {
+      int64_t server_now = rsnd_get_time_ns() - state.clock_min_offset;
+      int64_t played = (int64_t)(state.clock_base_played + state.clock_slope * (double)(server_now - state.clock_base_ts));
+      if (played > state.total_written)
+         played = state.total_written;
+
+      ptr = (int)(state.total_written - played) + (int)rsnd_fifo_read_avail(rd->fifo_buffer);
+      return ptr < 0 ? 0 : (size_t)ptr;
+   }
+
+   ptr = rsnd_drain(rd, &state);
 
    /* Adds the backend latency to the calculated latency. */
-   ptr += (int)rd->backend_info.latency;
+   ptr += (int)state.latency;
 
-   pthread_mutex_lock(&rd->thread.mutex);
-   ptr += rd->delay_offset;
-   rd->use_latency = 1;
-   RSD_DEBUG("Offset: %d", rd->delay_offset);
-   pthread_mutex_unlock(&rd->thread.mutex);
+   ptr += state.delay_offset;
+   RSD_DEBUG("Offset: %d", state.delay_offset);
 
    if (ptr < 0)
       ptr = 0;
@@ -979,12 +1533,7 @@ static size_t rsnd_get_delay(rsound_t *rd)
 
 static size_t rsnd_get_ptr(rsound_t *rd)
 {
-   int ptr;
-   pthread_mutex_lock(&rd->thread.mutex);
-   ptr = rsnd_fifo_read_avail(rd->fifo_buffer);
-   pthread_mutex_unlock(&rd->thread.mutex);
-
-   return ptr;
+   return rsnd_fifo_read_avail(rd->fifo_buffer);
 }
 
 static int rsnd_send_identity_info(rsound_t *rd)
@@ -995,22 +1544,334 @@ static int rsnd_send_identity_info(rsound_t *rd)
    char tmpbuf[RSD_PROTO_MAXSIZE];
    char sendbuf[RSD_PROTO_MAXSIZE];
 
+   if (rd->conn_type & RSD_CONN_BINARY)
+   {
+      rsnd_ctl_msg_t msg = {
+         .type = RSD_CTL_IDENTITY
+      };
+      return rsnd_send_ctl_msg(rd, &msg, rd->identity, strlen(rd->identity), 0);
+   }
+
    snprintf(tmpbuf, RSD_PROTO_MAXSIZE - 1, " IDENTITY %s", rd->identity);
    tmpbuf[RSD_PROTO_MAXSIZE - 1] = '\0';
    snprintf(sendbuf, RSD_PROTO_MAXSIZE - 1, "RSD%5d%s", (int)strlen(tmpbuf), tmpbuf);
    sendbuf[RSD_PROTO_MAXSIZE - 1] = '\0';
 
-   if (rsnd_send_chunk(rd->conn.ctl_socket, sendbuf, strlen(sendbuf), 0) != (ssize_t)strlen(sendbuf))
+   if (rsnd_send_ctl(rd, sendbuf, strlen(sendbuf), 0) != (ssize_t)strlen(sendbuf))
+      return -1;
+
+   return 0;
+}
+
+static int rsnd_send_pair_info(rsound_t *rd)
+{
+   // Only ever holds " PAIR <port>".
+   char tmpbuf[32];
+   char sendbuf[RSD_PROTO_MAXSIZE];
+   struct sockaddr_storage addr;
+   socklen_t addr_len = sizeof(addr);
+   int port;
+
+   if (getsockname(rd->conn.socket, (struct sockaddr*)&addr, &addr_len) < 0)
+      return -1;
+
+   if (addr.ss_family == AF_INET)
+      port = ntohs(((struct sockaddr_in*)&addr)->sin_port);
+   else if (addr.ss_family == AF_INET6)
+      port = ntohs(((struct sockaddr_in6*)&addr)->sin6_port);
+   else
+      return -1;
+
+   snprintf(tmpbuf, sizeof(tmpbuf), " PAIR %d", port);
+   snprintf(sendbuf, RSD_PROTO_MAXSIZE - 1, "RSD%5d%s", (int)strlen(tmpbuf), tmpbuf);
+   sendbuf[RSD_PROTO_MAXSIZE - 1] = '\0';
+
+   if (rsnd_send_chunk(rd->conn.ctl_socket, sendbuf, strlen(sendbuf), 1) != (ssize_t)strlen(sendbuf))
       return -1;
 
    return 0;
 }
 
+/* Control messages go on the ctl socket, or in a frame on the data socket if the server does framing. */
+static ssize_t rsnd_send_ctl(rsound_t *rd, const char *buf, size_t size, int blocking)
+{
+   if (rd->conn_type & RSD_CONN_FRAMED)
+      return rsnd_send_frame(rd, RSD_FRAME_CTL, buf, size);
+   else
+      return rsnd_send_chunk(rd->conn.ctl_socket, buf, size, blocking);
+}
+
+static void rsnd_write_be(uint8_t *buf, uint64_t val, int bytes)
+{
+   for (int i = bytes - 1; i >= 0; i--)
+   {
+      buf[i] = val & 0xff;
+      val >>= 8;
+   }
+}
+
+static uint64_t rsnd_read_be(const uint8_t *buf, int bytes)
+{
+   uint64_t val = 0;
+   for (int i = 0; i < bytes; i++)
+      val = (val << 8) | buf[i];
+   return val;
+}
+
+static void rsnd_unpack_ctl_msg(const char *buf, rsnd_ctl_msg_t *msg)
+{
+   const uint8_t *in = (const uint8_t*)buf;
+   msg->type = rsnd_read_be(in + 0, 2);
+   msg->size = rsnd_read_be(in + 2, 2);
+   msg->flags = rsnd_read_be(in + 4, 4);
+   msg->client_ptr = (int64_t)rsnd_read_be(in + 8, 8);
+   msg->serv_ptr = (int64_t)rsnd_read_be(in + 16, 8);
+   msg->timestamp = (int64_t)rsnd_read_be(in + 24, 8);
+}
+
+/* Sends a binary control message, with an optional payload of len bytes after the fixed part (IDENTITY and RESET use this). 
+   The message goes out in one piece, or not at all. */
+static int rsnd_send_ctl_msg(rsound_t *rd, rsnd_ctl_msg_t *msg, const char *payload, size_t len, int blocking)
+{
+   char buf[RSD_CTL_MSG_MAXSIZE];
+   uint8_t *out = (uint8_t*)buf;
+
+   if (len > RSD_CTL_MSG_MAXSIZE - RSD_CTL_MSG_SIZE)
+      len = RSD_CTL_MSG_MAXSIZE - RSD_CTL_MSG_SIZE;
+
+   msg->size = RSD_CTL_MSG_SIZE + len;
+   rsnd_write_be(out + 0, msg->type, 2);
+   rsnd_write_be(out + 2, msg->size, 2);
+   rsnd_write_be(out + 4, msg->flags, 4);
+   rsnd_write_be(out + 8, (uint64_t)msg->client_ptr, 8);
+   rsnd_write_be(out + 16, (uint64_t)msg->serv_ptr, 8);
+   rsnd_write_be(out + 24, (uint64_t)msg->timestamp, 8);
+   if (len > 0)
+      memcpy(buf + RSD_CTL_MSG_SIZE, payload, len);
+
+   if (!blocking && !(rd->conn_type & RSD_CONN_FRAMED))
+   {
+      struct pollfd fd = {
+         .fd = rd->conn.ctl_socket,
+         .events = POLLOUT
+      };
+
+      if (rsnd_poll(&fd, 1, 0) < 0 || !(fd.revents & POLLOUT))
+         return -1;
+   }
+
+   if (rsnd_send_ctl(rd, buf, msg->size, 1) != (ssize_t)msg->size)
+      return -1;
+
+   return 0;
+}
+
+/* Reads a control message from the server, should there be one. For text messages, the body of the message is put in buf,
+   and binary messages are put there whole. 
+   Returns the size of what was put in buf, 0 if there's nothing to read, and -1 on error. */
+static ssize_t rsnd_recv_ctl(rsound_t *rd, char *buf, size_t size)
+{
+   ssize_t rc;
+
+   if (!(rd->conn_type & RSD_CONN_FRAMED) && (rd->conn_type & RSD_CONN_BINARY))
+   {
+      struct pollfd fd = {
+         .fd = rd->conn.ctl_socket,
+         .events = POLLIN
+      };
+
+      if (rsnd_poll(&fd, 1, 0) < 0)
+         return -1;
+
+      if (!(fd.revents & POLLIN))
+         return (fd.revents & POLLHUP) ? -1 : 0;
+
+      // Like with frames, the message is only taken off the socket when all of it has arrived.
+      rc = recv(rd->conn.ctl_socket, buf, size, MSG_PEEK);
+      if (rc <= 0)
+         return -1;
+      if (rc < RSD_CTL_MSG_SIZE)
+         return 0;
+
+      size_t len = rsnd_read_be((const uint8_t*)buf + 2, 2);
+      if (len < RSD_CTL_MSG_SIZE || len > size)
+         return -1;
+      if (rc < (ssize_t)len)
+         return 0;
+
+      if (recv(rd->conn.ctl_socket, buf, len, 0) != (ssize_t)len)
+         return -1;
+
+      return len;
+   }
+   else if (!(rd->conn_type & RSD_CONN_FRAMED))
+   {
+      char header[RSD_PROTO_CHUNKSIZE + 1] = {0};
+
+      // We first recieve the small header.
+      rc = rsnd_recv_chunk(rd->conn.ctl_socket, header, RSD_PROTO_CHUNKSIZE, 0);
+      if (rc == 0)
+         return 0;
+      else if (rc < RSD_PROTO_CHUNKSIZE)
+         return -1;
+
+      if (memcmp(header, "RSD", 3) != 0)
+         return -1;
+
+      // The length of the argument message is stored in the small 8 byte header.
+      long int len = strtol(header + 3, NULL, 10);
+      if (len <= 0 || len >= (long int)size)
+         return -1;
+
+      // Recieve the rest of the data.
+      if (rsnd_recv_chunk(rd->conn.ctl_socket, buf, len, 0) < len)
+         return -1;
+
+      buf[len] = '\0';
+      return len;
+   }
+
+   char frame[RSD_FRAME_HEADER_SIZE + RSD_CTL_MSG_MAXSIZE];
+   struct pollfd fd = {
+      .fd = rd->conn.socket,
+      .events = POLLIN
+   };
+
+   for (;;)
+   {
+      if (rsnd_poll(&fd, 1, 0) < 0)
+         return -1;
+
+      if (!(fd.revents & POLLIN))
+         return (fd.revents & POLLHUP) ? -1 : 0;
+
+      // The frame is only taken off the socket when all of it has arrived, so we never block halfway through one.
+      rc = recv(rd->conn.socket, frame, sizeof(frame), MSG_PEEK);
+      if (rc <= 0)
+         return -1;
+      if (rc < RSD_FRAME_HEADER_SIZE)
+         return 0;
+
+      const uint8_t *header = (const uint8_t*)frame;
+      uint16_t type = (header[0] << 8) | header[1];
+      uint32_t frame_size = ((uint32_t)header[4] << 24) | ((uint32_t)header[5] << 16) | ((uint32_t)header[6] << 8) | header[7];
+
+      if (frame_size > sizeof(frame) - RSD_FRAME_HEADER_SIZE)
+         return -1;
+      if (rc < (ssize_t)(RSD_FRAME_HEADER_SIZE + frame_size))
+         return 0;
+
+      if (recv(rd->conn.socket, frame, RSD_FRAME_HEADER_SIZE + frame_size, 0) != (ssize_t)(RSD_FRAME_HEADER_SIZE + frame_size))
+         return -1;
+
+      // The server doesn't send us anything but control frames.
+      if (type != RSD_FRAME_CTL)
+         continue;
+
+      if (rd->conn_type & RSD_CONN_BINARY)
+      {
+         if (frame_size < RSD_CTL_MSG_SIZE || frame_size > size)
+            return -1;
+
+         memcpy(buf, frame + RSD_FRAME_HEADER_SIZE, frame_size);
+         return frame_size;
+      }
+
+      if (frame_size < RSD_PROTO_CHUNKSIZE || memcmp(frame + RSD_FRAME_HEADER_SIZE, "RSD", 3) != 0)
+         continue;
+
+      size_t len = frame_size - RSD_PROTO_CHUNKSIZE;
+      if (len >= size)
+         return -1;
+
+      memcpy(buf, frame + RSD_FRAME_HEADER_SIZE + RSD_PROTO_CHUNKSIZE, len);
+      buf[len] = '\0';
+      return len;
+   }
+}
+
 static int rsnd_close_ctl(rsound_t *rd)
 {
    if (!(rd->conn_type & RSD_CONN_PROTO))
       return -1;
 
+   if (rd->conn_type & RSD_CONN_BINARY)
+   {
+      char reply[RSD_CTL_MSG_MAXSIZE];
+      rsnd_ctl_msg_t msg = {
+         .type = RSD_CTL_CLOSECTL
+      };
+      struct pollfd fd = {
+         .fd = (rd->conn_type & RSD_CONN_FRAMED) ? rd->conn.socket : rd->conn.ctl_socket,
+         .events = POLLIN
+      };
+
+      if (rsnd_send_ctl_msg(rd, &msg, NULL, 0, 1) < 0)
+         return -1;
+
+      // There might be replies to INFO queued up before ours.
+      for (;;)
+      {
+         if (rsnd_poll(&fd, 1, 2000) < 0)
+            return -1;
+         if (!(fd.revents & POLLIN))
+            return -1;
+
+         ssize_t rc = rsnd_recv_ctl(rd, reply, sizeof(reply));
+         if (rc < 0)
+            return -1;
+         else if (rc == 0)
+            continue;
+
+         rsnd_unpack_ctl_msg(reply, &msg);
+         if (msg.type != RSD_CTL_CLOSECTL)
+            continue;
+         if (msg.flags != 0)
+            return -1;
+         break;
+      }
+
+      if (rd->conn_type & RSD_CONN_FRAMED)
+         rd->conn_type &= ~RSD_CONN_FRAMED;
+      else
+         close(rd->conn.ctl_socket);
+      return 0;
+   }
+
+   if (rd->conn_type & RSD_CONN_FRAMED)
+   {
+      char reply[RSD_PROTO_MAXSIZE + 1];
+      struct pollfd fd = {
+         .fd = rd->conn.socket,
+         .events = POLLIN
+      };
+
+      const char *sendbuf = "RSD    9 CLOSECTL";
+      if (rsnd_send_ctl(rd, sendbuf, strlen(sendbuf), 1) < 0)
+         return -1;
+
+      // There might be replies to INFO queued up before ours.
+      for (;;)
+      {
+         if (rsnd_poll(&fd, 1, 2000) < 0)
+            return -1;
+         if (!(fd.revents & POLLIN))
+            return -1;
+
+         ssize_t rc = rsnd_recv_ctl(rd, reply, sizeof(reply));
+         if (rc < 0)
+            return -1;
+         else if (rc > 0 && strstr(reply, "CLOSECTL OK") != NULL)
+            break;
+         else if (rc > 0 && strstr(reply, "CLOSECTL ERROR") != NULL)
+            return -1;
+      }
+
+      // The server expects nothing but audio from now on.
+      rd->conn_type &= ~RSD_CONN_FRAMED;
+      return 0;
+   }
+
    struct pollfd fd = {
       .fd = rd->conn.ctl_socket,
       .events = POLLOUT
@@ -1075,6 +1936,50 @@ static int rsnd_close_ctl(rsound_t *rd)
    return 0;
 }
 
+/* Starts a new stream on a connection kept by rsd_stop(). The server answers RESET when the new stream is set up,
+   and whatever it sent about the old stream comes before that. */
+static int rsnd_reset_connection(rsound_t *rd)
+{
+   char header[HEADER_SIZE];
+   char reply[RSD_CTL_MSG_MAXSIZE];
+   rsnd_ctl_msg_t msg = {
+      .type = RSD_CTL_RESET
+   };
+   struct pollfd fd = {
+      .fd = rd->conn.socket,
+      .events = POLLIN
+   };
+
+   rd->conn_type &= ~RSD_CONN_PARKED;
+
+   rsnd_make_header(rd, header);
+   if (rsnd_send_ctl_msg(rd, &msg, header, HEADER_SIZE, 1) < 0)
+      return -1;
+
+   for (;;)
+   {
+      if (rsnd_poll(&fd, 1, 2000) < 0)
+         return -1;
+      if (!(fd.revents & POLLIN))
+         return -1;
+
+      ssize_t rc = rsnd_recv_ctl(rd, reply, sizeof(reply));
+      if (rc < 0)
+         return -1;
+      else if (rc == 0)
+         continue;
+
+      rsnd_unpack_ctl_msg(reply, &msg);
+      if (msg.type != RSD_CTL_RESET)
+         continue;
+      if (msg.flags != 0 || rc < RSD_CTL_RESET_REPLY_SIZE)
+         return -1;
+      break;
+   }
+
+   const uint8_t *info = (const uint8_t*)reply + RSD_CTL_MSG_SIZE;
+   return rsnd_set_backend_info(rd, rsnd_read_be(info, 4), rsnd_read_be(info + 4, 4));
+}
 
 // Sends delay info request to server on the ctl socket. This code section isn't critical, and will work if it works. 
 // It will never block.
@@ -1083,6 +1988,16 @@ static int rsnd_send_info_query(rsound_t *rd)
    char tmpbuf[RSD_PROTO_MAXSIZE];
    char sendbuf[RSD_PROTO_MAXSIZE];
 
+   if (rd->conn_type & RSD_CONN_BINARY)
+   {
+      rsnd_ctl_msg_t msg = {
+         .type = RSD_CTL_INFO,
+         .client_ptr = rd->total_written,
+         .timestamp = rsnd_get_time_ns()
+      };
+      return rsnd_send_ctl_msg(rd, &msg, NULL, 0, 0);
+   }
+
 #ifdef _WIN32
    snprintf(tmpbuf, RSD_PROTO_MAXSIZE - 1, " INFO %I64d", (__int64)rd->total_written);
 #else
@@ -1092,7 +2007,7 @@ static int rsnd_send_info_query(rsound_t *rd)
    snprintf(sendbuf, RSD_PROTO_MAXSIZE - 1, "RSD%5d%s", (int)strlen(tmpbuf), tmpbuf);
    sendbuf[RSD_PROTO_MAXSIZE - 1] = '\0';
 
-   if (rsnd_send_chunk(rd->conn.ctl_socket, sendbuf, strlen(sendbuf), 0) != (ssize_t)strlen(sendbuf))
+   if (rsnd_send_ctl(rd, sendbuf, strlen(sendbuf), 0) != (ssize_t)strlen(sendbuf))
       return -1;
 
    return 0;
@@ -1106,36 +2021,62 @@ static int rsnd_update_server_info(rsound_t *rd)
 
    long long int client_ptr = -1;
    long long int serv_ptr = -1;
-   char temp[RSD_PROTO_MAXSIZE + 1] = {0};
+   int pushed = 0;
+   char temp[RSD_CTL_MSG_MAXSIZE + 1] = {0};
 
    // We read until we have the last (most recent) data in the network buffer.
    for (;;)
    {
       const char *substr;
       char *tmpstr;
-      memset(temp, 0, sizeof(temp));
 
-      // We first recieve the small header. We just use the larger buffer as it is disposable.
-      rc = rsnd_recv_chunk(rd->conn.ctl_socket, temp, RSD_PROTO_CHUNKSIZE, 0);
+      rc = rsnd_recv_ctl(rd, temp, sizeof(temp));
       if (rc == 0)
          break;
-      else if (rc < RSD_PROTO_CHUNKSIZE)
+      else if (rc < 0)
          return -1;
 
-      temp[RSD_PROTO_CHUNKSIZE] = '\0';
+      if (rd->conn_type & RSD_CONN_BINARY)
+      {
+         rsnd_ctl_msg_t msg;
+         rsnd_unpack_ctl_msg(temp, &msg);
 
-      if ( (substr = strstr(temp, "RSD")) == NULL )
-         return -1;
+         // Pushed by the server on its own, so what we have written so far is our side of it.
+         if (msg.type == RSD_CTL_REPORT && rc >= RSD_CTL_MSG_SIZE + 8)
+         {
+            if (msg.flags > 0)
+               rd->conn_type |= RSD_CONN_REPORTS;
+            else
+               rd->conn_type &= ~RSD_CONN_REPORTS;
 
-      // Jump over "RSD" in header
-      substr += 3;
+            if (msg.serv_ptr <= 0)
+               continue;
 
-      // The length of the argument message is stored in the small 8 byte header.
-      long int len = strtol(substr, NULL, 0);
+            if (msg.timestamp > 0)
+               rsnd_clock_add(rd, msg.serv_ptr, msg.timestamp);
 
-      // Recieve the rest of the data.
-      if (rsnd_recv_chunk(rd->conn.ctl_socket, temp, len, 0) < len)
-         return -1;
+            rsnd_publish_begin(rd);
+            RSND_STORE(&rd->backend_info.latency, (uint32_t)rsnd_read_be((const uint8_t*)temp + RSD_CTL_MSG_SIZE, 8));
+            rsnd_publish_end(rd);
+            client_ptr = rd->total_written;
+            serv_ptr = msg.serv_ptr;
+            pushed = 1;
+            continue;
+         }
+
+         if (msg.type != RSD_CTL_INFO)
+            continue;
+         pushed = 0;
+         if (msg.client_ptr <= 0 || msg.serv_ptr <= 0)
+            return -1;
+
+         if (msg.timestamp > 0)
+            rsnd_clock_add(rd, msg.serv_ptr, msg.timestamp);
+
+         client_ptr = msg.client_ptr;
+         serv_ptr = msg.serv_ptr;
+         continue;
+      }
 
       // We only bother if this is an INFO message.
       substr = strstr(temp, "INFO");
@@ -1159,14 +2100,12 @@ static int rsnd_update_server_info(rsound_t *rd)
    {
       int delay = rsd_delay(rd);
       int delta = (int)(client_ptr - serv_ptr);
-      pthread_mutex_lock(&rd->thread.mutex);
       delta += rsnd_fifo_read_avail(rd->fifo_buffer);
-      pthread_mutex_unlock(&rd->thread.mutex);
 
       RSD_DEBUG("Delay: %d, Delta: %d", delay, delta);
 
-      // We only update the pointer if the data we got is quite recent.
-      if (rd->total_written - client_ptr < 4 * rd->backend_info.chunk_size && rd->total_written > client_ptr)
+      // We only update the pointer if the data we got is quite recent. Pushed reports always are.
+      if (pushed || (rd->total_written - client_ptr < 4 * rd->backend_info.chunk_size && rd->total_written > client_ptr))
       {
          int offset_delta = delta - delay;
          int max_offset = rd->backend_info.chunk_size;
@@ -1175,9 +2114,9 @@ static int rsnd_update_server_info(rsound_t *rd)
          else if (offset_delta > max_offset)
             offset_delta = max_offset;
 
-         pthread_mutex_lock(&rd->thread.mutex);
-         rd->delay_offset += offset_delta;
-         pthread_mutex_unlock(&rd->thread.mutex);
+         rsnd_publish_begin(rd);
+         RSND_STORE(&rd->delay_offset, rd->delay_offset + offset_delta);
+         rsnd_publish_end(rd);
          RSD_DEBUG("Changed offset-delta: %d", offset_delta);
       }
    }
@@ -1185,9 +2124,58 @@ static int rsnd_update_server_info(rsound_t *rd)
    return 0;
 }
 
+/* Points iov at the first size bytes in the fifo. Returns how many pieces that took. */
+static int rsnd_fifo_iov(rsound_fifo_buffer_t *fifo, struct iovec *iov, size_t size)
+{
+   size_t span;
+   iov[0].iov_base = (void*)rsnd_fifo_read_ptr(fifo, &span);
+   iov[0].iov_len = span < size ? span : size;
+   if (iov[0].iov_len == size)
+      return 1;
+
+   iov[1].iov_base = (void*)rsnd_fifo_peek(fifo, iov[0].iov_len, &span);
+   iov[1].iov_len = size - iov[0].iov_len;
+   return 2;
+}
+
+/* Counts what has been sent. If this was the first write, it sets the start point for the timer as well. */
+static void rsnd_add_written(rsound_t *rd, size_t size)
+{
+   rsnd_publish_begin(rd);
+   if (!rd->has_written)
+   {
+      RSND_STORE(&rd->start_ns, rsnd_get_time_ns());
+      RSND_STORE(&rd->has_written, 1);
+   }
+   RSND_STORE(&rd->total_written, rd->total_written + (int64_t)size);
+   rsnd_publish_end(rd);
+}
+
+/* Sends a chunk straight out of the fifo. The chunk is in two pieces if it wraps around, which it never
+ * does when the fifo is mirrored. The writer can't touch it before we've committed the read. 
+ * Returns -1 if the chunk couldn't be sent. */
+static int rsnd_send_fifo_chunk(rsound_t *rd)
+{
+   struct iovec iov[2];
+   int iovcnt = rsnd_fifo_iov(rd->fifo_buffer, iov, rd->backend_info.chunk_size);
+
+   if (rd->event_callback)
+      rd->event_callback(rd->event_data);
+   ssize_t rc = rsnd_send_audio(rd, iov, iovcnt);
+   if (rc != (ssize_t)rd->backend_info.chunk_size)
+      return -1;
+
+   rsnd_fifo_read_commit(rd->fifo_buffer, rc);
+   rsnd_add_written(rd, rc);
+
+   /* Buffer has decreased, wake up the writer if it has been waiting for room */
+   rsnd_wake_writer(rd);
+   return 0;
+}
+
 // Sort of simulates the behavior of pthread_cancel()
 #define _TEST_CANCEL() \
-   if (!rd->thread_active) \
+   if (!RSND_LOAD(&rd->thread_active)) \
       break
 
 /* The blocking thread */
@@ -1195,8 +2183,6 @@ static void* rsnd_thread ( void * thread_data )
 {
    /* We share data between thread and callable functions */
    rsound_t *rd = thread_data;
-   int rc;
-   char buffer[rd->backend_info.chunk_size];
 
    /* Plays back data as long as there is data in the buffer. Else, sleep until it can. */
    /* Two (;;) for loops! :3 Beware! */
@@ -1208,90 +2194,52 @@ static void* rsnd_thread ( void * thread_data )
 
          // We ask the server to send its latest backend data. Do not really care about errors atm.
          // We only bother to check after 1 sec of audio has been played, as it might be quite inaccurate in the start of the stream.
-         if (rd->use_latency && (rd->conn_type & RSD_CONN_PROTO) && (rd->total_written > rd->channels * rd->rate * rd->samplesize))
+         if (RSND_LOAD(&rd->use_latency) && (rd->conn_type & RSD_CONN_PROTO) && (rd->total_written > rd->channels * rd->rate * rd->samplesize))
          {
-            rsnd_send_info_query(rd); 
+            if (!(rd->conn_type & RSD_CONN_REPORTS))
+               rsnd_send_info_query(rd); 
             rsnd_update_server_info(rd);
          }
 
          /* If the buffer is empty or we've stopped the stream, jump out of this for loop */
-         pthread_mutex_lock(&rd->thread.mutex);
-         if (rsnd_fifo_read_avail(rd->fifo_buffer) < rd->backend_info.chunk_size || !rd->thread_active)
-         {
-            pthread_mutex_unlock(&rd->thread.mutex);
+         if (rsnd_fifo_read_avail(rd->fifo_buffer) < rd->backend_info.chunk_size || !RSND_LOAD(&rd->thread_active))
             break;
-         }
-         pthread_mutex_unlock(&rd->thread.mutex);
 
          _TEST_CANCEL();
-         pthread_mutex_lock(&rd->thread.mutex);
-         rsnd_fifo_read(rd->fifo_buffer, buffer, sizeof(buffer));
-         pthread_mutex_unlock(&rd->thread.mutex);
-         if (rd->event_callback)
-            rd->event_callback(rd->event_data);
-         rc = rsnd_send_chunk(rd->conn.socket, buffer, sizeof(buffer), 1);
 
          /* If this happens, we should make sure that subsequent and current calls to rsd_write() will fail. */
-         if (rc != (int)rd->backend_info.chunk_size)
+         if (rsnd_send_fifo_chunk(rd) < 0)
          {
             _TEST_CANCEL();
+            /* Also wakes up a potentially sleeping writer */
             rsnd_reset(rd);
 
-            /* Wakes up a potentially sleeping fill_buffer() */
-            pthread_cond_signal(&rd->thread.cond);
-
             /* This thread will not be joined, so detach. */
             pthread_detach(pthread_self());
             pthread_exit(NULL);
          }
-
-         /* If this was the first write, set the start point for the timer. */
-         if (!rd->has_written)
-         {
-            pthread_mutex_lock(&rd->thread.mutex);
-#if defined(_POSIX_MONOTONIC_CLOCK) && !defined(__APPLE__)
-            clock_gettime(CLOCK_MONOTONIC, &rd->start_tv_nsec);
-#else
-            gettimeofday(&rd->start_tv_usec, NULL);
-#endif
-            rd->has_written = 1;
-            pthread_mutex_unlock(&rd->thread.mutex);
-         }
-
-         /* Increase the total_written counter. Used in rsnd_drain() */
-         pthread_mutex_lock(&rd->thread.mutex);
-         rd->total_written += rc;
-         pthread_mutex_unlock(&rd->thread.mutex);
-
-         /* Buffer has decreased, signal fill_buffer() */
-         pthread_cond_signal(&rd->thread.cond);
-
       }
 
-      /* If we're still good to go, sleep. We are waiting for fill_buffer() to fill up some data. */
+      /* If we're still good to go, sleep until a whole chunk has been written. */
 
-      if (rd->thread_active)
+      if (RSND_LOAD(&rd->thread_active))
       {
-         // There is a very slim change of getting a deadlock using the cond_wait scheme.
-         // This solution is rather dirty, but avoids complete deadlocks at the very least.
-
          pthread_mutex_lock(&rd->thread.cond_mutex);
-         pthread_cond_signal(&rd->thread.cond);
+         RSND_STORE(&rd->thread.sender_waiting, 1);
+         RSND_BARRIER();
 
-         if (rd->thread_active)
-         {
-            RSD_DEBUG("Thread going to sleep.");
+         RSD_DEBUG("Thread going to sleep.");
+         while (RSND_LOAD(&rd->thread_active) && rsnd_fifo_read_avail(rd->fifo_buffer) < rd->backend_info.chunk_size)
             pthread_cond_wait(&rd->thread.cond, &rd->thread.cond_mutex);
-            RSD_DEBUG("Thread woke up.");
-         }
+         RSD_DEBUG("Thread woke up.");
 
+         RSND_STORE(&rd->thread.sender_waiting, 0);
          pthread_mutex_unlock(&rd->thread.cond_mutex);
-         RSD_DEBUG("Thread unlocked cond_mutex.");
       }
       /* Abort request, chap. */
       else
       {
-         pthread_cond_signal(&rd->thread.cond);
+         rsnd_wake_all(rd);
          pthread_exit(NULL);
       }
 
@@ -1308,7 +2256,7 @@ static void* rsnd_cb_thread(void *thread_data)
 
    uint8_t buffer[rd->backend_info.chunk_size];
 
-   while (rd->thread_active)
+   while (RSND_LOAD(&rd->thread_active))
    {
       size_t has_read = 0;
 
@@ -1348,7 +2296,11 @@ static void* rsnd_cb_thread(void *thread_data)
          }
       }
 
-      ssize_t ret = rsnd_send_chunk(rd->conn.socket, buffer, rd->backend_info.chunk_size, 1);
+      struct iovec iov = {
+         .iov_base = buffer,
+         .iov_len = rd->backend_info.chunk_size
+      };
+      ssize_t ret = rsnd_send_audio(rd, &iov, 1);
       if (ret != (ssize_t)rd->backend_info.chunk_size)
       {
          rsnd_reset(rd);
@@ -1357,22 +2309,12 @@ static void* rsnd_cb_thread(void *thread_data)
          pthread_exit(NULL);
       }
 
-      /* If this was the first write, set the start point for the timer. */
-      if (!rd->has_written)
-      {
-#if defined(_POSIX_MONOTONIC_CLOCK) && !defined(__APPLE__)
-         clock_gettime(CLOCK_MONOTONIC, &rd->start_tv_nsec);
-#else
-         gettimeofday(&rd->start_tv_usec, NULL);
-#endif
-         rd->has_written = 1;
-      }
-
-      rd->total_written += rd->backend_info.chunk_size;
+      rsnd_add_written(rd, rd->backend_info.chunk_size);
 
       if ((rd->conn_type & RSD_CONN_PROTO) && (rd->total_written > rd->channels * rd->rate * rd->samplesize))
       {
-         rsnd_send_info_query(rd); 
+         if (!(rd->conn_type & RSD_CONN_REPORTS))
+            rsnd_send_info_query(rd); 
          rsnd_update_server_info(rd);
       }
 
@@ -1382,27 +2324,37 @@ static void* rsnd_cb_thread(void *thread_data)
    pthread_exit(NULL);
 }
 
+/* Forgets about the stream, but not the connection. Goes between rsnd_publish_begin() and rsnd_publish_end(). */
+static void rsnd_clear_stream(rsound_t *rd)
+{
+   RSND_STORE(&rd->total_written, 0);
+   rd->ready_for_data = 0;
+   RSND_STORE(&rd->has_written, 0);
+   RSND_STORE(&rd->bytes_in_buffer, 0);
+   RSND_STORE(&rd->thread_active, 0);
+   RSND_STORE(&rd->delay_offset, 0);
+   RSND_STORE(&rd->use_latency, 0);
+   rd->clock.count = 0;
+   rd->clock.index = 0;
+   RSND_STORE(&rd->clock.valid, 0);
+}
+
 static int rsnd_reset(rsound_t *rd)
 {
    if (rd->conn.socket != -1)
       close(rd->conn.socket);
 
-   if (rd->conn.ctl_socket != 1)
+   if (rd->conn.ctl_socket != -1)
       close(rd->conn.ctl_socket);
 
    /* Pristine stuff, baby! */
-   pthread_mutex_lock(&rd->thread.mutex);
+   rsnd_publish_begin(rd);
    rd->conn.socket = -1;
    rd->conn.ctl_socket = -1;
-   rd->total_written = 0;
-   rd->ready_for_data = 0;
-   rd->has_written = 0;
-   rd->bytes_in_buffer = 0;
-   rd->thread_active = 0;
-   rd->delay_offset = 0;
-   rd->use_latency = 0;
-   pthread_mutex_unlock(&rd->thread.mutex);
-   pthread_cond_signal(&rd->thread.cond);
+   rd->conn_type &= ~(RSD_CONN_FRAMED | RSD_CONN_BINARY | RSD_CONN_REPORTS | RSD_CONN_RESET | RSD_CONN_PARKED);
+   rsnd_clear_stream(rd);
+   rsnd_publish_end(rd);
+   rsnd_wake_all(rd);
 
    return 0;
 }
@@ -1413,11 +2365,33 @@ RSD_API_DECL int RSD_API_CALLTYPE rsd_stop(rsound_t *rd)
    assert(rd != NULL);
    rsnd_stop_thread(rd);
 
+   /* The server can take a new stream on this connection, so we only end the stream, and keep the connection for rsd_start(). */
+   rsnd_ctl_msg_t reset = {
+      .type = RSD_CTL_RESET
+   };
+   if ((rd->conn_type & RSD_CONN_RESET) && rd->ready_for_data && rsnd_send_ctl_msg(rd, &reset, NULL, 0, 1) == 0)
+   {
+      rsnd_publish_begin(rd);
+      rsnd_clear_stream(rd);
+      rsnd_publish_end(rd);
+      rsnd_wake_all(rd);
+      rd->conn_type |= RSD_CONN_PARKED;
+      return 0;
+   }
+
    const char buf[] = "RSD    5 STOP";
 
    // Do not really care about errors here. 
    // The socket will be closed down in any case in rsnd_reset().
-   rsnd_send_chunk(rd->conn.ctl_socket, buf, strlen(buf), 0);
+   if (rd->conn_type & RSD_CONN_BINARY)
+   {
+      rsnd_ctl_msg_t msg = {
+         .type = RSD_CTL_STOP
+      };
+      rsnd_send_ctl_msg(rd, &msg, NULL, 0, 0);
+   }
+   else
+      rsnd_send_ctl(rd, buf, strlen(buf), 0);
 
    rsnd_reset(rd);
    return 0;
@@ -1454,6 +2428,162 @@ RSD_API_DECL size_t RSD_API_CALLTYPE rsd_write( rsound_t *rsound, const void* bu
    return written;
 }
 
+RSD_API_DECL int RSD_API_CALLTYPE rsd_begin_write(rsound_t *rsound, void **ptr, size_t *frames)
+{
+   assert(rsound != NULL);
+   assert(ptr != NULL);
+   assert(frames != NULL);
+   if (!rsound->ready_for_data)
+      return -1;
+
+   size_t framesize = rsound->channels * rsound->samplesize;
+   size_t max_write = (rsound->buffer_size - rsound->backend_info.chunk_size)/2;
+   max_write -= max_write % framesize;
+   if (max_write < framesize)
+      max_write = framesize;
+
+   size_t want = *frames * framesize;
+   if (want == 0 || want > max_write)
+      want = max_write;
+
+   if (rsnd_wait_buffer(rsound, want) < 0)
+   {
+      rsd_stop(rsound);
+      return -1;
+   }
+
+   size_t span;
+   void *buf = rsnd_fifo_write_ptr(rsound->fifo_buffer, &span);
+   span -= span % framesize;
+
+   /* A fifo that isn't mirrored might wrap before a whole frame fits. The caller gets a
+      staging buffer instead, which is copied into the fifo on commit. */
+   rsound->write_staged = 0;
+   if (span == 0)
+   {
+      // The buffer size might have grown since last time.
+      if (rsound->write_stage == NULL || rsound->write_stage_size < max_write)
+      {
+         char *stage = realloc(rsound->write_stage, max_write);
+         if (stage == NULL)
+            return -1;
+         rsound->write_stage = stage;
+         rsound->write_stage_size = max_write;
+      }
+      buf = rsound->write_stage;
+      span = want;
+      rsound->write_staged = 1;
+   }
+
+   if (span > want)
+      span = want;
+
+   rsound->write_granted = span;
+   *ptr = buf;
+   *frames = span / framesize;
+   return 0;
+}
+
+RSD_API_DECL int RSD_API_CALLTYPE rsd_commit_write(rsound_t *rsound, size_t frames)
+{
+   assert(rsound != NULL);
+   if (!rsound->ready_for_data)
+      return -1;
+
+   // Never more than rsd_begin_write() handed out, or we would run past the free space.
+   size_t size = frames * rsound->channels * rsound->samplesize;
+   if (size > rsound->write_granted)
+      return -1;
+
+   if (rsound->write_staged)
+      rsnd_fifo_write(rsound->fifo_buffer, rsound->write_stage, size);
+   else
+      rsnd_fifo_write_commit(rsound->fifo_buffer, size);
+   rsound->write_staged = 0;
+   rsound->write_granted = 0;
+
+   rsnd_wake_sender(rsound);
+   return 0;
+}
+
+RSD_API_DECL int RSD_API_CALLTYPE rsd_get_pollfds(rsound_t *rd, struct pollfd *fds, int max)
+{
+   assert(rd != NULL);
+   assert(fds != NULL);
+   if (!rd->ready_for_data || !rd->threadless)
+      return -1;
+
+   int numfd = 0;
+   if (numfd < max)
+   {
+      fds[numfd].fd = rd->conn.socket;
+      fds[numfd].events = 0;
+      fds[numfd].revents = 0;
+
+      // We only send whole chunks.
+      if (rsnd_fifo_read_avail(rd->fifo_buffer) >= rd->backend_info.chunk_size)
+         fds[numfd].events |= POLLOUT;
+      // Replies come back in frames on the data socket.
+      if ((rd->conn_type & RSD_CONN_PROTO) && (rd->conn_type & RSD_CONN_FRAMED))
+         fds[numfd].events |= POLLIN;
+      numfd++;
+   }
+
+   if (numfd < max && (rd->conn_type & RSD_CONN_PROTO) && !(rd->conn_type & RSD_CONN_FRAMED) && rd->conn.ctl_socket >= 0)
+   {
+      fds[numfd].fd = rd->conn.ctl_socket;
+      fds[numfd].events = POLLIN;
+      fds[numfd].revents = 0;
+      numfd++;
+   }
+
+   return numfd;
+}
+
+RSD_API_DECL int RSD_API_CALLTYPE rsd_process(rsound_t *rd)
+{
+   assert(rd != NULL);
+   if (!rd->ready_for_data || !rd->threadless || !RSND_LOAD(&rd->thread_active))
+      return -1;
+
+   // The server might have gone away while there was nothing to send.
+   if (rsnd_hung_up(rd->conn.socket))
+   {
+      RSD_WARN("*** Remote side hung up! ***");
+      goto error;
+   }
+
+   struct pollfd fd = {
+      .fd = rd->conn.socket,
+      .events = POLLOUT
+   };
+
+   while (rsnd_fifo_read_avail(rd->fifo_buffer) >= rd->backend_info.chunk_size)
+   {
+      if (rsnd_poll(&fd, 1, 0) < 0)
+         goto error;
+      if (!(fd.revents & POLLOUT))
+         break;
+
+      if (rsnd_send_fifo_chunk(rd) < 0)
+         goto error;
+   }
+
+   // Same as the thread does, so errors here are not fatal.
+   if (rd->conn_type & RSD_CONN_PROTO)
+   {
+      if (RSND_LOAD(&rd->use_latency) && !(rd->conn_type & RSD_CONN_REPORTS) && (rd->total_written > rd->channels * rd->rate * rd->samplesize))
+         rsnd_send_info_query(rd);
+      rsnd_update_server_info(rd);
+   }
+
+   return 0;
+
+error:
+   rsnd_reset(rd);
+   return -1;
+}
+
 RSD_API_DECL int RSD_API_CALLTYPE rsd_start(rsound_t *rsound)
 {
    assert(rsound != NULL);
@@ -1476,7 +2606,7 @@ RSD_API_DECL int RSD_API_CALLTYPE rsd_exec(rsound_t *rsound)
    RSD_DEBUG("rsd_exec()");
 
    // Makes sure we have a working connection
-   if (rsound->conn.socket < 0)
+   if (!rsound->ready_for_data)
    {
       RSD_DEBUG("Calling rsd_start()");
       if (rsd_start(rsound) < 0)
@@ -1486,15 +2616,19 @@ RSD_API_DECL int RSD_API_CALLTYPE rsd_exec(rsound_t *rsound)
       }
    }
 
+   // The thread has to be out of the way first, as it might be sending on the socket the ctl messages go on.
+   rsnd_stop_thread(rsound);
+
    RSD_DEBUG("Closing ctl");
    if (rsnd_close_ctl(rsound) < 0)
+   {
+      rsnd_start_thread(rsound);
       return -1;
+   }
 
    int fd = rsound->conn.socket;
    RSD_DEBUG("Socket: %d", fd);
 
-   rsnd_stop_thread(rsound);
-
    // Unsets NONBLOCK
 #ifdef _WIN32
    u_long iMode = 0;
@@ -1519,16 +2653,18 @@ RSD_API_DECL int RSD_API_CALLTYPE rsd_exec(rsound_t *rsound)
 
    // Flush the buffer
 
-   if (rsnd_fifo_read_avail(rsound->fifo_buffer) > 0)
+   size_t size = rsnd_fifo_read_avail(rsound->fifo_buffer);
+   if (size > 0)
    {
-      char buffer[rsnd_fifo_read_avail(rsound->fifo_buffer)];
-      rsnd_fifo_read(rsound->fifo_buffer, buffer, sizeof(buffer));
-      if (rsnd_send_chunk(fd, buffer, sizeof(buffer), 1) != (ssize_t)sizeof(buffer))
+      struct iovec iov[2];
+      int iovcnt = rsnd_fifo_iov(rsound->fifo_buffer, iov, size);
+      if (rsnd_send_iov(fd, iov, iovcnt, 1) != (ssize_t)size)
       {
          RSD_DEBUG("Failed flushing buffer!");
          close(fd);
          return -1;
       }
+      rsnd_fifo_read_commit(rsound->fifo_buffer, size);
    }
 
    RSD_DEBUG("Returning from rsd_exec()");
@@ -1565,11 +2701,19 @@ RSD_API_DECL int RSD_API_CALLTYPE rsd_set_param(rsound_t *rd, enum rsd_settings
          if (rd->host != NULL)
             free(rd->host);
          rd->host = strdup(param);
+         // A different server might well do framing.
+         rd->conn_type &= ~RSD_CONN_NO_FRAMING;
+         // The next stream goes to the new server.
+         if (rd->conn_type & RSD_CONN_PARKED)
+            rsd_stop(rd);
          break;
       case RSD_PORT:
          if (rd->port != NULL)
             free(rd->port);
          rd->port = strdup(param);
+         rd->conn_type &= ~RSD_CONN_NO_FRAMING;
+         if (rd->conn_type & RSD_CONN_PARKED)
+            rsd_stop(rd);
          break;
       case RSD_BUFSIZE:
          if (*(int*)param > 0)
@@ -1600,6 +2744,22 @@ RSD_API_DECL int RSD_API_CALLTYPE rsd_set_param(rsound_t *rd, enum rsd_settings
          rd->identity[sizeof(rd->identity)-1] = '\0';
          break;
 
+      case RSD_REPORT_INTERVAL:
+         if (*(int*)param < 0)
+            return -1;
+         rd->report_interval = *((int*)param);
+         break;
+
+      case RSD_PACKET_SIZE:
+         if (*(int*)param < 0)
+            return -1;
+         rd->packet_size = *((int*)param);
+         break;
+
+      case RSD_THREADLESS:
+         rd->threadless = *((int*)param) ? 1 : 0;
+         break;
+
       default:
          return -1;
    }
@@ -1691,6 +2851,7 @@ RSD_API_DECL int RSD_API_CALLTYPE rsd_init(rsound_t** rsound)
    pthread_mutex_init(&(*rsound)->thread.cond_mutex, NULL);
    pthread_mutex_init(&(*rsound)->cb_lock, NULL);
    pthread_cond_init(&(*rsound)->thread.cond, NULL);
+   pthread_cond_init(&(*rsound)->thread.space_cond, NULL);
 
    // Assumes default of S16_LE samples.
    int format = RSD_S16_LE;
@@ -1792,8 +2953,12 @@ RSD_API_DECL void RSD_API_CALLTYPE rsd_callback_unlock(rsound_t *rsound)
 RSD_API_DECL int RSD_API_CALLTYPE rsd_free(rsound_t *rsound)
 {
    assert(rsound != NULL);
+   // rsd_stop() might have kept the connection.
+   if (rsound->conn_type & RSD_CONN_PARKED)
+      rsd_stop(rsound);
    if (rsound->fifo_buffer)
       rsnd_fifo_free(rsound->fifo_buffer);
+   free(rsound->write_stage);
    if (rsound->host)
       free(rsound->host);
    if (rsound->port)
@@ -1825,6 +2990,12 @@ RSD_API_DECL int RSD_API_CALLTYPE rsd_free(rsound_t *rsound)
       return -1;
    }
 
+   if ((err = pthread_cond_destroy(&rsound->thread.space_cond)) != 0)
+   {
+      RSD_WARN("Error: %s\n", strerror(err));
+      return -1;
+   }
+
    free(rsound);
 
    return 0;
@@ -33,6 +33,8 @@ extern "C" {
 #include <sys/types.h>
 #endif
 
+struct pollfd;
+
 #ifdef _WIN32
 #define RSD_DEFAULT_HOST "127.0.0.1" // Stupid Windows.
 #else
@@ -145,7 +147,10 @@ typedef long ssize_t;
       RSD_BUFSIZE,
       RSD_LATENCY,
       RSD_FORMAT,
-      RSD_IDENTITY
+      RSD_IDENTITY,
+      RSD_REPORT_INTERVAL,
+      RSD_PACKET_SIZE,
+      RSD_THREADLESS
    };
 
    /* Audio callback for rsd_set_callback. Return -1 to trigger an error in the stream. */
@@ -166,6 +171,9 @@ typedef long ssize_t;
    typedef struct rsound_fifo_buffer rsound_fifo_buffer_t;
 #endif
 
+   /* How many position reports from the server the clock fit goes over. */
+#define RSD_CLOCK_SAMPLES 16
+
    /* Defines the main structure for use with the API. */
    typedef struct rsound
    {
@@ -188,9 +196,9 @@ typedef long ssize_t;
 
       int64_t total_written;
 #ifndef _WIN32
-      struct timespec start_tv_nsec;
+      struct timespec start_tv_nsec; /* Obsolete, but kept for backwards header compatibility. */
 #endif
-      struct timeval start_tv_usec;
+      struct timeval start_tv_usec; /* Obsolete, but kept for backwards header compatibility. */
       volatile int has_written;
       int bytes_in_buffer;
       int delay_offset;
@@ -214,7 +222,10 @@ typedef long ssize_t;
          pthread_t threadId;
          pthread_mutex_t mutex;
          pthread_mutex_t cond_mutex;
-         pthread_cond_t cond;
+         pthread_cond_t cond; /* Sender waits here for a chunk to send. */
+         pthread_cond_t space_cond; /* Writer waits here for room. */
+         volatile int sender_waiting;
+         volatile size_t writer_wants;
       } thread;
 
       char identity[256];
@@ -229,6 +240,38 @@ typedef long ssize_t;
       void *event_data;
 
       int use_latency;
+      int report_interval;
+      int packet_size;
+
+      char *write_stage;
+      size_t write_stage_size;
+      int write_staged;
+      size_t write_granted; /* Bytes handed out by rsd_begin_write(). */
+
+      int threadless;
+
+      /* Play position of the server against its own clock, as reported with REPORT and INFO. 
+         The samples are only touched by whoever reads from the server, the fit is published through seq. */
+      struct
+      {
+         int64_t played[RSD_CLOCK_SAMPLES];
+         int64_t server_ts[RSD_CLOCK_SAMPLES];
+         int64_t offset[RSD_CLOCK_SAMPLES]; /* Our clock minus the server's, when the sample came in. */
+         int count;
+         int index;
+
+         int valid;
+         int64_t base_ts;
+         double base_played;
+         double slope; /* Bytes per ns. */
+         int64_t min_offset;
+      } clock;
+
+      int64_t start_ns; /* When the first chunk went out. Replaces start_tv_nsec and start_tv_usec. */
+
+      /* Sequence count for what the sender publishes for rsd_delay(): total_written, has_written, start_ns, 
+         delay_offset, backend_info.latency and the clock fit. It is odd while they are being updated. */
+      unsigned int seq;
    } rsound_t;
 #else
    typedef struct rsound rsound_t;
@@ -290,6 +333,20 @@ typedef long ssize_t;
    Takes a (char *) parameter with the stream name.
    Will be truncated if longer than 256 bytes.
 
+   RSD_REPORT_INTERVAL: Asks the server to push latency information at this interval in milliseconds, 
+   instead of librsound asking for it all the time. Only newer servers support this, 
+   and the server might go with a different interval. 0 (the default) disables this.
+   Expects (int *) in param. Optional.
+
+   RSD_PACKET_SIZE: Limits how many bytes of audio go into a single send to the server, 
+   for links where large writes hurt. 0 (the default) sends every chunk in one go.
+   Expects (int *) in param. Optional.
+
+   RSD_THREADLESS: If non-zero, rsd_start() does not spawn a thread to send audio to the server. 
+   The application drives the stream from its own event loop instead, with rsd_get_pollfds() and rsd_process().
+   Cannot be used together with the callback interface. Must be set when stream is not active.
+   Expects (int *) in param. Optional.
+
    */
 
    RSD_API_DECL int RSD_API_CALLTYPE rsd_set_param (rsound_t *rd, enum rsd_settings option, void* param);
@@ -334,8 +391,10 @@ typedef long ssize_t;
       This call will block until all internal buffers have been sent to the network.  */
    RSD_API_DECL int RSD_API_CALLTYPE rsd_exec (rsound_t *rd);
 
-   /* Disconnects from server. All audio data still in network buffer and other buffers will be dropped. 
-      To continue playing, you will need to rsd_start() again. */
+   /* Stops the stream. All audio data still in network buffer and other buffers will be dropped. 
+      If the server can take a new stream on the same connection, the connection is kept open for the next
+      rsd_start() until rsd_free() is called. Otherwise, or if the server gave up on the idle connection
+      in the meantime, rsd_start() connects again. To continue playing, you will need to rsd_start() again. */
    RSD_API_DECL int RSD_API_CALLTYPE rsd_stop (rsound_t *rd);
 
    /* Writes from buf to the internal buffer. Might fail if no connection is established, 
@@ -344,6 +403,28 @@ typedef long ssize_t;
       or 0 should it fail (disconnection from server). You will have to restart the stream again should this occur. */
    RSD_API_DECL size_t RSD_API_CALLTYPE rsd_write (rsound_t *rd, const void* buf, size_t size);
 
+   /* Zero-copy alternative to rsd_write(). rsd_begin_write() waits until there is room, and hands out a pointer
+      into the internal buffer where audio can be rendered directly. On input, frames holds how many frames the
+      caller wants to write, or 0 for as many as fit. On output, it holds how many frames can be written to ptr, 
+      which might be fewer. rsd_commit_write() hands the first frames of them over to be sent, and fails if asked for more. 
+      Nothing else may be written to the stream between the two calls, and ptr is not valid after committing.
+      Both return 0 on success, and -1 should the stream have failed, in which case it will have to be 
+      restarted, as with rsd_write(). */
+   RSD_API_DECL int RSD_API_CALLTYPE rsd_begin_write (rsound_t *rd, void **ptr, size_t *frames);
+   RSD_API_DECL int RSD_API_CALLTYPE rsd_commit_write (rsound_t *rd, size_t frames);
+
+   /* For streams started with RSD_THREADLESS. rsd_get_pollfds() fills in at most max pollfd structures
+      with the sockets of the stream, and the events librsound is waiting for on them. 2 is always enough.
+      Returns the number of structures filled in, or -1 if the stream is not active. 
+      The sockets and events change as the stream goes on, so call it again before every poll().
+      rsd_process() sends buffered audio a chunk at a time for as long as the socket is writable, and reads
+      the replies to latency queries. It does not wait for the socket to become writable. Returns 0 on success, and -1 should the stream 
+      have failed, in which case it will have to be restarted.
+      rsd_write() and rsd_begin_write() only return once there is room, so in this mode they call rsd_process()
+      themselves until there is. Write no more than rsd_get_avail() to never block. */
+   RSD_API_DECL int RSD_API_CALLTYPE rsd_get_pollfds (rsound_t *rd, struct pollfd *fds, int max);
+   RSD_API_DECL int RSD_API_CALLTYPE rsd_process (rsound_t *rd);
+
    /* Gets the position of the buffer pointer. 
       Not really interesting for normal applications. 
       Might be useful for implementing rsound on top of other blocking APIs. 
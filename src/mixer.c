@@ -0,0 +1,696 @@
+/*  RSound - A PCM audio client/server
+ *  Copyright (C) 2010-2011 - Hans-Kristian Arntzen
+ *
+ *  RSound is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RSound is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RSound.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/************************************************************************
+ *   Server side mixer. All streams are converted to float, resampled   *
+ *   to the device rate and summed up by a single thread which is the   *
+ *   only one ever writing to the audio device.                         *
+ ************************************************************************/
+
+#include "mixer.h"
+#include "rsound.h"
+#include "endian.h"
+
+// Never let a stream send us chunks smaller than this.
+#define MIXER_MIN_CHUNK_FRAMES 64
+#define MIXER_RESAMPLE_MARGIN 16
+
+struct mixer_stream
+{
+   audio_converter_t conv;
+   unsigned channels;
+   int framesize;
+   int samplesize;
+   double ratio; // Device rate / stream rate.
+
+   // Queue of mixer-ready audio (device rate, device channels).
+   float *queue;
+   size_t queue_frames;
+   size_t queue_ptr;
+   size_t queue_avail;
+   int primed;
+
+   size_t chunk_frames;
+   uint8_t *convert_buf;
+   float *map_buf;
+
+   /* Input for the resampler, and where it writes its output. The first stage_fed frames
+    * were handed to the resampler, which may still be reading them. */
+   float *stage_buf;
+   size_t stage_fed;
+   size_t stage_frames;
+   size_t stage_max;
+   float *out_buf;
+   size_t out_max;
+
+#ifdef HAVE_SAMPLERATE
+   SRC_STATE *resampler;
+#else
+   resampler_t *resampler;
+   uint64_t fed_frames;
+   uint64_t out_frames;
+#endif
+
+   pthread_cond_t cond;
+   struct mixer_stream *next;
+};
+
+static struct
+{
+   const rsd_backend_callback_t *device;
+   void *device_data;
+   wav_header_t header;
+   size_t period_frames;
+   int device_latency;
+
+   pthread_t thread;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   mixer_stream_t *streams;
+   volatile int alive;
+} mixer;
+
+#define DEVICE_FRAMESIZE (MIXER_CHANNELS * sizeof(int16_t))
+
+void mixer_set_device(const rsd_backend_callback_t *device)
+{
+   mixer.device = device;
+}
+
+// These loops are kept trivial on purpose so the compiler is able to vectorize them.
+static void mixer_accumulate(float * restrict out, const float * restrict in, size_t samples)
+{
+   for (size_t i = 0; i < samples; i++)
+      out[i] += in[i];
+}
+
+static void mixer_float_to_s16(int16_t * restrict out, const float * restrict in, size_t samples)
+{
+   for (size_t i = 0; i < samples; i++)
+   {
+      float val = in[i] * 32767.0f;
+      val = val > 32767.0f ? 32767.0f : val;
+      val = val < -32768.0f ? -32768.0f : val;
+      out[i] = (int16_t)val;
+   }
+}
+
+/* Converts native endian integer samples to float, and maps the stream channels onto the device channels.
+ * Mono is copied to every channel, while streams with more channels than the device are folded down. */
+static void mixer_map_channels(mixer_stream_t *stream, float * restrict out, const void *in, size_t frames)
+{
+   union
+   {
+      const int16_t *i16;
+      const int32_t *i32;
+      const void *ptr;
+   } u;
+   u.ptr = in;
+
+   unsigned channels = stream->channels;
+   int is_32bit = stream->samplesize == 4;
+   const float scale = is_32bit ? 1.0f / 2147483648.0f : 1.0f / 32768.0f;
+
+#define SAMPLE(x) (is_32bit ? (float)u.i32[x] : (float)u.i16[x])
+   if (channels == MIXER_CHANNELS)
+   {
+      for (size_t i = 0; i < frames * MIXER_CHANNELS; i++)
+         out[i] = SAMPLE(i) * scale;
+   }
+   else if (channels == 1)
+   {
+      for (size_t i = 0; i < frames; i++)
+         for (unsigned c = 0; c < MIXER_CHANNELS; c++)
+            out[i * MIXER_CHANNELS + c] = SAMPLE(i) * scale;
+   }
+   else
+   {
+      for (size_t i = 0; i < frames; i++)
+      {
+         for (unsigned c = 0; c < MIXER_CHANNELS; c++)
+         {
+            float sum = 0.0f;
+            unsigned num = 0;
+            for (unsigned k = c; k < channels; k += MIXER_CHANNELS, num++)
+               sum += SAMPLE(i * channels + k);
+
+            out[i * MIXER_CHANNELS + c] = num ? (sum * scale) / num : 0.0f;
+         }
+      }
+   }
+#undef SAMPLE
+}
+
+/* Pushes mixer-ready frames to the stream queue. Blocks while the queue is full, which makes
+ * the device clock throttle the client. */
+static int mixer_stream_push(mixer_stream_t *stream, const float *frames, size_t num_frames)
+{
+   pthread_mutex_lock(&mixer.lock);
+   while (num_frames > 0)
+   {
+      while (mixer.alive && stream->queue_avail == stream->queue_frames)
+         pthread_cond_wait(&stream->cond, &mixer.lock);
+
+      if (!mixer.alive)
+      {
+         pthread_mutex_unlock(&mixer.lock);
+         return -1;
+      }
+
+      size_t write_ptr = (stream->queue_ptr + stream->queue_avail) % stream->queue_frames;
+      size_t copy_frames = stream->queue_frames - stream->queue_avail;
+      if (copy_frames > stream->queue_frames - write_ptr)
+         copy_frames = stream->queue_frames - write_ptr;
+      if (copy_frames > num_frames)
+         copy_frames = num_frames;
+
+      memcpy(stream->queue + write_ptr * MIXER_CHANNELS, frames, copy_frames * MIXER_CHANNELS * sizeof(float));
+      stream->queue_avail += copy_frames;
+      frames += copy_frames * MIXER_CHANNELS;
+      num_frames -= copy_frames;
+   }
+   pthread_mutex_unlock(&mixer.lock);
+   return 0;
+}
+
+#ifdef HAVE_SAMPLERATE
+static int mixer_stream_resample(mixer_stream_t *stream, size_t frames)
+{
+   SRC_DATA src_data = {
+      .data_in = stream->map_buf,
+      .input_frames = frames,
+      .data_out = stream->out_buf,
+      .output_frames = stream->out_max,
+      .src_ratio = stream->ratio,
+      .end_of_input = 0
+   };
+
+   while (src_data.input_frames > 0)
+   {
+      if (src_process(stream->resampler, &src_data) != 0)
+         return -1;
+
+      if (mixer_stream_push(stream, stream->out_buf, src_data.output_frames_gen) < 0)
+         return -1;
+
+      if (src_data.input_frames_used == 0 && src_data.output_frames_gen == 0)
+         break;
+
+      src_data.data_in += src_data.input_frames_used * MIXER_CHANNELS;
+      src_data.input_frames -= src_data.input_frames_used;
+   }
+
+   return 0;
+}
+#else
+/* The resampler pulls its input, so we hand it whatever has been staged so far.
+ * What we handed out last time is done with now. */
+static size_t mixer_resample_callback(void *cb_data, float **data)
+{
+   mixer_stream_t *stream = cb_data;
+   size_t frames = stream->stage_frames;
+
+   memmove(stream->stage_buf, stream->stage_buf + stream->stage_fed * MIXER_CHANNELS, frames * MIXER_CHANNELS * sizeof(float));
+   *data = stream->stage_buf;
+   stream->fed_frames += frames;
+   stream->stage_fed = frames;
+   stream->stage_frames = 0;
+   return frames;
+}
+
+static int mixer_stream_resample(mixer_stream_t *stream, size_t frames)
+{
+   if (stream->stage_fed + stream->stage_frames + frames > stream->stage_max)
+   {
+      log_printf("Mixer resampler stage overflowed. Dropping audio.\n");
+      stream->stage_frames = 0;
+      if (stream->stage_fed + frames > stream->stage_max)
+         return 0;
+   }
+
+   memcpy(stream->stage_buf + (stream->stage_fed + stream->stage_frames) * MIXER_CHANNELS, stream->map_buf, frames * MIXER_CHANNELS * sizeof(float));
+   stream->stage_frames += frames;
+
+   for (;;)
+   {
+      /* Only ask for as many frames as the resampler can produce with the input we have,
+       * so that the callback never runs dry. */
+      uint64_t in_frames = stream->fed_frames + stream->stage_frames;
+      uint64_t lookahead = resampler_lookahead(stream->resampler);
+      if (in_frames <= lookahead)
+         break;
+
+      int64_t out_frames = (int64_t)((in_frames - lookahead) * stream->ratio) - (int64_t)stream->out_frames - 1;
+      if (out_frames <= 0)
+         break;
+      if (out_frames > (int64_t)stream->out_max)
+         out_frames = stream->out_max;
+
+      if (resampler_cb_read(stream->resampler, out_frames, stream->out_buf) < 0)
+         return -1;
+      stream->out_frames += out_frames;
+
+      if (mixer_stream_push(stream, stream->out_buf, out_frames) < 0)
+         return -1;
+   }
+
+   return 0;
+}
+#endif
+
+mixer_stream_t* mixer_stream_new(const wav_header_t *w)
+{
+   if (w->numChannels == 0)
+      return NULL;
+
+   mixer_stream_t *stream = calloc(1, sizeof(*stream));
+   if (stream == NULL)
+      return NULL;
+
+   stream->channels = w->numChannels;
+   stream->framesize = w->numChannels * rsnd_format_to_bytes(w->rsd_format);
+   stream->ratio = (double)mixer.header.sampleRate / w->sampleRate;
+
+   int conversion;
+   if (rsnd_format_to_bytes(w->rsd_format) == 4)
+   {
+      conversion = converter_fmt_to_s32ne(w->rsd_format);
+      stream->samplesize = 4;
+   }
+   else
+   {
+      conversion = converter_fmt_to_s16ne(w->rsd_format);
+      stream->samplesize = 2;
+   }
+
+   if (audio_converter_init(&stream->conv, w->rsd_format, conversion) < 0)
+   {
+      log_printf("Mixer does not support %s.\n", rsnd_format_to_string(w->rsd_format));
+      goto error;
+   }
+
+   // Let clients send us about a device period worth of audio at a time.
+   stream->chunk_frames = mixer.period_frames / stream->ratio;
+   if (stream->chunk_frames < MIXER_MIN_CHUNK_FRAMES)
+      stream->chunk_frames = MIXER_MIN_CHUNK_FRAMES;
+
+   stream->queue_frames = mixer.period_frames * MIXER_QUEUE_PERIODS;
+   stream->queue = calloc(stream->queue_frames * MIXER_CHANNELS, sizeof(float));
+   // 8-bit formats are expanded to 16-bit in place.
+   stream->convert_buf = malloc(stream->chunk_frames * stream->channels * stream->samplesize * 2);
+   stream->map_buf = malloc(stream->chunk_frames * MIXER_CHANNELS * sizeof(float));
+   if (stream->queue == NULL || stream->convert_buf == NULL || stream->map_buf == NULL)
+      goto error;
+
+   if (w->sampleRate != mixer.header.sampleRate)
+   {
+      stream->stage_max = stream->chunk_frames * 2;
+      stream->out_max = stream->chunk_frames * stream->ratio + 16;
+      stream->stage_buf = malloc(stream->stage_max * MIXER_CHANNELS * sizeof(float));
+      stream->out_buf = malloc(stream->out_max * MIXER_CHANNELS * sizeof(float));
+      if (stream->stage_buf == NULL || stream->out_buf == NULL)
+         goto error;
+
+#ifdef HAVE_SAMPLERATE
+      int err;
+      stream->resampler = src_new(src_converter, MIXER_CHANNELS, &err);
+#else
+      stream->resampler = resampler_new(mixer_resample_callback, stream->ratio, MIXER_CHANNELS, resampler_quality, stream);
+#endif
+      if (stream->resampler == NULL)
+      {
+         log_printf("Could not initialize resampler.\n");
+         goto error;
+      }
+   }
+
+   pthread_cond_init(&stream->cond, NULL);
+
+   pthread_mutex_lock(&mixer.lock);
+   stream->next = mixer.streams;
+   mixer.streams = stream;
+   pthread_cond_signal(&mixer.cond);
+   pthread_mutex_unlock(&mixer.lock);
+
+   return stream;
+
+error:
+   free(stream->queue);
+   free(stream->convert_buf);
+   free(stream->map_buf);
+   free(stream->stage_buf);
+   free(stream->out_buf);
+   free(stream);
+   return NULL;
+}
+
+void mixer_stream_free(mixer_stream_t *stream)
+{
+   if (stream == NULL)
+      return;
+
+   pthread_mutex_lock(&mixer.lock);
+   for (mixer_stream_t **ptr = &mixer.streams; *ptr != NULL; ptr = &(*ptr)->next)
+   {
+      if (*ptr == stream)
+      {
+         *ptr = stream->next;
+         break;
+      }
+   }
+   pthread_mutex_unlock(&mixer.lock);
+
+   if (stream->resampler)
+   {
+#ifdef HAVE_SAMPLERATE
+      src_delete(stream->resampler);
+#else
+      resampler_free(stream->resampler);
+#endif
+   }
+
+   pthread_cond_destroy(&stream->cond);
+   free(stream->queue);
+   free(stream->convert_buf);
+   free(stream->map_buf);
+   free(stream->stage_buf);
+   free(stream->out_buf);
+   free(stream);
+}
+
+size_t mixer_stream_chunk_size(mixer_stream_t *stream)
+{
+   return stream->chunk_frames * stream->framesize;
+}
+
+size_t mixer_stream_write(mixer_stream_t *stream, const void *buf, size_t size)
+{
+   const uint8_t *in = buf;
+   size_t frames = size / stream->framesize;
+
+   while (frames > 0)
+   {
+      size_t process_frames = frames > stream->chunk_frames ? stream->chunk_frames : frames;
+      size_t process_bytes = process_frames * stream->framesize;
+
+      // Samples that are already signed and native can be mapped straight from the input.
+      const void *samples = in;
+      if (stream->conv.kernel != NULL)
+      {
+         audio_convert(&stream->conv, stream->convert_buf, in, process_bytes);
+         samples = stream->convert_buf;
+      }
+      mixer_map_channels(stream, stream->map_buf, samples, process_frames);
+
+      int rc;
+      if (stream->resampler)
+         rc = mixer_stream_resample(stream, process_frames);
+      else
+         rc = mixer_stream_push(stream, stream->map_buf, process_frames);
+
+      if (rc < 0)
+         return 0;
+
+      in += process_bytes;
+      frames -= process_frames;
+   }
+
+   return size;
+}
+
+// Latency as seen by the stream, in bytes of the stream format.
+int mixer_stream_latency(mixer_stream_t *stream)
+{
+   pthread_mutex_lock(&mixer.lock);
+   size_t frames = stream->queue_avail + mixer.device_latency / DEVICE_FRAMESIZE;
+   pthread_mutex_unlock(&mixer.lock);
+
+   return (int)(frames / stream->ratio) * stream->framesize;
+}
+
+/* How many bytes can be written to the stream right now without blocking, or -1 if the mixer is gone.
+ * Resampled streams hold back a few frames since the resampler might flush out some extra frames. */
+ssize_t mixer_stream_writable(mixer_stream_t *stream)
+{
+   pthread_mutex_lock(&mixer.lock);
+   int alive = mixer.alive;
+   size_t frames = stream->queue_frames - stream->queue_avail;
+   pthread_mutex_unlock(&mixer.lock);
+
+   if (!alive)
+      return -1;
+
+   if (stream->resampler)
+   {
+      frames = frames / stream->ratio;
+      frames = frames > MIXER_RESAMPLE_MARGIN ? frames - MIXER_RESAMPLE_MARGIN : 0;
+   }
+
+   return frames * stream->framesize;
+}
+
+/* The only thread which writes to the device. Since backend writes block, the device clock paces the mixing. */
+static void* mixer_thread(void *data)
+{
+   (void)data;
+   size_t samples = mixer.period_frames * MIXER_CHANNELS;
+   float *accum = malloc(samples * sizeof(float));
+   int16_t *out = malloc(samples * sizeof(int16_t));
+   if (accum == NULL || out == NULL)
+   {
+      log_printf("Could not allocate memory for mixer.\n");
+      goto end;
+   }
+
+   pthread_mutex_lock(&mixer.lock);
+   while (mixer.alive)
+   {
+      // Let the device idle when nobody is connected.
+      while (mixer.alive && mixer.streams == NULL)
+         pthread_cond_wait(&mixer.cond, &mixer.lock);
+
+      if (!mixer.alive)
+         break;
+
+      memset(accum, 0, samples * sizeof(float));
+
+      for (mixer_stream_t *stream = mixer.streams; stream != NULL; stream = stream->next)
+      {
+         // Wait for a period worth of audio before we start playing a stream. Avoids a stuttering start.
+         if (!stream->primed)
+         {
+            if (stream->queue_avail < mixer.period_frames)
+               continue;
+            stream->primed = 1;
+         }
+
+         size_t frames = stream->queue_avail > mixer.period_frames ? mixer.period_frames : stream->queue_avail;
+         size_t first = stream->queue_frames - stream->queue_ptr;
+         if (first > frames)
+            first = frames;
+
+         mixer_accumulate(accum, stream->queue + stream->queue_ptr * MIXER_CHANNELS, first * MIXER_CHANNELS);
+         mixer_accumulate(accum + first * MIXER_CHANNELS, stream->queue, (frames - first) * MIXER_CHANNELS);
+
+         stream->queue_ptr = (stream->queue_ptr + frames) % stream->queue_frames;
+         stream->queue_avail -= frames;
+
+         // Underrun, so we need to build up a buffer again.
+         if (frames < mixer.period_frames)
+            stream->primed = 0;
+
+         pthread_cond_signal(&stream->cond);
+      }
+      pthread_mutex_unlock(&mixer.lock);
+
+      mixer_float_to_s16(out, accum, samples);
+
+      size_t size = samples * sizeof(int16_t);
+      for (size_t written = 0; written < size; )
+      {
+         size_t rc = mixer.device->write(mixer.device_data, (const char*)out + written, size - written);
+         if (rc == 0)
+         {
+            log_printf("Mixer failed to write to device.\n");
+            pthread_mutex_lock(&mixer.lock);
+            goto end_locked;
+         }
+         written += rc;
+      }
+
+      int latency = mixer.device->latency ? mixer.device->latency(mixer.device_data) : 0;
+
+      pthread_mutex_lock(&mixer.lock);
+      mixer.device_latency = latency;
+   }
+
+end_locked:
+   // Make sure nobody waits forever for us.
+   mixer.alive = 0;
+   for (mixer_stream_t *stream = mixer.streams; stream != NULL; stream = stream->next)
+      pthread_cond_signal(&stream->cond);
+   pthread_mutex_unlock(&mixer.lock);
+
+end:
+   free(accum);
+   free(out);
+   pthread_exit(NULL);
+}
+
+static void mixer_initialize(void)
+{
+   if (mixer.device->initialize)
+      mixer.device->initialize();
+
+   mixer.header.numChannels = MIXER_CHANNELS;
+   mixer.header.sampleRate = resample_freq > 0 ? resample_freq : MIXER_DEFAULT_RATE;
+   mixer.header.bitsPerSample = 16;
+   mixer.header.rsd_format = is_little_endian() ? RSD_S16_LE : RSD_S16_BE;
+
+   if (mixer.device->init(&mixer.device_data) < 0)
+   {
+      log_printf("Failed to initialize %s ...\n", mixer.device->backend);
+      exit(1);
+   }
+
+   if (mixer.device->open(mixer.device_data, &mixer.header) < 0)
+   {
+      log_printf("Failed to open audio driver ...\n");
+      exit(1);
+   }
+
+   backend_info_t info;
+   memset(&info, 0, sizeof(info));
+   mixer.device->get_backend_info(mixer.device_data, &info);
+   if (info.chunk_size == 0 || info.resample)
+   {
+      log_printf("Mixer cannot drive %s ...\n", mixer.device->backend);
+      exit(1);
+   }
+
+   mixer.period_frames = info.chunk_size / DEVICE_FRAMESIZE;
+   if (mixer.period_frames < MIXER_MIN_CHUNK_FRAMES)
+      mixer.period_frames = MIXER_MIN_CHUNK_FRAMES;
+   mixer.device_latency = info.latency;
+
+   pthread_mutex_init(&mixer.lock, NULL);
+   pthread_cond_init(&mixer.cond, NULL);
+   mixer.alive = 1;
+
+   if (pthread_create(&mixer.thread, NULL, mixer_thread, NULL) != 0)
+   {
+      log_printf("Creating mixer thread failed ...\n");
+      exit(1);
+   }
+
+   if (debug)
+      log_printf("Mixing into %s: %d Hz, %d frames per period.\n",
+            mixer.device->backend, (int)mixer.header.sampleRate, (int)mixer.period_frames);
+}
+
+static void mixer_shutdown(void)
+{
+   pthread_mutex_lock(&mixer.lock);
+   mixer.alive = 0;
+   pthread_cond_signal(&mixer.cond);
+   pthread_mutex_unlock(&mixer.lock);
+
+   // The thread might be in the middle of writing to the device.
+   pthread_join(mixer.thread, NULL);
+
+#ifdef _WIN32
+#undef close
+#endif
+   mixer.device->close(mixer.device_data);
+#ifdef _WIN32
+#define close(x) closesocket(x)
+#endif
+
+   if (mixer.device->shutdown)
+      mixer.device->shutdown();
+}
+
+/* Pseudo-backend. Every connection gets a mixer stream rather than a device handle. */
+
+typedef struct
+{
+   mixer_stream_t *stream;
+} mixer_backend_t;
+
+static int mixer_backend_init(void **data)
+{
+   mixer_backend_t *mix = calloc(1, sizeof(*mix));
+   if (mix == NULL)
+      return -1;
+   *data = mix;
+   return 0;
+}
+
+static int mixer_backend_open(void *data, wav_header_t *w)
+{
+   mixer_backend_t *mix = data;
+   mix->stream = mixer_stream_new(w);
+   if (mix->stream == NULL)
+      return -1;
+   return 0;
+}
+
+static size_t mixer_backend_write(void *data, const void *buf, size_t size)
+{
+   mixer_backend_t *mix = data;
+   return mixer_stream_write(mix->stream, buf, size);
+}
+
+static int mixer_backend_latency(void *data)
+{
+   mixer_backend_t *mix = data;
+   return mixer_stream_latency(mix->stream);
+}
+
+static void mixer_backend_get_info(void *data, backend_info_t *backend_info)
+{
+   mixer_backend_t *mix = data;
+   backend_info->chunk_size = mixer_stream_chunk_size(mix->stream);
+   backend_info->latency = mixer_stream_latency(mix->stream);
+   backend_info->resample = 0;
+}
+
+static void mixer_backend_close(void *data)
+{
+   mixer_backend_t *mix = data;
+   if (mix == NULL)
+      return;
+
+   mixer_stream_free(mix->stream);
+   free(mix);
+}
+
+ssize_t mixer_writable(void *data)
+{
+   mixer_backend_t *mix = data;
+   return mixer_stream_writable(mix->stream);
+}
+
+const rsd_backend_callback_t rsd_mixer = {
+   .initialize = mixer_initialize,
+   .init = mixer_backend_init,
+   .open = mixer_backend_open,
+   .write = mixer_backend_write,
+   .latency = mixer_backend_latency,
+   .get_backend_info = mixer_backend_get_info,
+   .close = mixer_backend_close,
+   .shutdown = mixer_shutdown,
+   .backend = "Mixer"
+};
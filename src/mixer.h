@@ -0,0 +1,44 @@
+/*  RSound - A PCM audio client/server
+ *  Copyright (C) 2010-2011 - Hans-Kristian Arntzen
+ *
+ *  RSound is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RSound is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RSound.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __MIXER_H
+#define __MIXER_H
+
+#include "audio.h"
+
+#define MIXER_DEFAULT_RATE 44100
+#define MIXER_CHANNELS STEREO
+// How many device periods a stream may have queued up in the mixer.
+#define MIXER_QUEUE_PERIODS 4
+
+typedef struct mixer_stream mixer_stream_t;
+
+// The mixer owns the one and only device handle. It has to be told which backend to drive before it is initialized.
+void mixer_set_device(const rsd_backend_callback_t *device);
+
+// Streams are fed with data in their own format. Conversion and resampling to the device format happens in the mixer.
+mixer_stream_t* mixer_stream_new(const wav_header_t *w);
+size_t mixer_stream_write(mixer_stream_t *stream, const void *buf, size_t size);
+int mixer_stream_latency(mixer_stream_t *stream);
+size_t mixer_stream_chunk_size(mixer_stream_t *stream);
+ssize_t mixer_stream_writable(mixer_stream_t *stream);
+void mixer_stream_free(mixer_stream_t *stream);
+
+// Pseudo-backend that attaches every connection to the mixer rather than to a device of its own.
+extern const rsd_backend_callback_t rsd_mixer;
+// Same as mixer_stream_writable(), but takes the backend handle of rsd_mixer.
+ssize_t mixer_writable(void *data);
+
+#endif
@@ -0,0 +1,114 @@
+/*  RSound - A PCM audio client/server
+ *  Copyright (C) 2010-2011 - Hans-Kristian Arntzen
+ *
+ *  RSound is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RSound is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RSound.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A fixed set of worker threads, fed from a bounded queue of connections.
+ * Accepting a connection is only a queue push, and a connection storm can never
+ * make us spawn more threads than we were told to. */
+
+#include "pool.h"
+#include "rsound.h"
+
+static struct
+{
+   void (*handler)(connection_t);
+
+   connection_t *queue;
+   size_t queue_size;
+   size_t queue_ptr;
+   size_t queue_avail;
+
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+} pool;
+
+static void* pool_thread(void *data)
+{
+   (void)data;
+   connection_t conn;
+
+   for (;;)
+   {
+      pthread_mutex_lock(&pool.lock);
+      while (pool.queue_avail == 0)
+         pthread_cond_wait(&pool.cond, &pool.lock);
+
+      conn = pool.queue[pool.queue_ptr];
+      pool.queue_ptr = (pool.queue_ptr + 1) % pool.queue_size;
+      pool.queue_avail--;
+      pthread_mutex_unlock(&pool.lock);
+
+      pool.handler(conn);
+   }
+
+   pthread_exit(NULL);
+}
+
+int pool_init(int workers, size_t stack_size, void (*handler)(connection_t))
+{
+   pthread_attr_t attr;
+   pthread_t thread;
+
+   pool.handler = handler;
+   pool.queue_size = workers * POOL_QUEUE_PER_WORKER;
+   pool.queue = calloc(pool.queue_size, sizeof(*pool.queue));
+   if (pool.queue == NULL)
+      return -1;
+
+   pthread_mutex_init(&pool.lock, NULL);
+   pthread_cond_init(&pool.cond, NULL);
+
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   if (stack_size > 0 && pthread_attr_setstacksize(&attr, stack_size) != 0)
+   {
+      log_printf("Invalid stack size for worker threads.\n");
+      goto error;
+   }
+
+   for (int i = 0; i < workers; i++)
+   {
+      if (pthread_create(&thread, &attr, pool_thread, NULL) != 0)
+      {
+         log_printf("Creating worker thread failed ...\n");
+         goto error;
+      }
+   }
+
+   pthread_attr_destroy(&attr);
+
+   if (debug)
+      log_printf("Started %d worker thread(s).\n", workers);
+   return 0;
+
+error:
+   pthread_attr_destroy(&attr);
+   return -1;
+}
+
+int pool_push(connection_t conn)
+{
+   pthread_mutex_lock(&pool.lock);
+   if (pool.queue_avail == pool.queue_size)
+   {
+      pthread_mutex_unlock(&pool.lock);
+      return -1;
+   }
+
+   pool.queue[(pool.queue_ptr + pool.queue_avail) % pool.queue_size] = conn;
+   pool.queue_avail++;
+   pthread_cond_signal(&pool.cond);
+   pthread_mutex_unlock(&pool.lock);
+   return 0;
+}
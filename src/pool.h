@@ -0,0 +1,30 @@
+/*  RSound - A PCM audio client/server
+ *  Copyright (C) 2010-2011 - Hans-Kristian Arntzen
+ *
+ *  RSound is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RSound is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RSound.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __POOL_H
+#define __POOL_H
+
+#include "audio.h"
+
+// Number of connections that may wait for a worker for each worker in the pool.
+#define POOL_QUEUE_PER_WORKER 2
+
+// Spawns the workers up front. stack_size of 0 keeps the default stack size.
+int pool_init(int workers, size_t stack_size, void (*handler)(connection_t));
+
+// Queues up a connection for the next free worker. Fails if the queue is full.
+int pool_push(connection_t conn);
+
+#endif
@@ -16,7 +16,10 @@
 #include "proto.h"
 #include "endian.h"
 #include "audio.h"
+#include "rsound.h"
 #include <poll.h>
+#include <errno.h>
+#include <time.h>
 
 #ifdef _WIN32
 #ifndef _WIN32_WINNT
@@ -41,14 +44,76 @@ typedef struct rsd_proto
 } rsd_proto_t;
 
 static int get_proto(rsd_proto_t *proto, char *rsd_proto_header);
-static int send_proto(int ctl_sock, rsd_proto_t *proto);
+static int send_proto(connection_t *conn, rsd_proto_t *proto);
+static int send_ctl(connection_t *conn, const char *buf, size_t size, int blocking);
+static int send_ctl_msg(connection_t *conn, const rsd_ctl_msg_t *msg);
+static int handle_binary_message(connection_t *conn, void *data, const char *buf, size_t size);
+static int handle_binary_ctl_request(connection_t *conn, void *data);
+
+// Acts on the body of a single control message. Returns -1 if the stream should be shut down,
+// and 1 if no more control messages should be read.
+static int handle_ctl_message(connection_t *conn, void *data, char *rsd_proto_header)
+{
+   rsd_proto_t proto;
+
+   // Invalid messages are simply ignored.
+   if ( get_proto(&proto, rsd_proto_header) < 0 )
+      return 0;
+
+   switch ( proto.proto )
+   {
+      case RSD_PROTO_NULL:
+         break;
+      case RSD_PROTO_STOP:
+         return -1;
+
+      case RSD_PROTO_INFO:
+         proto.serv_ptr = conn->serv_ptr;
+         if ( backend->latency != NULL )
+         {
+            proto.serv_ptr -= (int)(backend->latency(data) / conn->rate_ratio);
+         }
+         if ( send_proto(conn, &proto) < 0 )
+            return -1;
+         break;
+
+      case RSD_PROTO_IDENTITY:
+         strncpy(conn->identity, proto.identity, sizeof(conn->identity));
+         break;
+
+      // Only used to pair up the sockets when accepting. Nothing to do here.
+      case RSD_PROTO_PAIR:
+         break;
+
+      case RSD_PROTO_CLOSECTL:
+         send_proto(conn, &proto);
+         // From now on, there is nothing but audio on the data socket.
+         if ( conn->framed )
+            conn->framed = 0;
+         else
+         {
+            if ( conn->ctl_socket != 0 )
+               close(conn->ctl_socket);
+            conn->ctl_socket = 0;
+            conn->ctl_queue_len = 0;
+         }
+         return 1; // No point in continuing here.
+
+      default:
+         return -1;
+   }
+
+   return 0;
+}
 
 // Here we handle all requests from the client that are available in the network buffer. We are using non-blocking socket.
 // If recv() returns less than we expect, we bail out as there is not more data to be read.
 int handle_ctl_request(connection_t *conn, void *data)
 {
+   if ( conn->binary_ctl )
+      return handle_binary_ctl_request(conn, data);
+
    char rsd_proto_header[RSD_PROTO_MAXSIZE + 1];
-   rsd_proto_t proto;
 
    struct pollfd fd = {
       .fd = conn->ctl_socket,
@@ -108,45 +173,328 @@ int handle_ctl_request(connection_t *conn, void *data)
       }
 
       // Let's parse this.
+      rc = handle_ctl_message(conn, data, rsd_proto_header);
+      if ( rc < 0 )
+         return -1;
+      else if ( rc > 0 )
+         return 0;
+   }
+}
 
-      if ( get_proto(&proto, rsd_proto_header) < 0 )
-         // We recieved invalid proto
-         continue;
+static int64_t get_time_ns(void)
+{
+#ifdef _WIN32
+   return (int64_t)GetTickCount() * 1000000;
+#else
+   struct timespec tv;
+   clock_gettime(CLOCK_MONOTONIC, &tv);
+   return (int64_t)tv.tv_sec * 1000000000 + tv.tv_nsec;
+#endif
+}
+
+static void write_be(uint8_t *buf, uint64_t val, int bytes)
+{
+   for ( int i = bytes - 1; i >= 0; i-- )
+   {
+      buf[i] = val & 0xff;
+      val >>= 8;
+   }
+}
+
+static uint64_t read_be(const uint8_t *buf, int bytes)
+{
+   uint64_t val = 0;
+   for ( int i = 0; i < bytes; i++ )
+      val = (val << 8) | buf[i];
+   return val;
+}
+
+static void pack_ctl_msg(char *buf, const rsd_ctl_msg_t *msg)
+{
+   uint8_t *out = (uint8_t*)buf;
+   write_be(out + 0, msg->type, 2);
+   write_be(out + 2, msg->size, 2);
+   write_be(out + 4, msg->flags, 4);
+   write_be(out + 8, (uint64_t)msg->client_ptr, 8);
+   write_be(out + 16, (uint64_t)msg->serv_ptr, 8);
+   write_be(out + 24, (uint64_t)msg->timestamp, 8);
+}
+
+static void unpack_ctl_msg(const char *buf, rsd_ctl_msg_t *msg)
+{
+   const uint8_t *in = (const uint8_t*)buf;
+   msg->type = read_be(in + 0, 2);
+   msg->size = read_be(in + 2, 2);
+   msg->flags = read_be(in + 4, 4);
+   msg->client_ptr = (int64_t)read_be(in + 8, 8);
+   msg->serv_ptr = (int64_t)read_be(in + 16, 8);
+   msg->timestamp = (int64_t)read_be(in + 24, 8);
+}
+
+// The timestamp is taken right after asking the backend, as clients line up the position with it.
+// Only the REPORTs we push at an interval are allowed to be dropped, as there will be another one.
+static int send_report_msg(connection_t *conn, void *data, int blocking)
+{
+   char buf[RSD_CTL_REPORT_SIZE];
+   int64_t latency = 0;
+   // There is no device between two streams of a connection.
+   if ( backend->latency != NULL && data != NULL )
+      latency = (int64_t)(backend->latency(data) / conn->rate_ratio);
+
+   rsd_ctl_msg_t msg = {
+      .type = RSD_PROTO_REPORT,
+      .size = RSD_CTL_REPORT_SIZE,
+      .flags = conn->report_interval,
+      .serv_ptr = conn->serv_ptr - latency,
+      .timestamp = get_time_ns()
+   };
+
+   pack_ctl_msg(buf, &msg);
+   write_be((uint8_t*)buf + RSD_CTL_MSG_SIZE, (uint64_t)latency, 8);
+   return send_ctl(conn, buf, sizeof(buf), blocking);
+}
+
+int send_report(connection_t *conn, void *data)
+{
+   if ( conn->report_interval == 0 )
+      return 0;
+
+   int64_t now = get_time_ns();
+   if ( now < conn->next_report )
+      return 0;
+
+   conn->next_report = now + (int64_t)conn->report_interval * 1000000;
+   return send_report_msg(conn, data, 0);
+}
+
+int send_reset_reply(connection_t *conn, const backend_info_t *info)
+{
+   char buf[RSD_CTL_RESET_REPLY_SIZE];
+   rsd_ctl_msg_t msg = {
+      .type = RSD_PROTO_RESET,
+      .size = RSD_CTL_RESET_REPLY_SIZE,
+      .timestamp = get_time_ns()
+   };
+
+   pack_ctl_msg(buf, &msg);
+   write_be((uint8_t*)buf + RSD_CTL_MSG_SIZE, info->latency, 4);
+   write_be((uint8_t*)buf + RSD_CTL_MSG_SIZE + 4, info->chunk_size, 4);
+   return send_ctl(conn, buf, sizeof(buf), 1);
+}
+
+// Same as handle_ctl_message(), but for one complete binary message.
+static int handle_binary_message(connection_t *conn, void *data, const char *buf, size_t size)
+{
+   rsd_ctl_msg_t msg;
+
+   if ( size < RSD_CTL_MSG_SIZE )
+      return -1;
+
+   unpack_ctl_msg(buf, &msg);
+   if ( msg.size != size )
+      return -1;
+
+   switch ( msg.type )
+   {
+      case RSD_PROTO_NULL:
+         break;
+      case RSD_PROTO_STOP:
+         return -1;
+
+      case RSD_PROTO_INFO:
+         msg.serv_ptr = conn->serv_ptr;
+         if ( backend->latency != NULL && data != NULL )
+            msg.serv_ptr -= (int)(backend->latency(data) / conn->rate_ratio);
+         msg.timestamp = get_time_ns();
+         msg.size = RSD_CTL_MSG_SIZE;
+         msg.flags = 0;
+         if ( send_ctl_msg(conn, &msg) < 0 )
+            return -1;
+         break;
 
-      switch ( proto.proto )
+      case RSD_PROTO_IDENTITY:
       {
-         case RSD_PROTO_NULL:
-            break;
-         case RSD_PROTO_STOP:
+         size_t len = size - RSD_CTL_MSG_SIZE;
+         if ( len >= sizeof(conn->identity) )
+            len = sizeof(conn->identity) - 1;
+         memcpy(conn->identity, buf + RSD_CTL_MSG_SIZE, len);
+         conn->identity[len] = '\0';
+         break;
+      }
+
+      // The client wants us to push REPORT at an interval instead of asking with INFO. 0 turns it off.
+      // The first one goes out right away, so the client knows which interval we went with.
+      case RSD_PROTO_REPORT:
+         conn->report_interval = msg.flags;
+         if ( conn->report_interval > RSD_REPORT_MAX_INTERVAL )
+            conn->report_interval = RSD_REPORT_MAX_INTERVAL;
+         else if ( conn->report_interval > 0 && conn->report_interval < RSD_REPORT_MIN_INTERVAL )
+            conn->report_interval = RSD_REPORT_MIN_INTERVAL;
+
+         conn->next_report = get_time_ns() + (int64_t)conn->report_interval * 1000000;
+         if ( send_report_msg(conn, data, 1) < 0 )
+            return -1;
+         break;
+
+      // The client is done with this stream. If it wants a new one, the WAV header of it comes along,
+      // and handle_connection() sets up the new stream before answering.
+      case RSD_PROTO_RESET:
+         if ( !conn->reset )
+            return -1;
+         if ( size == RSD_CTL_RESET_SIZE )
+         {
+            memcpy(conn->reset_header, buf + RSD_CTL_MSG_SIZE, HEADER_SIZE);
+            conn->reset_next = 1;
+         }
+         else if ( size != RSD_CTL_MSG_SIZE )
             return -1;
-            break;
-
-         case RSD_PROTO_INFO:
-            proto.serv_ptr = conn->serv_ptr;
-            if ( backend->latency != NULL )
-            {
-               proto.serv_ptr -= (int)(backend->latency(data) / conn->rate_ratio);
-            }
-            if ( send_proto(conn->ctl_socket, &proto) < 0 )
-               return -1;
-            break;
-
-         case RSD_PROTO_IDENTITY:
-            strncpy(conn->identity, proto.identity, sizeof(conn->identity));
-            break;
-
-         case RSD_PROTO_CLOSECTL:
-            send_proto(conn->ctl_socket, &proto);
+         conn->reset_pending = 1;
+         break;
+
+      case RSD_PROTO_CLOSECTL:
+         msg.size = RSD_CTL_MSG_SIZE;
+         msg.flags = 0;
+         send_ctl_msg(conn, &msg);
+         conn->report_interval = 0;
+         if ( conn->framed )
+            conn->framed = 0;
+         else
+         {
             if ( conn->ctl_socket != 0 )
                close(conn->ctl_socket);
             conn->ctl_socket = 0;
-            return 0; // No point in continuing here.
+            conn->ctl_queue_len = 0;
+         }
+         return 1;
 
-         default:
-            return -1;
+      // Newer clients might know about more than we do.
+      default:
+         break;
+   }
+
+   return 0;
+}
+
+/* Binary messages tell us their size up front, so we can read everything that's there in one go,
+   and keep the last partial message around for next time. */
+static int handle_binary_ctl_request(connection_t *conn, void *data)
+{
+   ssize_t rc = recv(conn->ctl_socket, conn->ctl_buf + conn->ctl_ptr, sizeof(conn->ctl_buf) - conn->ctl_ptr, 0);
+   if ( rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) )
+      return 0;
+   else if ( rc <= 0 )
+      return -1;
+
+   conn->ctl_ptr += rc;
+
+   size_t ptr = 0;
+   while ( conn->ctl_ptr - ptr >= RSD_CTL_MSG_SIZE )
+   {
+      size_t size = read_be((const uint8_t*)conn->ctl_buf + ptr + 2, 2);
+      if ( size < RSD_CTL_MSG_SIZE || size > RSD_CTL_MSG_MAXSIZE )
+         return -1;
+      if ( conn->ctl_ptr - ptr < size )
+         break;
+
+      rc = handle_binary_message(conn, data, conn->ctl_buf + ptr, size);
+      if ( rc < 0 )
+         return -1;
+      else if ( rc > 0 )
+         return 0; // ctl socket is gone.
+
+      ptr += size;
+   }
+
+   memmove(conn->ctl_buf, conn->ctl_buf + ptr, conn->ctl_ptr - ptr);
+   conn->ctl_ptr -= ptr;
+   return 0;
+}
+
+void set_frame_header(char *buf, uint16_t type, uint32_t size)
+{
+   // Network byte order, as the rest of the protocol.
+   buf[0] = type >> 8;
+   buf[1] = type & 0xff;
+   buf[2] = 0;
+   buf[3] = 0;
+   buf[4] = size >> 24;
+   buf[5] = (size >> 16) & 0xff;
+   buf[6] = (size >> 8) & 0xff;
+   buf[7] = size & 0xff;
+}
+
+/* Audio frames are received directly into the buffer of the caller. Frame headers and control frames
+   are collected in the connection, as they might be split up over several reads. */
+ssize_t recv_frames(connection_t *conn, void *data, void *buffer, size_t size)
+{
+   ssize_t rc;
+
+   if ( conn->frame_type == RSD_FRAME_AUDIO && conn->frame_left > 0 )
+   {
+      if ( size > conn->frame_left )
+         size = conn->frame_left;
+
+      rc = recv(conn->socket, buffer, size, 0);
+      if ( rc > 0 )
+         conn->frame_left -= rc;
+      return rc;
+   }
+
+   size_t read_size = conn->frame_left > 0 ? conn->frame_left : RSD_FRAME_HEADER_SIZE - conn->frame_ptr;
+   rc = recv(conn->socket, conn->frame_buf + conn->frame_ptr, read_size, 0);
+   if ( rc <= 0 )
+      return rc;
+
+   conn->frame_ptr += rc;
+
+   if ( conn->frame_left == 0 )
+   {
+      if ( conn->frame_ptr < RSD_FRAME_HEADER_SIZE )
+         goto again;
+
+      const uint8_t *header = (const uint8_t*)conn->frame_buf;
+      conn->frame_type = (header[0] << 8) | header[1];
+      conn->frame_left = ((uint32_t)header[4] << 24) | ((uint32_t)header[5] << 16) | ((uint32_t)header[6] << 8) | header[7];
+      conn->frame_ptr = 0;
+
+      if ( conn->frame_type == RSD_FRAME_AUDIO )
+         goto again;
+
+      if ( conn->frame_type != RSD_FRAME_CTL || conn->frame_left < RSD_PROTO_CHUNKSIZE || conn->frame_left > RSD_FRAME_CTL_MAXSIZE )
+      {
+         log_printf("Got garbage frame from client.\n");
+         return 0;
       }
+      goto again;
+   }
+
+   conn->frame_left -= rc;
+   if ( conn->frame_left > 0 )
+      goto again;
+
+   // We have a complete control message.
+   size_t msg_size = conn->frame_ptr;
+   conn->frame_type = RSD_FRAME_AUDIO;
+   conn->frame_ptr = 0;
+
+   if ( conn->binary_ctl )
+   {
+      if ( handle_binary_message(conn, data, conn->frame_buf, msg_size) < 0 )
+         return 0; // Client asked us to stop, which is no different from hanging up.
+   }
+   else
+   {
+      conn->frame_buf[msg_size] = '\0';
+      long int len = strtol(conn->frame_buf + 3, NULL, 10);
+      int valid = memcmp(conn->frame_buf, "RSD", 3) == 0 && len == (long int)msg_size - RSD_PROTO_CHUNKSIZE;
 
+      if ( valid && handle_ctl_message(conn, data, conn->frame_buf + RSD_PROTO_CHUNKSIZE) < 0 )
+         return 0;
    }
+
+again:
+   errno = EAGAIN;
+   return -1;
 }
 
 static int get_proto(rsd_proto_t *proto, char *rsd_proto_header)
@@ -192,62 +540,155 @@ static int get_proto(rsd_proto_t *proto, char *rsd_proto_header)
       proto->proto = RSD_PROTO_CLOSECTL;
       return 0;
    }
+   else if ( (substr = strstr(rsd_proto_header, "PAIR ")) != NULL )
+   {
+      proto->proto = RSD_PROTO_PAIR;
+      return 0;
+   }
 
    return -1;
 }
 
-static int send_proto(int ctl_sock, rsd_proto_t *proto)
+/* The event loop sends what it can right away, and keeps the rest in the connection for flush_ctl().
+   Replies have to stay in order, so nothing goes out directly while some are still waiting. */
+static int queue_ctl(connection_t *conn, const char *buf, size_t size, int blocking)
 {
+   int sock = conn->framed ? conn->socket : conn->ctl_socket;
+   int started = 0;
+
+   if ( conn->ctl_queue_len == 0 )
+   {
+      ssize_t rc = send(sock, buf, size, 0);
+      if ( rc < 0 && !(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) )
+         return -1;
+
+      if ( rc > 0 )
+      {
+         buf += rc;
+         size -= rc;
+         started = 1;
+      }
+      if ( size == 0 )
+         return 0;
+   }
+
+   if ( !blocking && !started )
+      return 0;
+
+   if ( size > sizeof(conn->ctl_queue) - conn->ctl_queue_len )
+   {
+      log_printf("Client doesn't read its replies. Disconnecting.\n");
+      return -1;
+   }
+
+   memcpy(conn->ctl_queue + conn->ctl_queue_len, buf, size);
+   conn->ctl_queue_len += size;
+   return 0;
+}
+
+int flush_ctl(connection_t *conn)
+{
+   if ( conn->ctl_queue_len == 0 )
+      return 0;
+
+   // After CLOSECTL, framed replies still go out on the data socket.
+   int sock = conn->ctl_socket > 0 ? conn->ctl_socket : conn->socket;
+   ssize_t rc = send(sock, conn->ctl_queue, conn->ctl_queue_len, 0);
+   if ( rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) )
+      return 0;
+   else if ( rc <= 0 )
+      return -1;
+
+   memmove(conn->ctl_queue, conn->ctl_queue + rc, conn->ctl_queue_len - rc);
+   conn->ctl_queue_len -= rc;
+   return 0;
+}
+
+// Sends a control message to the client, either on the ctl socket, or in a frame on the data socket.
+/* Replies to the client are blocking, as it is waiting for them. If not blocking, the message is dropped 
+   should the socket be full. */
+static int send_ctl(connection_t *conn, const char *buf, size_t size, int blocking)
+{
+   int sock = conn->framed ? conn->socket : conn->ctl_socket;
 
    struct pollfd fd = {
-      .fd = ctl_sock,
+      .fd = sock,
       .events = POLLOUT
    };
 
-   if ( poll(&fd, 1, 0) < 0 )
+   char sendbuf[RSD_FRAME_HEADER_SIZE + RSD_FRAME_CTL_MAXSIZE];
+   size_t offset = 0;
+   if ( conn->framed )
    {
-      perror("poll");
-      return -1;
+      set_frame_header(sendbuf, RSD_FRAME_CTL, size);
+      offset = RSD_FRAME_HEADER_SIZE;
    }
+   memcpy(sendbuf + offset, buf, size);
+   size += offset;
+
+   if ( conn->queue_ctl )
+      return queue_ctl(conn, sendbuf, size, blocking);
 
-   if ( fd.revents & POLLOUT )
+   size_t sent = 0;
+   while ( sent < size )
    {
+      // Half a message would leave the client out of sync with us, so once some of it is out, the rest has to follow.
+      if ( poll(&fd, 1, (blocking || sent > 0) ? 10000 : 0) < 0 )
+      {
+         perror("poll");
+         return -1;
+      }
 
-      char sendbuf[RSD_PROTO_MAXSIZE] = {0};
-      char tempbuf[RSD_PROTO_MAXSIZE] = {0};
-      int rc;
-      switch ( proto->proto )
+      if ( !(fd.revents & POLLOUT) )
       {
-         case RSD_PROTO_INFO:
-#ifdef _WIN32
-            snprintf(tempbuf, RSD_PROTO_MAXSIZE - 1, " INFO %I64d %I64d", (__int64)proto->client_ptr, (__int64)proto->serv_ptr);
-#else
-            snprintf(tempbuf, RSD_PROTO_MAXSIZE - 1, " INFO %lld %lld", (long long int)proto->client_ptr, (long long int)proto->serv_ptr);
-#endif
-            snprintf(sendbuf, RSD_PROTO_MAXSIZE - 1, "RSD%5d%s", (int)strlen(tempbuf), tempbuf);
-            //log_printf("Sent info: \"%s\"\n", sendbuf);
-            rc = send(ctl_sock, sendbuf, strlen(sendbuf), 0);
-            if ( rc < 0 )
-               return -1;
-            break;
-
-         case RSD_PROTO_CLOSECTL:
-            strncpy(sendbuf, "RSD   12 CLOSECTL OK", sizeof(sendbuf)-1);
-            rc = send(ctl_sock, sendbuf, strlen(sendbuf), 0);
-            if ( rc < 0 )
-               return -1;
-            break;
-            
-
-         default:
-            return -1;
+         // Nothing to do if we can't send right away.
+         if ( !blocking && sent == 0 )
+            return 0;
+         return -1;
       }
+
+      int rc = send(sock, sendbuf + sent, size - sent, 0);
+      if ( rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) )
+         continue;
+      else if ( rc <= 0 )
+         return -1;
+
+      sent += rc;
    }
+
    return 0;
 }
 
+static int send_ctl_msg(connection_t *conn, const rsd_ctl_msg_t *msg)
+{
+   char buf[RSD_CTL_MSG_SIZE];
+   pack_ctl_msg(buf, msg);
+   return send_ctl(conn, buf, sizeof(buf), 1);
+}
 
+static int send_proto(connection_t *conn, rsd_proto_t *proto)
+{
+   char sendbuf[RSD_PROTO_MAXSIZE] = {0};
+   char tempbuf[RSD_PROTO_MAXSIZE] = {0};
+   switch ( proto->proto )
+   {
+      case RSD_PROTO_INFO:
+#ifdef _WIN32
+         snprintf(tempbuf, RSD_PROTO_MAXSIZE - 1, " INFO %I64d %I64d", (__int64)proto->client_ptr, (__int64)proto->serv_ptr);
+#else
+         snprintf(tempbuf, RSD_PROTO_MAXSIZE - 1, " INFO %lld %lld", (long long int)proto->client_ptr, (long long int)proto->serv_ptr);
+#endif
+         snprintf(sendbuf, RSD_PROTO_MAXSIZE - 1, "RSD%5d%s", (int)strlen(tempbuf), tempbuf);
+         //log_printf("Sent info: \"%s\"\n", sendbuf);
+         break;
 
+      case RSD_PROTO_CLOSECTL:
+         strncpy(sendbuf, "RSD   12 CLOSECTL OK", sizeof(sendbuf)-1);
+         break;
 
+      default:
+         return -1;
+   }
 
-
+   return send_ctl(conn, sendbuf, strlen(sendbuf), 1);
+}
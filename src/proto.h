@@ -29,8 +29,48 @@ enum
    RSD_PROTO_INFO = 0x0002,
    RSD_PROTO_IDENTITY = 0x0003,
    RSD_PROTO_CLOSECTL = 0x0004,
+   RSD_PROTO_PAIR = 0x0005,
+   RSD_PROTO_REPORT = 0x0006,
+   RSD_PROTO_RESET = 0x0007,
 };
 
+// Limits for how often we push REPORT messages, in ms.
+#define RSD_REPORT_MIN_INTERVAL 5
+#define RSD_REPORT_MAX_INTERVAL 1000
+// REPORT has the backend latency as an int64_t after the fixed part.
+#define RSD_CTL_REPORT_SIZE (RSD_CTL_MSG_SIZE + 8)
+// RESET has the WAV header of the new stream after the fixed part. The reply has latency and chunk size, as uint32_t.
+#define RSD_CTL_RESET_SIZE (RSD_CTL_MSG_SIZE + HEADER_SIZE)
+#define RSD_CTL_RESET_REPLY_SIZE (RSD_CTL_MSG_SIZE + 8)
+
+/* Binary control messages. On the wire, the fixed part is RSD_CTL_MSG_SIZE bytes, with every field in network byte order.
+   The message type is one of RSD_PROTO_*. IDENTITY has the name after the fixed part, which is why the size is included. */
+typedef struct rsd_ctl_msg
+{
+   uint16_t type;
+   uint16_t size;      // Size of the whole message.
+   uint32_t flags;     // CLOSECTL and RESET reply: 0 for OK. REPORT: Interval in ms.
+   int64_t client_ptr; // Bytes written by the client.
+   int64_t serv_ptr;   // Bytes played back by the server.
+   int64_t timestamp;  // CLOCK_MONOTONIC in ns, of the side which sent the message.
+} rsd_ctl_msg_t;
+
 int handle_ctl_request(connection_t *conn, void* data);
 
+// Pushes a REPORT to the client if it asked for them, and it's time for a new one.
+int send_report(connection_t *conn, void *data);
+
+// Sends replies which were held back as the client didn't read them fast enough. Only used by the event loop.
+int flush_ctl(connection_t *conn);
+
+// Tells the client that the stream it asked for with RESET is ready.
+int send_reset_reply(connection_t *conn, const backend_info_t *info);
+
+// Works like recv() on a framed data socket, but only audio ends up in buffer.
+// Control frames are handled on the way. If all we got was part of a control frame, it fails with EAGAIN.
+ssize_t recv_frames(connection_t *conn, void* data, void *buffer, size_t size);
+
+// Puts a frame header in the first RSD_FRAME_HEADER_SIZE bytes of buf.
+void set_frame_header(char *buf, uint16_t type, uint32_t size);
+
 #endif
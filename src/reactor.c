@@ -0,0 +1,497 @@
+/*  RSound - A PCM audio client/server
+ *  Copyright (C) 2010-2011 - Hans-Kristian Arntzen
+ *
+ *  RSound is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RSound is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RSound.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/************************************************************************
+ *   Event driven connection handling. A handful of threads handle all  *
+ *   connections with epoll. Every connection is a small state machine  *
+ *   which reads the WAV header, and then streams audio to the mixer.   *
+ *   Since the mixer tells us how much it can take, we never block on   *
+ *   writes. Streams which can't be written to are put aside and        *
+ *   retried on a short tick.                                           *
+ ************************************************************************/
+
+#include "reactor.h"
+#include "rsound.h"
+#include "mixer.h"
+#include "proto.h"
+#include <sys/epoll.h>
+
+#define REACTOR_MAX_EVENTS 64
+// How often we check if stalled streams can be written to again.
+#define REACTOR_TICK_MS 2
+// Limit on how many reads we do for a single stream before we let others have a go.
+#define REACTOR_READS_PER_EVENT 4
+
+enum reactor_state
+{
+   REACTOR_HEADER,
+   REACTOR_STREAM,
+   REACTOR_DEAD
+};
+
+typedef struct reactor_conn reactor_conn_t;
+typedef struct reactor_worker reactor_worker_t;
+
+// What we get back from epoll. Tells us which socket of the connection got the event.
+typedef struct
+{
+   reactor_conn_t *conn;
+   int ctl;
+} reactor_handle_t;
+
+struct reactor_conn
+{
+   connection_t conn;
+   enum reactor_state state;
+   reactor_handle_t data_handle;
+   reactor_handle_t ctl_handle;
+   reactor_worker_t *worker;
+
+   char header[HEADER_SIZE];
+   size_t header_ptr;
+
+   void *data;
+   int framesize;
+   uint8_t *buffer;
+   size_t buffer_size;
+   size_t buffer_ptr; // Partial frames left over from last read.
+
+   int stalled;
+   int ctl_out; // Waiting for the socket replies go out on to become writable.
+   reactor_conn_t *next; // Either in the stalled or dead list.
+};
+
+struct reactor_worker
+{
+   int epfd;
+   pthread_t thread;
+   reactor_conn_t *stalled;
+   reactor_conn_t *dead;
+};
+
+static reactor_worker_t *workers;
+static int num_workers;
+static unsigned next_worker;
+
+static void reactor_unlink(reactor_conn_t **list, reactor_conn_t *c)
+{
+   for (reactor_conn_t **ptr = list; *ptr != NULL; ptr = &(*ptr)->next)
+   {
+      if (*ptr == c)
+      {
+         *ptr = c->next;
+         c->next = NULL;
+         return;
+      }
+   }
+}
+
+/* Connections are not freed before all events of the current epoll_wait() have been handled,
+ * as there might be events pending for the other socket. */
+static void reactor_close(reactor_conn_t *c)
+{
+   if (c->state == REACTOR_DEAD)
+      return;
+
+   if (debug)
+      log_printf("Closed connection.\n\n");
+
+   if (c->stalled)
+      reactor_unlink(&c->worker->stalled, c);
+
+   if (c->data)
+      backend->close(c->data);
+   c->data = NULL;
+
+   close(c->conn.socket);
+   if (c->conn.ctl_socket > 0)
+      close(c->conn.ctl_socket);
+
+   c->state = REACTOR_DEAD;
+   c->next = c->worker->dead;
+   c->worker->dead = c;
+}
+
+static void reactor_free_dead(reactor_worker_t *worker)
+{
+   while (worker->dead)
+   {
+      reactor_conn_t *c = worker->dead;
+      worker->dead = c->next;
+      free(c->buffer);
+      free(c);
+   }
+}
+
+// The mixer is full. Stop listening to the stream until it has room again.
+static int reactor_stall(reactor_conn_t *c)
+{
+   if (epoll_ctl(c->worker->epfd, EPOLL_CTL_DEL, c->conn.socket, NULL) < 0)
+      return -1;
+
+   if (c->conn.ctl_socket <= 0)
+      c->ctl_out = 0;
+   c->stalled = 1;
+   c->next = c->worker->stalled;
+   c->worker->stalled = c;
+   return 0;
+}
+
+/* Replies the client didn't take right away are queued up in the connection.
+ * Listen for the socket becoming writable only for as long as some are left. */
+static int reactor_watch_ctl(reactor_conn_t *c)
+{
+   int out = c->conn.ctl_queue_len > 0;
+   if (out == c->ctl_out)
+      return 0;
+
+   struct epoll_event event;
+   int fd;
+   if (c->conn.ctl_socket > 0)
+   {
+      fd = c->conn.ctl_socket;
+      event.events = EPOLLIN | EPOLLRDHUP;
+      event.data.ptr = &c->ctl_handle;
+   }
+   else
+   {
+      // Framed replies go out on the data socket, which we get back when the stream is unstalled.
+      if (c->stalled)
+         return 0;
+
+      fd = c->conn.socket;
+      event.events = EPOLLIN;
+      event.data.ptr = &c->data_handle;
+   }
+
+   if (out)
+      event.events |= EPOLLOUT;
+
+   if (epoll_ctl(c->worker->epfd, EPOLL_CTL_MOD, fd, &event) < 0)
+      return -1;
+
+   c->ctl_out = out;
+   return 0;
+}
+
+static void reactor_unstall(reactor_worker_t *worker)
+{
+   reactor_conn_t *c = worker->stalled;
+   while (c)
+   {
+      reactor_conn_t *next = c->next;
+      ssize_t writable = mixer_writable(c->data);
+
+      if (writable < 0 || (size_t)writable > c->buffer_ptr)
+      {
+         struct epoll_event event = {
+            .events = EPOLLIN,
+            .data.ptr = &c->data_handle
+         };
+
+         reactor_unlink(&worker->stalled, c);
+         c->stalled = 0;
+         if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, c->conn.socket, &event) < 0 || reactor_watch_ctl(c) < 0)
+            reactor_close(c);
+      }
+
+      c = next;
+   }
+}
+
+static void reactor_log_identity(reactor_conn_t *c)
+{
+   if (strlen(c->conn.identity) > 0 && verbose)
+   {
+      log_printf(" :: %s\n", c->conn.identity);
+      c->conn.identity[0] = '\0';
+   }
+}
+
+static int reactor_stream(reactor_conn_t *c)
+{
+   for (int i = 0; i < REACTOR_READS_PER_EVENT; i++)
+   {
+      ssize_t writable = mixer_writable(c->data);
+      if (writable < 0)
+         return -1;
+
+      if ((size_t)writable <= c->buffer_ptr)
+         return reactor_stall(c);
+
+      size_t read_size = c->buffer_size - c->buffer_ptr;
+      if (read_size > (size_t)writable - c->buffer_ptr)
+         read_size = (size_t)writable - c->buffer_ptr;
+
+      ssize_t rc;
+      if (c->conn.framed)
+      {
+         rc = recv_frames(&c->conn, c->data, c->buffer + c->buffer_ptr, read_size);
+         reactor_log_identity(c);
+      }
+      else
+         rc = recv(c->conn.socket, c->buffer + c->buffer_ptr, read_size, 0);
+
+      if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+         return 0;
+      else if (rc <= 0)
+      {
+         if (debug)
+            log_printf("Client closed connection.\n");
+         return -1;
+      }
+
+      c->conn.serv_ptr += rc;
+      c->buffer_ptr += rc;
+
+      size_t write_size = c->buffer_ptr - c->buffer_ptr % c->framesize;
+      if (write_size > 0)
+      {
+         if (backend->write(c->data, c->buffer, write_size) == 0)
+            return -1;
+
+         memmove(c->buffer, c->buffer + write_size, c->buffer_ptr - write_size);
+         c->buffer_ptr -= write_size;
+
+         if (send_report(&c->conn, c->data) < 0)
+            return -1;
+      }
+   }
+
+   return 0;
+}
+
+static int reactor_header(reactor_conn_t *c)
+{
+   ssize_t rc = recv(c->conn.socket, c->header + c->header_ptr, HEADER_SIZE - c->header_ptr, 0);
+   if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+      return 0;
+   else if (rc <= 0)
+      return -1;
+
+   c->header_ptr += rc;
+   if (c->header_ptr < HEADER_SIZE)
+      return 0;
+
+   wav_header_t w;
+   if (parse_wav_header(c->header, &w) < 0)
+   {
+      log_printf("Couldn't read WAV header... Disconnecting.\n");
+      return -1;
+   }
+   c->conn.framed = w.framed;
+   c->conn.binary_ctl = w.proto_flags & RSD_PROTO_FLAG_BINARY;
+
+   if (debug)
+   {
+      log_printf("Successfully got WAV header: %d ch, %d Hz, %s\n",
+            (int)w.numChannels, (int)w.sampleRate, rsnd_format_to_string(w.rsd_format));
+   }
+
+   if (backend->init(&c->data) < 0)
+   {
+      log_printf("Failed to initialize %s ...\n", backend->backend);
+      return -1;
+   }
+
+   if (backend->open(c->data, &w) < 0)
+   {
+      log_printf("Failed to open audio driver ...\n");
+      return -1;
+   }
+
+   backend_info_t backend_info;
+   memset(&backend_info, 0, sizeof(backend_info));
+   backend->get_backend_info(c->data, &backend_info);
+   if (backend_info.chunk_size == 0)
+   {
+      log_printf("Couldn't get backend info ...\n");
+      return -1;
+   }
+
+   c->framesize = w.numChannels * rsnd_format_to_bytes(w.rsd_format);
+   c->buffer_size = backend_info.chunk_size;
+   if (c->buffer_size < (size_t)c->framesize)
+      c->buffer_size = c->framesize;
+   c->buffer = malloc(c->buffer_size);
+   if (c->buffer == NULL)
+   {
+      log_printf("Could not allocate memory for buffer.");
+      return -1;
+   }
+
+   set_socket_options(c->conn, &backend_info);
+
+   if (send_backend_info(c->conn, &backend_info) < 0)
+   {
+      log_printf("Failed to send backend info ...\n");
+      return -1;
+   }
+
+   if (c->conn.ctl_socket > 0)
+   {
+      struct epoll_event event = {
+         .events = EPOLLIN | EPOLLRDHUP,
+         .data.ptr = &c->ctl_handle
+      };
+
+      if (epoll_ctl(c->worker->epfd, EPOLL_CTL_ADD, c->conn.ctl_socket, &event) < 0)
+         return -1;
+   }
+
+   if (debug)
+      log_printf("Initializing of %s successful ...\n", backend->backend);
+
+   c->state = REACTOR_STREAM;
+   return reactor_stream(c);
+}
+
+static int reactor_ctl(reactor_conn_t *c, uint32_t events)
+{
+   if (events & EPOLLIN)
+   {
+      if (handle_ctl_request(&c->conn, c->data) < 0)
+         return -1;
+
+      // CLOSECTL closed the socket for us.
+      if (c->conn.ctl_socket == 0)
+         return 0;
+
+      reactor_log_identity(c);
+   }
+
+   // As with the threaded server, the client hanging up the control socket means that we're done.
+   if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+      return -1;
+
+   return 0;
+}
+
+static void reactor_event(reactor_handle_t *handle, uint32_t events)
+{
+   reactor_conn_t *c = handle->conn;
+   int rc = 0;
+
+   if (c->state == REACTOR_DEAD)
+      return;
+
+   if ((events & EPOLLOUT) && flush_ctl(&c->conn) < 0)
+      rc = -1;
+   else if (handle->ctl)
+      rc = reactor_ctl(c, events);
+   else if (!(events & EPOLLIN))
+      rc = (events & (EPOLLHUP | EPOLLERR)) ? -1 : 0;
+   else if (c->state == REACTOR_HEADER)
+      rc = reactor_header(c);
+   else if (!c->stalled)
+      rc = reactor_stream(c);
+
+   if (rc < 0 || reactor_watch_ctl(c) < 0)
+      reactor_close(c);
+}
+
+static void* reactor_thread(void *data)
+{
+   reactor_worker_t *worker = data;
+   struct epoll_event events[REACTOR_MAX_EVENTS];
+
+   for (;;)
+   {
+      int timeout = worker->stalled ? REACTOR_TICK_MS : -1;
+      int num_events = epoll_wait(worker->epfd, events, REACTOR_MAX_EVENTS, timeout);
+      if (num_events < 0)
+      {
+         if (errno == EINTR)
+            continue;
+
+         log_printf("epoll_wait() failed: %s\n", strerror(errno));
+         break;
+      }
+
+      for (int i = 0; i < num_events; i++)
+         reactor_event(events[i].data.ptr, events[i].events);
+
+      reactor_unstall(worker);
+      reactor_free_dead(worker);
+   }
+
+   pthread_exit(NULL);
+}
+
+int reactor_init(int num)
+{
+   workers = calloc(num, sizeof(*workers));
+   if (workers == NULL)
+      return -1;
+
+   for (int i = 0; i < num; i++)
+   {
+      workers[i].epfd = epoll_create(REACTOR_MAX_EVENTS);
+      if (workers[i].epfd < 0)
+      {
+         log_printf("epoll_create() failed: %s\n", strerror(errno));
+         return -1;
+      }
+
+      if (pthread_create(&workers[i].thread, NULL, reactor_thread, &workers[i]) != 0)
+      {
+         log_printf("Creating event loop thread failed ...\n");
+         return -1;
+      }
+      pthread_detach(workers[i].thread);
+   }
+
+   num_workers = num;
+   if (debug)
+      log_printf("Started %d event loop thread(s).\n", num_workers);
+
+   return 0;
+}
+
+int reactor_add(connection_t conn)
+{
+   reactor_conn_t *c = calloc(1, sizeof(*c));
+   if (c == NULL)
+      return -1;
+
+   c->conn.socket = conn.socket;
+   c->conn.ctl_socket = conn.ctl_socket;
+   c->conn.rate_ratio = 1.0;
+   c->conn.queue_ctl = 1;
+   c->state = REACTOR_HEADER;
+   c->data_handle.conn = c;
+   c->ctl_handle.conn = c;
+   c->ctl_handle.ctl = 1;
+
+   // Connections are spread round robin. They're all in the same mixer anyways.
+   c->worker = &workers[next_worker++ % num_workers];
+
+   struct epoll_event event = {
+      .events = EPOLLIN,
+      .data.ptr = &c->data_handle
+   };
+
+   if (epoll_ctl(c->worker->epfd, EPOLL_CTL_ADD, c->conn.socket, &event) < 0)
+   {
+      log_printf("epoll_ctl() failed: %s\n", strerror(errno));
+      free(c);
+      return -1;
+   }
+
+   if (debug)
+      log_printf("Connection accepted, awaiting WAV header data ...\n");
+
+   return 0;
+}
@@ -0,0 +1,29 @@
+/*  RSound - A PCM audio client/server
+ *  Copyright (C) 2010-2011 - Hans-Kristian Arntzen
+ *
+ *  RSound is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RSound is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RSound.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __REACTOR_H
+#define __REACTOR_H
+
+#include "audio.h"
+
+#ifdef HAVE_EPOLL
+// Spawns the event loop threads. Connections are spread out over these.
+int reactor_init(int workers);
+
+// Hands over a connection (with non-blocking sockets) to one of the event loops.
+int reactor_add(connection_t conn);
+#endif
+
+#endif
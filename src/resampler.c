@@ -15,33 +15,321 @@
 
 
 #include "resampler.h"
+#include "simd.h"
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
+#include <math.h>
 
-#define SAMPLES_TO_FRAMES(x,y) ((x)/(y)->channels)
 #define FRAMES_TO_SAMPLES(x,y) ((x)*(y)->channels)
 
+// Room in the rings beyond the window, so input can be taken in blocks.
+#define RESAMPLER_BLOCK_FRAMES 1024
+
+// Limits for giving a rational ratio L / M a phase table of its own, with L rows.
+#define RESAMPLER_MAX_RATIONAL 2048
+#define RESAMPLER_MAX_TABLE (256 * 1024)
+
+// Positions for ratios that aren't rational enough are kept in 32.32 fixed point.
+#define RESAMPLER_FIXED_ONE (UINT64_C(1) << 32)
+
 struct resampler
 {
-   float *data;
    double ratio;
-   size_t data_ptr;
-   size_t data_size;
    void *cb_data;
    int channels;
    resampler_cb_t func;
-   uint64_t sum_output_frames;
-   uint64_t sum_input_frames;
+   void (*process)(resampler_t *state, float *out, const float *ring);
+
+   /* The next output frame is phase / den of an input frame past the first frame of its window, pos.
+    * It moves step_int + step_frac / den input frames per output frame. With a rational ratio,
+    * den is L and all of this is exact, otherwise it's 32.32 fixed point. */
+   uint64_t pos;
+   uint64_t phase;
+   uint64_t den;
+   uint64_t step_int;
+   uint64_t step_frac;
+   float phase_scale; // 1 / den
+
+   /* Input history, one ring per channel. Every frame is stored twice, capacity frames apart,
+    * so any window of up to capacity frames can be read in one piece, wherever it starts. */
+   float *ring;
+   size_t capacity;
+   // Number of the oldest input frame in the rings, counting the silence in front, and how many there are.
+   uint64_t ring_start;
+   size_t ring_frames;
+   // Where in the rings the oldest frame is.
+   size_t ring_offset;
+
+   // What the callback gave us that doesn't fit in the rings yet. It stays valid until the next callback.
+   const float *saved;
+   size_t saved_frames;
+
+   // Input frames an output frame is computed from.
+   unsigned window;
+   // Frames of silence in front of the input, so the window can be centered on the first frame.
+   unsigned delay;
+
+   /* Windowed sinc filter, in rows of taps. With a phase table of its own, row p is for output
+    * frames p / den of a frame past the first input frame of their window, one for each phase
+    * the ratio can hit. Otherwise row p is for p / phases, there are phases + 1 rows, and the
+    * two rows around the output frame are interpolated. */
+   float *filter;
+   unsigned taps;
+   unsigned phases;
+   double cutoff;
+   double beta;
+   simd_fir_t fir;
+   simd_dot_t dot;
+};
+
+struct resampler_preset
+{
+   unsigned taps;
+   unsigned phases;
+   double beta;
+   double cutoff;
+};
+
+/* The Kaiser beta sets the stopband attenuation (50, 80, 100 and 120 dB), and the cutoff,
+ * relative to the Nyquist frequency, is placed so that the transition band ends at the
+ * Nyquist frequency for that many taps. Where phases are interpolated linearly, there are
+ * enough of them to keep the interpolation error below the stopband. */
+static const struct resampler_preset resampler_presets[RESAMPLER_QUALITY_MAX + 1] = {
+   [2] = {  16,   64,  4.55, 0.80 },
+   [3] = {  32,  256,  7.86, 0.84 },
+   [4] = {  64,  512, 10.06, 0.90 },
+   [5] = { 128, 1024, 12.26, 0.92 },
 };
 
-resampler_t* resampler_new(resampler_cb_t func, double ratio, int channels, void* cb_data)
+// Modified Bessel function of the first kind, order 0.
+static double resampler_bessel_i0(double x)
+{
+   double sum = 1.0;
+   double term = 1.0;
+   for (int k = 1; k < 64 && term > sum * 1e-15; k++)
+   {
+      term *= (x / (2.0 * k)) * (x / (2.0 * k));
+      sum += term;
+   }
+   return sum;
+}
+
+static double resampler_kaiser(double x, double beta)
+{
+   if (x < -1.0 || x > 1.0)
+      return 0.0;
+   return resampler_bessel_i0(beta * sqrt(1.0 - x * x)) / resampler_bessel_i0(beta);
+}
+
+static float resampler_fir_c(const float *h0, const float *h1, float mu, const float *x, size_t taps)
+{
+   float sum0 = 0.0f;
+   float sum1 = 0.0f;
+   for (size_t i = 0; i < taps; i++)
+   {
+      sum0 += h0[i] * x[i];
+      sum1 += h1[i] * x[i];
+   }
+   return sum0 + (sum1 - sum0) * mu;
+}
+
+static float resampler_dot_c(const float *h, const float *x, size_t taps)
+{
+   float sum = 0.0f;
+   for (size_t i = 0; i < taps; i++)
+      sum += h[i] * x[i];
+   return sum;
+}
+
+static void poly_create_3(float *poly, const float *y)
+{
+   poly[2] = (y[0] - 2*y[1] + y[2])/2;
+   poly[1] = -1.5*y[0] + 2*y[1] - 0.5*y[2];
+   poly[0] = y[0];
+}
+
+static void resampler_process_quadratic(resampler_t *state, float *out, const float *ring)
+{
+   float x_val = state->phase * state->phase_scale + 1.0f;
+   for (int c = 0; c < state->channels; c++)
+   {
+      float poly[3];
+      poly_create_3(poly, ring + c * 2 * state->capacity);
+      out[c] = poly[2] * x_val * x_val + poly[1] * x_val + poly[0];
+   }
+}
+
+// Any ratio. Phases is a power of two, so the row and how far to interpolate are just bits of the phase.
+static void resampler_process_sinc(resampler_t *state, float *out, const float *ring)
+{
+   uint64_t phase = state->phase * state->phases;
+   const float *h0 = state->filter + (phase >> 32) * state->taps;
+   const float *h1 = h0 + state->taps;
+   float mu = (float)(uint32_t)phase * (1.0f / RESAMPLER_FIXED_ONE);
+
+   for (int c = 0; c < state->channels; c++)
+      out[c] = state->fir(h0, h1, mu, ring + c * 2 * state->capacity, state->taps);
+}
+
+// Rational ratios. The phase is the row.
+static void resampler_process_polyphase(resampler_t *state, float *out, const float *ring)
+{
+   const float *h = state->filter + state->phase * state->taps;
+   for (int c = 0; c < state->channels; c++)
+      out[c] = state->dot(h, ring + c * 2 * state->capacity, state->taps);
+}
+
+// Upsampling by a power of two. Every L-th output frame is right on an input frame.
+static void resampler_process_halfband(resampler_t *state, float *out, const float *ring)
+{
+   if (state->phase != 0)
+   {
+      resampler_process_polyphase(state, out, ring);
+      return;
+   }
+
+   for (int c = 0; c < state->channels; c++)
+      out[c] = ring[c * 2 * state->capacity + state->delay];
+}
+
+// Finds L / M equal to ratio, with L and M at most RESAMPLER_MAX_RATIONAL, from its continued fraction.
+static int resampler_rational(double ratio, unsigned *l, unsigned *m)
+{
+   uint64_t l0 = 0, m0 = 1, l1 = 1, m1 = 0;
+   double x = ratio;
+
+   for (int i = 0; i < 32; i++)
+   {
+      double a = floor(x);
+      if (a > RESAMPLER_MAX_RATIONAL)
+         return -1;
+
+      uint64_t l2 = (uint64_t)a * l1 + l0;
+      uint64_t m2 = (uint64_t)a * m1 + m0;
+      if (l2 > RESAMPLER_MAX_RATIONAL || m2 > RESAMPLER_MAX_RATIONAL)
+         return -1;
+
+      // Ratios come from integer sample rates, so anything else than rounding errors means it's not the one.
+      if (fabs((double)l2 / m2 - ratio) <= ratio * 1e-12)
+      {
+         *l = l2;
+         *m = m2;
+         return 0;
+      }
+
+      if (x == a)
+         return -1;
+      x = 1.0 / (x - a);
+      l0 = l1;
+      m0 = m1;
+      l1 = l2;
+      m1 = m2;
+   }
+
+   return -1;
+}
+
+// Makes rows of taps, where row p is for output frames p / phases of a frame past the start of their window.
+static int resampler_make_filter(resampler_t *state, unsigned rows, unsigned phases)
+{
+   float *filter = malloc(rows * state->taps * sizeof(float));
+   if (filter == NULL)
+      return -1;
+
+   for (unsigned p = 0; p < rows; p++)
+   {
+      for (unsigned i = 0; i < state->taps; i++)
+      {
+         // Distance from the tap to where the output frame is, in input frames.
+         double x = (double)i - state->delay - (double)p / phases;
+         double sinc = (x == 0.0) ? 1.0 : sin(M_PI * state->cutoff * x) / (M_PI * state->cutoff * x);
+         filter[p * state->taps + i] = state->cutoff * sinc * resampler_kaiser(x / (state->taps / 2.0), state->beta);
+      }
+   }
+
+   free(state->filter);
+   state->filter = filter;
+   return 0;
+}
+
+static int resampler_init_interpolated(resampler_t *state)
+{
+   if (resampler_make_filter(state, state->phases + 1, state->phases) < 0)
+      return -1;
+
+   state->process = resampler_process_sinc;
+   state->fir = simd_fir();
+   if (state->fir == NULL)
+      state->fir = resampler_fir_c;
+   return 0;
+}
+
+static int resampler_init_sinc(resampler_t *state, int quality, unsigned l, unsigned m)
+{
+   const struct resampler_preset *preset = &resampler_presets[quality];
+   unsigned taps = preset->taps;
+   unsigned phases = preset->phases;
+   state->cutoff = preset->cutoff;
+   state->beta = preset->beta;
+
+   // When downsampling, the cutoff has to go below the output's Nyquist frequency instead.
+   // The filter gets wider by the same factor, and smoother, so it takes more taps but fewer phases.
+   if (state->ratio < 1.0)
+   {
+      state->cutoff *= state->ratio;
+      taps = ((unsigned)ceil(taps / state->ratio) + 7) & ~7u;
+      while (phases > 16 && phases / 2 >= preset->phases * state->ratio)
+         phases /= 2;
+   }
+
+   state->taps = taps;
+   state->phases = phases;
+   state->window = taps;
+   state->delay = taps / 2 - 1;
+
+   if (l == 0 || l * taps > RESAMPLER_MAX_TABLE)
+      return resampler_init_interpolated(state);
+
+   /* Only L phases ever come up, so they can all be in the table, and there's nothing to
+    * interpolate. When upsampling by a power of two, the transition band is centered on
+    * the input's Nyquist frequency instead. That's a half-band filter: the taps of phase 0
+    * fall on the zeros of the sinc, so those output frames are just copies of input frames. */
+   if (m == 1 && (l & (l - 1)) == 0)
+   {
+      state->cutoff = 1.0;
+      state->process = resampler_process_halfband;
+   }
+   else
+      state->process = resampler_process_polyphase;
+
+   state->dot = simd_dot();
+   if (state->dot == NULL)
+      state->dot = resampler_dot_c;
+
+   return resampler_make_filter(state, l, l);
+}
+
+// Positions in 32.32 fixed point, for any ratio.
+static void resampler_set_fixed_step(resampler_t *state, double ratio)
+{
+   uint64_t step = (uint64_t)llround(RESAMPLER_FIXED_ONE / ratio);
+   state->den = RESAMPLER_FIXED_ONE;
+   state->step_int = step >> 32;
+   state->step_frac = step & (RESAMPLER_FIXED_ONE - 1);
+   state->phase_scale = 1.0f / RESAMPLER_FIXED_ONE;
+}
+
+resampler_t* resampler_new(resampler_cb_t func, double ratio, int channels, int quality, void* cb_data)
 {
    if (func == NULL)
       return NULL;
 
-   if (channels < 1)
+   if (channels < 1 || ratio <= 0.0)
+      return NULL;
+
+   if (quality < RESAMPLER_QUALITY_MIN || quality > RESAMPLER_QUALITY_MAX)
       return NULL;
 
    resampler_t* state = calloc(1, sizeof(resampler_t));
@@ -53,22 +341,90 @@ resampler_t* resampler_new(resampler_cb_t func, double ratio, int channels, void
    state->channels = channels;
    state->cb_data = cb_data;
 
+   unsigned l = 0, m = 0;
+   if (resampler_rational(ratio, &l, &m) < 0)
+      l = m = 0;
+
+   // The quadratic goes through the input frames before, at and after where the output frame is.
+   state->window = 3;
+   state->delay = 1;
+   state->process = resampler_process_quadratic;
+
+   if (quality > RESAMPLER_QUALITY_QUADRATIC && resampler_init_sinc(state, quality, l, m) < 0)
+      goto error;
+
+   // Interpolating between phases needs the fixed point position, even when the ratio is rational.
+   if (l != 0 && state->process != resampler_process_sinc)
+   {
+      state->den = l;
+      state->step_int = m / l;
+      state->step_frac = m % l;
+      state->phase_scale = 1.0f / l;
+   }
+   else
+      resampler_set_fixed_step(state, ratio);
+
+   state->capacity = state->window + RESAMPLER_BLOCK_FRAMES;
+   state->ring = calloc(FRAMES_TO_SAMPLES(2 * state->capacity, state), sizeof(float));
+   if (state->ring == NULL)
+      goto error;
+   state->ring_frames = state->delay;
+
    return state;
+
+error:
+   resampler_free(state);
+   return NULL;
 }
 
 void resampler_free(resampler_t* state)
 {
-   if (state && state->data)
-      free(state->data);
-   if (state)
-      free(state);
+   if (state == NULL)
+      return;
+
+   free(state->ring);
+   free(state->filter);
+   free(state);
+}
+
+int resampler_set_ratio(resampler_t *state, double ratio)
+{
+   if (ratio <= 0.0)
+      return -1;
+
+   if (ratio == state->ratio)
+      return 0;
+
+   // A table of exact phases only has the phases of the ratio it was made for.
+   if (state->filter != NULL && state->process != resampler_process_sinc &&
+         resampler_init_interpolated(state) < 0)
+      return -1;
+
+   if (state->den != RESAMPLER_FIXED_ONE)
+      state->phase = (state->phase << 32) / state->den;
+   resampler_set_fixed_step(state, ratio);
+   state->ratio = ratio;
+   return 0;
+}
+
+size_t resampler_lookahead(const resampler_t *state)
+{
+   return state->window - state->delay;
+}
+
+// Lets the vector kernel for op do what it can, and returns where the scalar code should pick up.
+static size_t resampler_simd(enum simd_op op, void *out, const void *in, size_t samples)
+{
+   simd_kernel_t kernel = simd_kernel(op);
+   return kernel ? kernel(out, in, samples) : 0;
 }
 
 void resampler_float_to_s16(int16_t * restrict out, const float * restrict in, size_t samples)
 {
-   for (int i = 0; i < (int)samples; i++)
+   for (int i = resampler_simd(SIMD_RESAMPLER_FLOAT_TO_S16, out, in, samples); i < (int)samples; i++)
    {
-      int32_t temp = in[i] + 0.5; 
+      // Clamp before converting, so samples way out of range don't overflow.
+      double temp = in[i] * 0x8000 + 0.5;
       if (temp > 0x7FFE)
          out[i] = 0x7FFE;
       else if (temp < -0x7FFF)
@@ -80,9 +436,9 @@ void resampler_float_to_s16(int16_t * restrict out, const float * restrict in, s
 
 void resampler_float_to_s32(int32_t * restrict out, const float * restrict in, size_t samples)
 {
-   for (int i = 0; i < (int)samples; i++)
+   for (int i = resampler_simd(SIMD_RESAMPLER_FLOAT_TO_S32, out, in, samples); i < (int)samples; i++)
    {
-      int64_t temp = in[i] + 0.5; 
+      double temp = in[i] * 0x80000000UL + 0.5;
       if (temp > 0x7FFFFFFE)
          out[i] = 0x7FFFFFFE;
       else if (temp < -0x7FFFFFFF)
@@ -92,89 +448,75 @@ void resampler_float_to_s32(int32_t * restrict out, const float * restrict in, s
    }
 }
 
-void resampler_s16_to_float(float * restrict out, const int16_t * restrict in, size_t samples)
-{
-   for (int i = 0; i < (int)samples; i++)
-      out[i] = in[i];
-}
-
-void resampler_s32_to_float(float * restrict out, const int32_t * restrict in, size_t samples)
+// Appends frames to the rings. They must fit.
+static void resampler_push(resampler_t *state, const float *in, size_t frames)
 {
-   for (int i = 0; i < (int)samples; i++)
-      out[i] = in[i];
-}
-
-static size_t resampler_get_required_frames(resampler_t* state, size_t frames)
-{
-   assert(state);
+   size_t pos = state->ring_offset + state->ring_frames;
+   if (pos >= state->capacity)
+      pos -= state->capacity;
 
-   size_t after_sum = state->sum_output_frames + frames;
+   for (int c = 0; c < state->channels; c++)
+   {
+      float *ring = state->ring + c * 2 * state->capacity;
+      size_t p = pos;
+      for (size_t i = 0; i < frames; i++)
+      {
+         float sample = in[FRAMES_TO_SAMPLES(i, state) + c];
+         ring[p] = sample;
+         ring[p + state->capacity] = sample;
+         if (++p == state->capacity)
+            p = 0;
+      }
+   }
 
-   size_t min_input_frames = (size_t)((after_sum / state->ratio) + 2.0);
-   return min_input_frames - state->sum_input_frames;
+   state->ring_frames += frames;
 }
 
-static void poly_create_3(float *poly, float *y)
+// Drops the input frames before start, even those that haven't been read yet.
+static void resampler_discard(resampler_t *state, uint64_t start)
 {
-   poly[2] = (y[0] - 2*y[1] + y[2])/2;
-   poly[1] = -1.5*y[0] + 2*y[1] - 0.5*y[2];
-   poly[0] = y[0];
+   if (start <= state->ring_start)
+      return;
+
+   uint64_t frames = start - state->ring_start;
+   if (frames > state->ring_frames)
+      frames = state->ring_frames;
+   state->ring_start += frames;
+   state->ring_frames -= frames;
+   state->ring_offset += frames;
+   if (state->ring_offset >= state->capacity)
+      state->ring_offset -= state->capacity;
 }
 
-static size_t resampler_process(resampler_t *state, size_t frames, float *out_data)
+// Makes sure the rings hold the input frames from start up to end.
+static int resampler_fill(resampler_t *state, uint64_t start, uint64_t end)
 {
-   size_t frames_used = 0;
-   uint64_t pos_out;
-   double pos_in = 0.0;
-
-#if 0
-   log_printf("=========================================\n");
-   log_printf("Output: %zu frames.\n", frames);
-   log_printf("Output frames: %zu - %zu\n", state->sum_output_frames, state->sum_output_frames + frames);
-   log_printf("Needed input frames: %zu - %zu\n", (size_t)(state->sum_output_frames/state->ratio), (size_t)((state->sum_output_frames + frames)/state->ratio + 1.0));
-   log_printf("Current input frames: %zu - %zu\n", state->sum_input_frames, state->sum_input_frames + SAMPLES_TO_FRAMES(state->data_ptr, state));
-   log_printf("=========================================\n");
-
-   assert(state->sum_input_frames <= (size_t)(state->sum_output_frames/state->ratio));
-   assert(state->sum_input_frames + SAMPLES_TO_FRAMES(state->data_ptr, state) - 1 >= (size_t)((state->sum_output_frames + frames - 1)/state->ratio + 1.0));
-#endif
-
-   for (uint64_t x = state->sum_output_frames; x < state->sum_output_frames + frames; x++)
+   for (;;)
    {
-      pos_out = x - state->sum_output_frames;
-      pos_in  = ((double)x / state->ratio) - (double)state->sum_input_frames;
-      //pos_in = pos_out / state->ratio;
-      //log_printf("pos_in: %15.7lf\n", pos_in + state->sum_input_frames);
-      for (int c = 0; c < state->channels; c++)
+      resampler_discard(state, start);
+      if (state->ring_start + state->ring_frames >= end)
+         return 0;
+
+      if (state->saved_frames == 0)
       {
+         float *ptr = NULL;
+         size_t ret = state->func(state->cb_data, &ptr);
 
+         if (ret == 0 || ptr == NULL) // We're done.
+            return -1;
 
-         float poly[3];
-         float data[3];
-         float x_val;
-
-         if ((int)pos_in == 0)
-         {
-            data[0] = state->data[0 * state->channels + c];
-            data[1] = state->data[1 * state->channels + c];
-            data[2] = state->data[2 * state->channels + c];
-            x_val = pos_in;
-         }
-         else
-         {
-            data[0] = state->data[((int)pos_in - 1) * state->channels + c];
-            data[1] = state->data[((int)pos_in + 0) * state->channels + c];
-            data[2] = state->data[((int)pos_in + 1) * state->channels + c];
-            x_val = pos_in - (int)pos_in + 1.0;
-         }
-
-         poly_create_3(poly, data);
-         
-         out_data[pos_out * state->channels + c] = poly[2] * x_val * x_val + poly[1] * x_val + poly[0];
+         state->saved = ptr;
+         state->saved_frames = ret;
       }
+
+      size_t frames = state->capacity - state->ring_frames;
+      if (frames > state->saved_frames)
+         frames = state->saved_frames;
+
+      resampler_push(state, state->saved, frames);
+      state->saved += FRAMES_TO_SAMPLES(frames, state);
+      state->saved_frames -= frames;
    }
-   frames_used = (int)pos_in;
-   return frames_used;
 }
 
 ssize_t resampler_cb_read(resampler_t *state, size_t frames, float *data)
@@ -182,68 +524,26 @@ ssize_t resampler_cb_read(resampler_t *state, size_t frames, float *data)
    assert(state);
    assert(data);
 
-
-   // How many frames must we have to resample?
-   size_t req_frames = resampler_get_required_frames(state, frames);
-
-   // Do we need to read more data?
-   if (SAMPLES_TO_FRAMES(state->data_ptr, state) < req_frames)
+   for (size_t i = 0; i < frames; i++)
    {
-      size_t must_read = req_frames - SAMPLES_TO_FRAMES(state->data_ptr, state);
-      float temp_buf[FRAMES_TO_SAMPLES(must_read, state)];
-
-      size_t has_read = 0;
-
-      size_t copy_size = 0;
-      size_t ret = 0;
-      float *ptr = NULL;
-      while (has_read < must_read)
+      // Old frames are only dropped when we need room for new ones.
+      if (state->pos + state->window > state->ring_start + state->ring_frames &&
+            resampler_fill(state, state->pos, state->pos + state->window) < 0)
+         return -1;
+
+      size_t offset = state->ring_offset + (size_t)(state->pos - state->ring_start);
+      if (offset >= state->capacity)
+         offset -= state->capacity;
+      state->process(state, data + FRAMES_TO_SAMPLES(i, state), state->ring + offset);
+
+      state->pos += state->step_int;
+      state->phase += state->step_frac;
+      if (state->phase >= state->den)
       {
-         ret = state->func(state->cb_data, &ptr);
-
-         if (ret == 0 || ptr == NULL) // We're done.
-            return -1;
-
-         copy_size = (ret > must_read - has_read) ? (must_read - has_read) : ret;
-         memcpy(temp_buf + FRAMES_TO_SAMPLES(has_read, state), ptr, FRAMES_TO_SAMPLES(copy_size, state) * sizeof(float));
-
-         has_read += ret;
-      }
-
-      // We might have gotten a lot of data from the callback. We should realloc our buffer if needed.
-      size_t req_buffer_frames = SAMPLES_TO_FRAMES(state->data_ptr, state) + has_read;
-
-      if (req_buffer_frames > SAMPLES_TO_FRAMES(state->data_size, state))
-      {
-         state->data = realloc(state->data, FRAMES_TO_SAMPLES(req_buffer_frames, state) * sizeof(float));
-         if (state->data == NULL)
-            return -1;
-
-         state->data_size = FRAMES_TO_SAMPLES(req_buffer_frames, state);
-      }
-      
-      memcpy(state->data + state->data_ptr, temp_buf, FRAMES_TO_SAMPLES(must_read, state) * sizeof(float));
-      state->data_ptr += FRAMES_TO_SAMPLES(must_read, state);
-
-      // We have some data from the callback we need to copy over as well.
-      if (ret > copy_size)
-      {
-         memcpy(state->data + state->data_ptr, ptr + FRAMES_TO_SAMPLES(copy_size, state), FRAMES_TO_SAMPLES(ret - copy_size, state) * sizeof(float));
-         state->data_ptr += FRAMES_TO_SAMPLES(ret - copy_size, state);
+         state->phase -= state->den;
+         state->pos++;
       }
    }
 
-   // Phew. We should have enough data in our buffer now to be able to process the data we need.
-
-   size_t frames_used = resampler_process(state, frames, data);
-   state->sum_input_frames += frames_used;
-   memmove(state->data, state->data + FRAMES_TO_SAMPLES(frames_used, state), (state->data_ptr - FRAMES_TO_SAMPLES(frames_used, state)) * sizeof(float));
-   state->data_ptr -= FRAMES_TO_SAMPLES(frames_used, state);
-   state->sum_output_frames += frames;
-
    return frames;
 }
-
-
-
-
@@ -24,18 +24,32 @@
 extern "C" {
 #endif
 
+// Hands out more input, and returns how many frames it is. Like with libsamplerate, the data
+// has to stay valid until the callback is called again.
 typedef size_t (*resampler_cb_t) (void *cb_data, float **data);
 
 typedef struct resampler resampler_t;
 
-resampler_t* resampler_new(resampler_cb_t func, double ratio, int channels, void* cb_data);
+// Quality 1 is a quadratic interpolator. 2 to 5 are windowed sinc filters, getting sharper and slower.
+#define RESAMPLER_QUALITY_MIN 1
+#define RESAMPLER_QUALITY_QUADRATIC 1
+#define RESAMPLER_QUALITY_DEFAULT 3
+#define RESAMPLER_QUALITY_MAX 5
+
+resampler_t* resampler_new(resampler_cb_t func, double ratio, int channels, int quality, void* cb_data);
 ssize_t resampler_cb_read(resampler_t *state, size_t frames, float *data);
 void resampler_free(resampler_t* state);
 
+// Changes the ratio from the next output frame on, e.g. to follow a drifting clock. The filter stays
+// the one made for the ratio given to resampler_new(), so the new ratio should be close to that.
+int resampler_set_ratio(resampler_t *state, double ratio);
+
+// How many input frames past the last output frame's position must be available to compute it.
+size_t resampler_lookahead(const resampler_t *state);
+
+// From floats in [-1, 1], like audio_convert() makes with RSD_S16_TO_FLOAT and RSD_S32_TO_FLOAT.
 void resampler_float_to_s16(int16_t * restrict out, const float * restrict in, size_t samples);
 void resampler_float_to_s32(int32_t * restrict out, const float * restrict in, size_t samples);
-void resampler_s16_to_float(float * restrict out, const int16_t * restrict in, size_t samples);
-void resampler_s32_to_float(float * restrict out, const int32_t * restrict in, size_t samples);
 
 #ifdef __cplusplus
 }
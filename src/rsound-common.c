@@ -21,6 +21,10 @@
 #include "endian.h"
 #include "audio.h"
 #include "proto.h"
+#include "mixer.h"
+#include "reactor.h"
+#include "pool.h"
+#include "drift.h"
 #include <stdarg.h>
 
 #ifndef _WIN32
@@ -30,6 +34,7 @@
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/un.h>
+#include <sys/ioctl.h>
 #else
 #ifndef _WIN32_WINNT
 #define _WIN32_WINNT 0x0501
@@ -99,8 +104,17 @@ extern const rsd_backend_callback_t rsd_ds;
 extern const rsd_backend_callback_t rsd_coreaudio;
 #endif
 
+/* These don't need any hardware, and are always there. */
+#ifndef _WIN32
+extern const rsd_backend_callback_t rsd_null;
+extern const rsd_backend_callback_t rsd_file;
+#endif
+
 
 #define MAX_PACKET_SIZE 1024
+/* A client which ended its stream with RESET, and then didn't say anything for this long, is disconnected.
+   It holds on to a thread (or a worker with --workers) while we wait, and will simply reconnect if it comes back. */
+#define PARKED_TIMEOUT_MS 10000
 
 static void print_help(void);
 static void* rsd_thread(void*);
@@ -122,6 +136,22 @@ void initialize_audio ( void )
 {
    if ( backend->initialize )
       backend->initialize();
+
+#ifdef HAVE_EPOLL
+   if ( event_loop_workers > 0 && reactor_init(event_loop_workers) < 0 )
+   {
+      log_printf("Failed to start event loop ...\n");
+      exit(1);
+   }
+#endif
+
+#ifndef _WIN32
+   if ( pool_workers > 0 && pool_init(pool_workers, pool_stack_size * 1024, handle_connection) < 0 )
+   {
+      log_printf("Failed to start worker threads ...\n");
+      exit(1);
+   }
+#endif
 }
 
 #ifdef _WIN32
@@ -220,6 +250,31 @@ void new_sound_thread ( connection_t connection )
    }
 #endif
 
+#ifdef HAVE_EPOLL
+   if ( event_loop_workers > 0 )
+   {
+      if ( reactor_add(*conn) < 0 )
+         goto error;
+
+      free(conn);
+      return;
+   }
+#endif
+
+#ifndef _WIN32
+   if ( pool_workers > 0 )
+   {
+      if ( pool_push(*conn) < 0 )
+      {
+         log_printf("All workers are busy. Rejecting connection.\n");
+         goto error;
+      }
+
+      free(conn);
+      return;
+   }
+#endif
+
 #ifndef _WIN32
    /* If we're not using serveral threads, we must wait for the last thread to join. */
    if ( no_threading && last_thread != 0 )
@@ -248,7 +303,8 @@ void new_sound_thread ( connection_t connection )
    /* Cleanup if fcntl failed. */
 error:
    close(conn->socket);
-   close(conn->ctl_socket);
+   if ( conn->ctl_socket > 0 )
+      close(conn->ctl_socket);
    free(conn);
 }
 
@@ -270,9 +326,7 @@ void parse_input(int argc, char **argv)
       { "bind", 1, NULL, 'H' },
       { "rate", 1, NULL, 'R' },
       { "backend", 1, NULL, 'b' },
-#ifdef HAVE_SAMPLERATE
       { "resampler", 1, NULL, 'Q' },
-#endif
 #ifdef HAVE_SYSLOG
       { "syslog", 0, NULL, 'L' },
 #endif
@@ -280,9 +334,16 @@ void parse_input(int argc, char **argv)
       { "sock", 1, NULL, 'S' },
       { "kill", 0, NULL, 'K' },
       { "single", 0, NULL, 'T' },
+      { "workers", 1, NULL, 'W' },
+      { "worker-stack", 1, NULL, 'Z' },
       { "device", 1, NULL, 'd' },
 #endif
       { "daemon", 0, NULL, 'D' },
+      { "mixer", 0, NULL, 'M' },
+      { "adaptive", 1, NULL, 'A' },
+#ifdef HAVE_EPOLL
+      { "event-loop", 1, NULL, 'E' },
+#endif
       { NULL, 0, NULL, 0 }
    };
 
@@ -296,13 +357,7 @@ void parse_input(int argc, char **argv)
 #define LOG_ARGUMENT
 #endif
 
-#ifdef HAVE_SAMPLERATE
-#define SAMPLERATE_ARGUMENT "Q:"
-#else
-#define SAMPLERATE_ARGUMENT
-#endif
-
-   char optstring[] = "d:b:p:R:DvhQ:" LOG_ARGUMENT SAMPLERATE_ARGUMENT;
+   char optstring[] = "d:b:p:R:DvhQ:" LOG_ARGUMENT;
 
 #endif
 
@@ -322,8 +377,8 @@ void parse_input(int argc, char **argv)
             break;
 #endif
 
-#ifdef HAVE_SAMPLERATE
          case 'Q':
+#ifdef HAVE_SAMPLERATE
             src_converter = strtol(optarg, NULL, 10);
             switch (src_converter)
             {
@@ -346,9 +401,16 @@ void parse_input(int argc, char **argv)
                   log_printf("Invalid quality given. Needs value between 1 and 5.\n");
                   exit(1);
             }
+#else
+            resampler_quality = strtol(optarg, NULL, 10);
+            if ( resampler_quality < RESAMPLER_QUALITY_MIN || resampler_quality > RESAMPLER_QUALITY_MAX )
+            {
+               log_printf("Invalid quality given. Needs value between %d and %d.\n", RESAMPLER_QUALITY_MIN, RESAMPLER_QUALITY_MAX);
+               exit(1);
+            }
+#endif
 
             break;
-#endif
 
          case 'p':
             strncpy(port, optarg, 127);
@@ -386,6 +448,25 @@ void parse_input(int argc, char **argv)
             no_threading = 1;
             break;
 #endif
+#ifndef _WIN32
+         case 'W':
+            pool_workers = strtol(optarg, NULL, 10);
+            if ( pool_workers <= 0 )
+            {
+               log_printf("Invalid number of worker threads.\n");
+               exit(1);
+            }
+            break;
+
+         case 'Z':
+            pool_stack_size = strtol(optarg, NULL, 10);
+            if ( pool_stack_size <= 0 )
+            {
+               log_printf("Invalid stack size for worker threads.\n");
+               exit(1);
+            }
+            break;
+#endif
 #ifndef _WIN32
          case 'K':
             pidfile = fopen(PIDFILE, "r");
@@ -496,6 +577,18 @@ void parse_input(int argc, char **argv)
                break;
             }
 #endif
+#ifndef _WIN32
+            if ( !strcmp( "null", optarg) )
+            {
+               backend = &rsd_null;
+               break;
+            }
+            if ( !strcmp( "file", optarg) )
+            {
+               backend = &rsd_file;
+               break;
+            }
+#endif
 
             log_printf("\nValid backend not given. Exiting ...\n\n");
             print_help();
@@ -505,6 +598,32 @@ void parse_input(int argc, char **argv)
             daemonize = 1;
             break;
 
+         case 'M':
+            use_mixer = 1;
+            break;
+
+         case 'A':
+            adaptive_latency = strtol(optarg, NULL, 10);
+            if ( adaptive_latency <= 0 )
+            {
+               log_printf("Invalid latency for --adaptive.\n");
+               exit(1);
+            }
+            break;
+
+#ifdef HAVE_EPOLL
+         case 'E':
+            event_loop_workers = strtol(optarg, NULL, 10);
+            if ( event_loop_workers <= 0 )
+            {
+               log_printf("Invalid number of event loop threads.\n");
+               exit(1);
+            }
+            // Writes can never block in the event loop, which only the mixer can promise.
+            use_mixer = 1;
+            break;
+#endif
+
          case 'v':
             verbose = 1;
             break;
@@ -591,6 +710,17 @@ void parse_input(int argc, char **argv)
       exit(1);
    }
 
+   // The event loop never goes through handle_connection(), where the drift is followed.
+   if ( adaptive_latency && event_loop_workers > 0 )
+      log_printf("--adaptive has no effect with --event-loop.\n");
+
+   /* All connections go through the mixer, which is the only one talking to the real backend. */
+   if ( use_mixer )
+   {
+      mixer_set_device(backend);
+      backend = &rsd_mixer;
+   }
+
 }
 
 static void print_help()
@@ -598,17 +728,16 @@ static void print_help()
    printf("rsd - version %s - Copyright (C) 2010-2011 Hans-Kristian Arntzen\n", RSD_VERSION);
    printf("==========================================================================\n");
 #ifdef _WIN32
-   printf("Usage: rsd [ -p/--port | --bind | -R/--rate | -v/--verbose | --debug | -h/--help | -D/--daemon ]\n");
-#else
-#ifdef HAVE_SAMPLERATE
-   printf("Usage: rsd [ -d/--device | -b/--backend | -p/--port | --bind | -R/--rate | -Q/--resampler | -D/--daemon | -v/--verbose | --debug | -h/--help | --single | --kill ]\n");
+   printf("Usage: rsd [ -p/--port | --bind | -R/--rate | -v/--verbose | --debug | -h/--help | -D/--daemon | --mixer | --adaptive ]\n");
 #else
-   printf("Usage: rsd [ -d/--device | -b/--backend | -p/--port | --bind | -R/--rate | -D/--daemon | -v/--verbose | --debug | -h/--help | --single | --kill ]\n");
-#endif
+   printf("Usage: rsd [ -d/--device | -b/--backend | -p/--port | --bind | -R/--rate | -Q/--resampler | -D/--daemon | -v/--verbose | --debug | -h/--help | --single | --workers | --worker-stack | --kill | --mixer | --event-loop | --adaptive ]\n");
 #endif
    printf("\n-d/--device: Specifies a device to use. This is backend specific.\n");
    printf("  Examples:\n\t-d hw:1,0\n\t-d /dev/audio\n\t-d system:playback_1,system:playback_2\n\t"
           "    Defaults to \"default\" for alsa and /dev/dsp for OSS\n");
+#ifndef _WIN32
+   printf("  For the file backend, this is the WAV file to write to. Defaults to rsd-<n>.wav, one file per stream.\n");
+#endif
 
    printf("\n-b/--backend: Specifies which audio backend to use.\n");
    printf("Supported backends: ");
@@ -646,19 +775,33 @@ static void print_help()
 #ifdef _COREAUDIO
    printf("coreaudio ");
 #endif
+#ifndef _WIN32
+   printf("null file ");
+#endif
 
    putchar('\n');
    putchar('\n');
 
    printf("-D/--daemon: Runs as daemon.\n");
+   printf("--mixer: Mixes all connections together in rsd before sending audio to a single instance of the audio driver.\n");
+#ifdef HAVE_EPOLL
+   printf("--event-loop: Handles all connections with the given number of event driven threads rather than a thread per connection. Implies --mixer.\n");
+#endif
 #ifndef _WIN32
    printf("-p/--port: Defines which port to listen on.\n");
    printf("--single: Only allows a single connection at a time.\n");
+   printf("--workers: Handles connections with a fixed number of worker threads spawned at startup. Connections are rejected if too many are waiting for a worker.\n");
+   printf("--worker-stack: Stack size in KiB of the threads spawned by --workers.\n");
    printf("--kill: Cleanly shuts downs the running rsd process.\n");
 #endif
    printf("-R/--rate: Resamples all audio to defined samplerate before sending audio to the audio drivers. Mostly used if audio driver does not provide proper resampling.\n");
+   printf("--adaptive: Keeps the audio buffered for every stream at the given number of milliseconds, by always resampling and adjusting the ratio slightly as the clocks of the client and the sound card drift apart.\n");
+   printf("\tExample: --adaptive 60\n");
 #ifdef HAVE_SAMPLERATE
    printf("-Q/--resampler: Value from 1 (worst) to 5 (best) (default: 3) defines quality of libsamplerate resampling.\n"); 
+#else
+   printf("-Q/--resampler: Value from 1 (worst) to 5 (best) (default: 3) defines quality of resampling.\n");
+   printf("\t1 is quadratic interpolation. 2 to 5 are windowed sinc filters with 16 to 128 taps.\n");
 #endif
 #ifdef HAVE_SYSLOG
    printf("-L/--syslog: Redirects all console output to syslog.\n");
@@ -691,15 +834,6 @@ static void pheader(wav_header_t *w)
 /* Reads raw 44 bytes WAV header from client and parses this (naive approach) */
 static int get_wav_header(connection_t conn, wav_header_t* head)
 {
-
-   /* Are we on a little endian system?
-    * WAV files are little-endian. If server is big-endian, swaps over data to get sane results. */
-   int i = is_little_endian();
-   uint16_t temp16;
-   uint32_t temp32;
-   uint16_t temp_format;
-   uint16_t pcm;
-
    int rc = 0;
    char header[HEADER_SIZE] = {0};
 
@@ -710,6 +844,20 @@ static int get_wav_header(connection_t conn, wav_header_t* head)
       return -1;
    }
 
+   return parse_wav_header(header, head);
+}
+
+/* Parses a raw 44 bytes WAV header. */
+int parse_wav_header(const char *header, wav_header_t* head)
+{
+   /* Are we on a little endian system?
+    * WAV files are little-endian. If server is big-endian, swaps over data to get sane results. */
+   int i = is_little_endian();
+   uint16_t temp16;
+   uint32_t temp32;
+   uint16_t temp_format;
+   uint16_t pcm;
+
    /* Since we can't really rely on that the compiler doesn't pad our structs in funny ways (portability ftw), we need to do it this
       horrid way. :v */
 
@@ -723,6 +871,10 @@ static int get_wav_header(connection_t conn, wav_header_t* head)
       If this is 0 (RSD_UNSPEC) or some undefined value, we assume the default of S16_LE for 16 bit and U8 for 8bit. (We can assume that the client is using an old version of librsound since it sets 0
       by default in the header. */
 #define FORMAT 42
+   /* The RIFF chunk size is useless to us, as the stream has no known length. Newer clients ask for framing here. */
+#define RIFF_SIZE 4
+   /* Lower half of the data chunk size. Newer clients put protocol flags (RSD_PROTO_FLAG_*) here. */
+#define PROTO_FLAGS 40
 
 
    temp16 = *((uint16_t*)(header+CHANNELS));
@@ -750,6 +902,17 @@ static int get_wav_header(connection_t conn, wav_header_t* head)
       swap_endian_16 ( &temp16 );
    pcm = temp16;
 
+   temp32 = *((uint32_t*)(header+RIFF_SIZE));
+   if (!i)
+      swap_endian_32 ( &temp32 );
+   head->framed = temp32 == RSD_FRAME_MAGIC;
+
+   // Other clients might well put a real data chunk size there, so only trust it along with the magic.
+   temp16 = *((uint16_t*)(header+PROTO_FLAGS));
+   if (!i)
+      swap_endian_16 ( &temp16 );
+   head->proto_flags = (temp32 == RSD_FRAME_MAGIC || temp32 == RSD_PROTO_MAGIC) ? temp16 : 0;
+
    // Checks bits to get a default should the format not be set.
    switch ( head->bitsPerSample )
    {
@@ -836,7 +999,7 @@ static int get_wav_header(connection_t conn, wav_header_t* head)
    return 0;
 }
 
-static int send_backend_info(connection_t conn, backend_info_t *backend )
+int send_backend_info(connection_t conn, backend_info_t *backend )
 {
 
    // Magic 8 bytes that server sends to the client.
@@ -847,6 +1010,8 @@ static int send_backend_info(connection_t conn, backend_info_t *backend )
 #define RSND_HEADER_SIZE 16
 #define LATENCY 0
 #define CHUNKSIZE 1
+#define FRAMED 2
+#define ACK_FLAGS 3
 
    int rc = 0;
    struct pollfd fd;
@@ -859,12 +1024,18 @@ static int send_backend_info(connection_t conn, backend_info_t *backend )
    header[LATENCY] = backend->latency;
    // Preferred TCP packet size. (Fragsize for audio backend. Might be ignored by client.)
    header[CHUNKSIZE] = backend->chunk_size;
+   // Tells the client that we'll go along with framing.
+   header[FRAMED] = conn.framed ? RSD_FRAME_MAGIC : 0;
+   // The protocol flags we go along with.
+   header[ACK_FLAGS] = (conn.binary_ctl ? RSD_PROTO_FLAG_BINARY : 0) | (conn.reset ? RSD_PROTO_FLAG_RESET : 0);
 
    // For some reason, htonl was borked. :<
    if ( is_little_endian() )
    {
       swap_endian_32(&header[LATENCY]);
       swap_endian_32(&header[CHUNKSIZE]);
+      swap_endian_32(&header[FRAMED]);
+      swap_endian_32(&header[ACK_FLAGS]);
    }
 
    fd.fd = conn.socket;
@@ -879,7 +1050,10 @@ static int send_backend_info(connection_t conn, backend_info_t *backend )
    if ( rc != RSND_HEADER_SIZE)
       return -1;
 
-   // RSD will no longer use this for writing
+   // RSD will no longer use this for writing, unless we're framing.
+   if ( conn.framed )
+      return 0;
+
 #ifdef _WIN32
    shutdown(conn.socket, SD_SEND);
 #else
@@ -889,6 +1063,32 @@ static int send_backend_info(connection_t conn, backend_info_t *backend )
    return 0;
 }
 
+#define MAX_TCP_BUFSIZ (1 << 14)
+
+/* Tunes socket buffers to the chunk size of the backend. */
+void set_socket_options(connection_t conn, const backend_info_t *backend_info)
+{
+   // We only bother with setting buffer size if we're doing TCP.
+   if ( rsd_conn_type == RSD_CONN_TCP )
+   {
+      int flag = 1;
+      int bufsiz = backend_info->chunk_size * 32;
+      if (bufsiz > MAX_TCP_BUFSIZ)
+         bufsiz = MAX_TCP_BUFSIZ;
+
+      setsockopt(conn.socket, SOL_SOCKET, SO_RCVBUF, CONST_CAST &bufsiz, sizeof(int));
+
+      if ( conn.ctl_socket )
+      {
+         setsockopt(conn.ctl_socket, SOL_SOCKET, SO_RCVBUF, CONST_CAST &bufsiz, sizeof(int));
+         setsockopt(conn.ctl_socket, SOL_SOCKET, SO_SNDBUF, CONST_CAST &bufsiz, sizeof(int));
+         setsockopt(conn.ctl_socket, IPPROTO_TCP, TCP_NODELAY, CONST_CAST &flag, sizeof(int));
+      }
+
+      setsockopt(conn.socket, IPPROTO_TCP, TCP_NODELAY, CONST_CAST &flag, sizeof(int));
+   }
+}
+
 /* Sets up listening socket for further use */
 int set_up_socket()
 {
@@ -1016,7 +1216,8 @@ error:
 /* Makes sure that size data is recieved in full. Else, returns a 0. 
    Old protocol: If the control socket is set, this is a sign that it has been closed (for some reason),
    which currently means that we should stop the connection immediately.
-   New protocol: If the control socket is set, we should handle it! */
+   New protocol: If the control socket is set, we should handle it! 
+   Framed protocol: Control messages come in between the audio on the data socket. */
 
 int receive_data(void *data, connection_t *conn, void* buffer, size_t size)
 {
@@ -1034,6 +1235,10 @@ int receive_data(void *data, connection_t *conn, void* buffer, size_t size)
 
    while ( read < size )
    {
+      // The client is done with this stream. What we have read of it so far is dropped.
+      if ( conn->reset_pending )
+         return 0;
+
       // We check this in a loop since ctl_socket might change in handle_ctl_request().
       if ( conn->ctl_socket > 0 )
          fds = 2;
@@ -1061,7 +1266,16 @@ int receive_data(void *data, connection_t *conn, void* buffer, size_t size)
       if ( fd[0].revents & POLLIN )
       {
          read_size = size - read > MAX_PACKET_SIZE ? MAX_PACKET_SIZE : size - read;
-         rc = recv(conn->socket, (char*)buffer + read, read_size, 0);
+         if ( conn->framed )
+         {
+            rc = recv_frames(conn, data, (char*)buffer + read, read_size);
+            // Only got (parts of) a control frame.
+            if ( rc < 0 && errno == EAGAIN )
+               continue;
+         }
+         else
+            rc = recv(conn->socket, (char*)buffer + read, read_size, 0);
+
          if ( rc <= 0 )
             return 0;
 
@@ -1075,14 +1289,44 @@ int receive_data(void *data, connection_t *conn, void* buffer, size_t size)
    return read;
 }
 
-/* All and mighty connection handler. */
 static void* rsd_thread(void *thread_data)
+{
+   connection_t *conn = thread_data;
+   connection_t temp_conn = *conn;
+   free(conn);
+
+   handle_connection(temp_conn);
+   pthread_exit(NULL);
+}
+
+/* How much audio is waiting to be played: what the backend has, and what sits unread in the socket.
+ * in is what the client sends, out what we write to the backend. */
+static double buffered_seconds(connection_t *conn, void *data, const wav_header_t *in, const wav_header_t *out)
+{
+   double seconds = (double)backend->latency(data) /
+      (out->sampleRate * out->numChannels * rsnd_format_to_bytes(out->rsd_format));
+
+#ifdef _WIN32
+   u_long queued = 0;
+   if ( ioctlsocket(conn->socket, FIONREAD, &queued) == 0 )
+#else
+   int queued = 0;
+   if ( ioctl(conn->socket, FIONREAD, &queued) == 0 )
+#endif
+      seconds += (double)queued / (in->sampleRate * in->numChannels * rsnd_format_to_bytes(in->rsd_format));
+
+   return seconds;
+}
+
+/* All and mighty connection handler. */
+void handle_connection(connection_t temp_conn)
 {
    connection_t conn;
    void *data = NULL;
    wav_header_t w;
    wav_header_t w_orig;
    int resample = 0;
+   int reset = 0;
    int rc, written;
    void *buffer = NULL;
 #ifdef HAVE_SAMPLERATE
@@ -1092,14 +1336,19 @@ static void* rsd_thread(void *thread_data)
 #endif
    float *resample_buffer = NULL;
    resample_cb_state_t cb_data;
-
-   connection_t *temp_conn = thread_data;
-   conn.socket = temp_conn->socket;
-   conn.ctl_socket = temp_conn->ctl_socket;
+   memset(&cb_data, 0, sizeof(cb_data));
+   double resample_ratio = 1.0;
+   double drift_correction = 1.0;
+   double drift_log = 10.0;
+   drift_t drift;
+   drift_init(&drift, adaptive_latency / 1000.0);
+
+   memset(&conn, 0, sizeof(conn));
+   conn.socket = temp_conn.socket;
+   conn.ctl_socket = temp_conn.ctl_socket;
    conn.serv_ptr = 0;
    conn.rate_ratio = 1.0;
    conn.identity[0] = '\0';
-   free(temp_conn);
 
    if ( debug )
       log_printf("Connection accepted, awaiting WAV header data ...\n");
@@ -1109,15 +1358,25 @@ static void* rsd_thread(void *thread_data)
    if ( rc == -1 )
    {
       close(conn.socket);
-      close(conn.ctl_socket);
+      if ( conn.ctl_socket > 0 )
+         close(conn.ctl_socket);
       log_printf("Couldn't read WAV header... Disconnecting.\n");
-      pthread_exit(NULL);
+      return;
    }
+   conn.framed = w.framed;
+   conn.binary_ctl = w.proto_flags & RSD_PROTO_FLAG_BINARY;
+   conn.reset = conn.framed && conn.binary_ctl && (w.proto_flags & RSD_PROTO_FLAG_RESET);
+
+   /* After a RESET, we start over from here with the new header. */
+new_stream:
    memcpy(&w_orig, &w, sizeof(wav_header_t));
+   resample = 0;
+   conn.rate_ratio = 1.0;
 
-   if ( resample_freq > 0 && resample_freq != (int)w.sampleRate )
+   if ( (resample_freq > 0 && resample_freq != (int)w.sampleRate) || adaptive_latency )
    {
-      w.sampleRate = resample_freq;
+      if ( resample_freq > 0 )
+         w.sampleRate = resample_freq;
       w.bitsPerSample = w_orig.bitsPerSample == 32 ? 32 : 16;
       if (w_orig.bitsPerSample == 32)
          w.rsd_format = (is_little_endian()) ? RSD_S32_LE : RSD_S32_BE;
@@ -1197,16 +1456,25 @@ static void* rsd_thread(void *thread_data)
          goto rsd_exit;
       }
 
-      cb_data.format = w_orig.rsd_format;
-      cb_data.data = data;
-      cb_data.conn = &conn;
-      cb_data.framesize = w_orig.numChannels * rsnd_format_to_bytes(w_orig.rsd_format);
+      // Pull about one chunk's worth of output per callback, so neither the
+      // socket nor the converter gets called for every few frames.
+      resample_ratio = (double)w.sampleRate / w_orig.sampleRate;
+      size_t frames_out = BYTES_TO_SAMPLES(size, w.rsd_format) / w.numChannels;
+      size_t frames_in = (frames_out * w_orig.sampleRate + w.sampleRate - 1) / w.sampleRate;
+      if ( frames_in == 0 )
+         frames_in = 1;
+
+      if ( resample_cb_init(&cb_data, w_orig.rsd_format, w_orig.numChannels, frames_in, data, &conn) < 0 )
+      {
+         log_printf("Cannot resample %s.\n", rsnd_format_to_string(w_orig.rsd_format));
+         goto rsd_exit;
+      }
 
 #ifdef HAVE_SAMPLERATE
       int err;
       resample_state = src_callback_new(resample_callback, src_converter, w.numChannels, &err, &cb_data);
 #else
-      resample_state = resampler_new(resample_callback, (float)w.sampleRate/w_orig.sampleRate, w.numChannels, &cb_data);
+      resample_state = resampler_new(resample_callback, resample_ratio, w.numChannels, resampler_quality, &cb_data);
 #endif
       if ( resample_state == NULL )
       {
@@ -1215,30 +1483,15 @@ static void* rsd_thread(void *thread_data)
       }
    }
 
-#define MAX_TCP_BUFSIZ (1 << 14)
-
-   // We only bother with setting buffer size if we're doing TCP.
-   if ( rsd_conn_type == RSD_CONN_TCP )
-   {
-      int flag = 1;
-      int bufsiz = backend_info.chunk_size * 32;
-      if (bufsiz > MAX_TCP_BUFSIZ)
-         bufsiz = MAX_TCP_BUFSIZ;
+   set_socket_options(conn, &backend_info);
 
-      setsockopt(conn.socket, SOL_SOCKET, SO_RCVBUF, CONST_CAST &bufsiz, sizeof(int));
-
-      if ( conn.ctl_socket )
-      {
-         setsockopt(conn.ctl_socket, SOL_SOCKET, SO_RCVBUF, CONST_CAST &bufsiz, sizeof(int));
-         setsockopt(conn.ctl_socket, SOL_SOCKET, SO_SNDBUF, CONST_CAST &bufsiz, sizeof(int));
-         setsockopt(conn.ctl_socket, IPPROTO_TCP, TCP_NODELAY, CONST_CAST &flag, sizeof(int));
-      }
-
-      setsockopt(conn.socket, IPPROTO_TCP, TCP_NODELAY, CONST_CAST &flag, sizeof(int));
-   }
+   /* Now we can send backend info to client. After a RESET, the reply has it. */
+   if ( reset )
+      rc = send_reset_reply(&conn, &backend_info);
+   else
+      rc = send_backend_info(conn, &backend_info);
 
-   /* Now we can send backend info to client. */
-   if ( send_backend_info(conn, &backend_info) < 0 )
+   if ( rc < 0 )
    {
       log_printf("Failed to send backend info ...\n");
       goto rsd_exit;
@@ -1255,7 +1508,7 @@ static void* rsd_thread(void *thread_data)
 #ifdef HAVE_SAMPLERATE
          log_printf("(libsamplerate)\n");
 #else
-         log_printf("(internal quadratic resampler)\n");
+         log_printf("(internal resampler, quality %d)\n", resampler_quality);
 #endif
       }
    }
@@ -1272,12 +1525,13 @@ static void* rsd_thread(void *thread_data)
       if ( resample )
       {
 #ifdef HAVE_SAMPLERATE
-         rc = src_callback_read(resample_state, (double)w.sampleRate/(double)w_orig.sampleRate, BYTES_TO_SAMPLES(size, w.rsd_format)/w.numChannels, resample_buffer);
+         rc = src_callback_read(resample_state, resample_ratio * drift_correction, BYTES_TO_SAMPLES(size, w.rsd_format)/w.numChannels, resample_buffer);
          if (rsnd_format_to_bytes(w.rsd_format) == 4)
             src_float_to_int_array(resample_buffer, buffer, BYTES_TO_SAMPLES(size, w.rsd_format));
          else
             src_float_to_short_array(resample_buffer, buffer, BYTES_TO_SAMPLES(size, w.rsd_format));
 #else
+         resampler_set_ratio(resample_state, resample_ratio * drift_correction);
          rc = resampler_cb_read(resample_state, BYTES_TO_SAMPLES(size, w.rsd_format)/w.numChannels, resample_buffer);
          if (rsnd_format_to_bytes(w.rsd_format) == 4)
             resampler_float_to_s32(buffer, resample_buffer, BYTES_TO_SAMPLES(size, w.rsd_format));
@@ -1291,7 +1545,7 @@ static void* rsd_thread(void *thread_data)
       if ( rc <= 0 )
       {
          if ( debug )
-            log_printf("Client closed connection.\n");
+            log_printf(conn.reset_pending ? "Client ended stream.\n" : "Client closed connection.\n");
          goto rsd_exit;
       }
 
@@ -1303,23 +1557,28 @@ static void* rsd_thread(void *thread_data)
 
          written += rc;
       }
+
+      if ( adaptive_latency )
+      {
+         double period = (double)size / (w.sampleRate * w.numChannels * rsnd_format_to_bytes(w.rsd_format));
+         drift_correction = drift_update(&drift, buffered_seconds(&conn, data, &w_orig, &w), period);
+
+         if ( debug && drift.elapsed >= drift_log )
+         {
+            log_printf("Adaptive resampling: %.1f ms buffered, target %.1f ms, ratio %+.0f ppm.\n",
+                  drift.fill * 1000.0, drift.target * 1000.0, (drift_correction - 1.0) * 1e6);
+            drift_log += 10.0;
+         }
+      }
+
+      if ( send_report(&conn, data) < 0 )
+         goto rsd_exit;
    }
 
    /* Cleanup */
 rsd_exit:
-   if ( debug )
-      log_printf("Closed connection.\n\n");
-#ifdef _WIN32
-#undef close
-#endif
-   backend->close(data);
-#ifdef _WIN32
-#define close(x) closesocket(x)
-#endif
    free(buffer);
-   close(conn.socket);
-   if (conn.ctl_socket)
-      close(conn.ctl_socket);
+   buffer = NULL;
 
    if (resample_state)
    {
@@ -1328,8 +1587,78 @@ rsd_exit:
 #else
       resampler_free(resample_state);
 #endif
+      resample_state = NULL;
    }
+   resample_cb_free(&cb_data);
    free(resample_buffer);
-   pthread_exit(NULL);
+   resample_buffer = NULL;
+
+   /* On RESET, the device goes along with what it has yet to play, as it would have with STOP. The connection is kept. */
+   if ( conn.reset_pending )
+   {
+      if ( data != NULL )
+      {
+#ifdef _WIN32
+#undef close
+#endif
+         backend->close(data);
+#ifdef _WIN32
+#define close(x) closesocket(x)
+#endif
+         data = NULL;
+      }
+
+      /* The client only ended the stream, so we wait for it to start the next one. Stray audio is dropped. */
+      while ( !conn.reset_next )
+      {
+         char drop[256];
+         struct pollfd fd = {
+            .fd = conn.socket,
+            .events = POLLIN
+         };
+
+         conn.reset_pending = 0;
+         if ( poll(&fd, 1, PARKED_TIMEOUT_MS) <= 0 )
+         {
+            if ( debug )
+               log_printf("Client never started a new stream.\n");
+            break;
+         }
+
+         rc = recv_frames(&conn, NULL, drop, sizeof(drop));
+         if ( rc == 0 || (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) )
+            break;
+      }
+   }
+
+   if ( conn.reset_pending )
+   {
+      conn.reset_pending = 0;
+      conn.reset_next = 0;
+      if ( parse_wav_header(conn.reset_header, &w) == 0 )
+      {
+         reset = 1;
+         conn.serv_ptr = 0;
+         conn.next_report = 0;
+         drift_correction = 1.0;
+         drift_log = 10.0;
+         drift_init(&drift, adaptive_latency / 1000.0);
+         goto new_stream;
+      }
+   }
+
+   if ( debug )
+      log_printf("Closed connection.\n\n");
+#ifdef _WIN32
+#undef close
+#endif
+   if ( data != NULL )
+      backend->close(data);
+#ifdef _WIN32
+#define close(x) closesocket(x)
+#endif
+   close(conn.socket);
+   if (conn.ctl_socket)
+      close(conn.ctl_socket);
 }
 
@@ -35,6 +35,7 @@
 
 void parse_input(int, char**);
 void new_sound_thread(connection_t);
+void handle_connection(connection_t conn);
 int set_up_socket();
 void write_pid_file(void);
 #ifdef _WIN32
@@ -43,6 +44,9 @@ void cleanup(void);
 void cleanup(int);
 #endif
 void initialize_audio(void);
+int parse_wav_header(const char *header, wav_header_t *head);
+int send_backend_info(connection_t conn, backend_info_t *backend);
+void set_socket_options(connection_t conn, const backend_info_t *backend_info);
 void log_printf(const char *fmt, ...);
 
 extern char device[];
@@ -56,7 +60,16 @@ extern int daemonize;
 extern int debug;
 extern int rsd_conn_type;
 extern int resample_freq;
+extern int adaptive_latency;
+#ifdef HAVE_SAMPLERATE
 extern int src_converter;
+#else
+extern int resampler_quality;
+#endif
 extern int use_syslog;
+extern int use_mixer;
+extern int event_loop_workers;
+extern int pool_workers;
+extern int pool_stack_size;
 
 #endif 
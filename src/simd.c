@@ -0,0 +1,679 @@
+/*  RSound - A PCM audio client/server
+ *  Copyright (C) 2010-2011 - Hans-Kristian Arntzen
+ *
+ *  RSound is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RSound is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RSound.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Vector versions of the sample conversions, and of the resampler's filter. x86 kernels are built with target attributes,
+ * so the rest of rsd can be built for any x86, and we pick what the CPU has at runtime.
+ * NEON is part of every AArch64 CPU. 32-bit ARM builds get the NEON kernels when built
+ * with NEON enabled, and still check the hwcaps of the CPU before using them.
+ *
+ * Scaling a float by a power of two is exact, and so are int to float conversions with
+ * the default rounding mode, so the float conversions match the scalar code exactly.
+ * The resampler's rounding (truncating x + 0.5 in double precision) is matched by
+ * doing it in double precision as well, or with exact float arithmetic where that's
+ * all there is. */
+
+#include "simd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) || defined(__ARM_NEON)
+#define SIMD_HAVE_NEON 1
+#include <arm_neon.h>
+#if !defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+static unsigned simd_mask = ~0u;
+
+void simd_set_mask(unsigned mask)
+{
+   simd_mask = mask;
+}
+
+unsigned simd_features(void)
+{
+   unsigned features = 0;
+
+#ifdef SIMD_HAVE_X86
+   if ( __builtin_cpu_supports("sse2") )
+      features |= SIMD_SSE2;
+   if ( __builtin_cpu_supports("avx2") )
+      features |= SIMD_AVX2;
+#endif
+
+#ifdef SIMD_HAVE_NEON
+#if defined(__aarch64__)
+   features |= SIMD_NEON;
+#elif defined(__linux__)
+   if ( getauxval(AT_HWCAP) & HWCAP_NEON )
+      features |= SIMD_NEON;
+#else
+   features |= SIMD_NEON;
+#endif
+#endif
+
+   return features & simd_mask;
+}
+
+// Loops over whole vectors of samples. Each iteration reads in_step and writes out_step bytes.
+#define SIMD_LOOP(per, in_step, out_step, body) \
+   const uint8_t *in = in_; \
+   uint8_t *out = out_; \
+   size_t i; \
+   for ( i = 0; i + (per) <= samples; i += (per), in += (in_step), out += (out_step) ) \
+   { \
+      body \
+   } \
+   return i;
+
+#ifdef SIMD_HAVE_X86
+
+#define SSE2_INLINE static inline __attribute__((target("sse2")))
+#define SSE2_KERNEL static __attribute__((target("sse2"))) size_t
+#define AVX2_INLINE static inline __attribute__((target("avx2")))
+#define AVX2_KERNEL static __attribute__((target("avx2"))) size_t
+
+SSE2_INLINE __m128i sse2_swap16(__m128i x)
+{
+   return _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+}
+
+SSE2_INLINE __m128i sse2_swap32(__m128i x)
+{
+   x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+   x = _mm_shufflehi_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+   return sse2_swap16(x);
+}
+
+SSE2_INLINE __m128i sse2_flip16(__m128i x)
+{
+   return _mm_xor_si128(x, _mm_set1_epi16((short)0x8000));
+}
+
+SSE2_INLINE __m128i sse2_flip32(__m128i x)
+{
+   return _mm_xor_si128(x, _mm_set1_epi32((int)0x80000000));
+}
+
+SSE2_INLINE __m128i sse2_none(__m128i x)
+{
+   return x;
+}
+
+#define SSE2_MAP(name, bytes, func) \
+   SSE2_KERNEL name(void *out_, const void *in_, size_t samples) \
+   { \
+      SIMD_LOOP(16 / (bytes), 16, 16, \
+         _mm_storeu_si128((__m128i*)out, func(_mm_loadu_si128((const __m128i*)in)));) \
+   }
+
+SSE2_INLINE __m128i sse2_swap_flip16(__m128i x) { return sse2_flip16(sse2_swap16(x)); }
+SSE2_INLINE __m128i sse2_swap_flip32(__m128i x) { return sse2_flip32(sse2_swap32(x)); }
+
+SSE2_MAP(swap16_sse2, 2, sse2_swap16)
+SSE2_MAP(flip16_sse2, 2, sse2_flip16)
+SSE2_MAP(swap_flip16_sse2, 2, sse2_swap_flip16)
+SSE2_MAP(swap32_sse2, 4, sse2_swap32)
+SSE2_MAP(flip32_sse2, 4, sse2_flip32)
+SSE2_MAP(swap_flip32_sse2, 4, sse2_swap_flip32)
+
+#define SSE2_S16_TO_FLOAT(name, func, scale) \
+   SSE2_KERNEL name(void *out_, const void *in_, size_t samples) \
+   { \
+      const __m128 s = _mm_set1_ps(scale); \
+      SIMD_LOOP(8, 16, 32, \
+         __m128i x = func(_mm_loadu_si128((const __m128i*)in)); \
+         __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16); \
+         __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16); \
+         _mm_storeu_ps((float*)out, _mm_mul_ps(_mm_cvtepi32_ps(lo), s)); \
+         _mm_storeu_ps((float*)out + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), s));) \
+   }
+
+SSE2_S16_TO_FLOAT(s16_to_float_sse2, sse2_none, 1.0f / 0x8000)
+SSE2_S16_TO_FLOAT(swap_s16_to_float_sse2, sse2_swap16, 1.0f / 0x8000)
+
+#define SSE2_S32_TO_FLOAT(name, func, scale) \
+   SSE2_KERNEL name(void *out_, const void *in_, size_t samples) \
+   { \
+      const __m128 s = _mm_set1_ps(scale); \
+      SIMD_LOOP(4, 16, 16, \
+         __m128i x = func(_mm_loadu_si128((const __m128i*)in)); \
+         _mm_storeu_ps((float*)out, _mm_mul_ps(_mm_cvtepi32_ps(x), s));) \
+   }
+
+SSE2_S32_TO_FLOAT(s32_to_float_sse2, sse2_none, 1.0f / 0x80000000UL)
+SSE2_S32_TO_FLOAT(swap_s32_to_float_sse2, sse2_swap32, 1.0f / 0x80000000UL)
+
+#define SSE2_S32_TO_S16(name, func) \
+   SSE2_KERNEL name(void *out_, const void *in_, size_t samples) \
+   { \
+      SIMD_LOOP(8, 32, 16, \
+         __m128i a = _mm_srai_epi32(func(_mm_loadu_si128((const __m128i*)in)), 16); \
+         __m128i b = _mm_srai_epi32(func(_mm_loadu_si128((const __m128i*)in + 1)), 16); \
+         _mm_storeu_si128((__m128i*)out, _mm_packs_epi32(a, b));) \
+   }
+
+SSE2_S32_TO_S16(s32_to_s16_sse2, sse2_none)
+SSE2_S32_TO_S16(swap_s32_to_s16_sse2, sse2_swap32)
+
+/* Rounds like the resampler: truncate x + 0.5 towards zero. Done exactly in floats:
+ * with t = trunc(x), x - t is exact, and decides whether to step one up from t. */
+SSE2_INLINE __m128i sse2_round(__m128 x)
+{
+   __m128i t = _mm_cvttps_epi32(x);
+   __m128 frac = _mm_sub_ps(x, _mm_cvtepi32_ps(t));
+   __m128 up_pos = _mm_and_ps(_mm_cmpge_ps(x, _mm_setzero_ps()), _mm_cmpge_ps(frac, _mm_set1_ps(0.5f)));
+   __m128 up_neg = _mm_and_ps(_mm_cmple_ps(x, _mm_set1_ps(-1.0f)), _mm_cmpgt_ps(frac, _mm_set1_ps(-0.5f)));
+   // Masks are -1 where set.
+   return _mm_sub_epi32(t, _mm_castps_si128(_mm_or_ps(up_pos, up_neg)));
+}
+
+SSE2_INLINE __m128i sse2_float_to_s16(__m128 a, __m128 b)
+{
+   // Clamping first keeps the conversions in range, and doesn't change the result.
+   const __m128 lo = _mm_set1_ps(-32768.0f);
+   const __m128 hi = _mm_set1_ps(32767.0f);
+   a = _mm_min_ps(_mm_max_ps(a, lo), hi);
+   b = _mm_min_ps(_mm_max_ps(b, lo), hi);
+   __m128i x = _mm_packs_epi32(sse2_round(a), sse2_round(b));
+   x = _mm_max_epi16(x, _mm_set1_epi16(-0x7FFF));
+   return _mm_min_epi16(x, _mm_set1_epi16(0x7FFE));
+}
+
+SSE2_KERNEL resampler_float_to_s16_sse2(void *out_, const void *in_, size_t samples)
+{
+   const __m128 scale = _mm_set1_ps(0x8000);
+   SIMD_LOOP(8, 32, 16,
+      __m128 a = _mm_mul_ps(_mm_loadu_ps((const float*)in), scale);
+      __m128 b = _mm_mul_ps(_mm_loadu_ps((const float*)in + 4), scale);
+      _mm_storeu_si128((__m128i*)out, sse2_float_to_s16(a, b));)
+}
+
+SSE2_INLINE __m128i sse2_double_to_s32(__m128d x)
+{
+   x = _mm_add_pd(_mm_mul_pd(x, _mm_set1_pd(0x80000000UL)), _mm_set1_pd(0.5));
+   x = _mm_min_pd(_mm_max_pd(x, _mm_set1_pd(-2147483647.0)), _mm_set1_pd(2147483646.0));
+   return _mm_cvttpd_epi32(x);
+}
+
+SSE2_KERNEL resampler_float_to_s32_sse2(void *out_, const void *in_, size_t samples)
+{
+   SIMD_LOOP(4, 16, 16,
+      __m128 x = _mm_loadu_ps((const float*)in);
+      __m128i lo = sse2_double_to_s32(_mm_cvtps_pd(x));
+      __m128i hi = sse2_double_to_s32(_mm_cvtps_pd(_mm_movehl_ps(x, x)));
+      _mm_storeu_si128((__m128i*)out, _mm_unpacklo_epi64(lo, hi));)
+}
+
+AVX2_INLINE __m256i avx2_swap16(__m256i x)
+{
+   const __m256i mask = _mm256_setr_epi8(
+         1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+         1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+   return _mm256_shuffle_epi8(x, mask);
+}
+
+AVX2_INLINE __m256i avx2_swap32(__m256i x)
+{
+   const __m256i mask = _mm256_setr_epi8(
+         3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+         3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+   return _mm256_shuffle_epi8(x, mask);
+}
+
+AVX2_INLINE __m256i avx2_flip16(__m256i x)
+{
+   return _mm256_xor_si256(x, _mm256_set1_epi16((short)0x8000));
+}
+
+AVX2_INLINE __m256i avx2_flip32(__m256i x)
+{
+   return _mm256_xor_si256(x, _mm256_set1_epi32((int)0x80000000));
+}
+
+AVX2_INLINE __m256i avx2_none(__m256i x)
+{
+   return x;
+}
+
+AVX2_INLINE __m256i avx2_swap_flip16(__m256i x) { return avx2_flip16(avx2_swap16(x)); }
+AVX2_INLINE __m256i avx2_swap_flip32(__m256i x) { return avx2_flip32(avx2_swap32(x)); }
+
+#define AVX2_MAP(name, bytes, func) \
+   AVX2_KERNEL name(void *out_, const void *in_, size_t samples) \
+   { \
+      SIMD_LOOP(32 / (bytes), 32, 32, \
+         _mm256_storeu_si256((__m256i*)out, func(_mm256_loadu_si256((const __m256i*)in)));) \
+   }
+
+AVX2_MAP(swap16_avx2, 2, avx2_swap16)
+AVX2_MAP(flip16_avx2, 2, avx2_flip16)
+AVX2_MAP(swap_flip16_avx2, 2, avx2_swap_flip16)
+AVX2_MAP(swap32_avx2, 4, avx2_swap32)
+AVX2_MAP(flip32_avx2, 4, avx2_flip32)
+AVX2_MAP(swap_flip32_avx2, 4, avx2_swap_flip32)
+
+AVX2_INLINE __m128i avx2_swap16_128(__m128i x)
+{
+   return _mm_shuffle_epi8(x, _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14));
+}
+
+AVX2_INLINE __m128i avx2_none_128(__m128i x)
+{
+   return x;
+}
+
+#define AVX2_S16_TO_FLOAT(name, func, scale) \
+   AVX2_KERNEL name(void *out_, const void *in_, size_t samples) \
+   { \
+      const __m256 s = _mm256_set1_ps(scale); \
+      SIMD_LOOP(8, 16, 32, \
+         __m256i x = _mm256_cvtepi16_epi32(func(_mm_loadu_si128((const __m128i*)in))); \
+         _mm256_storeu_ps((float*)out, _mm256_mul_ps(_mm256_cvtepi32_ps(x), s));) \
+   }
+
+AVX2_S16_TO_FLOAT(s16_to_float_avx2, avx2_none_128, 1.0f / 0x8000)
+AVX2_S16_TO_FLOAT(swap_s16_to_float_avx2, avx2_swap16_128, 1.0f / 0x8000)
+
+#define AVX2_S32_TO_FLOAT(name, func, scale) \
+   AVX2_KERNEL name(void *out_, const void *in_, size_t samples) \
+   { \
+      const __m256 s = _mm256_set1_ps(scale); \
+      SIMD_LOOP(8, 32, 32, \
+         __m256i x = func(_mm256_loadu_si256((const __m256i*)in)); \
+         _mm256_storeu_ps((float*)out, _mm256_mul_ps(_mm256_cvtepi32_ps(x), s));) \
+   }
+
+AVX2_S32_TO_FLOAT(s32_to_float_avx2, avx2_none, 1.0f / 0x80000000UL)
+AVX2_S32_TO_FLOAT(swap_s32_to_float_avx2, avx2_swap32, 1.0f / 0x80000000UL)
+
+#define AVX2_S32_TO_S16(name, func) \
+   AVX2_KERNEL name(void *out_, const void *in_, size_t samples) \
+   { \
+      SIMD_LOOP(16, 64, 32, \
+         __m256i a = _mm256_srai_epi32(func(_mm256_loadu_si256((const __m256i*)in)), 16); \
+         __m256i b = _mm256_srai_epi32(func(_mm256_loadu_si256((const __m256i*)in + 1)), 16); \
+         /* Packing works per 128-bit lane, so put the quarters back in order. */ \
+         __m256i x = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0)); \
+         _mm256_storeu_si256((__m256i*)out, x);) \
+   }
+
+AVX2_S32_TO_S16(s32_to_s16_avx2, avx2_none)
+AVX2_S32_TO_S16(swap_s32_to_s16_avx2, avx2_swap32)
+
+AVX2_INLINE __m256i avx2_round(__m256 x)
+{
+   __m256i t = _mm256_cvttps_epi32(x);
+   __m256 frac = _mm256_sub_ps(x, _mm256_cvtepi32_ps(t));
+   __m256 up_pos = _mm256_and_ps(_mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_GE_OQ),
+         _mm256_cmp_ps(frac, _mm256_set1_ps(0.5f), _CMP_GE_OQ));
+   __m256 up_neg = _mm256_and_ps(_mm256_cmp_ps(x, _mm256_set1_ps(-1.0f), _CMP_LE_OQ),
+         _mm256_cmp_ps(frac, _mm256_set1_ps(-0.5f), _CMP_GT_OQ));
+   return _mm256_sub_epi32(t, _mm256_castps_si256(_mm256_or_ps(up_pos, up_neg)));
+}
+
+AVX2_KERNEL resampler_float_to_s16_avx2(void *out_, const void *in_, size_t samples)
+{
+   const __m256 lo = _mm256_set1_ps(-32768.0f);
+   const __m256 hi = _mm256_set1_ps(32767.0f);
+   const __m256 scale = _mm256_set1_ps(0x8000);
+   SIMD_LOOP(8, 32, 16,
+      __m256 x = _mm256_mul_ps(_mm256_loadu_ps((const float*)in), scale);
+      x = _mm256_min_ps(_mm256_max_ps(x, lo), hi);
+      __m256i t = avx2_round(x);
+      __m128i s = _mm_packs_epi32(_mm256_castsi256_si128(t), _mm256_extracti128_si256(t, 1));
+      s = _mm_max_epi16(s, _mm_set1_epi16(-0x7FFF));
+      _mm_storeu_si128((__m128i*)out, _mm_min_epi16(s, _mm_set1_epi16(0x7FFE)));)
+}
+
+AVX2_INLINE __m128i avx2_double_to_s32(__m256d x)
+{
+   x = _mm256_add_pd(_mm256_mul_pd(x, _mm256_set1_pd(0x80000000UL)), _mm256_set1_pd(0.5));
+   x = _mm256_min_pd(_mm256_max_pd(x, _mm256_set1_pd(-2147483647.0)), _mm256_set1_pd(2147483646.0));
+   return _mm256_cvttpd_epi32(x);
+}
+
+AVX2_KERNEL resampler_float_to_s32_avx2(void *out_, const void *in_, size_t samples)
+{
+   SIMD_LOOP(8, 32, 32,
+      __m128i lo = avx2_double_to_s32(_mm256_cvtps_pd(_mm_loadu_ps((const float*)in)));
+      __m128i hi = avx2_double_to_s32(_mm256_cvtps_pd(_mm_loadu_ps((const float*)in + 4)));
+      _mm256_storeu_si256((__m256i*)out, _mm256_set_m128i(hi, lo));)
+}
+
+static __attribute__((target("sse2"))) float resampler_fir_sse2(const float *h0, const float *h1,
+      float mu, const float *x, size_t taps)
+{
+   __m128 sum0 = _mm_setzero_ps();
+   __m128 sum1 = _mm_setzero_ps();
+   for ( size_t i = 0; i < taps; i += 4 )
+   {
+      __m128 in = _mm_loadu_ps(x + i);
+      sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(h0 + i), in));
+      sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(h1 + i), in));
+   }
+
+   __m128 sum = _mm_add_ps(sum0, _mm_mul_ps(_mm_sub_ps(sum1, sum0), _mm_set1_ps(mu)));
+   sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+   sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(1, 1, 1, 1)));
+   return _mm_cvtss_f32(sum);
+}
+
+static __attribute__((target("avx2"))) float resampler_fir_avx2(const float *h0, const float *h1,
+      float mu, const float *x, size_t taps)
+{
+   __m256 sum0 = _mm256_setzero_ps();
+   __m256 sum1 = _mm256_setzero_ps();
+   for ( size_t i = 0; i < taps; i += 8 )
+   {
+      __m256 in = _mm256_loadu_ps(x + i);
+      sum0 = _mm256_add_ps(sum0, _mm256_mul_ps(_mm256_loadu_ps(h0 + i), in));
+      sum1 = _mm256_add_ps(sum1, _mm256_mul_ps(_mm256_loadu_ps(h1 + i), in));
+   }
+
+   __m256 sum8 = _mm256_add_ps(sum0, _mm256_mul_ps(_mm256_sub_ps(sum1, sum0), _mm256_set1_ps(mu)));
+   __m128 sum = _mm_add_ps(_mm256_castps256_ps128(sum8), _mm256_extractf128_ps(sum8, 1));
+   sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+   sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(1, 1, 1, 1)));
+   return _mm_cvtss_f32(sum);
+}
+
+static __attribute__((target("sse2"))) float resampler_dot_sse2(const float *h, const float *x, size_t taps)
+{
+   __m128 sum0 = _mm_setzero_ps();
+   __m128 sum1 = _mm_setzero_ps();
+   for ( size_t i = 0; i < taps; i += 8 )
+   {
+      sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(h + i), _mm_loadu_ps(x + i)));
+      sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(h + i + 4), _mm_loadu_ps(x + i + 4)));
+   }
+
+   __m128 sum = _mm_add_ps(sum0, sum1);
+   sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+   sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(1, 1, 1, 1)));
+   return _mm_cvtss_f32(sum);
+}
+
+static __attribute__((target("avx2"))) float resampler_dot_avx2(const float *h, const float *x, size_t taps)
+{
+   __m256 sum8 = _mm256_setzero_ps();
+   for ( size_t i = 0; i < taps; i += 8 )
+      sum8 = _mm256_add_ps(sum8, _mm256_mul_ps(_mm256_loadu_ps(h + i), _mm256_loadu_ps(x + i)));
+
+   __m128 sum = _mm_add_ps(_mm256_castps256_ps128(sum8), _mm256_extractf128_ps(sum8, 1));
+   sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+   sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(1, 1, 1, 1)));
+   return _mm_cvtss_f32(sum);
+}
+
+#endif
+
+#ifdef SIMD_HAVE_NEON
+
+static inline uint8x16_t neon_swap16(uint8x16_t x)
+{
+   return vrev16q_u8(x);
+}
+
+static inline uint8x16_t neon_swap32(uint8x16_t x)
+{
+   return vrev32q_u8(x);
+}
+
+static inline uint8x16_t neon_flip16(uint8x16_t x)
+{
+   return vreinterpretq_u8_u16(veorq_u16(vreinterpretq_u16_u8(x), vdupq_n_u16(0x8000)));
+}
+
+static inline uint8x16_t neon_flip32(uint8x16_t x)
+{
+   return vreinterpretq_u8_u32(veorq_u32(vreinterpretq_u32_u8(x), vdupq_n_u32(0x80000000)));
+}
+
+static inline uint8x16_t neon_none(uint8x16_t x)
+{
+   return x;
+}
+
+static inline uint8x16_t neon_swap_flip16(uint8x16_t x) { return neon_flip16(neon_swap16(x)); }
+static inline uint8x16_t neon_swap_flip32(uint8x16_t x) { return neon_flip32(neon_swap32(x)); }
+
+#define NEON_MAP(name, bytes, func) \
+   static size_t name(void *out_, const void *in_, size_t samples) \
+   { \
+      SIMD_LOOP(16 / (bytes), 16, 16, vst1q_u8(out, func(vld1q_u8(in)));) \
+   }
+
+NEON_MAP(swap16_neon, 2, neon_swap16)
+NEON_MAP(flip16_neon, 2, neon_flip16)
+NEON_MAP(swap_flip16_neon, 2, neon_swap_flip16)
+NEON_MAP(swap32_neon, 4, neon_swap32)
+NEON_MAP(flip32_neon, 4, neon_flip32)
+NEON_MAP(swap_flip32_neon, 4, neon_swap_flip32)
+
+#define NEON_S16_TO_FLOAT(name, func, scale) \
+   static size_t name(void *out_, const void *in_, size_t samples) \
+   { \
+      SIMD_LOOP(8, 16, 32, \
+         int16x8_t x = vreinterpretq_s16_u8(func(vld1q_u8(in))); \
+         float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(x))); \
+         float32x4_t hi = vcvtq_f32_s32(vmovl_s16(vget_high_s16(x))); \
+         vst1q_f32((float*)out, vmulq_n_f32(lo, scale)); \
+         vst1q_f32((float*)out + 4, vmulq_n_f32(hi, scale));) \
+   }
+
+NEON_S16_TO_FLOAT(s16_to_float_neon, neon_none, 1.0f / 0x8000)
+NEON_S16_TO_FLOAT(swap_s16_to_float_neon, neon_swap16, 1.0f / 0x8000)
+
+#define NEON_S32_TO_FLOAT(name, func, scale) \
+   static size_t name(void *out_, const void *in_, size_t samples) \
+   { \
+      SIMD_LOOP(4, 16, 16, \
+         int32x4_t x = vreinterpretq_s32_u8(func(vld1q_u8(in))); \
+         vst1q_f32((float*)out, vmulq_n_f32(vcvtq_f32_s32(x), scale));) \
+   }
+
+NEON_S32_TO_FLOAT(s32_to_float_neon, neon_none, 1.0f / 0x80000000UL)
+NEON_S32_TO_FLOAT(swap_s32_to_float_neon, neon_swap32, 1.0f / 0x80000000UL)
+
+#define NEON_S32_TO_S16(name, func) \
+   static size_t name(void *out_, const void *in_, size_t samples) \
+   { \
+      SIMD_LOOP(8, 32, 16, \
+         int32x4_t a = vreinterpretq_s32_u8(func(vld1q_u8(in))); \
+         int32x4_t b = vreinterpretq_s32_u8(func(vld1q_u8(in + 16))); \
+         vst1q_s16((int16_t*)out, vcombine_s16(vshrn_n_s32(a, 16), vshrn_n_s32(b, 16)));) \
+   }
+
+NEON_S32_TO_S16(s32_to_s16_neon, neon_none)
+NEON_S32_TO_S16(swap_s32_to_s16_neon, neon_swap32)
+
+// Same rounding as sse2_round().
+static inline int32x4_t neon_round(float32x4_t x)
+{
+   int32x4_t t = vcvtq_s32_f32(x);
+   float32x4_t frac = vsubq_f32(x, vcvtq_f32_s32(t));
+   uint32x4_t up_pos = vandq_u32(vcgeq_f32(x, vdupq_n_f32(0.0f)), vcgeq_f32(frac, vdupq_n_f32(0.5f)));
+   uint32x4_t up_neg = vandq_u32(vcleq_f32(x, vdupq_n_f32(-1.0f)), vcgtq_f32(frac, vdupq_n_f32(-0.5f)));
+   return vsubq_s32(t, vreinterpretq_s32_u32(vorrq_u32(up_pos, up_neg)));
+}
+
+static size_t resampler_float_to_s16_neon(void *out_, const void *in_, size_t samples)
+{
+   const float32x4_t lo = vdupq_n_f32(-32768.0f);
+   const float32x4_t hi = vdupq_n_f32(32767.0f);
+   SIMD_LOOP(8, 32, 16,
+      float32x4_t a = vminq_f32(vmaxq_f32(vmulq_n_f32(vld1q_f32((const float*)in), 0x8000), lo), hi);
+      float32x4_t b = vminq_f32(vmaxq_f32(vmulq_n_f32(vld1q_f32((const float*)in + 4), 0x8000), lo), hi);
+      int16x8_t x = vcombine_s16(vqmovn_s32(neon_round(a)), vqmovn_s32(neon_round(b)));
+      x = vmaxq_s16(x, vdupq_n_s16(-0x7FFF));
+      vst1q_s16((int16_t*)out, vminq_s16(x, vdupq_n_s16(0x7FFE)));)
+}
+
+#ifdef __aarch64__
+static inline int32x2_t neon_double_to_s32(float64x2_t x)
+{
+   x = vaddq_f64(vmulq_n_f64(x, 0x80000000UL), vdupq_n_f64(0.5));
+   x = vminq_f64(vmaxq_f64(x, vdupq_n_f64(-2147483647.0)), vdupq_n_f64(2147483646.0));
+   return vmovn_s64(vcvtq_s64_f64(x));
+}
+
+static size_t resampler_float_to_s32_neon(void *out_, const void *in_, size_t samples)
+{
+   SIMD_LOOP(4, 16, 16,
+      float32x4_t x = vld1q_f32((const float*)in);
+      int32x2_t lo = neon_double_to_s32(vcvt_f64_f32(vget_low_f32(x)));
+      int32x2_t hi = neon_double_to_s32(vcvt_high_f64_f32(x));
+      vst1q_s32((int32_t*)out, vcombine_s32(lo, hi));)
+}
+#endif
+
+static float resampler_fir_neon(const float *h0, const float *h1, float mu, const float *x, size_t taps)
+{
+   float32x4_t sum0 = vdupq_n_f32(0.0f);
+   float32x4_t sum1 = vdupq_n_f32(0.0f);
+   for ( size_t i = 0; i < taps; i += 4 )
+   {
+      float32x4_t in = vld1q_f32(x + i);
+      sum0 = vmlaq_f32(sum0, vld1q_f32(h0 + i), in);
+      sum1 = vmlaq_f32(sum1, vld1q_f32(h1 + i), in);
+   }
+
+   float32x4_t sum = vmlaq_n_f32(sum0, vsubq_f32(sum1, sum0), mu);
+   float32x2_t half = vadd_f32(vget_low_f32(sum), vget_high_f32(sum));
+   return vget_lane_f32(vpadd_f32(half, half), 0);
+}
+
+static float resampler_dot_neon(const float *h, const float *x, size_t taps)
+{
+   float32x4_t sum0 = vdupq_n_f32(0.0f);
+   float32x4_t sum1 = vdupq_n_f32(0.0f);
+   for ( size_t i = 0; i < taps; i += 8 )
+   {
+      sum0 = vmlaq_f32(sum0, vld1q_f32(h + i), vld1q_f32(x + i));
+      sum1 = vmlaq_f32(sum1, vld1q_f32(h + i + 4), vld1q_f32(x + i + 4));
+   }
+
+   float32x4_t sum = vaddq_f32(sum0, sum1);
+   float32x2_t half = vadd_f32(vget_low_f32(sum), vget_high_f32(sum));
+   return vget_lane_f32(vpadd_f32(half, half), 0);
+}
+
+#endif
+
+struct simd_entry
+{
+   unsigned feature;
+   simd_kernel_t kernel;
+};
+
+// Best kernel first.
+static const struct simd_entry simd_kernels[SIMD_NUM_OPS][3] = {
+#ifdef SIMD_HAVE_X86
+   [SIMD_SWAP16] = { { SIMD_AVX2, swap16_avx2 }, { SIMD_SSE2, swap16_sse2 } },
+   [SIMD_FLIP16] = { { SIMD_AVX2, flip16_avx2 }, { SIMD_SSE2, flip16_sse2 } },
+   [SIMD_SWAP_FLIP16] = { { SIMD_AVX2, swap_flip16_avx2 }, { SIMD_SSE2, swap_flip16_sse2 } },
+   [SIMD_S16_TO_FLOAT] = { { SIMD_AVX2, s16_to_float_avx2 }, { SIMD_SSE2, s16_to_float_sse2 } },
+   [SIMD_SWAP_S16_TO_FLOAT] = { { SIMD_AVX2, swap_s16_to_float_avx2 }, { SIMD_SSE2, swap_s16_to_float_sse2 } },
+   [SIMD_SWAP32] = { { SIMD_AVX2, swap32_avx2 }, { SIMD_SSE2, swap32_sse2 } },
+   [SIMD_FLIP32] = { { SIMD_AVX2, flip32_avx2 }, { SIMD_SSE2, flip32_sse2 } },
+   [SIMD_SWAP_FLIP32] = { { SIMD_AVX2, swap_flip32_avx2 }, { SIMD_SSE2, swap_flip32_sse2 } },
+   [SIMD_S32_TO_S16] = { { SIMD_AVX2, s32_to_s16_avx2 }, { SIMD_SSE2, s32_to_s16_sse2 } },
+   [SIMD_SWAP_S32_TO_S16] = { { SIMD_AVX2, swap_s32_to_s16_avx2 }, { SIMD_SSE2, swap_s32_to_s16_sse2 } },
+   [SIMD_S32_TO_FLOAT] = { { SIMD_AVX2, s32_to_float_avx2 }, { SIMD_SSE2, s32_to_float_sse2 } },
+   [SIMD_SWAP_S32_TO_FLOAT] = { { SIMD_AVX2, swap_s32_to_float_avx2 }, { SIMD_SSE2, swap_s32_to_float_sse2 } },
+   [SIMD_RESAMPLER_FLOAT_TO_S16] = { { SIMD_AVX2, resampler_float_to_s16_avx2 }, { SIMD_SSE2, resampler_float_to_s16_sse2 } },
+   [SIMD_RESAMPLER_FLOAT_TO_S32] = { { SIMD_AVX2, resampler_float_to_s32_avx2 }, { SIMD_SSE2, resampler_float_to_s32_sse2 } },
+#endif
+#ifdef SIMD_HAVE_NEON
+   [SIMD_SWAP16] = { { SIMD_NEON, swap16_neon } },
+   [SIMD_FLIP16] = { { SIMD_NEON, flip16_neon } },
+   [SIMD_SWAP_FLIP16] = { { SIMD_NEON, swap_flip16_neon } },
+   [SIMD_S16_TO_FLOAT] = { { SIMD_NEON, s16_to_float_neon } },
+   [SIMD_SWAP_S16_TO_FLOAT] = { { SIMD_NEON, swap_s16_to_float_neon } },
+   [SIMD_SWAP32] = { { SIMD_NEON, swap32_neon } },
+   [SIMD_FLIP32] = { { SIMD_NEON, flip32_neon } },
+   [SIMD_SWAP_FLIP32] = { { SIMD_NEON, swap_flip32_neon } },
+   [SIMD_S32_TO_S16] = { { SIMD_NEON, s32_to_s16_neon } },
+   [SIMD_SWAP_S32_TO_S16] = { { SIMD_NEON, swap_s32_to_s16_neon } },
+   [SIMD_S32_TO_FLOAT] = { { SIMD_NEON, s32_to_float_neon } },
+   [SIMD_SWAP_S32_TO_FLOAT] = { { SIMD_NEON, swap_s32_to_float_neon } },
+   [SIMD_RESAMPLER_FLOAT_TO_S16] = { { SIMD_NEON, resampler_float_to_s16_neon } },
+#ifdef __aarch64__
+   [SIMD_RESAMPLER_FLOAT_TO_S32] = { { SIMD_NEON, resampler_float_to_s32_neon } },
+#endif
+#endif
+};
+
+simd_kernel_t simd_kernel(enum simd_op op)
+{
+   if ( op <= SIMD_NONE || op >= SIMD_NUM_OPS )
+      return NULL;
+
+   unsigned features = simd_features();
+   for ( unsigned i = 0; i < sizeof(simd_kernels[op]) / sizeof(simd_kernels[op][0]); i++ )
+   {
+      const struct simd_entry *entry = &simd_kernels[op][i];
+      if ( entry->kernel != NULL && (entry->feature & features) )
+         return entry->kernel;
+   }
+
+   return NULL;
+}
+
+simd_fir_t simd_fir(void)
+{
+   unsigned features = simd_features();
+
+#ifdef SIMD_HAVE_X86
+   if ( features & SIMD_AVX2 )
+      return resampler_fir_avx2;
+   if ( features & SIMD_SSE2 )
+      return resampler_fir_sse2;
+#endif
+
+#ifdef SIMD_HAVE_NEON
+   if ( features & SIMD_NEON )
+      return resampler_fir_neon;
+#endif
+
+   (void)features;
+   return NULL;
+}
+
+simd_dot_t simd_dot(void)
+{
+   unsigned features = simd_features();
+
+#ifdef SIMD_HAVE_X86
+   if ( features & SIMD_AVX2 )
+      return resampler_dot_avx2;
+   if ( features & SIMD_SSE2 )
+      return resampler_dot_sse2;
+#endif
+
+#ifdef SIMD_HAVE_NEON
+   if ( features & SIMD_NEON )
+      return resampler_dot_neon;
+#endif
+
+   (void)features;
+   return NULL;
+}
@@ -0,0 +1,82 @@
+/*  RSound - A PCM audio client/server
+ *  Copyright (C) 2010-2011 - Hans-Kristian Arntzen
+ *
+ *  RSound is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RSound is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RSound.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RSD_SIMD_H
+#define __RSD_SIMD_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Vector instruction sets we have kernels for.
+#define SIMD_SSE2 0x0001
+#define SIMD_AVX2 0x0002
+#define SIMD_NEON 0x0004
+
+// Operations with vector versions. They give the same output as the scalar code in
+// audio.c and resampler.c, bit for bit.
+enum simd_op
+{
+   SIMD_NONE = 0,
+
+   // Sample conversions of audio_convert().
+   SIMD_SWAP16,
+   SIMD_FLIP16,
+   SIMD_SWAP_FLIP16,
+   SIMD_S16_TO_FLOAT,
+   SIMD_SWAP_S16_TO_FLOAT,
+   SIMD_SWAP32,
+   SIMD_FLIP32,
+   SIMD_SWAP_FLIP32,
+   SIMD_S32_TO_S16,
+   SIMD_SWAP_S32_TO_S16,
+   SIMD_S32_TO_FLOAT,
+   SIMD_SWAP_S32_TO_FLOAT,
+
+   // Rounds and clamps like the scalar code in the resampler.
+   SIMD_RESAMPLER_FLOAT_TO_S16,
+   SIMD_RESAMPLER_FLOAT_TO_S32,
+
+   SIMD_NUM_OPS
+};
+
+// Converts as many samples from in to out as fit in whole vectors, and returns how many that was.
+// The rest is left for the scalar code.
+typedef size_t (*simd_kernel_t)(void *out, const void *in, size_t samples);
+
+// Instruction sets the CPU we're running on has.
+unsigned simd_features(void);
+
+// Returns the best kernel for op on this CPU, or NULL if there is none.
+simd_kernel_t simd_kernel(enum simd_op op);
+
+// Sums (h0[i] + (h1[i] - h0[i]) * mu) * x[i] over taps, a multiple of 8. This is the inner loop
+// of the sinc resampler. The sums are done in a different order than in the scalar code,
+// so the result is only the same up to rounding.
+typedef float (*simd_fir_t)(const float *h0, const float *h1, float mu, const float *x, size_t taps);
+
+// Returns the best FIR kernel on this CPU, or NULL if there is none.
+simd_fir_t simd_fir(void);
+
+// Sums h[i] * x[i] over taps, a multiple of 8. This is the inner loop of the resampler when
+// the ratio has a phase table of its own, so there's nothing to interpolate.
+typedef float (*simd_dot_t)(const float *h, const float *x, size_t taps);
+
+// Returns the best dot product kernel on this CPU, or NULL if there is none.
+simd_dot_t simd_dot(void);
+
+// Only use the instruction sets in mask. Mostly useful for testing the scalar code.
+void simd_set_mask(unsigned mask);
+
+#endif
@@ -0,0 +1,652 @@
+/*  RSound - A PCM audio client/server
+ *  Copyright (C) 2010-2011 - Hans-Kristian Arntzen
+ *
+ *  RSound is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RSound is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RSound.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Starts a local rsd with the null backend, and throws synthetic librsound clients at it.
+   Results are written as JSON, so they can be compared between builds.
+
+   The null backend plays audio at exactly the rate of the stream, starting when the first data arrives.
+   As server and clients share a machine and a clock, the amount of data that has really been played
+   at any point is (now - first write) * byte rate, which we use as the ground truth for latency. */
+
+#include <rsound.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+enum bench_mode
+{
+   BENCH_BLOCKING = 0,
+   BENCH_CALLBACK,
+   BENCH_EXEC
+};
+
+typedef struct
+{
+   enum bench_mode mode;
+   enum rsd_format format;
+   int rate;
+   int channels;
+} bench_case_t;
+
+static const bench_case_t bench_cases[] = {
+   { BENCH_BLOCKING, RSD_S16_LE, 44100, 2 },
+   { BENCH_BLOCKING, RSD_U8, 22050, 1 },
+   { BENCH_BLOCKING, RSD_S32_LE, 48000, 2 },
+   { BENCH_CALLBACK, RSD_S16_LE, 48000, 2 },
+   { BENCH_EXEC, RSD_S16_LE, 44100, 2 },
+};
+
+typedef struct
+{
+   double *data;
+   size_t size;
+   size_t cap;
+} bench_samples_t;
+
+typedef struct
+{
+   const bench_case_t *c;
+   pthread_t thread;
+   rsound_t *rd;
+   size_t bps;
+
+   pthread_mutex_t lock;
+   double start;        // First audio handed to librsound.
+   uint64_t written;
+
+   bench_samples_t latency;   // Ground truth, in ms.
+   bench_samples_t error;     // rsd_delay_ms() minus ground truth.
+   int failed;
+} bench_stream_t;
+
+static struct
+{
+   const char *rsd_path;
+   const char *port;
+   int streams;
+   double seconds;
+   int connects;
+   int latency;
+
+   pid_t pid;
+   pthread_t log_thread;
+   FILE *log;
+   pthread_mutex_t lock;
+   unsigned underruns;
+} bench = {
+   .rsd_path = "../rsd",
+   .port = "12399",
+   .streams = 8,
+   .seconds = 5.0,
+   .connects = 200,
+   .latency = 100,
+   .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static double bench_now(void)
+{
+   struct timespec tv;
+   clock_gettime(CLOCK_MONOTONIC, &tv);
+   return tv.tv_sec + tv.tv_nsec / 1000000000.0;
+}
+
+static void bench_sleep(double secs)
+{
+   if ( secs <= 0.0 )
+      return;
+
+   struct timespec tv = {
+      .tv_sec = (time_t)secs,
+      .tv_nsec = (long)((secs - (time_t)secs) * 1000000000.0)
+   };
+   nanosleep(&tv, NULL);
+}
+
+static void bench_add_sample(bench_samples_t *s, double val)
+{
+   if ( s->size == s->cap )
+   {
+      size_t cap = s->cap ? s->cap * 2 : 1024;
+      double *data = realloc(s->data, cap * sizeof(double));
+      if ( data == NULL )
+         return;
+      s->data = data;
+      s->cap = cap;
+   }
+   s->data[s->size++] = val;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+   double x = *(const double*)a, y = *(const double*)b;
+   return (x > y) - (x < y);
+}
+
+static const char* bench_mode_to_string(enum bench_mode mode)
+{
+   switch ( mode )
+   {
+      case BENCH_BLOCKING:
+         return "blocking";
+      case BENCH_CALLBACK:
+         return "callback";
+      case BENCH_EXEC:
+         return "exec";
+   }
+   return "unknown";
+}
+
+static const char* bench_format_to_string(enum rsd_format fmt)
+{
+   switch ( fmt )
+   {
+      case RSD_S16_LE:
+         return "S16_LE";
+      case RSD_U8:
+         return "U8";
+      case RSD_S32_LE:
+         return "S32_LE";
+      default:
+         return "unknown";
+   }
+}
+
+/* Reads the log of rsd, and picks up underruns reported by the null backend. */
+static void* bench_log_thread(void *data)
+{
+   (void)data;
+   char line[1024];
+   unsigned count;
+
+   while ( fgets(line, sizeof(line), bench.log) != NULL )
+   {
+      if ( sscanf(line, "null: %u underruns.", &count) == 1 )
+      {
+         pthread_mutex_lock(&bench.lock);
+         bench.underruns += count;
+         pthread_mutex_unlock(&bench.lock);
+      }
+   }
+
+   return NULL;
+}
+
+static int bench_start_server(void)
+{
+   int fds[2];
+   if ( pipe(fds) < 0 )
+      return -1;
+
+   bench.pid = fork();
+   if ( bench.pid < 0 )
+      return -1;
+
+   if ( bench.pid == 0 )
+   {
+      close(fds[0]);
+      dup2(fds[1], STDERR_FILENO);
+      if ( freopen("/dev/null", "w", stdout) == NULL )
+         _exit(1);
+
+      execl(bench.rsd_path, bench.rsd_path, "-b", "null", "-p", bench.port, "--debug", (char*)NULL);
+      _exit(1);
+   }
+
+   close(fds[1]);
+   bench.log = fdopen(fds[0], "r");
+   if ( bench.log == NULL )
+      return -1;
+
+   if ( pthread_create(&bench.log_thread, NULL, bench_log_thread, NULL) < 0 )
+      return -1;
+
+   // Wait for it to listen.
+   for ( int i = 0; i < 100; i++ )
+   {
+      rsound_t *rd;
+      if ( rsd_init(&rd) < 0 )
+         return -1;
+
+      int rate = 44100, channels = 2;
+      rsd_set_param(rd, RSD_HOST, "localhost");
+      rsd_set_param(rd, RSD_PORT, (void*)bench.port);
+      rsd_set_param(rd, RSD_SAMPLERATE, &rate);
+      rsd_set_param(rd, RSD_CHANNELS, &channels);
+
+      int rc = rsd_start(rd);
+      rsd_stop(rd);
+      rsd_free(rd);
+      if ( rc == 0 )
+         return 0;
+
+      bench_sleep(0.05);
+   }
+
+   return -1;
+}
+
+static void bench_stop_server(void)
+{
+   if ( bench.pid <= 0 )
+      return;
+
+   kill(bench.pid, SIGTERM);
+   waitpid(bench.pid, NULL, 0);
+   pthread_join(bench.log_thread, NULL);
+   fclose(bench.log);
+}
+
+/* CPU time used by rsd in seconds, from /proc. */
+static double bench_server_cpu(void)
+{
+   char path[64];
+   snprintf(path, sizeof(path), "/proc/%d/stat", (int)bench.pid);
+
+   FILE *file = fopen(path, "r");
+   if ( file == NULL )
+      return -1.0;
+
+   unsigned long utime = 0, stime = 0;
+   int rc = fscanf(file, "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+   fclose(file);
+   if ( rc != 2 )
+      return -1.0;
+
+   return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static double bench_client_cpu(void)
+{
+   struct rusage usage;
+   getrusage(RUSAGE_SELF, &usage);
+   return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1000000.0 +
+      usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1000000.0;
+}
+
+static rsound_t* bench_open(const bench_case_t *c)
+{
+   rsound_t *rd;
+   if ( rsd_init(&rd) < 0 )
+      return NULL;
+
+   int rate = c->rate, channels = c->channels, format = c->format;
+   rsd_set_param(rd, RSD_HOST, "localhost");
+   rsd_set_param(rd, RSD_PORT, (void*)bench.port);
+   rsd_set_param(rd, RSD_SAMPLERATE, &rate);
+   rsd_set_param(rd, RSD_CHANNELS, &channels);
+   rsd_set_param(rd, RSD_FORMAT, &format);
+   rsd_set_param(rd, RSD_LATENCY, &bench.latency);
+   rsd_set_param(rd, RSD_IDENTITY, "rsd-bench");
+   return rd;
+}
+
+/* Ground truth latency in ms, as the null backend sees it. */
+static double bench_truth(bench_stream_t *s, double now)
+{
+   double played = (now - s->start) * s->bps;
+   if ( played > s->written )
+      played = s->written;
+   return (s->written - played) * 1000.0 / s->bps;
+}
+
+/* Blocks until we would have produced size more bytes in real time, keeping bench.latency ms ahead. */
+static void bench_pace(bench_stream_t *s, size_t size)
+{
+   double due = s->start + (s->written + size) / (double)s->bps - bench.latency / 1000.0;
+   bench_sleep(due - bench_now());
+}
+
+static void bench_sample(bench_stream_t *s, int with_delay)
+{
+   double now = bench_now();
+   pthread_mutex_lock(&s->lock);
+   if ( s->written > 0 )
+   {
+      double truth = bench_truth(s, now);
+      bench_add_sample(&s->latency, truth);
+      if ( with_delay )
+         bench_add_sample(&s->error, (double)rsd_delay_ms(s->rd) - truth);
+   }
+   pthread_mutex_unlock(&s->lock);
+}
+
+static ssize_t bench_callback(void *data, size_t bytes, void *userdata)
+{
+   bench_stream_t *s = userdata;
+   memset(data, 0, bytes);
+
+   pthread_mutex_lock(&s->lock);
+   if ( s->written == 0 )
+      s->start = bench_now();
+   pthread_mutex_unlock(&s->lock);
+
+   bench_pace(s, bytes);
+
+   pthread_mutex_lock(&s->lock);
+   s->written += bytes;
+   pthread_mutex_unlock(&s->lock);
+   return bytes;
+}
+
+static void bench_error_callback(void *userdata)
+{
+   bench_stream_t *s = userdata;
+   s->failed = 1;
+}
+
+static void* bench_stream_thread(void *data)
+{
+   bench_stream_t *s = data;
+   const bench_case_t *c = s->c;
+
+   s->rd = bench_open(c);
+   if ( s->rd == NULL )
+      goto error;
+
+   s->bps = c->rate * c->channels * rsd_samplesize(s->rd);
+   size_t chunk = s->bps / 100;
+   chunk -= chunk % (c->channels * rsd_samplesize(s->rd));
+   char *buf = calloc(1, chunk);
+   if ( buf == NULL )
+      goto error;
+
+   if ( c->mode == BENCH_CALLBACK )
+      rsd_set_callback(s->rd, bench_callback, bench_error_callback, 0, s);
+
+   if ( rsd_start(s->rd) < 0 )
+   {
+      free(buf);
+      goto error;
+   }
+
+   double end = bench_now() + bench.seconds;
+
+   switch ( c->mode )
+   {
+      case BENCH_BLOCKING:
+         while ( bench_now() < end )
+         {
+            rsd_delay_wait(s->rd);
+            if ( rsd_write(s->rd, buf, chunk) != chunk )
+            {
+               s->failed = 1;
+               break;
+            }
+
+            pthread_mutex_lock(&s->lock);
+            if ( s->written == 0 )
+               s->start = bench_now();
+            s->written += chunk;
+            pthread_mutex_unlock(&s->lock);
+            bench_sample(s, 1);
+         }
+         rsd_stop(s->rd);
+         break;
+
+      case BENCH_CALLBACK:
+         while ( bench_now() < end && !s->failed )
+         {
+            bench_sleep(0.01);
+            bench_sample(s, 1);
+         }
+         rsd_stop(s->rd);
+         break;
+
+      case BENCH_EXEC:
+      {
+         int fd = rsd_exec(s->rd);
+         s->rd = NULL;
+         if ( fd < 0 )
+         {
+            s->failed = 1;
+            break;
+         }
+
+         s->start = bench_now();
+         while ( bench_now() < end )
+         {
+            bench_pace(s, chunk);
+            if ( write(fd, buf, chunk) != (ssize_t)chunk )
+            {
+               s->failed = 1;
+               break;
+            }
+            pthread_mutex_lock(&s->lock);
+            s->written += chunk;
+            pthread_mutex_unlock(&s->lock);
+            bench_sample(s, 0);
+         }
+         close(fd);
+         break;
+      }
+   }
+
+   free(buf);
+   if ( s->rd != NULL )
+      rsd_free(s->rd);
+   return NULL;
+
+error:
+   s->failed = 1;
+   if ( s->rd != NULL )
+      rsd_free(s->rd);
+   s->rd = NULL;
+   return NULL;
+}
+
+static void bench_print_percentiles(FILE *out, const char *name, bench_samples_t *s, int absolute)
+{
+   if ( s->size == 0 )
+   {
+      fprintf(out, "\"%s\": null", name);
+      return;
+   }
+
+   double sum = 0.0;
+   for ( size_t i = 0; i < s->size; i++ )
+   {
+      if ( absolute && s->data[i] < 0.0 )
+         s->data[i] = -s->data[i];
+      sum += s->data[i];
+   }
+
+   qsort(s->data, s->size, sizeof(double), bench_cmp);
+   fprintf(out, "\"%s\": { \"samples\": %zu, \"mean\": %.3f, \"p50\": %.3f, \"p95\": %.3f, \"p99\": %.3f, \"max\": %.3f }",
+         name, s->size, sum / s->size,
+         s->data[s->size / 2], s->data[(s->size * 95) / 100], s->data[(s->size * 99) / 100], s->data[s->size - 1]);
+}
+
+static void bench_run_case(FILE *out, const bench_case_t *c)
+{
+   bench_stream_t *streams = calloc(bench.streams, sizeof(*streams));
+   if ( streams == NULL )
+      return;
+
+   pthread_mutex_lock(&bench.lock);
+   unsigned underruns = bench.underruns;
+   pthread_mutex_unlock(&bench.lock);
+
+   double server_cpu = bench_server_cpu();
+   double client_cpu = bench_client_cpu();
+   double start = bench_now();
+
+   for ( int i = 0; i < bench.streams; i++ )
+   {
+      streams[i].c = c;
+      pthread_mutex_init(&streams[i].lock, NULL);
+      if ( pthread_create(&streams[i].thread, NULL, bench_stream_thread, &streams[i]) < 0 )
+         streams[i].failed = 1;
+   }
+
+   for ( int i = 0; i < bench.streams; i++ )
+      pthread_join(streams[i].thread, NULL);
+
+   double elapsed = bench_now() - start;
+   client_cpu = bench_client_cpu() - client_cpu;
+   server_cpu = bench_server_cpu() - server_cpu;
+
+   // The null backend reports underruns when the stream is closed.
+   bench_sleep(0.2);
+   pthread_mutex_lock(&bench.lock);
+   underruns = bench.underruns - underruns;
+   pthread_mutex_unlock(&bench.lock);
+
+   bench_samples_t latency = {0}, error = {0};
+   uint64_t bytes = 0;
+   int failed = 0;
+   for ( int i = 0; i < bench.streams; i++ )
+   {
+      for ( size_t j = 0; j < streams[i].latency.size; j++ )
+         bench_add_sample(&latency, streams[i].latency.data[j]);
+      for ( size_t j = 0; j < streams[i].error.size; j++ )
+         bench_add_sample(&error, streams[i].error.data[j]);
+      bytes += streams[i].written;
+      failed += streams[i].failed;
+
+      free(streams[i].latency.data);
+      free(streams[i].error.data);
+      pthread_mutex_destroy(&streams[i].lock);
+   }
+
+   fprintf(out, "    { \"mode\": \"%s\", \"format\": \"%s\", \"rate\": %d, \"channels\": %d, \"streams\": %d, \"failed\": %d,\n",
+         bench_mode_to_string(c->mode), bench_format_to_string(c->format), c->rate, c->channels, bench.streams, failed);
+   fprintf(out, "      \"seconds\": %.3f, \"bytes\": %llu, \"underruns\": %u,\n", elapsed, (unsigned long long)bytes, underruns);
+   if ( server_cpu >= 0.0 )
+      fprintf(out, "      \"server_cpu_per_stream\": %.5f, ", server_cpu / elapsed / bench.streams);
+   else
+      fprintf(out, "      \"server_cpu_per_stream\": null, ");
+   fprintf(out, "\"client_cpu_per_stream\": %.5f,\n      ", client_cpu / elapsed / bench.streams);
+   bench_print_percentiles(out, "latency_ms", &latency, 0);
+   fprintf(out, ",\n      ");
+   bench_print_percentiles(out, "delay_error_ms", &error, 1);
+   fprintf(out, " }");
+
+   free(latency.data);
+   free(error.data);
+   free(streams);
+}
+
+/* Connects and hangs up as fast as we can, one at a time. */
+static void bench_run_connects(FILE *out)
+{
+   int failed = 0;
+   double start = bench_now();
+
+   for ( int i = 0; i < bench.connects; i++ )
+   {
+      rsound_t *rd = bench_open(&bench_cases[0]);
+      if ( rd == NULL || rsd_start(rd) < 0 )
+         failed++;
+      if ( rd != NULL )
+      {
+         rsd_stop(rd);
+         rsd_free(rd);
+      }
+   }
+
+   double elapsed = bench_now() - start;
+   fprintf(out, "  \"connect\": { \"connections\": %d, \"failed\": %d, \"seconds\": %.3f, \"per_second\": %.1f },\n",
+         bench.connects, failed, elapsed, (bench.connects - failed) / elapsed);
+}
+
+static void bench_usage(void)
+{
+   fprintf(stderr, "Usage: rsd-bench [-s rsd] [-p port] [-n streams] [-d seconds] [-l latency ms] [-c connections] [-o file]\n");
+}
+
+int main(int argc, char **argv)
+{
+   FILE *out = stdout;
+   int c;
+
+   while ( (c = getopt(argc, argv, "s:p:n:d:l:c:o:h")) != -1 )
+   {
+      switch ( c )
+      {
+         case 's':
+            bench.rsd_path = optarg;
+            break;
+         case 'p':
+            bench.port = optarg;
+            break;
+         case 'n':
+            bench.streams = strtol(optarg, NULL, 10);
+            break;
+         case 'd':
+            bench.seconds = strtod(optarg, NULL);
+            break;
+         case 'l':
+            bench.latency = strtol(optarg, NULL, 10);
+            break;
+         case 'c':
+            bench.connects = strtol(optarg, NULL, 10);
+            break;
+         case 'o':
+            out = fopen(optarg, "w");
+            if ( out == NULL )
+            {
+               perror("fopen");
+               return 1;
+            }
+            break;
+         default:
+            bench_usage();
+            return 1;
+      }
+   }
+
+   if ( bench.streams <= 0 || bench.seconds <= 0.0 || bench.latency <= 0 || bench.connects < 0 )
+   {
+      bench_usage();
+      return 1;
+   }
+
+   signal(SIGPIPE, SIG_IGN);
+
+   if ( bench_start_server() < 0 )
+   {
+      fprintf(stderr, "Couldn't start %s.\n", bench.rsd_path);
+      bench_stop_server();
+      return 1;
+   }
+
+   fprintf(out, "{\n");
+   fprintf(out, "  \"config\": { \"streams\": %d, \"seconds\": %.3f, \"latency_ms\": %d },\n", bench.streams, bench.seconds, bench.latency);
+   if ( bench.connects > 0 )
+      bench_run_connects(out);
+
+   fprintf(out, "  \"cases\": [\n");
+   for ( size_t i = 0; i < sizeof(bench_cases) / sizeof(bench_cases[0]); i++ )
+   {
+      fprintf(stderr, "Running %s %s ...\n", bench_mode_to_string(bench_cases[i].mode), bench_format_to_string(bench_cases[i].format));
+      bench_run_case(out, &bench_cases[i]);
+      fprintf(out, "%s\n", i + 1 < sizeof(bench_cases) / sizeof(bench_cases[0]) ? "," : "");
+   }
+   fprintf(out, "  ]\n}\n");
+
+   bench_stop_server();
+   if ( out != stdout )
+      fclose(out);
+   return 0;
+}
@@ -0,0 +1,462 @@
+/*  RSound - A PCM audio client/server
+ *  Copyright (C) 2010-2011 - Hans-Kristian Arntzen
+ *
+ *  RSound is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RSound is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RSound.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Checks the conversion kernels against known answers, that the vector conversion kernels give
+ * exactly the same output as the scalar ones, and that the vector resampler filters come close
+ * to the scalar one, for every instruction set this CPU has. */
+
+#include "audio.h"
+#include "resampler.h"
+#include "simd.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define TEST_MAX_SAMPLES 1031
+#define TEST_MAX_BYTES (TEST_MAX_SAMPLES * 4)
+
+static unsigned test_failures;
+static unsigned test_cases;
+
+// audio.c pulls data for the resampler from the network, which isn't tested here.
+int receive_data(void *data, connection_t *conn, void *buffer, size_t size)
+{
+   (void)data;
+   (void)conn;
+   (void)buffer;
+   (void)size;
+   return 0;
+}
+
+static void test_fill_random(void *data, size_t bytes)
+{
+   uint8_t *ptr = data;
+   for ( size_t i = 0; i < bytes; i++ )
+      ptr[i] = rand();
+}
+
+static void test_check(int ok, const char *what, unsigned features, size_t samples)
+{
+   test_cases++;
+   if ( !ok )
+   {
+      test_failures++;
+      fprintf(stderr, "FAIL: %s, features 0x%x, %zu samples.\n", what, features, samples);
+   }
+}
+
+// Runs a conversion both into another buffer and in place.
+static size_t test_convert(const audio_converter_t *conv, uint8_t *out, uint8_t *inplace,
+      const uint8_t *in, size_t bytes)
+{
+   size_t size = audio_convert(conv, out, in, bytes);
+   memcpy(inplace, in, bytes);
+   if ( audio_convert(conv, inplace, inplace, bytes) != size )
+      return (size_t)-1;
+   return size;
+}
+
+/* What the old audio_converter() made of a single sample. Operations which keep the samples
+ * in a given byte order are checked byte by byte, which works out the same on any host. */
+static const struct test_known_bytes
+{
+   enum rsd_format fmt;
+   int operation;
+   uint8_t in[4];
+   uint8_t out[4];
+} test_known_bytes[] = {
+   // Swapping turns the byte order around ...
+   { RSD_S16_LE, RSD_SWAP_ENDIAN, { 0x12, 0x34 }, { 0x34, 0x12 } },
+   { RSD_S16_BE, RSD_SWAP_ENDIAN, { 0x12, 0x34 }, { 0x34, 0x12 } },
+   { RSD_U32_BE, RSD_SWAP_ENDIAN, { 0x12, 0x34, 0x56, 0x78 }, { 0x78, 0x56, 0x34, 0x12 } },
+   // ... flipping the sign alone keeps it ...
+   { RSD_U8, RSD_U_TO_S, { 0x00 }, { 0x80 } },
+   { RSD_U8, RSD_U_TO_S, { 0xff }, { 0x7f } },
+   { RSD_U16_LE, RSD_U_TO_S, { 0x01, 0x00 }, { 0x01, 0x80 } },
+   { RSD_U16_BE, RSD_U_TO_S, { 0x00, 0x01 }, { 0x80, 0x01 } },
+   { RSD_U16_BE, RSD_U_TO_S, { 0xff, 0xfe }, { 0x7f, 0xfe } },
+   { RSD_U32_LE, RSD_U_TO_S, { 0x00, 0x00, 0x00, 0x80 }, { 0x00, 0x00, 0x00, 0x00 } },
+   { RSD_U32_BE, RSD_U_TO_S, { 0x00, 0x00, 0x00, 0x01 }, { 0x80, 0x00, 0x00, 0x01 } },
+   // ... and along with a swap, the samples end up in the other byte order.
+   { RSD_U16_LE, RSD_U_TO_S | RSD_SWAP_ENDIAN, { 0x01, 0x00 }, { 0x80, 0x01 } },
+   { RSD_U16_BE, RSD_U_TO_S | RSD_SWAP_ENDIAN, { 0x00, 0x01 }, { 0x01, 0x80 } },
+   { RSD_U32_LE, RSD_U_TO_S | RSD_SWAP_ENDIAN, { 0x01, 0x00, 0x00, 0x00 }, { 0x80, 0x00, 0x00, 0x01 } },
+   { RSD_U32_BE, RSD_U_TO_S | RSD_SWAP_ENDIAN, { 0x00, 0x00, 0x00, 0x01 }, { 0x01, 0x00, 0x00, 0x80 } },
+};
+
+/* Conversions to native byte order are checked by value. They are what the backends ask for,
+ * converter_fmt_to_s16ne() or converter_fmt_to_s32ne() of the format, with extra on top. */
+static const struct test_known_value
+{
+   enum rsd_format fmt;
+   int s32;
+   int extra;
+   uint8_t in[4];
+   double out;
+} test_known_values[] = {
+   { RSD_U8, 0, 0, { 0x00 }, -32768 },
+   { RSD_U8, 0, 0, { 0x80 }, 0 },
+   { RSD_U8, 0, 0, { 0xff }, 32512 },
+   { RSD_S8, 0, 0, { 0x80 }, -32768 },
+   { RSD_S8, 0, 0, { 0x01 }, 256 },
+   { RSD_ALAW, 0, 0, { 0x00 }, -5504 },
+   { RSD_ALAW, 0, 0, { 0x55 }, -8 },
+   { RSD_ALAW, 0, 0, { 0x80 }, 5504 },
+   { RSD_ALAW, 0, 0, { 0xd5 }, 8 },
+   { RSD_MULAW, 0, 0, { 0x00 }, -32124 },
+   { RSD_MULAW, 0, 0, { 0x7e }, -8 },
+   { RSD_MULAW, 0, 0, { 0x80 }, 32124 },
+   { RSD_MULAW, 0, 0, { 0xfe }, 8 },
+   { RSD_S16_LE, 0, 0, { 0x34, 0x12 }, 0x1234 },
+   { RSD_S16_BE, 0, 0, { 0x12, 0x34 }, 0x1234 },
+   { RSD_S16_BE, 0, 0, { 0x80, 0x00 }, -32768 },
+   { RSD_U16_LE, 0, 0, { 0x00, 0x00 }, -32768 },
+   { RSD_U16_LE, 0, 0, { 0xff, 0xff }, 32767 },
+   { RSD_U16_BE, 0, 0, { 0x80, 0x01 }, 1 },
+   { RSD_S32_LE, 0, 0, { 0x78, 0x56, 0x34, 0x12 }, 0x1234 },
+   { RSD_S32_BE, 0, 0, { 0x12, 0x34, 0x56, 0x78 }, 0x1234 },
+   { RSD_S32_BE, 0, 0, { 0xff, 0xfe, 0x00, 0x00 }, -2 },
+   { RSD_U32_LE, 0, 0, { 0x00, 0x00, 0x00, 0x80 }, 0 },
+   { RSD_U32_BE, 0, 0, { 0x00, 0x00, 0x00, 0x00 }, -32768 },
+   { RSD_S32_LE, 1, 0, { 0xff, 0xff, 0xff, 0xff }, -1 },
+   { RSD_S32_BE, 1, 0, { 0x12, 0x34, 0x56, 0x78 }, 0x12345678 },
+   { RSD_U32_LE, 1, 0, { 0x00, 0x00, 0x00, 0x00 }, -2147483648.0 },
+   { RSD_U32_BE, 1, 0, { 0x80, 0x00, 0x00, 0x01 }, 1 },
+   { RSD_U8, 0, RSD_S16_TO_FLOAT, { 0x00 }, -1.0 },
+   { RSD_U8, 0, RSD_S16_TO_FLOAT, { 0xc0 }, 0.5 },
+   { RSD_S8, 0, RSD_S16_TO_FLOAT, { 0x40 }, 0.5 },
+   { RSD_ALAW, 0, RSD_S16_TO_FLOAT, { 0x80 }, 5504.0 / 0x8000 },
+   { RSD_MULAW, 0, RSD_S16_TO_FLOAT, { 0x00 }, -32124.0 / 0x8000 },
+   { RSD_S16_LE, 0, RSD_S16_TO_FLOAT, { 0x00, 0x80 }, -1.0 },
+   { RSD_S16_BE, 0, RSD_S16_TO_FLOAT, { 0x40, 0x00 }, 0.5 },
+   { RSD_U16_LE, 0, RSD_S16_TO_FLOAT, { 0x00, 0x40 }, -0.5 },
+   { RSD_U16_BE, 0, RSD_S16_TO_FLOAT, { 0xc0, 0x00 }, 0.5 },
+   { RSD_S32_LE, 1, RSD_S32_TO_FLOAT, { 0x00, 0x00, 0x00, 0x80 }, -1.0 },
+   { RSD_S32_BE, 1, RSD_S32_TO_FLOAT, { 0x40, 0x00, 0x00, 0x00 }, 0.5 },
+   { RSD_U32_LE, 1, RSD_S32_TO_FLOAT, { 0x00, 0x00, 0x00, 0xc0 }, 0.5 },
+   { RSD_U32_BE, 1, RSD_S32_TO_FLOAT, { 0x00, 0x00, 0x00, 0x00 }, -1.0 },
+};
+
+#define TEST_KNOWN_SAMPLES 37
+
+static double test_sample_value(const uint8_t *out, int operation, int bytes)
+{
+   float f;
+   int16_t i16;
+   int32_t i32;
+
+   if ( operation & (RSD_S16_TO_FLOAT | RSD_S32_TO_FLOAT) )
+   {
+      memcpy(&f, out, sizeof(f));
+      return f;
+   }
+   else if ( bytes == 2 )
+   {
+      memcpy(&i16, out, sizeof(i16));
+      return i16;
+   }
+
+   memcpy(&i32, out, sizeof(i32));
+   return i32;
+}
+
+/* Converts a run of the same sample, long enough to go through the vector kernels as well,
+ * both into another buffer and in place. Every sample has to come out as expected. */
+static void test_known(enum rsd_format fmt, int operation, const uint8_t *sample,
+      const uint8_t *expected, double value, unsigned features)
+{
+   uint8_t in[TEST_KNOWN_SAMPLES * 4];
+   uint8_t out[TEST_KNOWN_SAMPLES * 4], inplace[TEST_KNOWN_SAMPLES * 4];
+   char what[128];
+   snprintf(what, sizeof(what), "known answer for %s, operation 0x%x, first byte 0x%02x",
+         rsnd_format_to_string(fmt), operation, sample[0]);
+
+   int bytes = rsnd_format_to_bytes(fmt);
+   for ( int i = 0; i < TEST_KNOWN_SAMPLES; i++ )
+      memcpy(in + i * bytes, sample, bytes);
+
+   audio_converter_t conv;
+   simd_set_mask(features);
+   if ( audio_converter_init(&conv, fmt, operation) < 0 )
+   {
+      test_check(0, what, features, TEST_KNOWN_SAMPLES);
+      return;
+   }
+
+   size_t size = test_convert(&conv, out, inplace, in, TEST_KNOWN_SAMPLES * bytes);
+   int ok = size == (size_t)(TEST_KNOWN_SAMPLES * conv.out_bytes) && memcmp(out, inplace, size) == 0;
+   for ( int i = 0; ok && i < TEST_KNOWN_SAMPLES; i++ )
+   {
+      const uint8_t *ptr = out + i * conv.out_bytes;
+      if ( expected )
+         ok = memcmp(ptr, expected, conv.out_bytes) == 0;
+      else
+         ok = test_sample_value(ptr, operation, conv.out_bytes) == value;
+   }
+
+   test_check(ok, what, features, TEST_KNOWN_SAMPLES);
+}
+
+static void test_known_answers(unsigned features)
+{
+   for ( unsigned i = 0; i < sizeof(test_known_bytes) / sizeof(test_known_bytes[0]); i++ )
+   {
+      const struct test_known_bytes *k = &test_known_bytes[i];
+      test_known(k->fmt, k->operation, k->in, k->out, 0.0, features);
+   }
+
+   for ( unsigned i = 0; i < sizeof(test_known_values) / sizeof(test_known_values[0]); i++ )
+   {
+      const struct test_known_value *k = &test_known_values[i];
+      int operation = (k->s32 ? converter_fmt_to_s32ne(k->fmt) : converter_fmt_to_s16ne(k->fmt)) | k->extra;
+      test_known(k->fmt, operation, k->in, NULL, k->out, features);
+   }
+}
+
+static void test_audio(enum rsd_format fmt, int operation, unsigned features)
+{
+   static uint8_t in_buf[TEST_MAX_BYTES + 16] __attribute__((aligned(16)));
+   static uint8_t ref[4 * TEST_MAX_BYTES], ref_inplace[4 * TEST_MAX_BYTES];
+   static uint8_t out[4 * TEST_MAX_BYTES], out_inplace[4 * TEST_MAX_BYTES];
+   char what[128];
+   snprintf(what, sizeof(what), "%s, operation 0x%x", rsnd_format_to_string(fmt), operation);
+
+   int bytes_per_sample = rsnd_format_to_bytes(fmt);
+   for ( size_t samples = 0; samples <= TEST_MAX_SAMPLES; samples += (samples < 70) ? 1 : 97 )
+   {
+      // Samples are always aligned to their size, but not to the vector size.
+      const uint8_t *in = in_buf + (samples % 3) * bytes_per_sample;
+      size_t bytes = samples * bytes_per_sample;
+      test_fill_random(in_buf, sizeof(in_buf));
+
+      audio_converter_t conv;
+      simd_set_mask(0);
+      if ( audio_converter_init(&conv, fmt, operation) < 0 )
+      {
+         test_check(0, what, 0, samples);
+         return;
+      }
+      size_t ref_size = test_convert(&conv, ref, ref_inplace, in, bytes);
+
+      simd_set_mask(features);
+      audio_converter_init(&conv, fmt, operation);
+      size_t size = test_convert(&conv, out, out_inplace, in, bytes);
+
+      test_check(size == ref_size && memcmp(ref, ref_inplace, size) == 0 &&
+            memcmp(ref, out, size) == 0 && memcmp(ref, out_inplace, size) == 0,
+            what, features, samples);
+   }
+}
+
+static const float test_float_edges[] = {
+   0.0f, -0.0f, 0.5f, -0.5f, 0.49999997f, -0.49999997f, 0.50000006f, -0.50000006f,
+   1.0f, -1.0f, 1.5f, -1.5f, 2.5f, -2.5f, 0.99999994f, -0.99999994f, -1.0000001f,
+   32766.0f, 32766.5f, 32767.0f, 32767.5f, 32768.0f, 1e6f, 1e20f,
+   -32767.0f, -32767.5f, -32768.0f, -32768.5f, -32769.0f, -1e6f, -1e20f,
+   2147483520.0f, 2147483648.0f, 4294967296.0f, -2147483648.0f, -2147483904.0f, -4294967296.0f,
+   8388607.5f, -8388607.5f, 16777215.0f, -16777215.0f,
+};
+
+// Generates sample values around the integer range and scales them to the
+// normalized floats the resampler works with. The scale is a power of two, so
+// the rounding edges survive it exactly.
+static void test_fill_floats(float *data, size_t samples, float range, float scale)
+{
+   const size_t edges = sizeof(test_float_edges) / sizeof(test_float_edges[0]);
+   for ( size_t i = 0; i < samples; i++ )
+   {
+      if ( rand() % 4 == 0 )
+         data[i] = test_float_edges[rand() % edges];
+      else if ( rand() % 4 == 0 )
+         data[i] = (float)(rand() % 65536 - 32768) + ((rand() % 2) ? 0.5f : -0.5f);
+      else
+         data[i] = ((float)rand() / RAND_MAX * 2.0f - 1.0f) * range;
+      data[i] *= scale;
+   }
+}
+
+static void test_resampler(unsigned features)
+{
+   static float in_f[TEST_MAX_SAMPLES];
+   static union
+   {
+      int16_t i16[TEST_MAX_SAMPLES];
+      int32_t i32[TEST_MAX_SAMPLES];
+   } ref, out;
+
+   for ( size_t samples = 0; samples <= TEST_MAX_SAMPLES; samples += (samples < 70) ? 1 : 97 )
+   {
+      test_fill_floats(in_f, samples, 40000.0f, 1.0f / 0x8000);
+      simd_set_mask(0);
+      resampler_float_to_s16(ref.i16, in_f, samples);
+      simd_set_mask(features);
+      resampler_float_to_s16(out.i16, in_f, samples);
+      test_check(memcmp(ref.i16, out.i16, samples * sizeof(int16_t)) == 0,
+            "resampler_float_to_s16()", features, samples);
+
+      test_fill_floats(in_f, samples, 3e9f, 1.0f / 0x80000000UL);
+      simd_set_mask(0);
+      resampler_float_to_s32(ref.i32, in_f, samples);
+      simd_set_mask(features);
+      resampler_float_to_s32(out.i32, in_f, samples);
+      test_check(memcmp(ref.i32, out.i32, samples * sizeof(int32_t)) == 0,
+            "resampler_float_to_s32()", features, samples);
+   }
+}
+
+static float test_fir_input[1024 * 2];
+
+static size_t test_fir_callback(void *cb_data, float **data)
+{
+   (void)cb_data;
+   *data = test_fir_input;
+   return 1024;
+}
+
+static void test_resample(float *out, size_t frames, double ratio, int quality, unsigned features)
+{
+   simd_set_mask(features);
+   resampler_t *state = resampler_new(test_fir_callback, ratio, 2, quality, NULL);
+   if ( state == NULL || resampler_cb_read(state, frames, out) != (ssize_t)frames )
+      memset(out, 0, frames * 2 * sizeof(float));
+   resampler_free(state);
+}
+
+// The vector filters add up in a different order, so they only have to be close to the scalar one.
+// The ratios cover the half-band, the phase table and the interpolating filters.
+static void test_resampler_fir(unsigned features)
+{
+   static const double ratios[] = { 48000.0 / 44100.0, 44100.0 / 48000.0, 2.0, 0.5, 48000.0 / 44101.0 };
+   static float ref[4096 * 2], out[4096 * 2];
+
+   for ( size_t i = 0; i < sizeof(test_fir_input) / sizeof(test_fir_input[0]); i++ )
+      test_fir_input[i] = (float)rand() / RAND_MAX * 2.0f - 1.0f;
+
+   for ( int quality = RESAMPLER_QUALITY_QUADRATIC + 1; quality <= RESAMPLER_QUALITY_MAX; quality++ )
+   {
+      for ( unsigned r = 0; r < sizeof(ratios) / sizeof(ratios[0]); r++ )
+      {
+         test_resample(ref, 4096, ratios[r], quality, 0);
+         test_resample(out, 4096, ratios[r], quality, features);
+
+         float max_err = 0.0f;
+         float max_abs = 0.0f;
+         for ( size_t i = 0; i < 4096 * 2; i++ )
+         {
+            if ( fabsf(ref[i] - out[i]) > max_err )
+               max_err = fabsf(ref[i] - out[i]);
+            if ( fabsf(ref[i]) > max_abs )
+               max_abs = fabsf(ref[i]);
+         }
+
+         char what[64];
+         snprintf(what, sizeof(what), "resampler quality %d, ratio %.3f", quality, ratios[r]);
+         test_check(max_abs > 0.1f && max_err < 1e-5f, what, features, 4096);
+      }
+   }
+}
+
+// Going from a phase table to the interpolating filter mid-stream mustn't move the output.
+// The two only differ by the interpolation error, which is largest with the few phases of quality 2.
+static void test_resampler_set_ratio(void)
+{
+   static const double ratios[] = { 48000.0 / 44100.0, 44100.0 / 48000.0, 2.0, 0.5 };
+   static float ref[4096 * 2], out[4096 * 2];
+
+   for ( int quality = RESAMPLER_QUALITY_MIN; quality <= RESAMPLER_QUALITY_MAX; quality++ )
+   {
+      for ( unsigned r = 0; r < sizeof(ratios) / sizeof(ratios[0]); r++ )
+      {
+         resampler_t *fixed = resampler_new(test_fir_callback, ratios[r], 2, quality, NULL);
+         resampler_t *changed = resampler_new(test_fir_callback, ratios[r], 2, quality, NULL);
+         int ok = fixed && changed &&
+            resampler_cb_read(fixed, 4096, ref) == 4096 &&
+            resampler_cb_read(changed, 1001, out) == 1001 &&
+            resampler_set_ratio(changed, ratios[r] * (1.0 + 1e-12)) == 0 &&
+            resampler_cb_read(changed, 4096 - 1001, out + 1001 * 2) == 4096 - 1001;
+
+         for ( size_t i = 0; ok && i < 4096 * 2; i++ )
+            ok = fabsf(ref[i] - out[i]) < 1e-2f;
+
+         char what[64];
+         snprintf(what, sizeof(what), "resampler_set_ratio(), quality %d, ratio %.3f", quality, ratios[r]);
+         test_check(ok, what, 0, 4096);
+         resampler_free(fixed);
+         resampler_free(changed);
+      }
+   }
+}
+
+int main(void)
+{
+   static const enum rsd_format formats[] = {
+      RSD_S16_LE, RSD_S16_BE, RSD_U16_LE, RSD_U16_BE, RSD_U8, RSD_S8, RSD_ALAW, RSD_MULAW,
+      RSD_S32_LE, RSD_S32_BE, RSD_U32_LE, RSD_U32_BE,
+   };
+
+   // Every instruction set on its own, as the better ones hide the others.
+   static const unsigned levels[] = { SIMD_SSE2, SIMD_SSE2 | SIMD_AVX2, SIMD_NEON };
+
+   srand(1);
+   unsigned features = simd_features();
+   printf("CPU features: %s%s%s\n", (features & SIMD_SSE2) ? "SSE2 " : "",
+         (features & SIMD_AVX2) ? "AVX2 " : "", (features & SIMD_NEON) ? "NEON " : "");
+
+   test_known_answers(0);
+
+   for ( unsigned l = 0; l < sizeof(levels) / sizeof(levels[0]); l++ )
+   {
+      if ( (levels[l] & features) != levels[l] )
+         continue;
+
+      test_known_answers(levels[l]);
+
+      for ( unsigned f = 0; f < sizeof(formats) / sizeof(formats[0]); f++ )
+      {
+         enum rsd_format fmt = formats[f];
+         int ops[8];
+         unsigned num_ops = 0;
+
+         // What the backends, the mixer and the resampler ask for.
+         if ( rsnd_format_to_bytes(fmt) == 4 )
+         {
+            ops[num_ops++] = converter_fmt_to_s32ne(fmt);
+            ops[num_ops++] = converter_fmt_to_s32ne(fmt) | RSD_S32_TO_FLOAT;
+         }
+         else
+            ops[num_ops++] = converter_fmt_to_s16ne(fmt) | RSD_S16_TO_FLOAT;
+         ops[num_ops++] = converter_fmt_to_s16ne(fmt);
+         if ( rsnd_format_to_bytes(fmt) > 1 )
+         {
+            ops[num_ops++] = RSD_SWAP_ENDIAN;
+            ops[num_ops++] = RSD_U_TO_S;
+            ops[num_ops++] = RSD_U_TO_S | RSD_SWAP_ENDIAN;
+         }
+
+         for ( unsigned o = 0; o < num_ops; o++ )
+            if ( ops[o] != RSD_NULL )
+               test_audio(fmt, ops[o], levels[l]);
+      }
+
+      test_resampler(levels[l]);
+      test_resampler_fir(levels[l]);
+   }
+
+   test_resampler_set_ratio();
+
+   printf("%u of %u cases passed.\n", test_cases - test_failures, test_cases);
+   return test_failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
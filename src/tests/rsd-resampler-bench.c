@@ -0,0 +1,432 @@
+/*  RSound - A PCM audio client/server
+ *  Copyright (C) 2010-2011 - Hans-Kristian Arntzen
+ *
+ *  RSound is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RSound is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RSound.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Measures speed and quality of every quality level of the internal resampler, and of
+   libsamplerate when rsd is built with it. Results are written as JSON, like rsd-bench.
+
+   Quality is measured with sine tones. The SNR of a tone is its power against whatever is
+   left after fitting a sine of the right frequency to the output, so it counts noise and
+   distortion, but not gain or delay. The alias rejection is how much weaker the alias of a
+   tone between the two Nyquist frequencies is than the tone itself. When downsampling that
+   tone is folded back into the output, and when upsampling it is the image of a tone in the input. */
+
+#include "config.h"
+#include "resampler.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_SAMPLERATE
+#include <samplerate.h>
+#endif
+
+#define BENCH_CHANNELS 2
+#define BENCH_CHUNK 1024
+#define BENCH_TONE_SECONDS 2
+#define BENCH_WARMUP_FRAMES 4096
+
+typedef struct
+{
+   int in_rate;
+   int out_rate;
+} bench_ratio_t;
+
+static const bench_ratio_t bench_ratios[] = {
+   { 44100, 48000 },
+   { 48000, 44100 },
+   { 48000, 96000 },
+   { 96000, 48000 },
+};
+
+// Tones for the SNR, relative to the lower of the two Nyquist frequencies.
+static const double bench_tones[] = { 0.05, 0.2, 0.4, 0.6 };
+
+typedef enum
+{
+   BENCH_INTERNAL = 0,
+   BENCH_LIBSAMPLERATE
+} bench_engine_t;
+
+typedef struct
+{
+   const float *data;
+   size_t frames;
+   size_t ptr;
+   int loop;
+   float zeros[BENCH_CHUNK * BENCH_CHANNELS];
+} bench_input_t;
+
+typedef struct
+{
+   bench_engine_t engine;
+   int quality;
+   double ratio;
+   void *state;
+} bench_resampler_t;
+
+static double bench_seconds = 10.0;
+
+static double bench_time(void)
+{
+   struct timespec tv;
+   clock_gettime(CLOCK_MONOTONIC, &tv);
+   return tv.tv_sec + tv.tv_nsec / 1000000000.0;
+}
+
+// Hands out the input in chunks. Looped input goes on forever, else it ends in silence.
+static size_t bench_callback(void *cb_data, float **data)
+{
+   bench_input_t *in = cb_data;
+
+   if ( in->ptr >= in->frames )
+   {
+      if ( !in->loop )
+      {
+         *data = in->zeros;
+         return BENCH_CHUNK;
+      }
+      in->ptr = 0;
+   }
+
+   size_t frames = in->frames - in->ptr;
+   if ( frames > BENCH_CHUNK )
+      frames = BENCH_CHUNK;
+
+   *data = (float*)in->data + in->ptr * BENCH_CHANNELS;
+   in->ptr += frames;
+   return frames;
+}
+
+#ifdef HAVE_SAMPLERATE
+static long bench_src_callback(void *cb_data, float **data)
+{
+   return bench_callback(cb_data, data);
+}
+
+static const int bench_src_converters[] = {
+   [1] = SRC_ZERO_ORDER_HOLD,
+   [2] = SRC_LINEAR,
+   [3] = SRC_SINC_FASTEST,
+   [4] = SRC_SINC_MEDIUM_QUALITY,
+   [5] = SRC_SINC_BEST_QUALITY,
+};
+#endif
+
+static int bench_resampler_new(bench_resampler_t *rs, bench_engine_t engine, int quality, const bench_ratio_t *r, bench_input_t *in)
+{
+   rs->engine = engine;
+   rs->quality = quality;
+   rs->ratio = (double)r->out_rate / r->in_rate;
+
+#ifdef HAVE_SAMPLERATE
+   if ( engine == BENCH_LIBSAMPLERATE )
+   {
+      int err;
+      rs->state = src_callback_new(bench_src_callback, bench_src_converters[quality], BENCH_CHANNELS, &err, in);
+      return rs->state ? 0 : -1;
+   }
+#endif
+
+   rs->state = resampler_new(bench_callback, rs->ratio, BENCH_CHANNELS, quality, in);
+   return rs->state ? 0 : -1;
+}
+
+static int bench_resampler_read(bench_resampler_t *rs, size_t frames, float *out)
+{
+#ifdef HAVE_SAMPLERATE
+   if ( rs->engine == BENCH_LIBSAMPLERATE )
+      return src_callback_read(rs->state, rs->ratio, frames, out) == (long)frames ? 0 : -1;
+#endif
+
+   return resampler_cb_read(rs->state, frames, out) == (ssize_t)frames ? 0 : -1;
+}
+
+static void bench_resampler_free(bench_resampler_t *rs)
+{
+#ifdef HAVE_SAMPLERATE
+   if ( rs->engine == BENCH_LIBSAMPLERATE )
+   {
+      src_delete(rs->state);
+      return;
+   }
+#endif
+
+   resampler_free(rs->state);
+}
+
+static float* bench_tone(double freq, int rate, size_t frames)
+{
+   float *data = malloc(frames * BENCH_CHANNELS * sizeof(float));
+   if ( data == NULL )
+      return NULL;
+
+   for ( size_t i = 0; i < frames; i++ )
+      for ( int c = 0; c < BENCH_CHANNELS; c++ )
+         data[i * BENCH_CHANNELS + c] = 0.5 * sin(2.0 * M_PI * freq * i / rate);
+   return data;
+}
+
+/* Least squares fit of a * cos + b * sin at freq to the first channel of data.
+   Returns the power of the fitted sine, and the power of what's left in residual. */
+static double bench_fit(const float *data, size_t frames, double freq, int rate, double *residual)
+{
+   double cc = 0.0, ss = 0.0, cs = 0.0, yc = 0.0, ys = 0.0;
+   for ( size_t i = 0; i < frames; i++ )
+   {
+      double c = cos(2.0 * M_PI * freq * i / rate);
+      double s = sin(2.0 * M_PI * freq * i / rate);
+      double y = data[i * BENCH_CHANNELS];
+      cc += c * c;
+      ss += s * s;
+      cs += c * s;
+      yc += y * c;
+      ys += y * s;
+   }
+
+   double det = cc * ss - cs * cs;
+   double a = (yc * ss - ys * cs) / det;
+   double b = (ys * cc - yc * cs) / det;
+
+   double res = 0.0;
+   for ( size_t i = 0; i < frames; i++ )
+   {
+      double e = data[i * BENCH_CHANNELS] - a * cos(2.0 * M_PI * freq * i / rate) - b * sin(2.0 * M_PI * freq * i / rate);
+      res += e * e;
+   }
+
+   if ( residual )
+      *residual = res / frames;
+   return (a * a + b * b) / 2.0;
+}
+
+// Resamples a tone at freq, and returns the output, minus the start where the filter fills up.
+static float* bench_resample_tone(bench_engine_t engine, int quality, const bench_ratio_t *r, double freq, size_t *out_frames)
+{
+   bench_input_t in;
+   bench_resampler_t rs;
+   memset(&in, 0, sizeof(in));
+
+   in.frames = (size_t)r->in_rate * BENCH_TONE_SECONDS;
+   float *tone = bench_tone(freq, r->in_rate, in.frames);
+   if ( tone == NULL )
+      return NULL;
+   in.data = tone;
+
+   size_t frames = (size_t)((double)(in.frames - BENCH_WARMUP_FRAMES) * r->out_rate / r->in_rate);
+   float *out = malloc(frames * BENCH_CHANNELS * sizeof(float));
+   if ( out == NULL || bench_resampler_new(&rs, engine, quality, r, &in) < 0 )
+   {
+      free(tone);
+      free(out);
+      return NULL;
+   }
+
+   int rc = 0;
+   for ( size_t done = 0; done < frames && rc == 0; done += BENCH_CHUNK )
+      rc = bench_resampler_read(&rs, done + BENCH_CHUNK <= frames ? BENCH_CHUNK : frames - done, out + done * BENCH_CHANNELS);
+
+   bench_resampler_free(&rs);
+   free(tone);
+   if ( rc < 0 )
+   {
+      free(out);
+      return NULL;
+   }
+
+   memmove(out, out + BENCH_WARMUP_FRAMES * BENCH_CHANNELS, (frames - BENCH_WARMUP_FRAMES) * BENCH_CHANNELS * sizeof(float));
+   *out_frames = frames - BENCH_WARMUP_FRAMES;
+   return out;
+}
+
+static int bench_snr(bench_engine_t engine, int quality, const bench_ratio_t *r, double *min_snr, double *max_snr)
+{
+   double nyquist = (r->in_rate < r->out_rate ? r->in_rate : r->out_rate) / 2.0;
+   *min_snr = INFINITY;
+   *max_snr = -INFINITY;
+
+   for ( unsigned i = 0; i < sizeof(bench_tones) / sizeof(bench_tones[0]); i++ )
+   {
+      size_t frames;
+      double freq = bench_tones[i] * nyquist;
+      float *out = bench_resample_tone(engine, quality, r, freq, &frames);
+      if ( out == NULL )
+         return -1;
+
+      double residual;
+      double signal = bench_fit(out, frames, freq, r->out_rate, &residual);
+      double snr = 10.0 * log10(signal / residual);
+      if ( snr < *min_snr )
+         *min_snr = snr;
+      if ( snr > *max_snr )
+         *max_snr = snr;
+      free(out);
+   }
+
+   return 0;
+}
+
+static int bench_alias(bench_engine_t engine, int quality, const bench_ratio_t *r, double *rejection)
+{
+   double lo = (r->in_rate < r->out_rate ? r->in_rate : r->out_rate) / 2.0;
+   double hi = (r->in_rate > r->out_rate ? r->in_rate : r->out_rate) / 2.0;
+   double alias = (lo + hi) / 2.0;
+   double freq, alias_freq;
+
+   if ( r->out_rate < r->in_rate )
+   {
+      freq = alias;
+      alias_freq = r->out_rate - alias;
+   }
+   else
+   {
+      freq = r->in_rate - alias;
+      alias_freq = alias;
+   }
+
+   size_t frames;
+   float *out = bench_resample_tone(engine, quality, r, freq, &frames);
+   if ( out == NULL )
+      return -1;
+
+   double power = bench_fit(out, frames, alias_freq, r->out_rate, NULL);
+   *rejection = 10.0 * log10(0.125 / power);
+   free(out);
+   return 0;
+}
+
+static int bench_speed(bench_engine_t engine, int quality, const bench_ratio_t *r, double *realtime)
+{
+   bench_input_t in;
+   bench_resampler_t rs;
+   memset(&in, 0, sizeof(in));
+
+   in.frames = r->in_rate;
+   in.loop = 1;
+   float *noise = malloc(in.frames * BENCH_CHANNELS * sizeof(float));
+   float *out = malloc(BENCH_CHUNK * BENCH_CHANNELS * sizeof(float));
+   if ( noise == NULL || out == NULL )
+      goto error;
+   for ( size_t i = 0; i < in.frames * BENCH_CHANNELS; i++ )
+      noise[i] = (float)rand() / RAND_MAX - 0.5f;
+   in.data = noise;
+
+   if ( bench_resampler_new(&rs, engine, quality, r, &in) < 0 )
+      goto error;
+
+   size_t frames = (size_t)(bench_seconds * r->out_rate);
+   double start = bench_time();
+   int rc = 0;
+   for ( size_t done = 0; done < frames && rc == 0; done += BENCH_CHUNK )
+      rc = bench_resampler_read(&rs, BENCH_CHUNK, out);
+   double elapsed = bench_time() - start;
+
+   bench_resampler_free(&rs);
+   free(noise);
+   free(out);
+
+   *realtime = bench_seconds / elapsed;
+   return rc;
+
+error:
+   free(noise);
+   free(out);
+   return -1;
+}
+
+static void bench_run(FILE *out, bench_engine_t engine, int quality, const bench_ratio_t *r, int last)
+{
+   double min_snr, max_snr, rejection, realtime;
+   const char *name = engine == BENCH_LIBSAMPLERATE ? "libsamplerate" : "internal";
+
+   fprintf(stderr, "Running %s quality %d, %d -> %d ...\n", name, quality, r->in_rate, r->out_rate);
+   fprintf(out, "    { \"engine\": \"%s\", \"quality\": %d, \"in_rate\": %d, \"out_rate\": %d, ", name, quality, r->in_rate, r->out_rate);
+
+   if ( bench_speed(engine, quality, r, &realtime) < 0 || bench_snr(engine, quality, r, &min_snr, &max_snr) < 0 ||
+         bench_alias(engine, quality, r, &rejection) < 0 )
+   {
+      fprintf(out, "\"failed\": 1 }%s\n", last ? "" : ",");
+      return;
+   }
+
+   fprintf(out, "\"failed\": 0,\n      \"realtime\": %.1f, \"mframes_per_second\": %.3f, \"snr_min_db\": %.1f, \"snr_max_db\": %.1f, \"alias_rejection_db\": %.1f }%s\n",
+         realtime, realtime * r->out_rate / 1000000.0, min_snr, max_snr, rejection, last ? "" : ",");
+   fflush(out);
+}
+
+static void print_help(void)
+{
+   fprintf(stderr, "Usage: rsd-resampler-bench [-d seconds] [-o file]\n");
+   fprintf(stderr, "\t-d: Seconds of stereo audio to resample when timing each case. Defaults to 10.\n");
+   fprintf(stderr, "\t-o: Writes the JSON results to file instead of stdout.\n");
+}
+
+int main(int argc, char **argv)
+{
+   FILE *out = stdout;
+   int c;
+
+   while ( (c = getopt(argc, argv, "d:o:h")) != -1 )
+   {
+      switch ( c )
+      {
+         case 'd':
+            bench_seconds = strtod(optarg, NULL);
+            break;
+         case 'o':
+            out = fopen(optarg, "w");
+            if ( out == NULL )
+            {
+               perror("fopen");
+               return 1;
+            }
+            break;
+         default:
+            print_help();
+            return c == 'h' ? 0 : 1;
+      }
+   }
+
+   if ( bench_seconds <= 0.0 )
+   {
+      print_help();
+      return 1;
+   }
+
+   bench_engine_t engines[] = {
+      BENCH_INTERNAL,
+#ifdef HAVE_SAMPLERATE
+      BENCH_LIBSAMPLERATE,
+#endif
+   };
+   unsigned num_engines = sizeof(engines) / sizeof(engines[0]);
+   unsigned num_ratios = sizeof(bench_ratios) / sizeof(bench_ratios[0]);
+
+   fprintf(out, "{\n");
+   fprintf(out, "  \"config\": { \"seconds\": %.3f, \"channels\": %d },\n", bench_seconds, BENCH_CHANNELS);
+   fprintf(out, "  \"cases\": [\n");
+   for ( unsigned e = 0; e < num_engines; e++ )
+      for ( int q = RESAMPLER_QUALITY_MIN; q <= RESAMPLER_QUALITY_MAX; q++ )
+         for ( unsigned r = 0; r < num_ratios; r++ )
+            bench_run(out, engines[e], q, &bench_ratios[r], e + 1 == num_engines && q == RESAMPLER_QUALITY_MAX && r + 1 == num_ratios);
+   fprintf(out, "  ]\n}\n");
+
+   if ( out != stdout )
+      fclose(out);
+   return 0;
+}